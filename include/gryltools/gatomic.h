@@ -0,0 +1,90 @@
+#ifndef GATOMIC_H_INCLUDED
+#define GATOMIC_H_INCLUDED
+
+/*! GrylTools atomics.
+ *  Atomic operations on plain variables, with explicit memory orders.
+ *  Use these for any variable shared between threads without a lock - volatile doesn't
+ *  make accesses atomic, nor does it order them with respect to other memory.
+ *
+ *  - Typed functions: gatomic_<Type>_<op>, e.g. gatomic_Int_fetchAdd( &counter, 1, GATOMIC_RELAXED ).
+ *  - Generic macros: gatomic_<op>, work on any integer or pointer type.
+ *
+ *  Built on the GCC/Clang __atomic builtins, so they compile to plain instructions.
+ *  Memory orders should be compile-time constants.
+ */
+
+#include <stddef.h>
+
+#if !defined __GNUC__
+    #error "gatomic: a compiler with __atomic builtins (GCC 4.7+, Clang) is required."
+#endif
+
+// Memory orders
+#define GATOMIC_RELAXED  __ATOMIC_RELAXED
+#define GATOMIC_ACQUIRE  __ATOMIC_ACQUIRE
+#define GATOMIC_RELEASE  __ATOMIC_RELEASE
+#define GATOMIC_ACQ_REL  __ATOMIC_ACQ_REL
+#define GATOMIC_SEQ_CST  __ATOMIC_SEQ_CST
+
+/*! Generic operations.
+ *  cas() is strong, casWeak() may fail spuriously (use in loops). Both store the
+ *  current value to *expected on failure, and return nonzero on success.
+ */
+#define gatomic_load( ptr, order )                  __atomic_load_n( (ptr), (order) )
+#define gatomic_store( ptr, val, order )            __atomic_store_n( (ptr), (val), (order) )
+#define gatomic_exchange( ptr, val, order )         __atomic_exchange_n( (ptr), (val), (order) )
+#define gatomic_fetchAdd( ptr, val, order )         __atomic_fetch_add( (ptr), (val), (order) )
+#define gatomic_fetchSub( ptr, val, order )         __atomic_fetch_sub( (ptr), (val), (order) )
+#define gatomic_addFetch( ptr, val, order )         __atomic_add_fetch( (ptr), (val), (order) )
+#define gatomic_subFetch( ptr, val, order )         __atomic_sub_fetch( (ptr), (val), (order) )
+#define gatomic_fetchOr( ptr, val, order )          __atomic_fetch_or( (ptr), (val), (order) )
+#define gatomic_fetchAnd( ptr, val, order )         __atomic_fetch_and( (ptr), (val), (order) )
+
+#define gatomic_cas( ptr, expected, desired, succOrder, failOrder ) \
+    __atomic_compare_exchange_n( (ptr), (expected), (desired), 0, (succOrder), (failOrder) )
+#define gatomic_casWeak( ptr, expected, desired, succOrder, failOrder ) \
+    __atomic_compare_exchange_n( (ptr), (expected), (desired), 1, (succOrder), (failOrder) )
+
+#define gatomic_fence( order )        __atomic_thread_fence( (order) )
+#define gatomic_signalFence( order )  __atomic_signal_fence( (order) )
+
+/*! Typed operations.
+ *  The same as the generic ones, but type-checked.
+ *  cas() here uses the success order for failure too (weakened to what's allowed).
+ */
+#define GATOMIC_FAIL_ORDER_PRIV( order ) \
+    ( (order) == GATOMIC_ACQ_REL ? GATOMIC_ACQUIRE : ((order) == GATOMIC_RELEASE ? GATOMIC_RELAXED : (order)) )
+
+#define GATOMIC_DEFINE_BASIC_PRIV( Name, type ) \
+    static inline type gatomic_##Name##_load( const type* ptr, int order ){ \
+        return __atomic_load_n( ptr, order ); } \
+    static inline void gatomic_##Name##_store( type* ptr, type val, int order ){ \
+        __atomic_store_n( ptr, val, order ); } \
+    static inline type gatomic_##Name##_exchange( type* ptr, type val, int order ){ \
+        return __atomic_exchange_n( ptr, val, order ); } \
+    static inline char gatomic_##Name##_cas( type* ptr, type* expected, type desired, int order ){ \
+        return __atomic_compare_exchange_n( ptr, expected, desired, 0, order, GATOMIC_FAIL_ORDER_PRIV(order) ); }
+
+#define GATOMIC_DEFINE_INTEGER_PRIV( Name, type ) \
+    GATOMIC_DEFINE_BASIC_PRIV( Name, type ) \
+    static inline type gatomic_##Name##_fetchAdd( type* ptr, type val, int order ){ \
+        return __atomic_fetch_add( ptr, val, order ); } \
+    static inline type gatomic_##Name##_fetchSub( type* ptr, type val, int order ){ \
+        return __atomic_fetch_sub( ptr, val, order ); } \
+    static inline type gatomic_##Name##_fetchOr( type* ptr, type val, int order ){ \
+        return __atomic_fetch_or( ptr, val, order ); } \
+    static inline type gatomic_##Name##_fetchAnd( type* ptr, type val, int order ){ \
+        return __atomic_fetch_and( ptr, val, order ); }
+
+GATOMIC_DEFINE_INTEGER_PRIV( Char,  char )
+GATOMIC_DEFINE_INTEGER_PRIV( Short, short )
+GATOMIC_DEFINE_INTEGER_PRIV( Int,   int )
+GATOMIC_DEFINE_INTEGER_PRIV( UInt,  unsigned int )
+GATOMIC_DEFINE_INTEGER_PRIV( Long,  long )
+GATOMIC_DEFINE_INTEGER_PRIV( ULong, unsigned long )
+GATOMIC_DEFINE_INTEGER_PRIV( Size,  size_t )
+// Typedef'd, so the "const type*" parameter is a pointer to a const pointer.
+typedef void* GAtomicPtr_priv;
+GATOMIC_DEFINE_BASIC_PRIV(   Ptr,   GAtomicPtr_priv )
+
+#endif // GATOMIC_H_INCLUDED
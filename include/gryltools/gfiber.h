@@ -0,0 +1,51 @@
+#ifndef GFIBER_H_INCLUDED
+#define GFIBER_H_INCLUDED
+
+/*! GFiber: stackful coroutines for blocking-style session code.
+ *
+ *  - A scheduler runs many fibers on the thread that calls gfiber_Sched_run().
+ *    Fibers switch only when they wait or yield, so no locking is needed between
+ *    fibers of one scheduler.
+ *  - Waiting for a socket parks the fiber in the scheduler's event loop (epoll on Linux,
+ *    poll() elsewhere). gsockReceive()/gsockSend() called inside a fiber wait this way
+ *    instead of blocking the thread.
+ *  - Stacks are mmap'd with a guard page below, and reused through a per-scheduler pool.
+ *  - Context switches are hand-written on x86-64 and aarch64, and use ucontext elsewhere.
+ *
+ *  POSIX only - on Win32 gfiber_Sched_create() fails.
+ */
+
+#include <stddef.h>
+
+typedef void *GrFiberSched;
+typedef void *GrFiber;
+
+#define GFIBER_DEFAULT_STACK_SIZE  (64 * 1024)
+
+// Events to wait for.
+#define GFIBER_READ   1
+#define GFIBER_WRITE  2
+
+/*! Scheduler functions
+ *  stackSize 0 - GFIBER_DEFAULT_STACK_SIZE.
+ *  run() returns when all fibers have finished (0), or if they all wait forever (1).
+ */
+GrFiberSched gfiber_Sched_create(size_t stackSize);
+void gfiber_Sched_destroy(GrFiberSched* sched);
+char gfiber_Sched_run(GrFiberSched sched);
+
+size_t gfiber_Sched_getFiberCount(GrFiberSched sched);
+
+/*! Fiber functions
+ *  spawn() must be called on the scheduler's thread - before run(), or from a fiber.
+ *  The rest are for use inside a fiber.
+ *  waitFD() returns 0 when the fd is ready, 1 on timeout, < 0 on error. millisec < 0 - no timeout.
+ */
+GrFiber gfiber_spawn(GrFiberSched sched, void (*proc)(void*), void* param);
+
+GrFiber gfiber_current(); // NULL if not in a fiber.
+void gfiber_yield();
+void gfiber_sleep(long millisec);
+char gfiber_waitFD(int fd, int events, long millisec);
+
+#endif // GFIBER_H_INCLUDED
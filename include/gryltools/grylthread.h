@@ -14,10 +14,16 @@
  *    - Thread                                              *
  *    - Mutex                                               * 
  *    - Condition Variable                                  *
+ *    - Reader-Writer lock (SharedMutex)                    *
+ *  - Thread attributes: CPU affinity, names, scheduling    *
+ *  - Thread-local storage with destructors                 *
+ *  - Lightweight futex-based Mutex, CondVar and Event      *
+ *  - Selectable Event (eventfd), for waking event loops    *
+ *  - Lock-free bounded MPMC Queue                         *
+ *  - Work-stealing Thread Pool with Futures                *
  *                                                          *
  *  TODOS:
- *  - Process management API (Partly implemented).
- *  - Maybe split SharedMutex and SimpleMutex
+ *  - Process management API (fork, join, exit status; create() is not implemented yet).
  *  
  *  BUGS:
  *  - Currently no spotted, but must check more on POSIX.
@@ -26,6 +32,8 @@
 
 #define GTHREAD_VERSION "v0.3"
 
+#include <stddef.h>
+
 /*! The typedef'd primitives
  *  Implementation is defined in their respective source files.
  */ 
@@ -34,12 +42,70 @@ typedef void *GrMutex;
 typedef void *GrSharedMutex;
 typedef void *GrCondVar;
 typedef void *GrProcess;
+typedef void *GrQueue;
+typedef void *GrThreadPool;
+typedef void *GrFuture;
+typedef void *GrTLSKey;
+typedef void *GrEvent;
+
+/*! Lightweight primitives.
+ *  Embeddable by value and statically initializable, e.g.
+ *      static GrFastMutex lock = GTHREAD_FASTMUTEX_INIT;
+ *  They need no destruction. Only for use between threads of one process.
+ */
+typedef struct
+{
+    int state;
+    int spins; // Adaptive spin estimate.
+} GrFastMutex;
+
+typedef struct
+{
+    int seq;
+    GrFastMutex* mutex; // The mutex last waited with.
+} GrFastCondVar;
+
+typedef struct
+{
+    int state;
+} GrFastEvent;
+
+#define GTHREAD_FASTMUTEX_INIT    { 0, 0 }
+#define GTHREAD_FASTCONDVAR_INIT  { 0, NULL }
+#define GTHREAD_FASTEVENT_INIT    { 0 }
 
 /*! Specific attribute flags
  */
 // If set, mutex will be shared among processes.
 #define GTHREAD_MUTEX_SHARED  1
 
+/*! Thread creation attributes.
+ *  Initialize with gthread_ThreadAttribs_init(), then set only what's needed.
+ */
+#define GTHREAD_MAX_CPUS  1024
+
+typedef struct
+{
+    unsigned long bits[ GTHREAD_MAX_CPUS / (8 * sizeof(unsigned long)) ];
+} GrCPUSet;
+
+// Scheduling policies. FIFO and RR usually need privileges.
+#define GTHREAD_SCHED_DEFAULT  0 // Inherit from the creating thread.
+#define GTHREAD_SCHED_OTHER    1
+#define GTHREAD_SCHED_BATCH    2
+#define GTHREAD_SCHED_IDLE     3
+#define GTHREAD_SCHED_FIFO     4
+#define GTHREAD_SCHED_RR       5
+
+typedef struct
+{
+    GrCPUSet cpus;        // CPUs the thread may run on. Empty - any.
+    size_t stackSize;     // 0 - default.
+    int schedPolicy;      // GTHREAD_SCHED_*
+    int schedPriority;    // Only for FIFO and RR.
+    const char* name;     // NULL - not named. Linux keeps up to 15 chars.
+} GrThreadAttribs;
+
 /*! Threading functions
  *  Supports creation, checking if running, joining, etc.
  */ 
@@ -57,14 +123,62 @@ char gthread_Thread_equal(GrThread t1, GrThread t2);
 void gthread_Thread_sleep(unsigned int millisecs);
 void gthread_Thread_exit();
 
+/*! Thread attributes, affinity and naming.
+ *  Functions taking a GrThread use the current thread if hnd is NULL.
+ *  char-returning functions return 0 on success.
+ */
+void gthread_ThreadAttribs_init(GrThreadAttribs* attr);
+GrThread gthread_Thread_createEx(void (*proc)(void*), void* param, const GrThreadAttribs* attr);
+
+char gthread_Thread_setAffinity(GrThread hnd, const GrCPUSet* cpus);
+char gthread_Thread_getAffinity(GrThread hnd, GrCPUSet* cpus);
+char gthread_Thread_setName(GrThread hnd, const char* name);
+
+void gthread_CPUSet_clear(GrCPUSet* set);
+void gthread_CPUSet_add(GrCPUSet* set, int cpu);
+char gthread_CPUSet_has(const GrCPUSet* set, int cpu);
+int gthread_CPUSet_count(const GrCPUSet* set);
+
+int gthread_getCPUCount();
+int gthread_getCurrentCPU(); // -1 if unknown.
+
+/*! Thread-local storage.
+ *  Keys hold a pointer per thread, NULL until set. When a thread exits, destructors
+ *  of its non-NULL values are called (not for the main thread, nor on key destroy).
+ *  Up to GTHREAD_TLS_MAX_KEYS keys can exist at once.
+ *
+ *  The context is a single pointer per thread, for the hottest paths - getting it
+ *  is one TLS load. The destructor may be NULL.
+ */
+#define GTHREAD_TLS_MAX_KEYS  128
+
+GrTLSKey gthread_TLS_create(void (*destructor)(void*));
+void gthread_TLS_destroy(GrTLSKey* key);
+void* gthread_TLS_get(GrTLSKey key);
+char gthread_TLS_set(GrTLSKey key, void* value);
+
+void gthread_TLS_setContext(void* context, void (*destructor)(void*));
+
+extern __thread void* gthread_tlsContext_priv;
+static inline void* gthread_TLS_getContext(){ return gthread_tlsContext_priv; }
+
 /*! Process Functions.
  *  Allow process creation, joining, exitting, and Pid-operations.
+ *  - fork() runs proc(param) in the child, which then exits with status 0 - it never returns
+ *    into the caller. Returns NULL in the child's place on error.
+ *  - getExitStatus() returns the exit code of a finished process, GTHREAD_PROCESS_SIGNALED + signal
+ *    number if it was killed by a signal, or -1 if it's still running.
+ *  - terminate() asks the process to exit (SIGTERM on POSIX). 0 - sent, 1 - not running.
  */ 
+#define GTHREAD_PROCESS_SIGNALED  256
+
 GrProcess gthread_Process_create(const char* pathToFile, const char* commandLine);
 GrProcess gthread_Process_fork(void (*proc)(void*), void* param);
 void gthread_Process_join(GrProcess hnd);
 char gthread_Process_isRunning(GrProcess hnd);
 long gthread_Process_getID(GrProcess hnd);
+int gthread_Process_getExitStatus(GrProcess hnd);
+char gthread_Process_terminate(GrProcess hnd);
 
 /*! Mutex functions.
  *  Allow all basic mutex operations.
@@ -76,6 +190,22 @@ char gthread_Mutex_lock(GrMutex mtx);
 char gthread_Mutex_tryLock(GrMutex mtx);
 char gthread_Mutex_unlock(GrMutex mtx);
 
+/*! SharedMutex (reader-writer lock) functions.
+ *  Many readers, or one writer. Writers are preferred - new readers wait while a writer waits.
+ *  Lock functions return 0 on success. tryLock's return 1 if the lock is busy.
+ *  Not recursive, read locks can't be upgraded, and must be released by the thread which took them.
+ */
+GrSharedMutex gthread_SharedMutex_init();
+void gthread_SharedMutex_destroy(GrSharedMutex* mtx);
+
+char gthread_SharedMutex_lock(GrSharedMutex mtx);
+char gthread_SharedMutex_tryLock(GrSharedMutex mtx);
+char gthread_SharedMutex_unlock(GrSharedMutex mtx);
+
+char gthread_SharedMutex_lockShared(GrSharedMutex mtx);
+char gthread_SharedMutex_tryLockShared(GrSharedMutex mtx);
+char gthread_SharedMutex_unlockShared(GrSharedMutex mtx);
+
 /*! CondVar functions
  */ 
 GrCondVar gthread_CondVar_init();
@@ -86,5 +216,81 @@ char gthread_CondVar_wait_time(GrCondVar cond, GrMutex mtp, long millisec);
 void gthread_CondVar_notify(GrCondVar cond);
 void gthread_CondVar_notifyAll(GrCondVar cond);
 
+/*! Lightweight primitive functions
+ *  Timed waits return 1 on timeout. millisec < 0 - wait infinitely.
+ *  CondVar waits can wake spuriously, so check the condition in a loop.
+ *  Event is manual-reset: it stays set until reset.
+ */
+void gthread_FastMutex_init(GrFastMutex* mtx);
+void gthread_FastMutex_lock(GrFastMutex* mtx);
+char gthread_FastMutex_tryLock(GrFastMutex* mtx);
+void gthread_FastMutex_unlock(GrFastMutex* mtx);
+
+void gthread_FastCondVar_init(GrFastCondVar* cond);
+char gthread_FastCondVar_wait(GrFastCondVar* cond, GrFastMutex* mtx);
+char gthread_FastCondVar_wait_time(GrFastCondVar* cond, GrFastMutex* mtx, long millisec);
+void gthread_FastCondVar_notify(GrFastCondVar* cond);
+void gthread_FastCondVar_notifyAll(GrFastCondVar* cond);
+
+void gthread_FastEvent_init(GrFastEvent* evt, char set);
+void gthread_FastEvent_set(GrFastEvent* evt);
+void gthread_FastEvent_reset(GrFastEvent* evt);
+char gthread_FastEvent_isSet(GrFastEvent* evt);
+char gthread_FastEvent_wait(GrFastEvent* evt);
+char gthread_FastEvent_wait_time(GrFastEvent* evt, long millisec);
+
+/*! Queue functions
+ *  Bounded multi-producer/multi-consumer FIFO of pointers.
+ *  Capacity is rounded up to a power of 2. Push/Pop block for at most millisec (< 0 - forever).
+ */
+GrQueue gthread_Queue_create(size_t capacity);
+void gthread_Queue_destroy(GrQueue* queue);
+
+char gthread_Queue_tryPush(GrQueue queue, void* item);
+char gthread_Queue_tryPop(GrQueue queue, void** item);
+char gthread_Queue_push(GrQueue queue, void* item, long millisec);
+char gthread_Queue_pop(GrQueue queue, void** item, long millisec);
+
+size_t gthread_Queue_getSize(GrQueue queue);
+size_t gthread_Queue_getCapacity(GrQueue queue);
+
+/*! Thread Pool functions
+ *  Tasks run on a fixed set of workers, which steal work from each other.
+ *  Tasks submitted from a pool task are queued on the current worker.
+ *  workerCount <= 0 means one worker per CPU.
+ */
+GrThreadPool gthread_Pool_create(int workerCount);
+void gthread_Pool_destroy(GrThreadPool* pool, char finishTasks);
+
+char gthread_Pool_submit(GrThreadPool pool, void (*proc)(void*), void* param);
+GrFuture gthread_Pool_submitFuture(GrThreadPool pool, void* (*proc)(void*), void* param);
+
+int gthread_Pool_getWorkerCount(GrThreadPool pool);
+char gthread_Pool_isWorker(GrThreadPool pool);
+
+/*! Future functions
+ *  Completion of a task submitted with gthread_Pool_submitFuture().
+ */
+char gthread_Future_wait_time(GrFuture fut, long millisec);
+void* gthread_Future_get(GrFuture fut);
+char gthread_Future_isDone(GrFuture fut);
+void gthread_Future_destroy(GrFuture* fut);
+
+/*! Event functions
+ *  A wakeup which can be waited on in select()/poll()/epoll together with sockets:
+ *  the fd from getFD() is readable while the event is signaled.
+ *  Signals coalesce - many signals before a drain cost one wakeup.
+ *  drain() resets the event and returns how many signals it got.
+ *  signal() is async-signal-safe on POSIX.
+ */
+GrEvent gthread_Event_create();
+void gthread_Event_destroy(GrEvent* evt);
+
+char gthread_Event_signal(GrEvent evt);
+unsigned long gthread_Event_drain(GrEvent evt);
+char gthread_Event_isSet(GrEvent evt);
+char gthread_Event_wait(GrEvent evt);
+char gthread_Event_wait_time(GrEvent evt, long millisec);
+int gthread_Event_getFD(GrEvent evt);
 
 #endif //GRYLTHREAD_H_INCLUDED
@@ -1,22 +1,127 @@
-#ifndef HLOG_H_INCLUDED
-#define HLOG_H_INCLUDED
-
-#include <stdio.h>
-#include <stdlib.h>
-
-// If set, write()'s to file won't store data in buffer, but will immediately write data into file.
-#define HLOG_MODE_UNBUFFERED  1
-#define HLOG_MODE_APPEND      2       
-
-/* Set, Close and Get the current LogFile */
-FILE* hlogSetFile(const char* fname, char mode);
-void hlogSetFileFromFile(FILE* file, char mode);
-void hlogCloseFile();
-FILE* hlogGetFile();
-char hlogIsActive();
-void hlogSetActive(char val);
-
-/* Write to the LogFile (Printf style) */
-void hlogf( const char* fmt, ... );
-
-#endif // HLOG_H_INCLUDED
+#ifndef HLOG_H_INCLUDED
+#define HLOG_H_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// If set, write()'s to file won't store data in buffer, but will immediately write data into file.
+#define HLOG_MODE_UNBUFFERED  1
+#define HLOG_MODE_APPEND      2
+// If set, hlogf() only formats into a per-thread ring, and a background thread writes the rings
+// to file in batches. UNBUFFERED is ignored in this mode - the drainer flushes after every batch.
+#define HLOG_MODE_ASYNC       4
+// If set, log events are written as compact binary records into mmap'd segment files, next to the
+// given file ("<fname>.fmt", "<fname>.N.hlb"). Decode them with the hlogdecode tool. POSIX only.
+// The text file itself only receives data written directly through hlogGetFile().
+#define HLOG_MODE_BINARY      8
+
+/*! Async mode settings.
+ *  - Every logging thread gets its own lock-free ring of HLOG_ASYNC_RING_SIZE bytes.
+ *  - Messages longer than HLOG_ASYNC_MAX_MSG are truncated.
+ *  - Ordering is preserved per thread only.
+ */
+#define HLOG_ASYNC_RING_SIZE        (64 * 1024) // Must be a power of 2.
+#define HLOG_ASYNC_MAX_MSG          1024
+#define HLOG_ASYNC_DRAIN_INTERVAL   20          // Millisecs between drainer passes.
+
+// What to do when the thread's ring has no space for a message.
+#define HLOG_ASYNC_POLICY_DROP  0   // Drop the message, increment the dropped counter (Default).
+#define HLOG_ASYNC_POLICY_BLOCK 1   // Wait until the drainer frees enough space.
+
+/*! Log levels.
+ *  Statements below HLOG_MIN_LEVEL are compiled out entirely (arguments are not evaluated).
+ *  Set it on the command line, e.g. -DHLOG_MIN_LEVEL=HLOG_LEVEL_INFO
+ */
+#define HLOG_LEVEL_TRACE  0
+#define HLOG_LEVEL_DEBUG  1
+#define HLOG_LEVEL_INFO   2
+#define HLOG_LEVEL_WARN   3
+#define HLOG_LEVEL_ERROR  4
+#define HLOG_LEVEL_NONE   5
+
+#ifndef HLOG_MIN_LEVEL
+    #define HLOG_MIN_LEVEL HLOG_LEVEL_TRACE
+#endif
+
+/*! Modules - bit positions in the runtime enable mask.
+ *  Define HLOG_MODULE before including hlog.h to tag a file's statements.
+ */
+#define HLOG_MOD_GENERAL  0
+#define HLOG_MOD_THREAD   1
+#define HLOG_MOD_SOCKS    2
+#define HLOG_MOD_MISC     3
+#define HLOG_MOD_CLIENT   4
+#define HLOG_MOD_SERVER   5
+#define HLOG_MOD_FTP      6
+
+#define HLOG_MODMASK_ALL  0xFFFFFFFFu
+
+#ifndef HLOG_MODULE
+    #define HLOG_MODULE HLOG_MOD_GENERAL
+#endif
+
+/*! Runtime gate: for each level, the mask of enabled modules.
+ *  Levels below the runtime threshold have a zero mask, and all masks are zero when inactive,
+ *  so a statement is checked with a single load-and-branch. Don't modify directly.
+ */
+extern unsigned int hlogLevelGate[ HLOG_LEVEL_NONE ];
+
+#define hlogIsEnabled( level, module ) \
+    ( (level) >= HLOG_MIN_LEVEL && (hlogLevelGate[ (level) ] & (1u << (module))) )
+
+#define HLOG_FORMAT_MAX_ARGS  8 // Binary mode stores at most this many args per statement.
+
+/*! Static per-statement format descriptor.
+ *  Lets binary mode log a format id and raw args instead of formatted text.
+ *  The arg signature is parsed from the format on first use.
+ */
+typedef struct
+{
+    const char* fmt;
+    unsigned char level;
+    unsigned char module;
+    unsigned short id;      // 0 until registered.
+    unsigned char argc;
+    char argTypes[ HLOG_FORMAT_MAX_ARGS ];
+} HLogFormat;
+
+// The format of a leveled statement must be a string literal.
+#define hlog_priv_statement( level, fmt, ... ) \
+    do{ if( hlogIsEnabled( (level), HLOG_MODULE ) ){ \
+        static HLogFormat hlog_priv_format = { fmt, (level), HLOG_MODULE }; \
+        hlogEvent( &hlog_priv_format, ##__VA_ARGS__ ); \
+    } }while(0)
+
+#define hlogTrace( ... )  hlog_priv_statement( HLOG_LEVEL_TRACE, __VA_ARGS__ )
+#define hlogDebug( ... )  hlog_priv_statement( HLOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define hlogInfo( ... )   hlog_priv_statement( HLOG_LEVEL_INFO,  __VA_ARGS__ )
+#define hlogWarn( ... )   hlog_priv_statement( HLOG_LEVEL_WARN,  __VA_ARGS__ )
+#define hlogError( ... )  hlog_priv_statement( HLOG_LEVEL_ERROR, __VA_ARGS__ )
+
+/* Runtime threshold and per-module mask */
+void hlogSetLevel(int level);
+int hlogGetLevel();
+void hlogSetModuleMask(unsigned int mask);
+unsigned int hlogGetModuleMask();
+
+/* Set, Close and Get the current LogFile */
+FILE* hlogSetFile(const char* fname, char mode);
+void hlogSetFileFromFile(FILE* file, char mode);
+void hlogCloseFile();
+FILE* hlogGetFile();
+char hlogIsActive();
+void hlogSetActive(char val);
+
+/* Async mode control */
+void hlogSetAsyncPolicy(char policy);
+unsigned long hlogGetDroppedCount();
+size_t hlogGetAsyncRingCount(); // Rings made so far. New threads take over the rings of exited ones.
+void hlogFlush();
+
+/* Write to the LogFile (Printf style). Not leveled - only checks the active flag. */
+void hlogf( const char* fmt, ... );
+
+/* Log a statement described by a static format. Used by the leveled macros. */
+void hlogEvent( HLogFormat* format, ... );
+
+#endif // HLOG_H_INCLUDED
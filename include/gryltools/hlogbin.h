@@ -0,0 +1,45 @@
+#ifndef HLOGBIN_H_INCLUDED
+#define HLOGBIN_H_INCLUDED
+
+/*! HLog binary event log format.
+ *  Shared by the hlog writer and the offline decoder.
+ *
+ *  A binary log with base name "log" consists of:
+ *  - "log.fmt"   - Format dictionary, text, one format per line:
+ *                  <id> <level> <module> <argTypes or -> <escaped format string>
+ *  - "log.N.hlb" - Segments (N = 0, 1, ...). A sequence of records, each starting
+ *                  with HLogBinRecordHeader, 8-byte aligned. A zero size marks the end.
+ *
+ *  Record args follow the header, encoded by the format's argTypes:
+ *  - I32, I64, DBL, PTR: raw native value (4, 8, 8, 8 bytes).
+ *  - STR: uint16 length, then that many bytes (no terminator).
+ *  Text records (fmtId == HLOG_BIN_TEXT_ID) carry one STR - an already formatted message.
+ */
+
+#include <stdint.h>
+
+#define HLOG_BIN_VERSION        1
+#define HLOG_BIN_SEGMENT_SIZE   (4 * 1024 * 1024)
+#define HLOG_BIN_TEXT_ID        0
+#define HLOG_BIN_MAX_STRING     128 // Longer string args are truncated.
+#define HLOG_BIN_ALIGN          8
+
+#define HLOG_BIN_FMT_EXT        ".fmt"
+#define HLOG_BIN_SEGMENT_EXT    ".hlb"
+
+// Argument type codes, also used as letters in the dictionary.
+#define HLOG_BIN_ARG_I32  'i'
+#define HLOG_BIN_ARG_I64  'l'
+#define HLOG_BIN_ARG_DBL  'd'
+#define HLOG_BIN_ARG_STR  's'
+#define HLOG_BIN_ARG_PTR  'p'
+
+typedef struct
+{
+    uint16_t size;      // Whole record size, including header and padding.
+    uint16_t fmtId;
+    uint32_t tid;
+    uint64_t timestamp; // Nanoseconds since the Epoch.
+} HLogBinRecordHeader;
+
+#endif // HLOGBIN_H_INCLUDED
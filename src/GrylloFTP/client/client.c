@@ -7,37 +7,48 @@
  *  Features:                                               *
  *  - 1980s FTP Plain text model                            *
  *  - Working USER/PASS authentication                      *           
- *  - All the basic commands (except Upload)                *   
+ *  - All the basic commands                                *   
+ *  - Uploads straight from the page cache (sendfile)       *
  *  - Using only NAT/Firewall-friendly Passive mode         *
  *  - Multithreaded download/control                        *
+ *  - Segmented parallel download (pget)                    *
  *  - Efficient command-handling                            *
  *  - Easily implementable new commands                     *
  *  - Uses Cross-Platform GrylTools framework               *
  *                                                          *
  *  TODOS:                                                  *
  *  - Synchronized Console I/O using Mutex-CondVars         *
- *  - Support for Upload                                    *
  *  - Support for different Data Modes                      *
  *  - (Far future) Support for FTPS                         *
  *                                                          *   
  ***********************************************************/ 
 
 #define FTP_CLIENT_VERSION  "v0.1"
+#define HLOG_MODULE HLOG_MOD_CLIENT
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <libgen.h>
+#include <strings.h>
+#include <errno.h>
 #include <gmisc.h>
 #include <grylsocks.h>
 #include <grylthread.h>
+#include <gatomic.h>
 #include <hlog.h>
 #include "clientcommands.h"
 
+#if defined __linux__
+    #include <sys/sendfile.h>
+    #include <poll.h>
+#endif
+
 // Command parser procedures
 
 int ftpSimpleComProc(  struct FTPCallbackCommand, FTPClientState*);
 int ftpParamComProc(   struct FTPCallbackCommand, FTPClientState*);
 int ftpDataConComProc( struct FTPCallbackCommand, FTPClientState*);
+int ftpPgetComProc(    struct FTPCallbackCommand, FTPClientState*);
 
 // Available command database
 
@@ -56,72 +67,55 @@ const struct FTPClientUICommand ftpClientCommands[]=
     // Complex commands (more than one raw FTP command required)
     { 3, "get",    0x0E, ftpDataConComProc},
     { 3, "send",   0x0F, ftpDataConComProc},
+    { 3, "append", 0x12, ftpDataConComProc},
+    { 3, "sunique", 0x11, ftpDataConComProc},
     { 1, "dir",    0x1C, ftpDataConComProc},
+    { 3, "pget",   0x0E, ftpPgetComProc},
 
     // Setting altering commands
     { 4, "passive",   0, ftpParamComProc}
 };
 
 // MultiThreading Synchronization Primitives.
-// Here we use a Mutex and a Condition Variable to wait for specific events.
 
-// - We need this pair of Mutex/CondVar to check the state of pending STDOUT 
-// writing operations by other threads. 
+// - We need to know the state of pending STDOUT writing operations by other threads. 
 // - Specifically, in the Main (command input) thread we must know that the
 // data threads completed their output operations to the STDOUT, before 
 // calling function reading (User Input) from STDIN.
+// - Data threads decrement the counter and signal the Event when done. The Event is
+// selectable, so the main thread watches the control connection while it waits.
 
-GrMutex mutex_WaitPrintData;
-GrCondVar condvar_WaitPrintData;
-volatile int PrintingThreadCount = 0;
+GrEvent event_PrintDone;
+int PrintingThreadCount = 0; // Atomic.
 
 /*! Default ClientState value setter.
  */
 void FTP_setDefaultClientState(FTPClientState* state)
 {
-    /*if(!state) return;
-    state->passiveModeOn =  1;
-    state->defType =    FTP_DATATYPE_ASCII;
-    state->defaultFormat =  FTP_DATAFORMAT_NONPRINT;
-    state->defaultStrucure= FTP_STRUCTURE_FILE;
-    state->defaultMode =    FTP_TRANSMODE_STREAM;*/
+    if(!state) return;
+    state->passiveModeOn = 1;
+    state->defDataType =   'I'; // Files come over byte for byte.
+    state->defDataFormat = 0;
+    state->defTransMode =  'S';
+    state->defStructure =  'F';
 }
 
-// Helper funcs
-
-// Simple callback-format function, which can print a buffer to a specified file.
-void printBuffer(char* buff, size_t sz, void* param)
+/*! The transfer parameters the server is known to have.
+ *  A freshly logged in session has the RFC 959 defaults: TYPE A N, MODE S, STRU F.
+ *  After a raw command which may have changed them, they're unknown until negotiated again.
+ */
+void FTP_resetNegotiatedState(FTPClientState* state, char loggedIn)
 {
-    //buff[sz] = 0; // Null-terminate the bufer for printing.
-    hlogf("helper_printBuffer(): printing %d bytes...\n", sz);
-
-    fwrite( buff, 1, sz, (param ? (FILE*)param : stdout));
+    if(!state) return;
+    state->negDataType =   (loggedIn ? 'A' : 0);
+    state->negDataFormat = (loggedIn ? 'N' : 0);
+    state->negTransMode =  (loggedIn ? 'S' : 0);
+    state->negStructure =  (loggedIn ? 'F' : 0);
 }
 
-/*! Helper for sendMessageGetResponse_Extended()
- *  A Select-based sender/receiver
- *  Args:
- *  - The same as for the main func.
- */
-
-int sendMessageGetResponse(SOCKET sock, const char* command, char* respondbuf, size_t respbufsiz, int flags);
-
-/*! FTP request-response handler.
- *  Sends a client request, and returns server response.
- *  By FTP conventions, 1 packet each.
- *  Params:
- *  - Command - fully ready C-String buffer to send (with a CRLF at the end).
- *  - Result in respondbuf
- *  Retval:
- *  - Fatal technical err: <0 (Need to exit a program)
- *  - If >0, then server response code.
- */
-
-// Flags and defines
-// Set the default timeout 
-#define FTOOL_RECVRESP_DEFAULT_TIMEOUT_SECS   0      
-#define FTOOL_RECVRESP_DEFAULT_TIMEOUT_MICROS 500000
+// Helper funcs
 
+// sendMessageGetResponse() flags
 #define FTOOL_RECVRESP_PRINTBUFFER      (1 << 0) // 1
 #define FTOOL_RECVRESP_NOSEND           (1 << 1) // 2
 #define FTOOL_RECVRESP_NORECEIVE        (1 << 2) // 4
@@ -129,147 +123,110 @@ int sendMessageGetResponse(SOCKET sock, const char* command, char* respondbuf, s
 #define FTOOL_RECVRESP_PRINTFLUSH       (1 << 4) // 16
 #define FTOOL_RECVRESP_FLUSH_ONLY       (1 << 5) // 32
 
-int sendMessageGetResponse_Extended( SOCKET sock, const char* command, char* respondbuf, size_t respbufsiz, 
-                        int flags, void (*responseBufferCallback)(char*, size_t, void*), void* callbackParam,
-                        int selectWaitTime_secs, int selectWaitTime_microsecs )
-{
-    fd_set readSet;
-    fd_set writeSet;
-    int iRes = 0;
-    int lastRespCode = 0;
-    int maxFds; // Linux-only argument to the "select()", the highest value of the FD's in sets + 1.
-    //Set the timeout
-    struct timeval tv;
-
-    hlogf("\nsendMessageGetResponse(): start\n");
-
-    // If flush socket is specified, then receive the pending data until empty. 
-    // When no data is pending (socket flushed), send the data.
-    // Flush is enabled by default, it can be disabled by flag NO_BUFFERFLUSH.
-    if(! (flags & FTOOL_RECVRESP_NO_BUFFERFLUSH))
-    {
-        hlogf("Flush flag set. Executing the recursion with NO_BUFFERFLUSH...\n");
-        char flushbuff[1024]; // 1KB temp. buffer for flushing
+// Final replies still due on the control connection: every 1xx preliminary reply (like
+// "150 Opening data connection") is followed by one more. Main thread only.
+int ctrlPendingReplies = 0;
 
-        // Specify that only receiving should be done, and the print flag. 
-        sendMessageGetResponse_Extended( sock, NULL, flushbuff, sizeof(flushbuff), 
-                FTOOL_RECVRESP_NOSEND | FTOOL_RECVRESP_NO_BUFFERFLUSH | \
-                ((flags & FTOOL_RECVRESP_PRINTFLUSH) ? FTOOL_RECVRESP_PRINTBUFFER : 0),
-                responseBufferCallback, callbackParam, 0, 5000 ); 
+/*! Reads one reply off the control connection, keeping count of the final replies due.
+ *  Returns the same as gsockLineReader_readReply().
+ */
+int readControlReply(GSockLineReader ctrl, char** reply, size_t* len, int* code, long millisec)
+{
+    int replyCode = 0;
+    int iRes = gsockLineReader_readReply(ctrl, reply, len, &replyCode, millisec);
+    if(iRes == 0){
+        if(replyCode >= 100 && replyCode < 200)
+            ctrlPendingReplies++;
+        else if(ctrlPendingReplies > 0){
+            ctrlPendingReplies--;
+            // A transfer's completion. The data connection's FIN alone doesn't tell whether the
+            // server sent everything - only a 2xx here does.
+            if(replyCode >= 300){
+                hlogError("Transfer failed: %s", *reply);
+                printf("\nTransfer failed: %s", *reply);
+            }
+        }
+        if(code)
+            *code = replyCode;
+    }
+    return iRes;
+}
 
+/*! FTP request-response handler.
+ *  Sends a client request, and waits for the server's reply - all of its lines, and no more.
+ *  The final replies still due for earlier commands (like transfer completions) are waited
+ *  for first, and dropped, or printed with FTOOL_RECVRESP_PRINTFLUSH.
+ *  Params:
+ *  - command - fully ready C-String buffer to send (with a CRLF at the end).
+ *  - The reply is copied to respondbuf, truncated to fit.
+ *  Retval:
+ *  - Fatal technical err: <0 (Need to exit a program)
+ *  - Else the server's reply code.
+ */
+int sendMessageGetResponse(GSockLineReader ctrl, const char* command, char* respondbuf, size_t respbufsiz, int flags)
+{
+    SOCKET sock = gsockLineReader_getSocket(ctrl);
+    char* reply;
+    size_t replyLen;
+    int code = 0;
+
+    hlogTrace("\nsendMessageGetResponse(): start\n");
+
+    if(!(flags & FTOOL_RECVRESP_NO_BUFFERFLUSH)){
+        // A transfer can take any time, so there's no limit on waiting for its completion.
+        while( ctrlPendingReplies > 0 || gsockLineReader_hasLine(ctrl) ){
+            int iRes = readControlReply(ctrl, &reply, &replyLen, &code, (ctrlPendingReplies > 0 ? -1 : 0));
+            if(iRes == 1)
+                break;
+            if(iRes != 0){
+                hlogError("Control connection lost while waiting for a pending reply.\n");
+                return -1;
+            }
+            hlogTrace("Flushing a pending reply: %s", reply);
+            if(flags & FTOOL_RECVRESP_PRINTFLUSH)
+                printf("%s", reply);
+        }
         if(flags & FTOOL_RECVRESP_FLUSH_ONLY)
             return 0;
     }
 
     if(!(flags & FTOOL_RECVRESP_NOSEND) && command)
     {
-        hlogf("Send flag is set. Data to send:\n%s\nChecking FD's for sending.\n", command);
-
-        // Wait time until it's possible to send 
-        tv.tv_sec = selectWaitTime_secs;        // Seconds 
-        tv.tv_usec = selectWaitTime_microsecs;  // MicroSeconds
-
-        FD_ZERO(&writeSet);
-        FD_SET(sock, &writeSet);
-        // Reserve the max-numbered SockFD for Loonix
-        maxFds = (int)sock + 1;
-
-        iRes = select(maxFds, NULL, &writeSet, NULL, &tv);
-        if(iRes == SOCKET_ERROR){
-            hlogf("SELECT returned error when SENDing.\n\n");
-            return -1;
-        }
-        else if(iRes == 0){
-            hlogf("Timeout: Its's unavailable to send data on this socket!\n\n");
-            return 0;
-        }
-
-        if(FD_ISSET(sock, &writeSet)) // There's data for reading on this sock.
-        {
-            hlogf("FD's are OK for sending. Trying to send...\n");
+        hlogTrace("Sending:\n%s\n", command);
 
-            // Send the command
-            if((iRes = send(sock, command, strlen(command), 0)) < 0){
-                hlogf("Error sending a message.\n\n");
-                return -2;
-            }
-            hlogf("Bytes sent: %d\n", iRes);
+        // The whole command must go out, or the server sees a truncated line.
+        if(gsockSendAll_time(sock, command, strlen(command), 0, FTOOL_REPLY_TIMEOUT_MS, NULL) != 0){
+            hlogError("Error sending a message.\n\n");
+            return -2;
         }
     }
 
     if(!(flags & FTOOL_RECVRESP_NORECEIVE) && respondbuf && respbufsiz>0)
     {
-        hlogf("Receive flag is set. Checking FD's for receiving.\n");
-
-        // Now receive the Response
-        while(1){
-            tv.tv_sec = selectWaitTime_secs;     
-            tv.tv_usec = selectWaitTime_microsecs;
-
-            FD_ZERO(&readSet);
-            FD_SET(sock, &readSet); // Add this socket to a set of socks checked for readability
-
-            // Reserve the max-numbered SockFD for Loonix
-            maxFds = (int)sock + 1;
-
-            iRes = select(maxFds, &readSet, NULL, NULL, &tv); // Return - no.of socks available for reading/writing.
-            if(iRes == SOCKET_ERROR){
-                hlogf("SELECT returned error.\n\n");
-                return -1;
-            }
-            else if(iRes == 0){
-                hlogf("Timeout: No more readable data on sockets!\n\n");
-                return 1;
-            }
-
-            if(FD_ISSET(sock, &readSet)) // There's data for reading on this sock.
-            {
-                hlogf("Data is available for receiving on this socket.\n");
-
-                iRes = recv(sock, respondbuf, respbufsiz, 0);
-                if( iRes < 0 ){
-                    hlogf("Error receiving  a response.\n\n");
-                    return -2;
-                }
-                if( iRes == 0 ){
-                    hlogf("recv returned 0 - FIN.\n\n");
-                    return -1;
-                }
-                // iRes > 0 = size of buffer.
-                hlogf("Received bytes: %d\n", iRes);
-
-                if((flags & FTOOL_RECVRESP_PRINTBUFFER) && !responseBufferCallback){ // No func passed, just print.
-                    // Parse the response, and null-terminate it.
-                    respondbuf[iRes] = 0;
-                    printf("%s", respondbuf);
-                }
-                else if(responseBufferCallback)
-                    responseBufferCallback( respondbuf, iRes, callbackParam );
-
-                // Return the response code as int.
-                //lastRespCode = ( (respondbuf[0]-'0')*100 + (respondbuf[1]-'0')*10 + (respondbuf[2]-'0') );
-                //lastRespCode = (lastRespCode<0 ? 0 : lastRespCode);
-                lastRespCode = 0; // Good.
-            }
+        int iRes = readControlReply(ctrl, &reply, &replyLen, &code, FTOOL_REPLY_TIMEOUT_MS);
+        if(iRes == 1){
+            hlogError("Timeout: no reply from the server in %d ms.\n\n", FTOOL_REPLY_TIMEOUT_MS);
+            return -1;
         }
-    }
-    hlogf("\n");
-    return lastRespCode;
-}
-
-int sendMessageGetResponse(SOCKET sock, const char* command, char* respondbuf, size_t respbufsiz, int flags)
-{
-    if(flags & FTOOL_RECVRESP_PRINTBUFFER)
-        printf("\n");
+        if(iRes == 2){
+            hlogTrace("Control connection closed by the server.\n\n");
+            return -1;
+        }
+        if(iRes != 0){
+            hlogError("Error receiving a response.\n\n");
+            return -2;
+        }
+        hlogTrace("Received reply %d, %d bytes.\n", code, (int)replyLen);
 
-    // Execute a function simply: No CallBacks, and 1 second timeout.
-    int retval = sendMessageGetResponse_Extended(sock, command, respondbuf, respbufsiz, flags, 
-             NULL, NULL, FTOOL_RECVRESP_DEFAULT_TIMEOUT_SECS, FTOOL_RECVRESP_DEFAULT_TIMEOUT_MICROS );
-    
-    if(flags & FTOOL_RECVRESP_PRINTBUFFER)
-        printf("\n");
+        if(flags & FTOOL_RECVRESP_PRINTBUFFER)
+            printf("\n%s\n", reply);
 
-    return retval;
+        if(replyLen >= respbufsiz)
+            replyLen = respbufsiz - 1;
+        memcpy(respondbuf, reply, replyLen);
+        respondbuf[replyLen] = 0;
+    }
+    return code;
 }
 
 // Help printer
@@ -293,24 +250,169 @@ void ftpThreadRunner_priv_ErrorCleanup(FTPDataFormatInfo* fmInfo, char unlockMtx
 {
     if(unlockMtx || (fmInfo ? fmInfo->outFile == stdout : 0)){
         // As the writing is done, decrement the Actively Writing counter,
-        // and notify all waiting threads to wake up and check.
-        hlogf("\nDataThread_cleanup: Identified Mutex Unlock/CondVar Notify.");
-
-        gthread_Mutex_lock( mutex_WaitPrintData );
-
-        if(PrintingThreadCount > 0)
-            PrintingThreadCount--;
-        gthread_CondVar_notifyAll( condvar_WaitPrintData );
+        // and wake the main thread to check.
+        hlogDebug("\nDataThread_cleanup: Identified Print counter decrement/Event signal.");
 
-        gthread_Mutex_unlock( mutex_WaitPrintData );
+        int count = gatomic_load( &PrintingThreadCount, GATOMIC_RELAXED );
+        while( count > 0 && !gatomic_casWeak( &PrintingThreadCount, &count, count - 1, GATOMIC_ACQ_REL, GATOMIC_RELAXED ) )
+            ;
+        gthread_Event_signal( event_PrintDone );
     }
     if(fmInfo){
-        hlogf("Freeing formInfo.\n");
+        hlogDebug("Freeing formInfo.\n");
         FTP_freeDataFormInfo(fmInfo);
         free(fmInfo);
     }
 }
 
+/*! Streams the data connection into outFile until the server closes it.
+ *  The buffer is sized from the socket's receive buffer, so every read takes what the kernel
+ *  has queued. The end of the data is the FIN - there's no waiting for silence.
+ *  Retval: 0 - got everything up to the FIN, 1 - nothing came for FTOOL_DATA_IDLE_TIMEOUT_MS,
+ *  -1 - receive or write error.
+ */
+int ftpReceiveStream_priv(SOCKET sock, FILE* outFile, long long* received)
+{
+    int rcvBuf = 0;
+    size_t bufLen = FTOOL_DATA_MIN_BUFLEN;
+    if(gsockGetOption(sock, GSOCK_OPT_RCVBUF, &rcvBuf) == 0 && (size_t)rcvBuf > bufLen)
+        bufLen = ((size_t)rcvBuf < FTOOL_DATA_MAX_BUFLEN ? (size_t)rcvBuf : FTOOL_DATA_MAX_BUFLEN);
+
+    char* buf = malloc(bufLen);
+    if(!buf){
+        hlogError("Can't allocate a %d byte receive buffer.\n", (int)bufLen);
+        return -1;
+    }
+    hlogDebug("Receiving with a %d byte buffer.\n", (int)bufLen);
+
+    int retval = -1;
+    *received = 0;
+    while(1){
+        size_t got = 0;
+        int iRes = gsockReceiveAll_time(sock, buf, bufLen, 0, FTOOL_DATA_IDLE_TIMEOUT_MS, &got);
+        if(got > 0 && fwrite(buf, 1, got, outFile) != got){
+            hlogError("Write to the output file failed.\n");
+            break;
+        }
+        *received += got;
+
+        if(iRes == 2){ // FIN - that's all of it.
+            retval = 0;
+            break;
+        }
+        if(iRes == 1 && got == 0){
+            hlogError("Data connection idle for %d ms.\n", FTOOL_DATA_IDLE_TIMEOUT_MS);
+            retval = 1;
+            break;
+        }
+        if(iRes < 0){
+            hlogError("Error receiving on the data connection: %d\n", gsockGetLastError());
+            break;
+        }
+    }
+    free(buf);
+    fflush(outFile);
+    return retval;
+}
+
+/*! Streams inFile to the data connection, from the start to its end.
+ *  On Linux the kernel moves the file's pages to the socket with sendfile(), with no copying
+ *  through user space. If it can't do that for this file (a pipe, or a file system without
+ *  support), the file is read in buffers sized like the socket's send buffer.
+ *  Retval: 0 - everything sent, 1 - the server took nothing for FTOOL_DATA_IDLE_TIMEOUT_MS,
+ *  -1 - read or send error.
+ */
+int ftpSendStream_priv(SOCKET sock, FILE* inFile, long long* sent)
+{
+    *sent = 0;
+
+    #if defined __linux__
+    // sendfile() takes no flags - the socket is made non-blocking, and we wait for room
+    // ourselves, so a server which stops reading can't hold us forever.
+    int wasNonBlock = 0;
+    gsockGetOption(sock, GSOCK_OPT_NONBLOCK, &wasNonBlock);
+    if(!wasNonBlock)
+        gsockSetOption(sock, GSOCK_OPT_NONBLOCK, 1);
+
+    off_t offset = 0;
+    int result = 2; // Not done yet. Stays 2 if the file has to be read instead.
+    while(result == 2){
+        // Up to the EOF, not the size fstat() tells - it's 0 for some files which do have data.
+        ssize_t res = sendfile(sock, fileno(inFile), &offset, FTOOL_DATA_MAX_BUFLEN);
+        if(res == 0)
+            result = 0;
+        else if(res > 0 || errno == EINTR)
+            continue;
+        else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            struct pollfd pfd = { sock, POLLOUT, 0 };
+            int ready = poll(&pfd, 1, FTOOL_DATA_IDLE_TIMEOUT_MS);
+            if(ready == 0){
+                hlogError("Data connection stalled for %d ms.\n", FTOOL_DATA_IDLE_TIMEOUT_MS);
+                result = 1;
+            }
+            else if(ready < 0 && errno != EINTR){
+                hlogError("poll() on the data connection failed: %d\n", errno);
+                result = -1;
+            }
+        }
+        else if(offset == 0 && (errno == EINVAL || errno == ESPIPE || errno == ENOSYS)){
+            hlogDebug("sendfile() can't take this file, reading it instead.\n");
+            break;
+        }
+        else{
+            hlogError("sendfile() failed after %lld bytes: %d\n", (long long)offset, errno);
+            result = -1;
+        }
+    }
+
+    if(!wasNonBlock)
+        gsockSetOption(sock, GSOCK_OPT_NONBLOCK, 0);
+    if(result != 2){
+        *sent = offset;
+        return result;
+    }
+    #endif
+
+    int sndBuf = 0;
+    size_t bufLen = FTOOL_DATA_MIN_BUFLEN;
+    if(gsockGetOption(sock, GSOCK_OPT_SNDBUF, &sndBuf) == 0 && (size_t)sndBuf > bufLen)
+        bufLen = ((size_t)sndBuf < FTOOL_DATA_MAX_BUFLEN ? (size_t)sndBuf : FTOOL_DATA_MAX_BUFLEN);
+
+    char* buf = malloc(bufLen);
+    if(!buf){
+        hlogError("Can't allocate a %d byte send buffer.\n", (int)bufLen);
+        return -1;
+    }
+    hlogDebug("Sending with a %d byte buffer.\n", (int)bufLen);
+
+    int retval = 0;
+    size_t got;
+    while(retval == 0 && (got = fread(buf, 1, bufLen, inFile)) > 0){
+        for(size_t off = 0; off < got; ){
+            size_t done = 0;
+            int iRes = gsockSendAll_time(sock, buf + off, got - off, 0, FTOOL_DATA_IDLE_TIMEOUT_MS, &done);
+            off += done;
+            *sent += done;
+            if(iRes == 1 && done == 0){
+                hlogError("Data connection stalled for %d ms.\n", FTOOL_DATA_IDLE_TIMEOUT_MS);
+                retval = 1;
+                break;
+            }
+            if(iRes < 0){
+                hlogError("Error sending on the data connection: %d\n", gsockGetLastError());
+                retval = -1;
+                break;
+            }
+        }
+    }
+    if(retval == 0 && ferror(inFile)){
+        hlogError("Read from the local file failed.\n");
+        retval = -1;
+    }
+    free(buf);
+    return retval;
+}
+
 /*! The Data-connection thread procedures.
  *  Thread makes a Data connection to server and executes the transfer by the
  *  options specified in the FTPDataFormatInfo* structure.
@@ -324,30 +426,27 @@ void ftpThreadRunner_priv_ErrorCleanup(FTPDataFormatInfo* fmInfo, char unlockMtx
 void ftpThreadRunner_receive(void* param)
 {
     if(!param) return;
-    hlogf("\n* - * - * - * - * - * - *\n ftpThreadRunner_receive(): start\n");
+    hlogDebug("\n* - * - * - * - * - * - *\n ftpThreadRunner_receive(): start\n");
 
     FTPDataFormatInfo* formInfo = (FTPDataFormatInfo*)param;
     FTP_printDataFormInfo(formInfo, hlogGetFile());
         
     if(!formInfo->passiveOn){
-        hlogf("Active mode is not supported. Aborting.\n");
+        hlogWarn("Active mode is not supported. Aborting.\n");
         ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
         return;
     }
 
-    char port[8];
-    sprintf(port, "%d", formInfo->port);
-
     if(!formInfo->outFile && !formInfo->fname){
-        hlogf("NO file and filename specified. Aborting data transfer.\n");
+        hlogError("NO file and filename specified. Aborting data transfer.\n");
         ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
         return;
     }
 
-    // Connect to the server on specified sock and port.
-    SOCKET dataSocket = gsockConnectSocket(formInfo->ipAddr, port, 0, 0, 0, 0);
+    // The main thread has connected it already.
+    SOCKET dataSocket = formInfo->dataSock;
     if(dataSocket == INVALID_SOCKET){
-        hlogf("Can't connect to the server on Data Port! Aborting...\n");
+        hlogError("No data connection! Aborting...\n");
         ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
         return;
     }
@@ -357,48 +456,55 @@ void ftpThreadRunner_receive(void* param)
     // must Open the specified file for Writing by ourselves.
     if(formInfo->fname && !formInfo->outFile){ 
         if(! (formInfo->outFile = fopen(formInfo->fname, "wb"))){
-            hlogf("Can't open file: %s\nAborting...\n", formInfo->fname);
-            gsockCloseSocket(dataSocket);
+            hlogError("Can't open file: %s\nAborting...\n", formInfo->fname);
             ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
             return;
         }
     }
 
-    // Allocate the buffer to which we'll receive
-    char dataBuffer[GSOCK_DEFAULT_BUFLEN];
-    
-    // Execute the receiving and writing into buff. 
-    // Specify that No sending and no socket flushing should be done, only receiving.
-    hlogf("Starting the receiving procedure.....\n");
-    if( sendMessageGetResponse_Extended( dataSocket, dataBuffer, dataBuffer, sizeof(dataBuffer),
-                FTOOL_RECVRESP_NOSEND | FTOOL_RECVRESP_NO_BUFFERFLUSH, 
-                printBuffer, (void*)(formInfo->outFile), 
-                1, 0 ) < 0 ){ // For DataConn, use a safer timeout of 1 second.
-         hlogf("FIN or error while sending and receiving.\n");
-    }
+    // Receive until the server closes the connection. Whether it sent everything is told by
+    // the transfer's final reply, which the main thread reads off the control connection.
+    hlogDebug("Starting the receiving procedure.....\n");
+    long long received = 0;
+    if( ftpReceiveStream_priv( dataSocket, formInfo->outFile, &received ) != 0 )
+        hlogError("Data transfer broken off after %lld bytes.\n", received);
+    else
+        hlogDebug("Data connection closed by the server after %lld bytes.\n", received);
 
     // Cleanup. Close files, sockets, and free structures.
-    gsockCloseSocket(dataSocket);
     ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
 
-    hlogf("ftpThreadRunner_receive(): end\n* - * - * - * - * - * - *\n");
+    hlogDebug("ftpThreadRunner_receive(): end\n* - * - * - * - * - * - *\n");
 }
 
 void ftpThreadRunner_send(void* param)
 {
     if(!param) return;
-    hlogf("\n* - * - * - * - * - * - *\n ftpThreadRunner_send(): start\n");
+    hlogDebug("\n* - * - * - * - * - * - *\n ftpThreadRunner_send(): start\n");
 
     FTPDataFormatInfo* formInfo = (FTPDataFormatInfo*)param;
     FTP_printDataFormInfo(formInfo, hlogGetFile());
 
-    // Do work here.
+    if(!formInfo->inFile || formInfo->dataSock == INVALID_SOCKET){
+        hlogError("No file or no data connection to send on. Aborting data transfer.\n");
+        ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
+        return;
+    }
 
-    hlogf("Freeing formInfo.\n");
-    //FTP_freeDataFormInfo(formInfo);
-    free(formInfo);
+    // The end of the file is told by closing the connection. If the upload broke off, it's
+    // closed with a reset, so the server doesn't take the part it got for the whole file.
+    long long sent = 0;
+    if( ftpSendStream_priv( formInfo->dataSock, formInfo->inFile, &sent ) != 0 ){
+        hlogError("Upload broken off after %lld bytes.\n", sent);
+        struct linger lg = { 1, 0 };
+        setsockopt( formInfo->dataSock, SOL_SOCKET, SO_LINGER, (const char*)&lg, sizeof(lg) );
+    }
+    else
+        hlogDebug("Sent %lld bytes, closing the data connection.\n", sent);
+
+    ftpThreadRunner_priv_ErrorCleanup( formInfo, 0 ); 
 
-    hlogf("ftpThreadRunner_send(): end\n* - * - * - * - * - * - *\n");
+    hlogDebug("ftpThreadRunner_send(): end\n* - * - * - * - * - * - *\n");
 }
 
 /*! Convert the UI main command to a raw one.
@@ -449,34 +555,34 @@ int ftpConvertUItoRaw(char* buff, size_t sz, struct FTPCallbackCommand command)
  */
 int ftpSimpleComProc(struct FTPCallbackCommand command, FTPClientState* state)
 {
-    hlogf("ftpSimpleComProc() called. Name:%s\n", (command.commInfo)->name);
+    hlogDebug("ftpSimpleComProc() called. Name:%s\n", (command.commInfo)->name);
     GSOCKSocketStruct* ss = &(state->controlSocket);
 
     // Check for terminating commands.
     if(strcmp((command.commInfo)->name, "quit") == 0){
-        hlogf("ftpSimpleComProc(): QUIT identified.\n");
+        hlogDebug("ftpSimpleComProc(): QUIT identified.\n");
         return -1;
     }
     
     // Check for help command.
     if(strcmp((command.commInfo)->name, "help") == 0){
-        hlogf("ftpSimpleComProc(): HELP identified. Printing Help msg.\n");
+        hlogDebug("ftpSimpleComProc(): HELP identified. Printing Help msg.\n");
         ftpPrintHelp(stdout);
         return 0;
     }
 
     // Create the command string. Append RawName and params.
     if( ftpConvertUItoRaw( (state->controlSocket).dataBuff, GSOCK_DEFAULT_BUFLEN, command ) < 0){
-        hlogf("Couldn't convert UI command to Raw.\n");
+        hlogError("Couldn't convert UI command to Raw.\n");
         return 1;
     }
 
     //Execute that command.
     //Last result will be in the socket DataBuff.
-    if(sendMessageGetResponse((state->controlSocket).sock, (state->controlSocket).dataBuff,
+    if(sendMessageGetResponse(state->ctrlReader, (state->controlSocket).dataBuff,
        (state->controlSocket).dataBuff, GSOCK_DEFAULT_BUFLEN, 1 ) < 0)
     {
-        hlogf("Error on sendMessageGetResponse()\n");
+        hlogError("Error on sendMessageGetResponse()\n");
         return -3;
     }
     return 0;
@@ -493,6 +599,13 @@ void FTP_freeDataFormInfo(FTPDataFormatInfo* info)
         free(info->fname);*/
     if(info->outFile && info->outFile!=stdout && info->outFile!=stderr && info->outFile!=stdin)
         fclose(info->outFile);
+    info->outFile = NULL;
+    if(info->inFile)
+        fclose(info->inFile);
+    info->inFile = NULL;
+    if(info->dataSock != INVALID_SOCKET)
+        gsockCloseSocket(info->dataSock);
+    info->dataSock = INVALID_SOCKET;
 }
 
 void FTP_printDataFormInfo(const FTPDataFormatInfo* fi, FILE* outFile)
@@ -505,13 +618,22 @@ void FTP_printDataFormInfo(const FTPDataFormatInfo* fi, FILE* outFile)
                      fi->passiveOn, fi->ipAddr, fi->port, fi->outFile, fi->fname);
 }
 
+// A transfer parameter sent in the pipeline, and where its acknowledged value goes.
+typedef struct
+{
+    const char* what;
+    char* cached;
+    char value;
+} FTPPendingParam;
+
 int ftpDataConProc_checkError(int iResult, char* dataBuf, FTPDataFormatInfo* formInfo, const char* infoErr)
 {
     // Check if technical error occured or if server returned an error code.
     if(iResult < 0 ? 1 : (dataBuf ? (dataBuf[0]=='4' || dataBuf[0]=='5') : 0) ){
-        hlogf( (iResult<0 ? "Technical FATAL Error on function() : \"%s\"\n" :
-                            "Error on \"%s\": Server returned error response. Aborting.\n"),
-               infoErr );
+        if(iResult < 0)
+            hlogError("Technical FATAL Error on function() : \"%s\"\n", infoErr);
+        else
+            hlogError("Error on \"%s\": Server returned error response. Aborting.\n", infoErr);
         if(formInfo)
             FTP_freeDataFormInfo(formInfo);
         return (iResult<0 ? iResult : (dataBuf ? dataBuf[0]-'0' : 1)); // Return negative if fatal or server respose.
@@ -519,19 +641,19 @@ int ftpDataConProc_checkError(int iResult, char* dataBuf, FTPDataFormatInfo* for
     return 0;
 }
 
-int ftpExtractIpPortPasv( char** ip, short* port, const char* dataBuf, char extended )
+int ftpExtractIpPortPasv( char** ip, unsigned short* port, const char* dataBuf, char extended )
 {
     if(!ip || !port || !dataBuf)
         return -4;
 
-    hlogf("ftpExtractIpPortPasv(): start\n");
+    hlogDebug("ftpExtractIpPortPasv(): start\n");
 
     const char* start = NULL;
     const char* end = NULL;
     const char* ipEnd = NULL;
     int sepCount=0;
     //Find the beginning of IPv4
-    for(const char* i = dataBuf; i!=0; i++){
+    for(const char* i = dataBuf; *i; i++){
         if(*i == '(')
             start = i+1;
         if(*i == ')'){
@@ -566,7 +688,8 @@ int ftpExtractIpPortPasv( char** ip, short* port, const char* dataBuf, char exte
     //*port = (short)n1 * 256 + (short)n2;
     *port = ( (((unsigned char)n1) << 8) | (unsigned char)n2 );
 
-    hlogf("Successfully extracted IP and Port:\n IP: %s\n port: %d\n", *ip, *port);
+    hlogDebug("Successfully extracted IP and Port:\n IP: %s\n port: %d\n", *ip, *port);
+    return 0;
 }
 
 /*! Processes commands which consists of multiple requests and replies,
@@ -574,21 +697,22 @@ int ftpExtractIpPortPasv( char** ip, short* port, const char* dataBuf, char exte
  */
 int ftpDataConComProc(struct FTPCallbackCommand command, FTPClientState* state)
 {
-    hlogf("ftpDataConComProc() called. Name:%s\n", (command.commInfo)->name);
+    hlogDebug("ftpDataConComProc() called. Name:%s\n", (command.commInfo)->name);
 
     //Allocate a dynanic FTPDataFormatInfo structure, because it will be passed to thread.
     FTPDataFormatInfo* formInfo = (FTPDataFormatInfo*) calloc( sizeof(FTPDataFormatInfo), 1 );
     if(!formInfo){ //Calloc failed
-        hlogf("Oh no. Can't allocate dynamic memory!\n");
+        hlogError("Oh no. Can't allocate dynamic memory!\n");
         return -1;
     }
+    formInfo->dataSock = INVALID_SOCKET;
 
     const char* cname = (command.commInfo)->name;
     char* dataBuf = (state->controlSocket).dataBuff;
     void (*threadProc)(void*); // The procedure which we'll be spawning as thread.
     int iRes, filenameParam= -1;
 
-    hlogf("Setting individual parameters for command...\n");
+    hlogDebug("Setting individual parameters for command...\n");
 
     // Determine the individual params for each command.
     if(strcmp(cname, "get")==0){
@@ -599,7 +723,7 @@ int ftpDataConComProc(struct FTPCallbackCommand command, FTPClientState* state)
         threadProc = ftpThreadRunner_receive;
         formInfo->outFile = stdout; // Just set the output file directly.
     }
-    else if(strcmp(cname, "send")==0){
+    else if(strcmp(cname, "send")==0 || strcmp(cname, "append")==0 || strcmp(cname, "sunique")==0){
         threadProc = ftpThreadRunner_send;
         filenameParam = 0;
     }
@@ -608,103 +732,130 @@ int ftpDataConComProc(struct FTPCallbackCommand command, FTPClientState* state)
     if(filenameParam >= 0)
     {
         if(!command.params[0]){ // Must have a filename parameter.
-            hlogf("get: no filename specified!\n");
+            hlogError("%s: no filename specified!\n", cname);
             free(formInfo);
             return 1;
         }
-        formInfo->fname = (char*)malloc( strlen(command.params[0]) );
+        formInfo->fname = (char*)malloc( strlen(command.params[0]) + 1 );
         strcpy(formInfo->fname, command.params[0]);
     }
 
-    hlogf("Starting a format negotiation with the server...\n");
-
-    // Starting the transfer options negotiations.
-    // Check for data transfer options in State. If zero, skip.
-
-    // Data type and format (TYPE x y)
-    if(state->defDataType){
-        hlogf("Negotiating Data Type-format: %c %c\n", state->defDataType,
-                (state->defDataFormat ? state->defDataFormat : ' ') );
-        snprintf( dataBuf, GSOCK_DEFAULT_BUFLEN, "TYPE %c %c\r\n", state->defDataType,
-            (state->defDataType != 'I' ? (state->defDataFormat ? state->defDataFormat : 'N') : ' ') );
-
-        // Execute request, and check for errors, performing cleanup if needed.
-        if( (iRes = ftpDataConProc_checkError(
-                sendMessageGetResponse((state->controlSocket).sock, dataBuf, dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
-                dataBuf, formInfo, "Data type-format" )) != 0 )
-            return iRes;
-
-        formInfo->dataType = state->defDataType;
-        formInfo->dataFormat = state->defDataFormat;
+    // Uploads: send local-file [remote-file]. The file is opened now, so a bad name fails
+    // before anything is asked from the server.
+    if(threadProc == ftpThreadRunner_send)
+    {
+        if(! (formInfo->inFile = fopen(formInfo->fname, "rb"))){
+            hlogError("Can't open file: %s\n", formInfo->fname);
+            printf("Can't open file: %s\n", formInfo->fname);
+            free(formInfo->fname);
+            free(formInfo);
+            return 1;
+        }
+        // The server gets the name without the local path, unless another one was given.
+        // STOU takes no name - the server makes one up and tells it in the reply.
+        char* remoteName = (command.params[1] ? command.params[1] : basename(command.params[0]));
+        command.params[0] = (strcmp(cname, "sunique")==0 ? NULL : remoteName);
+        for(int i = 1; i < FTPUI_COMMAND_MAXPARAMS; i++)
+            command.params[i] = NULL;
     }
 
-    // Transmission mode (MODE x)
-    if(state->defTransMode){
-        hlogf("Negotiating TransMode: %c\n", state->defTransMode);
-        snprintf( dataBuf, GSOCK_DEFAULT_BUFLEN, "MODE %c\r\n", state->defTransMode );
+    hlogDebug("Starting a format negotiation with the server...\n");
 
-        // Execute request, and check for errors, performing cleanup if needed.
-        if( (iRes = ftpDataConProc_checkError(
-                sendMessageGetResponse((state->controlSocket).sock, dataBuf, dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
-                dataBuf, formInfo, "transmission mode" )) != 0 )
-            return iRes;
+    // Only the parameters the server doesn't have yet are sent, all in one write with PASV
+    // last. The server answers them in order.
+    //TODO: implement PORT mode
+    //By now we just set to PASv implicitly
+    state->passiveModeOn = 1;
+    formInfo->passiveOn = state->passiveModeOn;
 
-        formInfo->transMode = state->defTransMode;
+    char typeFormat = ((state->defDataType == 'A' || state->defDataType == 'E') ?
+                       (state->defDataFormat ? state->defDataFormat : 'N') : 0);
+    FTPPendingParam pending[3];
+    int pendingCount = 0;
+    size_t pipeLen = 0;
+
+    if(state->defDataType && (state->defDataType != state->negDataType || typeFormat != state->negDataFormat)){
+        if(typeFormat)
+            pipeLen += snprintf(dataBuf + pipeLen, GSOCK_DEFAULT_BUFLEN - pipeLen, "TYPE %c %c\r\n", state->defDataType, typeFormat);
+        else
+            pipeLen += snprintf(dataBuf + pipeLen, GSOCK_DEFAULT_BUFLEN - pipeLen, "TYPE %c\r\n", state->defDataType);
+        pending[pendingCount++] = (FTPPendingParam){ "Data type-format", &(state->negDataType), state->defDataType };
     }
+    if(state->defTransMode && state->defTransMode != state->negTransMode){
+        pipeLen += snprintf(dataBuf + pipeLen, GSOCK_DEFAULT_BUFLEN - pipeLen, "MODE %c\r\n", state->defTransMode);
+        pending[pendingCount++] = (FTPPendingParam){ "transmission mode", &(state->negTransMode), state->defTransMode };
+    }
+    if(state->defStructure && state->defStructure != state->negStructure){
+        pipeLen += snprintf(dataBuf + pipeLen, GSOCK_DEFAULT_BUFLEN - pipeLen, "STRU %c\r\n", state->defStructure);
+        pending[pendingCount++] = (FTPPendingParam){ "structure", &(state->negStructure), state->defStructure };
+    }
+    snprintf(dataBuf + pipeLen, GSOCK_DEFAULT_BUFLEN - pipeLen, "PASV\r\n");
+    hlogDebug("Negotiating %d parameters, pipelined with PASV.\n", pendingCount);
+
+    // Every reply must be read, even after a refusal, or the next command gets the wrong one.
+    const char* refused = NULL;
+    for(int i = 0; i <= pendingCount; i++){
+        iRes = sendMessageGetResponse(state->ctrlReader, (i == 0 ? dataBuf : NULL), dataBuf, GSOCK_DEFAULT_BUFLEN,
+                                      FTOOL_RECVRESP_PRINTBUFFER | (i == 0 ? 0 : FTOOL_RECVRESP_NOSEND | FTOOL_RECVRESP_NO_BUFFERFLUSH));
+        if(iRes < 0)
+            return ftpDataConProc_checkError(iRes, dataBuf, formInfo, (i < pendingCount ? pending[i].what : "setting passive mode"));
+        if(i == pendingCount)
+            break;
 
-    // Structure (STRU x)
-    if(state->defStructure){
-        hlogf("Negotiating structure: %c\n", state->defStructure);
-        snprintf( dataBuf, GSOCK_DEFAULT_BUFLEN, "STRU %c\r\n", state->defStructure );
-
-        // Execute request, and check for errors, performing cleanup if needed.
-        if( (iRes = ftpDataConProc_checkError(
-                sendMessageGetResponse((state->controlSocket).sock, dataBuf, dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
-                dataBuf, formInfo, "structure" )) != 0 )
-            return iRes;
-
-        formInfo->structure = state->defStructure;
+        char ok = (dataBuf[0] == '2');
+        *(pending[i].cached) = (ok ? pending[i].value : 0);
+        if(pending[i].cached == &(state->negDataType))
+            state->negDataFormat = (ok ? typeFormat : 0);
+        if(!ok && !refused)
+            refused = pending[i].what;
+    }
+    if(refused){
+        hlogError("Error on \"%s\": Server returned error response. Aborting.\n", refused);
+        FTP_freeDataFormInfo(formInfo);
+        return 4;
     }
+    formInfo->dataType = state->negDataType;
+    formInfo->dataFormat = state->negDataFormat;
+    formInfo->transMode = state->negTransMode;
+    formInfo->structure = state->negStructure;
 
-    //TODO: implement PORT mode
-    //By now we just set to PASv implicitly
-    state->passiveModeOn = 1;
+    // PASV's reply is in the buffer now.
+    if( (iRes = ftpDataConProc_checkError(0, dataBuf, formInfo, "setting passive mode")) != 0 )
+        return iRes;
 
-    // Set the passive option in formInfo
-    formInfo->passiveOn = state->passiveModeOn;
+    // Set IP and port in a structure and check for errors at the same time.
+    if( (iRes = ftpDataConProc_checkError(
+            ftpExtractIpPortPasv( &(formInfo->ipAddr), &(formInfo->port), dataBuf, 0),
+            NULL, formInfo, "Can't extract IP and port from PASV response." )) != 0 )
+        return 2;
 
-    if(state->passiveModeOn) // PASV mode
-    {
-        // Execute request, and check for errors, performing cleanup if needed.
-        if( (iRes = ftpDataConProc_checkError(
-                sendMessageGetResponse((state->controlSocket).sock, "PASV\r\n", dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
-                dataBuf, formInfo, "setting passive mode" )) != 0 )
-            return iRes;
-
-        // Set IP and port in a structure and check for errors at the same time.
-        if( (iRes = ftpDataConProc_checkError(
-                ftpExtractIpPortPasv( &(formInfo->ipAddr), &(formInfo->port), dataBuf, 0),
-                NULL, formInfo, "Can't extract IP and port from PASV response." )) != 0 )
-            return 2;
-    }
-    else  // PORT mode
-    {
-        //Not yet impl'd
+    // Connect before the transfer command - some servers reply to it only once the data
+    // connection is there.
+    char port[8];
+    snprintf(port, sizeof(port), "%d", formInfo->port);
+    GSockOptions sockOpts = { 0 };
+    sockOpts.connectTimeout = FTOOL_DATA_CONNECT_TIMEOUT_MS;
+    formInfo->dataSock = gsockConnectSocketEx(formInfo->ipAddr, port, 0, 0, 0, &sockOpts);
+    if(formInfo->dataSock == INVALID_SOCKET){
+        hlogError("Can't connect to the server on Data Port! Aborting...\n");
+        FTP_freeDataFormInfo(formInfo);
+        return 2;
     }
 
     // Now execute the command specified.
     // Create the command string. Append RawName and params.
     if( ftpConvertUItoRaw( dataBuf, GSOCK_DEFAULT_BUFLEN, command ) < 0){
-        hlogf("Couldn't convert UI command to Raw.\n");
+        hlogError("Couldn't convert UI command to Raw.\n");
+        FTP_freeDataFormInfo(formInfo);
         return 1;
     }
     
     // Execute the final data connection opening request, and check for errors, performing cleanup if needed.
     if( (iRes = ftpDataConProc_checkError(
-            sendMessageGetResponse((state->controlSocket).sock, dataBuf, dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
+            sendMessageGetResponse(state->ctrlReader, dataBuf, dataBuf, GSOCK_DEFAULT_BUFLEN, 1),
             dataBuf, formInfo, "Final Data Connection Opening" )) != 0 )
     {
-        hlogf("Couldn't open the data connection.\nAborting everything.\n");
+        hlogError("Couldn't open the data connection.\nAborting everything.\n");
 
         return iRes;
     }
@@ -715,38 +866,112 @@ int ftpDataConComProc(struct FTPCallbackCommand command, FTPClientState* state)
     // Signal that important writing to STDOUT is taking place, so no input should be done
     // (Increment the Actively Writing Thread Counter). We must lock a mutex to do it.
     if(formInfo->outFile == stdout ){
-        hlogf("STDOUT-using Data Connection command identified. Locking mutex, and setting PrintingThreadCount.\n");
-        gthread_Mutex_lock( mutex_WaitPrintData );
+        hlogDebug("STDOUT-using Data Connection command identified. Incrementing PrintingThreadCount.\n");
+        gatomic_addFetch( &PrintingThreadCount, 1, GATOMIC_ACQ_REL );
+    }
+    // On data thread the PrintingThreadCount must be decremented after operation is done!!!
 
-        PrintingThreadCount++;
+    // Queue the transfer on the data thread pool.
 
-        gthread_Mutex_unlock( mutex_WaitPrintData );
+    hlogDebug("Submitting a Data Connection task!\n");
+    if( gthread_Pool_submit( state->DataThreadPool, threadProc, (void*)formInfo ) != 0 ){
+        hlogError("Error submitting a data transfer task!\n");
+        FTP_freeDataFormInfo(formInfo);
+        return 1;
     }
-    // On data thread the PrintingThreadCount must be decremented after operation is done!!!
 
-    // Now we can find a position for the thread.
+    return 0;
+}
+
+/*! Segmented download: pget remote-file [local-file] [max-streams]
+ *  The command returns when the file is in. Its streams run on the data thread pool.
+ */
+int ftpPgetComProc(struct FTPCallbackCommand command, FTPClientState* state)
+{
+    if(!command.params[0]){
+        printf("usage: pget remote-file [local-file] [max-streams]\n");
+        return 1;
+    }
+    int iRes = ftpPget(state, command.params[0], command.params[1], (command.params[2] ? atoi(command.params[2]) : 0));
+    if(iRes != 2)
+        return iRes;
+
+    // Without a size there are no ranges to split. Get it the plain way.
+    printf("Falling back to a plain get.\n");
+    for(const struct FTPClientUICommand* cmd = ftpClientCommands;
+        cmd < ftpClientCommands + sizeof(ftpClientCommands)/sizeof(struct FTPClientUICommand);
+        cmd++)
+    {
+        if(strcmp(cmd->name, "get") == 0)
+            command.commInfo = cmd;
+    }
+    for(int i = 1; i < FTPUI_COMMAND_MAXPARAMS; i++)
+        command.params[i] = NULL;
+    return ftpDataConComProc(command, state);
+}
+
+/*! Waits until the data threads are done printing to STDOUT.
+ *  The control connection is watched at the same time, so a closed connection is noticed
+ *  right away. Replies which arrive meanwhile are printed after the wait, so they don't mix
+ *  with the data output.
+ *  Returns -1 if the control connection was closed, 0 otherwise.
+ */
+int waitForPrintingThreads(GSockLineReader ctrl, char* replyBuf, size_t replyBufSize)
+{
+    size_t replyLen = 0;
+    char watchCtrl = 1;
+    int retval = 0;
+    int eventFd = gthread_Event_getFD( event_PrintDone );
+    SOCKET ctrlSock = gsockLineReader_getSocket( ctrl );
 
-    hlogf("Spawning a Data Connection Thread!\n");
-    int threadError = 0;
-    for(int i = 0; i<FTP_MAX_DATA_THREADS; i++)
+    while( gatomic_load( &PrintingThreadCount, GATOMIC_ACQUIRE ) > 0 )
     {
-        if(!gthread_Thread_isRunning( (state->DataThreadPool[i]).thrHand )){
-            // Crete a new thread in this position and check if error occured.
-            if( ! ((state->DataThreadPool[i]).thrHand = gthread_Thread_create( threadProc, (void*)formInfo )) )
-                threadError = 1;
-            hlogf("[main thread]: Successfully spawned thread, in position %d\n", i);   
+        // Take the replies which are in already - the reader may hold some select() can't see.
+        char* reply;
+        size_t len;
+        int iRes;
+        while( watchCtrl && (iRes = readControlReply( ctrl, &reply, &len, NULL, 0 )) == 0 ){
+            if(replyLen + len >= replyBufSize)
+                len = replyBufSize - 1 - replyLen;
+            memcpy( replyBuf + replyLen, reply, len );
+            replyLen += len;
+        }
+        if(watchCtrl && iRes != 1){
+            hlogError("Control connection closed while data transfers are running.\n");
+            watchCtrl = 0;
+            retval = -1;
+        }
+
+        fd_set readSet;
+        int maxFds = eventFd;
+        FD_ZERO(&readSet);
+        FD_SET(eventFd, &readSet);
+        if(watchCtrl){
+            FD_SET(ctrlSock, &readSet);
+            if((int)ctrlSock > maxFds)
+                maxFds = (int)ctrlSock;
+        }
+
+        hlogDebug("\n[MAIN THREAD]: Writing operations are pending! Waiting for the data threads or control connection...\n");
+        if( select(maxFds + 1, &readSet, NULL, NULL, NULL) < 0 ){
+            if(gsockGetLastError() == EINTR)
+                continue;
+            hlogError("SELECT returned error while waiting for data threads.\n");
+            retval = -1;
             break;
         }
-        if(i==FTP_MAX_DATA_THREADS-1)
-            threadError = 2; // No free threads.
-    }
-    if(threadError){
-        hlogf(threadError==1 ? "Error creating thread!\n" : "No free threads!\n");
-        FTP_freeDataFormInfo(formInfo);
-        return 1;
+
+        if(FD_ISSET(eventFd, &readSet))
+            gthread_Event_drain( event_PrintDone );
+
+        // The control connection's replies are taken at the top of the loop.
     }
 
-    return 0;
+    if(replyLen){
+        replyBuf[replyLen] = 0;
+        printf("%s", replyBuf);
+    }
+    return retval;
 }
 
 /*! Processes commands which change the client local options
@@ -763,15 +988,16 @@ int ftpParamComProc(struct FTPCallbackCommand command, FTPClientState* state)
  *  - Authorizes the user and starts a valid FTP session.
  *  - On error return < 0.
  */
-int authorizeConnection(SOCKET sock)
+int authorizeConnection(FTPClientState* state)
 {
+    GSockLineReader ctrl = state->ctrlReader;
     char recvbuf[FTP_DEFAULT_BUFLEN];
 
     // Get the response from s3rver. First reply - The welcome message
-    int iResult = sendMessageGetResponse(sock, recvbuf, recvbuf, sizeof(recvbuf),
+    int iResult = sendMessageGetResponse(ctrl, recvbuf, recvbuf, sizeof(recvbuf),
                    FTOOL_RECVRESP_PRINTBUFFER | FTOOL_RECVRESP_NOSEND );
     if(iResult < 0){
-        hlogf("Error on sendMessageGetResponse() while receiving welcome message.\n");
+        hlogError("Error on sendMessageGetResponse() while receiving welcome message.\n");
         return -2;
     }
 
@@ -783,10 +1009,15 @@ int authorizeConnection(SOCKET sock)
         // Start user authorization. Straightforward, no encryption, just like the good ol' days :)
         strcpy(recvbuf, (i<attempts ? "USER " : "PASS ")); // Command
         gmisc_GetLine((i<attempts ? "Name: " : "Password: "), recvbuf+5, sizeof(recvbuf)-7, stdin); // Get parameter from user
+
+        // Kept for the extra sessions a segmented download opens.
+        char* cred = (i<attempts ? state->userName : state->password);
+        strncpy(cred, recvbuf+5, FTP_CREDENTIAL_LENGTH-1);
+        cred[FTP_CREDENTIAL_LENGTH-1] = 0;
         strcpy(recvbuf+strlen(recvbuf), "\r\n"); // CRLF terminator at the end
 
-        if(sendMessageGetResponse(sock, recvbuf, recvbuf, sizeof(recvbuf), 1) < 0){
-            hlogf("Error on sendMessageGetResponse()\n");
+        if(sendMessageGetResponse(ctrl, recvbuf, recvbuf, sizeof(recvbuf), 1) < 0){
+            hlogError("Error on sendMessageGetResponse()\n");
             return -3;
         }
 
@@ -794,7 +1025,7 @@ int authorizeConnection(SOCKET sock)
         //printf("\n%s\n", recvbuf);
 
         if((recvbuf[0]=='5' || recvbuf[0]=='4') && !((i+1) % attempts)){ // Haven't authenticated for all the attempts
-            hlogf("Can't authenticate. Max attempts reached. Aborting...\n");
+            hlogError("Can't authenticate. Max attempts reached. Aborting...\n");
             return -1;
         }
 
@@ -833,13 +1064,20 @@ int executeRawFtpCommand(const char* command, FTPClientState* state, char checkM
         (state->controlSocket).dataBuff[GSOCK_DEFAULT_BUFLEN-3] = 0; // Null-terminate, then add CRLF in the end.
         strcpy( (state->controlSocket).dataBuff + strlen( (state->controlSocket).dataBuff ), "\r\n" );*/
 
-        if( sendMessageGetResponse( (state->controlSocket).sock, command, \
+        if( sendMessageGetResponse( state->ctrlReader, command, \
             (state->controlSocket).dataBuff, GSOCK_DEFAULT_BUFLEN, 1 ) < 0 )
         {
-            hlogf("Error on sendMessageGetResponse()\n");
+            hlogError("Error on sendMessageGetResponse()\n");
             return -3;
         }
 
+        // The server's transfer parameters may not be what we think they are anymore.
+        const char* paramChangers[] = { "TYPE", "MODE", "STRU", "REIN", "USER" };
+        for(size_t i = 0; i < sizeof(paramChangers)/sizeof(paramChangers[0]); i++){
+            if(strncasecmp(command, paramChangers[i], 4) == 0)
+                FTP_resetNegotiatedState(state, 0);
+        }
+
         // Print the receive message
         //printf("\n%s\n", (state->controlSocket).dataBuff);
     }
@@ -865,12 +1103,12 @@ int executeCommand(SOCKET sock, char* command, size_t comBufLen, FTPClientState*
     int valid = 0; // Set invalid now, later if found match, change it to valid.
     size_t comlen;
 
-    hlogf("\n-----------------------------------\nProcessing a new command:\n%s\n", command);
+    hlogDebug("\n-----------------------------------\nProcessing a new command:\n%s\n", command);
 
     // Check if it is a raw command (# at the beginning)
     if( command[0]=='#' )
     {
-        hlogf("Identified a raw command. Passing to RawProcessor.\n");
+        hlogDebug("Identified a raw command. Passing to RawProcessor.\n");
 
         comlen = strlen(command);
         // Check for CRLF at the end, and set if possible
@@ -882,7 +1120,7 @@ int executeCommand(SOCKET sock, char* command, size_t comBufLen, FTPClientState*
 
         retval = executeRawFtpCommand(command+1, state, FTP_CHECKRAW_DEFAULT); // Call the raw command processor.
 
-        hlogf("\nEnded command processing.\n-----------------------------------\n\n");
+        hlogDebug("\nEnded command processing.\n-----------------------------------\n\n");
         return retval;
     }
 
@@ -899,7 +1137,7 @@ int executeCommand(SOCKET sock, char* command, size_t comBufLen, FTPClientState*
         {
             if( strncmp(command, cmd->name, comlen) == 0 ) // Found matching valid command.
             {
-                hlogf("Identified a Valid command! Name: %s\n", cmd->name);
+                hlogDebug("Identified a Valid command! Name: %s\n", cmd->name);
 
                 valid = 1;
 
@@ -913,11 +1151,11 @@ int executeCommand(SOCKET sock, char* command, size_t comBufLen, FTPClientState*
                 {
                     cbst.params[j] = strtok(NULL, gmisc_whitespaces); // After the last token, all calls return NULL.
                     if(cbst.params[j])
-                        hlogf("Found a param: %s\n", cbst.params[j]);
+                        hlogDebug("Found a param: %s\n", cbst.params[j]);
                 }
 
                 if( cmd->procedure(cbst, state) < 0 ){ // Call the specified processing function. If < 0, must end.
-                    hlogf("Quit signal received from a procedure. Time to quit.\n");
+                    hlogDebug("Quit signal received from a procedure. Time to quit.\n");
                     retval = -1; // Quit sign.
                 }
                 break; // We executed a valid command, now end loop.
@@ -926,9 +1164,9 @@ int executeCommand(SOCKET sock, char* command, size_t comBufLen, FTPClientState*
     }
     if(!valid){
         printf("Command is invalid!\n"); // retval=1 - command invalid.
-        hlogf("Command is InValid.\n");
+        hlogWarn("Command is InValid.\n");
     }
-    hlogf("\nEnded command processing.\n-----------------------------------\n");
+    hlogDebug("\nEnded command processing.\n-----------------------------------\n");
     return retval;
 }
 
@@ -945,55 +1183,58 @@ int main(int argc, char **argv)
     int iResult,
         oneCommand = 0;
 
-    // Activate the logger
-    hlogSetFile("grylogz.log", HLOG_MODE_UNBUFFERED | HLOG_MODE_APPEND);
+    // Activate the logger. Async mode keeps log writes off the transfer threads.
+    hlogSetFile("grylogz.log", HLOG_MODE_ASYNC | HLOG_MODE_APPEND);
     hlogSetActive(1);
 
-    // Print current time to a logger.
+    // Print current time to a logger. Time is written directly, so flush the pending header first.
     hlogf("\n\n===============================\nGrylloFTP %s\n> > ", FTP_CLIENT_VERSION);
+    hlogFlush();
     gmisc_PrintTimeByFormat( hlogGetFile(), NULL );
     hlogf("\n- - - - - - - - - - - - - - - - \n\n");
 
     //------------- Validate the parameters --------------//
 
-    if ((argc==2 ? strcmp(argv[1], "--help")==0 : 0) || argc<3) {
+    // A server on this host may be reached at "unix:/path", which needs no port.
+    const char* serverPort = (argc > 2 ? argv[2] : (argc == 2 && gsockIsUnixAddress(argv[1]) ? "0" : NULL));
+    if ((argc==2 ? strcmp(argv[1], "--help")==0 : 0) || !serverPort) {
         printf("usage: %s server-name server-port [remote-command] [local-filename]\n \
-        \nIf local-filename is set, command output will be redirected to the filename", basename(argv[0]));
+        \n       %s unix:/path/to/socket\n \
+        \nIf local-filename is set, command output will be redirected to the filename", basename(argv[0]), basename(argv[0]));
         return 1;
     }
 
     //-------- Initialize Multithreading Mutexes ---------//
     
-    hlogf("Init Mutexes and CondVars...\n");
+    hlogDebug("Init the print Event...\n");
 
-    mutex_WaitPrintData = gthread_Mutex_init(0);
-    condvar_WaitPrintData = gthread_CondVar_init();
-
-    if(!mutex_WaitPrintData || !condvar_WaitPrintData){
-        printf("Failed to init Mutexes!\n");
+    if( !(event_PrintDone = gthread_Event_create()) ){
+        printf("Failed to init the print Event!\n");
         return -1;
     }
 
     //--------------- Connect to a SeRVeR ----------------//
 
-    printf("Will connect to a server \"%s\" on port %s\n\nInit WinSock...", argv[1], argv[2]);
+    printf("Will connect to a server \"%s\" on port %s\n\nInit WinSock...", argv[1], serverPort);
 
     // Initialize Winsock
     iResult = gsockInitSocks();
     if (iResult != 0) {
         printf("gsockInitSocks() failed with error: %d\n", iResult);
-        gthread_Mutex_destroy(&mutex_WaitPrintData);
-        gthread_CondVar_destroy(&condvar_WaitPrintData);
+        gthread_Event_destroy(&event_PrintDone);
         return 1;
     }
 
     printf("Done.\nNow trying to connect.\n");
 
-    ControlSocket = gsockConnectSocket(argv[1], argv[2], 0, 0, 0, 0);
+    // Commands are small request-reply exchanges - don't let Nagle delay them.
+    GSockOptions sockOpts = { 0 };
+    sockOpts.flags = GSOCK_FLAG_NODELAY;
+    sockOpts.connectTimeout = FTOOL_CONTROL_CONNECT_TIMEOUT_MS;
+    ControlSocket = gsockConnectSocketEx(argv[1], serverPort, 0, 0, 0, &sockOpts);
     if(ControlSocket == INVALID_SOCKET){
         printf("ERROR: Can't connect to a server.\n");
-        gthread_Mutex_destroy(&mutex_WaitPrintData);
-        gthread_CondVar_destroy(&condvar_WaitPrintData);
+        gthread_Event_destroy(&event_PrintDone);
         return gsockErrorCleanup(0, NULL, "Can't connect to a server....", 1, 1);
     }
 
@@ -1002,29 +1243,46 @@ int main(int argc, char **argv)
     // The state structure
     FTPClientState ftpCliState = {0};
 
-    //FTP_setDefaultClientState( &ftpCliState );
+    FTP_setDefaultClientState( &ftpCliState );
     ftpCliState.controlSocket.sock = ControlSocket;
+    ftpCliState.serverHost = argv[1];
+    ftpCliState.serverPort = serverPort;
+
+    // Replies are taken off the control connection whole, as soon as they arrive.
+    if( !(ftpCliState.ctrlReader = gsockLineReader_create( ControlSocket, 0 )) ){
+        printf("Failed to create the control connection reader!\n");
+        gsockCloseSocket(ControlSocket);
+        gsockSockCleanup();
+        gthread_Event_destroy(&event_PrintDone);
+        return 1;
+    }
+
+    // Data transfers reuse the pool's threads, instead of spawning one per transfer.
+    if( !(ftpCliState.DataThreadPool = gthread_Pool_create( FTP_MAX_DATA_THREADS )) ){
+        printf("Failed to create the data thread pool!\n");
+        gsockLineReader_destroy(&(ftpCliState.ctrlReader));
+        gsockCloseSocket(ControlSocket);
+        gsockSockCleanup();
+        gthread_Event_destroy(&event_PrintDone);
+        return 1;
+    }
 
     // Authorize this connection.
-    if( authorizeConnection(ControlSocket) < 0 )
-        hlogf("Error authorizing a connection!\n");
+    if( authorizeConnection(&ftpCliState) < 0 )
+        hlogError("Error authorizing a connection!\n");
 
     else // If authorization succeeded (>=0), let's start a command loop.
     {
+        FTP_resetNegotiatedState(&ftpCliState, 1);
         printf("Starting loop...\n");
         while(1)
         {
-            hlogf("Attempting new command input. Checking if active STDOUT operations are present...\n");
+            hlogDebug("Attempting new command input. Checking if active STDOUT operations are present...\n");
 
             // Check if other threads are currently printing to stdout, if not, then input user command.
-            // If busy, then Wait using Condition Variable
-            gthread_Mutex_lock( mutex_WaitPrintData );
-            while( PrintingThreadCount > 0 ){ // There are printing threads.
-                // Release the lock and enter sleep state atomically, until Notified.  
-                hlogf("\n[MAIN THREAD]: Writing operations are pending! Entering Wait State on CondVar...\n");
-                gthread_CondVar_wait(condvar_WaitPrintData, mutex_WaitPrintData); 
-            }
-            gthread_Mutex_unlock( mutex_WaitPrintData );
+            // If busy, wait for them, watching the control connection.
+            if( waitForPrintingThreads(ftpCliState.ctrlReader, recvbuf, recvbuflen) < 0 )
+                break;
 
             // At this point no active writing operations are being done by other threads.
 
@@ -1036,18 +1294,21 @@ int main(int argc, char **argv)
         printf("Connection closed. Exitting...\n");
     }
 
-    // Execute QUIT command - safely terminate an FTP session.
-    sendMessageGetResponse(ControlSocket, "QUIT\r\n", recvbuf, recvbuflen, 1);
+    // Let the active transfers finish, and join all threads in the pool.
+    gthread_Pool_destroy( &(ftpCliState.DataThreadPool), 1 );
 
-    // Join all active threads in the pool
-    //for(FTPDataThread* th = 
+    // Execute QUIT command - safely terminate an FTP session.
+    sendMessageGetResponse(ftpCliState.ctrlReader, "QUIT\r\n", recvbuf, recvbuflen, 1);
 
     // cleanup. close the socket, and terminate the Winsock.dll instance bound to our app.
+    gsockLineReader_destroy(&(ftpCliState.ctrlReader));
     gsockCloseSocket(ControlSocket);
     gsockSockCleanup();
 
-    gthread_Mutex_destroy(&mutex_WaitPrintData);
-    gthread_CondVar_destroy(&condvar_WaitPrintData);
+    gthread_Event_destroy(&event_PrintDone);
+
+    // Write out everything left in the log rings.
+    hlogCloseFile();
 
     return 0;
 }
@@ -18,6 +18,33 @@
 #define FTP_CHECKRAW_DEFAULT 0
 
 #define FTP_MAX_DATA_THREADS 8
+#define FTP_CREDENTIAL_LENGTH 128
+
+// How long the server may take to send a reply.
+#define FTOOL_REPLY_TIMEOUT_MS  60000
+
+// Upper bound for connecting, all of the server's addresses included.
+#define FTOOL_CONTROL_CONNECT_TIMEOUT_MS  15000
+#define FTOOL_DATA_CONNECT_TIMEOUT_MS     10000
+
+// A transfer gives up after this long without progress. Its buffer is the socket's receive
+// or send buffer, kept within the bounds.
+#define FTOOL_DATA_IDLE_TIMEOUT_MS  60000
+#define FTOOL_DATA_MIN_BUFLEN       (64 * 1024)
+#define FTOOL_DATA_MAX_BUFLEN       (4 * 1024 * 1024)
+
+/*! Segmented download (pget, see pget.c)
+ *  - Segments are at least FTP_PGET_MIN_SEGMENT, and there are about 4 per stream, so
+ *    streams added later still find work.
+ *  - It starts with FTP_PGET_INITIAL_STREAMS, and adds one more after each FTP_PGET_SAMPLE_MS
+ *    sample which beat the one before the last addition by FTP_PGET_MIN_GAIN percent.
+ */
+#define FTP_PGET_MIN_SEGMENT      (4 * 1024 * 1024)
+#define FTP_PGET_SEGMENTS_PER_STREAM  4
+#define FTP_PGET_INITIAL_STREAMS  2
+#define FTP_PGET_SAMPLE_MS        500
+#define FTP_PGET_MIN_GAIN         10
+#define FTP_PGET_BUFLEN           (256 * 1024)
 
 
 // FTP Structs
@@ -33,9 +60,11 @@ typedef struct
 
     char passiveOn; // PASV or PORT
     char* ipAddr;   // Must be free'd
-    short port;
+    unsigned short port;
+    SOCKET dataSock; // Connected by the main thread, INVALID_SOCKET until then. Closed with the info.
 
     FILE* outFile;  // Maybe closed, if has been opened.
+    FILE* inFile;   // Upload source. Closed with the info.
     char* fname;    // Muse be free'd
 } FTPDataFormatInfo;
 
@@ -45,20 +74,10 @@ typedef struct
  */
 typedef struct
 {
-    volatile short flags;
+    short flags; // Shared with the data thread - access with gatomic_Short_*.
     //GrMutex mut; 
 } FTPDataThreadState;
 
-/*! Thread structure, contains state and raw handle
- *  - Must be kept alive for all thread's working time, 
- *    because thread itself will modify the state.
- */ 
-typedef struct
-{
-    GrThread thrHand;
-    FTPDataThreadState state;
-} FTPDataThread;
-
 /*! Client state structure.
  *  Holds current control socket, Data threads, and options.
  *  If option value is 0, don't use it (or use default).
@@ -66,8 +85,15 @@ typedef struct
 typedef struct 
 {
     GSOCKSocketStruct controlSocket;
+    GSockLineReader ctrlReader; // All reads from controlSocket go through it.
 
-    FTPDataThread DataThreadPool[FTP_MAX_DATA_THREADS];
+    GrThreadPool DataThreadPool; // Runs the data transfers, FTP_MAX_DATA_THREADS workers.
+
+    // Where we're connected, and as who - for the extra sessions of segmented downloads.
+    const char* serverHost;
+    const char* serverPort;
+    char userName[ FTP_CREDENTIAL_LENGTH ];
+    char password[ FTP_CREDENTIAL_LENGTH ];
     
     // Options.
     char passiveModeOn;
@@ -76,6 +102,13 @@ typedef struct
     char defTransMode;
     char defStructure;
 
+    // What the server last acknowledged, so the unchanged parameters aren't sent again.
+    // 0 - unknown, will be sent.
+    char negDataType;
+    char negDataFormat;
+    char negTransMode;
+    char negStructure;
+
 } FTPClientState;
 
 // TODO: This structure.
@@ -117,6 +150,12 @@ extern const struct FTPClientUICommand cftpClientCommand[];
 
 void FTP_freeDataFormInfo(FTPDataFormatInfo* info);
 void FTP_printDataFormInfo(const FTPDataFormatInfo* fi, FILE* outFile);
-int ftpExtractIpPortPasv( char** ip, short* port, const char* dataBuf, char extended );
+int ftpExtractIpPortPasv( char** ip, unsigned short* port, const char* dataBuf, char extended );
+
+/*! Downloads remoteName into localName over up to maxStreams control sessions of its own,
+ *  each getting byte ranges with REST. Returns 0 on success, 1 if the download failed,
+ *  2 if the server can't tell the file's size (use a plain get then).
+ */
+int ftpPget(FTPClientState* state, const char* remoteName, const char* localName, int maxStreams);
 
 #endif // CLIENTCOMMANDS_H_INCLUDED
@@ -0,0 +1,353 @@
+/*! Segmented download ("pget").
+ *
+ *  On a long fat link one TCP stream can't fill the pipe, so a big file is fetched over
+ *  several streams at once:
+ *  - The file is cut into segments. Each stream is a control session of its own, which takes
+ *    the next segment nobody has: PASV, REST offset, RETR, and pwrite() into the output file,
+ *    preallocated to the full size.
+ *  - A segment's data connection is closed as soon as the segment is in, so the server's
+ *    reply to that RETR is a 426/451 - expected, and ignored. The last segment is read up to
+ *    the server's EOF, and must get its 226.
+ *  - Streams are added while they pay off (see FTP_PGET_* in clientcommands.h), and until one
+ *    can't log in - servers limit sessions per user or address. Its segments go to the others.
+ */
+
+#define HLOG_MODULE HLOG_MOD_CLIENT
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <gatomic.h>
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include "clientcommands.h"
+
+typedef struct
+{
+    const FTPClientState* state; // Server and credentials. Read only.
+    const char* remoteName;
+    int fd;
+    long long fileSize;
+    long long segSize;
+    int segCount;
+
+    int nextSeg;          // Atomic.
+    long long bytesDone;  // Atomic.
+    int failed;           // Atomic. Set by the first stream which fails - the rest stop.
+    int noMoreStreams;    // Atomic. Set when an added stream can't log in.
+} FTPPgetJob;
+
+typedef struct
+{
+    FTPPgetJob* job;
+    GSockLineReader session; // NULL - the stream logs in by itself.
+} FTPPgetStream;
+
+static double pgetNow_priv()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*! Sends command (if not NULL) and reads the next reply. 1xx replies are returned too.
+ *  Returns the reply code, or -1 if the session is lost.
+ */
+static int pgetCommand_priv(GSockLineReader ses, const char* command, char** reply)
+{
+    char* rep;
+    size_t len;
+    int code = 0;
+    if(command && gsockSendAll_time(gsockLineReader_getSocket(ses), command, strlen(command), 0,
+                                    FTOOL_REPLY_TIMEOUT_MS, NULL) != 0)
+        return -1;
+    if(gsockLineReader_readReply(ses, &rep, &len, &code, FTOOL_REPLY_TIMEOUT_MS) != 0)
+        return -1;
+    hlogTrace("pget: %s%s", (command ? command : ""), rep);
+    if(reply)
+        *reply = rep;
+    return code;
+}
+
+static void pgetCloseSession_priv(GSockLineReader* ses)
+{
+    if(!*ses) return;
+    SOCKET sock = gsockLineReader_getSocket(*ses);
+    gsockSendAll_time(sock, "QUIT\r\n", 6, 0, 1000, NULL);
+    gsockLineReader_destroy(ses);
+    gsockCloseSocket(sock);
+}
+
+// Connects and logs in with the main session's credentials, in binary mode.
+static GSockLineReader pgetOpenSession_priv(const FTPClientState* state)
+{
+    GSockOptions opts = { 0 };
+    opts.flags = GSOCK_FLAG_NODELAY;
+    opts.connectTimeout = FTOOL_CONTROL_CONNECT_TIMEOUT_MS;
+    SOCKET sock = gsockConnectSocketEx(state->serverHost, state->serverPort, 0, 0, 0, &opts);
+    if(sock == INVALID_SOCKET){
+        hlogError("pget: Can't open another session to %s.\n", state->serverHost);
+        return NULL;
+    }
+    GSockLineReader ses = gsockLineReader_create(sock, 0);
+    if(!ses){
+        gsockCloseSocket(sock);
+        return NULL;
+    }
+
+    char cmd[ FTP_CREDENTIAL_LENGTH + 8 ];
+    int code = pgetCommand_priv(ses, NULL, NULL); // Welcome.
+    if(code == 220){
+        snprintf(cmd, sizeof(cmd), "USER %s\r\n", state->userName);
+        code = pgetCommand_priv(ses, cmd, NULL);
+    }
+    if(code == 331){
+        snprintf(cmd, sizeof(cmd), "PASS %s\r\n", state->password);
+        code = pgetCommand_priv(ses, cmd, NULL);
+    }
+    if(code == 230 || code == 202)
+        code = pgetCommand_priv(ses, "TYPE I\r\n", NULL);
+
+    if(code != 200){
+        hlogError("pget: Logging in another session failed (reply %d).\n", code);
+        pgetCloseSession_priv(&ses);
+    }
+    return ses;
+}
+
+// Gets one segment. Returns 0 on success.
+static int pgetSegment_priv(FTPPgetJob* job, GSockLineReader ses, int seg, char* buf)
+{
+    long long offset = job->segSize * seg;
+    long long left = (job->fileSize - offset < job->segSize ? job->fileSize - offset : job->segSize);
+    char last = (offset + left == job->fileSize);
+    char cmd[ FTP_DEFAULT_BUFLEN ];
+    char* reply;
+    char* ip = NULL;
+    unsigned short port;
+
+    if(pgetCommand_priv(ses, "PASV\r\n", &reply) != 227 || ftpExtractIpPortPasv(&ip, &port, reply, 0) < 0){
+        hlogError("pget: PASV failed for segment %d.\n", seg);
+        return -1;
+    }
+    char portStr[ 8 ];
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    GSockOptions opts = { 0 };
+    opts.connectTimeout = FTOOL_DATA_CONNECT_TIMEOUT_MS;
+    opts.recvBufSize = FTP_PGET_BUFLEN;
+    SOCKET data = gsockConnectSocketEx(ip, portStr, 0, 0, 0, &opts);
+    free(ip);
+    if(data == INVALID_SOCKET){
+        hlogError("pget: Can't connect the data connection of segment %d.\n", seg);
+        return -1;
+    }
+
+    int code = 350;
+    if(offset > 0){
+        snprintf(cmd, sizeof(cmd), "REST %lld\r\n", offset);
+        code = pgetCommand_priv(ses, cmd, NULL);
+    }
+    if(code == 350){
+        snprintf(cmd, sizeof(cmd), "RETR %s\r\n", job->remoteName);
+        code = pgetCommand_priv(ses, cmd, NULL);
+    }
+    if(code != 150 && code != 125){
+        hlogError("pget: Server refused segment %d (reply %d).\n", seg, code);
+        gsockCloseSocket(data);
+        return -1;
+    }
+
+    while(left > 0 && !gatomic_load(&(job->failed), GATOMIC_RELAXED)){
+        int got = gsockReceive(data, buf, (size_t)(left < FTP_PGET_BUFLEN ? left : FTP_PGET_BUFLEN), 0);
+        if(got <= 0)
+            break;
+        if(pwrite(job->fd, buf, got, offset) != got){
+            hlogError("pget: Write to the output file failed.\n");
+            break;
+        }
+        offset += got;
+        left -= got;
+        gatomic_fetchAdd(&(job->bytesDone), got, GATOMIC_RELAXED);
+    }
+    // The last segment runs to the server's EOF - closing before it would get the RETR a 426.
+    // Anything past the size the server told us means the file has changed.
+    long long extra = 0;
+    if(last && left == 0){
+        int got;
+        while((got = gsockReceive(data, buf, FTP_PGET_BUFLEN, 0)) > 0)
+            extra += got;
+    }
+    gsockCloseSocket(data);
+
+    // The transfer's end: 226 if it ran to EOF, some 4xx if we cut it short.
+    code = pgetCommand_priv(ses, NULL, NULL);
+    if(left > 0 || code < 0 || (last && code != 226)){
+        hlogError("pget: Segment %d is incomplete, %lld bytes missing (reply %d).\n", seg, left, code);
+        return -1;
+    }
+    if(extra > 0){
+        hlogError("pget: %s grew by %lld bytes during the download.\n", job->remoteName, extra);
+        return -1;
+    }
+    return 0;
+}
+
+static void* pgetStreamProc_priv(void* param)
+{
+    FTPPgetStream* stream = (FTPPgetStream*)param;
+    FTPPgetJob* job = stream->job;
+    char* buf = malloc(FTP_PGET_BUFLEN);
+
+    if(!stream->session && !(stream->session = pgetOpenSession_priv(job->state))){
+        // Only the first stream is a must - the running ones take this one's segments.
+        hlogDebug("pget: The server takes no more sessions - not adding more streams.\n");
+        gatomic_store(&(job->noMoreStreams), 1, GATOMIC_RELAXED);
+        free(buf);
+        return NULL;
+    }
+    if(!buf)
+        gatomic_store(&(job->failed), 1, GATOMIC_RELAXED);
+
+    while(!gatomic_load(&(job->failed), GATOMIC_RELAXED)){
+        int seg = gatomic_fetchAdd(&(job->nextSeg), 1, GATOMIC_RELAXED);
+        if(seg >= job->segCount)
+            break;
+        if(pgetSegment_priv(job, stream->session, seg, buf) != 0)
+            gatomic_store(&(job->failed), 1, GATOMIC_RELAXED);
+    }
+
+    pgetCloseSession_priv(&(stream->session));
+    free(buf);
+    return NULL;
+}
+
+int ftpPget(FTPClientState* state, const char* remoteName, const char* localName, int maxStreams)
+{
+    if(!state || !remoteName)
+        return 1;
+    if(!localName)
+        localName = remoteName;
+    int poolSize = gthread_Pool_getWorkerCount(state->DataThreadPool);
+    if(maxStreams <= 0 || maxStreams > poolSize)
+        maxStreams = poolSize;
+
+    // The first session asks for the size, then becomes the first stream.
+    GSockLineReader first = pgetOpenSession_priv(state);
+    if(!first)
+        return 1;
+    char cmd[ FTP_DEFAULT_BUFLEN ];
+    char* reply;
+    long long fileSize = -1;
+    snprintf(cmd, sizeof(cmd), "SIZE %s\r\n", remoteName);
+    if(pgetCommand_priv(first, cmd, &reply) != 213 || sscanf(reply + 4, "%lld", &fileSize) != 1 || fileSize < 0){
+        printf("pget: The server can't tell the size of %s.\n", remoteName);
+        pgetCloseSession_priv(&first);
+        return 2;
+    }
+
+    FTPPgetJob job = { 0 };
+    job.state = state;
+    job.remoteName = remoteName;
+    job.fileSize = fileSize;
+    job.segSize = (fileSize + maxStreams * FTP_PGET_SEGMENTS_PER_STREAM - 1) / (maxStreams * FTP_PGET_SEGMENTS_PER_STREAM);
+    if(job.segSize < FTP_PGET_MIN_SEGMENT)
+        job.segSize = FTP_PGET_MIN_SEGMENT;
+    job.segCount = (int)((fileSize + job.segSize - 1) / job.segSize);
+    if(job.segCount < 1)
+        job.segCount = 1; // An empty file still needs its RETR.
+
+    if((job.fd = open(localName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+        printf("pget: Can't open %s for writing.\n", localName);
+        pgetCloseSession_priv(&first);
+        return 1;
+    }
+    // The segments land anywhere in the file - give it its size up front.
+    if(posix_fallocate(job.fd, 0, fileSize) != 0 && ftruncate(job.fd, fileSize) != 0)
+        hlogWarn("pget: Can't preallocate %lld bytes for %s.\n", fileSize, localName);
+
+    FTPPgetStream streams[ FTP_MAX_DATA_THREADS ] = { { 0 } };
+    GrFuture futures[ FTP_MAX_DATA_THREADS ] = { 0 };
+    int streamCount = 0;
+    int wanted = (FTP_PGET_INITIAL_STREAMS < job.segCount ? FTP_PGET_INITIAL_STREAMS : job.segCount);
+    if(wanted > maxStreams)
+        wanted = maxStreams;
+    streams[0].session = first;
+
+    double start = pgetNow_priv();
+    double lastTime = start, baseRate = 0;
+    long long lastBytes = 0;
+    char growing = 1, settling = 1;
+
+    while(1)
+    {
+        // Start the streams wanted, while there are segments nobody has taken.
+        if(gatomic_load(&(job.noMoreStreams), GATOMIC_RELAXED))
+            growing = 0;
+        while(streamCount < wanted && growing && gatomic_load(&(job.nextSeg), GATOMIC_RELAXED) < job.segCount){
+            streams[streamCount].job = &job;
+            if(!(futures[streamCount] = gthread_Pool_submitFuture(state->DataThreadPool, pgetStreamProc_priv, streams + streamCount))){
+                hlogError("pget: Can't submit stream %d.\n", streamCount);
+                growing = 0;
+                break;
+            }
+            streamCount++;
+        }
+
+        char allDone = 1;
+        for(int i = 0; i < streamCount && allDone; i++)
+            allDone = gthread_Future_isDone(futures[i]);
+        if(allDone)
+            break;
+        for(int i = 0; i < streamCount; i++){
+            if(!gthread_Future_isDone(futures[i])){
+                gthread_Future_wait_time(futures[i], FTP_PGET_SAMPLE_MS);
+                break;
+            }
+        }
+
+        double now = pgetNow_priv();
+        if(now - lastTime < FTP_PGET_SAMPLE_MS / 1000.0)
+            continue;
+        long long bytes = gatomic_load(&(job.bytesDone), GATOMIC_RELAXED);
+        double rate = (bytes - lastBytes) / (now - lastTime);
+        lastTime = now;
+        lastBytes = bytes;
+
+        // A new stream spends its first sample logging in - judge it by the next one.
+        if(settling){
+            settling = 0;
+            continue;
+        }
+        if(growing && baseRate > 0 && rate < baseRate * (100 + FTP_PGET_MIN_GAIN) / 100){
+            hlogDebug("pget: %d streams do %.1f MB/s, no better than before - not adding more.\n",
+                      streamCount, rate / (1024 * 1024));
+            growing = 0;
+        }
+        if(growing && wanted < maxStreams){
+            hlogDebug("pget: %d streams do %.1f MB/s - adding one.\n", streamCount, rate / (1024 * 1024));
+            baseRate = rate;
+            wanted++;
+            settling = 1;
+        }
+    }
+
+    for(int i = 0; i < streamCount; i++){
+        gthread_Future_get(futures[i]);
+        gthread_Future_destroy(futures + i);
+    }
+    if(!streamCount) // The first session never got to a stream.
+        pgetCloseSession_priv(&first);
+    close(job.fd);
+
+    double secs = pgetNow_priv() - start;
+    if(job.failed || job.bytesDone != fileSize){
+        printf("pget: Download of %s failed, %lld of %lld bytes.\n", remoteName, job.bytesDone, fileSize);
+        return 1;
+    }
+    printf("pget: %s, %lld bytes in %.2f s (%.2f MB/s), %d streams.\n", localName, fileSize, secs,
+           (secs > 0 ? fileSize / secs / (1024 * 1024) : 0), streamCount);
+    return 0;
+}
@@ -0,0 +1,680 @@
+#define HLOG_MODULE HLOG_MOD_THREAD
+
+#include "gfiber.h"
+#include "systemcheck.h"
+#include "hlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined _GRYLTOOL_POSIX
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <time.h>
+    #include <poll.h>
+
+    #if defined __linux__
+        #include <sys/epoll.h>
+        #define GFIBER_HAVE_EPOLL  1
+    #endif
+
+    // Context switch implementation.
+    #if defined __x86_64__ && defined __ELF__
+        #define GFIBER_SWITCH_X86_64   1
+    #elif defined __aarch64__ && defined __ELF__
+        #define GFIBER_SWITCH_AARCH64  1
+    #else
+        #include <ucontext.h>
+        #define GFIBER_SWITCH_UCONTEXT 1
+    #endif
+#endif
+
+#define GFIBER_STACK_POOL_MAX  256
+#define GFIBER_EPOLL_BATCH     256
+
+// Fiber states
+#define GFIBER_STATE_READY    0
+#define GFIBER_STATE_RUNNING  1
+#define GFIBER_STATE_WAITING  2
+#define GFIBER_STATE_DONE     3
+
+#if defined _GRYLTOOL_POSIX
+
+/*! The fiber lives at the top of its own stack mapping, so spawning one is a single
+ *  mapping (or none, when a pooled stack is reused).
+ *  Mapping: [ guard page | stack, growing down ... | struct GFiberPriv ]
+ */
+struct GFiberPriv
+{
+    void* sp; // Saved stack pointer, while switched out.
+    #if defined GFIBER_SWITCH_UCONTEXT
+        ucontext_t ctx;
+    #endif
+    struct GFiberSchedPriv* sched;
+    void (*proc)(void*);
+    void* param;
+    char* mapBase;
+    size_t mapSize;
+
+    char state;
+    char waitResult;       // What waitFD() returns.
+    int waitFd;            // -1 if not waiting for an fd.
+    short waitEvents;      // poll() events, for the poll backend.
+    long timerIdx;         // Its timer's place in the heap, -1 if none. Removed on wakeup.
+    struct GFiberPriv* next; // Ready queue.
+};
+
+struct GFiberTimer
+{
+    long long deadline; // Monotonic ms.
+    struct GFiberPriv* fiber;
+};
+
+struct GFiberSchedPriv
+{
+    size_t stackSize;
+    size_t pageSize;
+    #if defined GFIBER_SWITCH_UCONTEXT
+        ucontext_t mainCtx;
+    #endif
+    void* mainSp;
+    struct GFiberPriv* current;
+    struct GFiberPriv* readyHead;
+    struct GFiberPriv* readyTail;
+
+    size_t fiberCount; // Not yet finished.
+    size_t fdWaiters;
+
+    // Binary min-heap by deadline. Only waiting fibers have timers, so a fiber's stack can be
+    // reused or unmapped once it's done.
+    struct GFiberTimer* timers;
+    size_t timerCount, timerCapacity;
+
+    // Mappings of finished fibers, for reuse.
+    char* freeStacks[ GFIBER_STACK_POOL_MAX ];
+    size_t freeStackCount;
+
+    #if defined GFIBER_HAVE_EPOLL
+        int epfd;
+    #else
+        struct GFiberPriv** pollWaiters;
+        size_t pollWaiterCount, pollWaiterCapacity;
+    #endif
+};
+
+// The scheduler running on this thread.
+static __thread struct GFiberSchedPriv* gfiber_curSched = NULL;
+
+//==========================================================//
+// - - - - - - - - - -  Context switching  - - - - - - - - -//
+
+/* gfiber_switch_priv( &saveSp, newSp )
+ * Pushes the callee-saved registers, stores the stack pointer to *saveSp,
+ * and pops the other context's registers from newSp.
+ * A new fiber's stack is set up to "return" into gfiber_main_priv().
+ */
+#if defined GFIBER_SWITCH_X86_64 || defined GFIBER_SWITCH_AARCH64
+void gfiber_switch_priv(void** saveSp, void* newSp);
+#endif
+
+#if defined GFIBER_SWITCH_X86_64
+__asm__(
+    ".text\n"
+    ".globl gfiber_switch_priv\n"
+    ".hidden gfiber_switch_priv\n"
+    ".type gfiber_switch_priv, @function\n"
+    "gfiber_switch_priv:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size gfiber_switch_priv, .-gfiber_switch_priv\n"
+);
+
+// Frame: fpu control, r15, r14, r13, r12, rbx, rbp, return address.
+#define GFIBER_FRAME_WORDS  8
+
+static void* gfiber_initFrame_priv(void* top, void (*entry)())
+{
+    // entry() must start with rsp % 16 == 8, like after a call.
+    uint64_t* sp = (uint64_t*)( ((uintptr_t)top & ~(uintptr_t)15) - 16 );
+    sp[0] = (uint64_t)(uintptr_t)entry;
+    sp -= GFIBER_FRAME_WORDS - 1;
+    memset( sp, 0, (GFIBER_FRAME_WORDS - 1) * sizeof(uint64_t) );
+    ((uint32_t*)sp)[0] = 0x1F80; // Default MXCSR
+    ((uint16_t*)sp)[2] = 0x037F; // Default x87 control word
+    return sp;
+}
+
+#elif defined GFIBER_SWITCH_AARCH64
+__asm__(
+    ".text\n"
+    ".globl gfiber_switch_priv\n"
+    ".hidden gfiber_switch_priv\n"
+    ".type gfiber_switch_priv, %function\n"
+    "gfiber_switch_priv:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8,  d9,  [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8,  d9,  [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size gfiber_switch_priv, .-gfiber_switch_priv\n"
+);
+
+#define GFIBER_FRAME_BYTES  160
+
+static void* gfiber_initFrame_priv(void* top, void (*entry)())
+{
+    char* sp = (char*)( ((uintptr_t)top & ~(uintptr_t)15) - GFIBER_FRAME_BYTES );
+    memset( sp, 0, GFIBER_FRAME_BYTES );
+    ((uint64_t*)sp)[11] = (uint64_t)(uintptr_t)entry; // x30 - where ret goes.
+    return sp;
+}
+#endif
+
+static void gfiber_main_priv() __attribute__((noreturn));
+
+// Switches from the scheduler into fiber.
+static void gfiber_resume_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber)
+{
+    sched->current = fiber;
+    fiber->state = GFIBER_STATE_RUNNING;
+    #if defined GFIBER_SWITCH_UCONTEXT
+        swapcontext( &(sched->mainCtx), &(fiber->ctx) );
+    #else
+        gfiber_switch_priv( &(sched->mainSp), fiber->sp );
+    #endif
+    sched->current = NULL;
+}
+
+// Switches from the current fiber back to the scheduler.
+static void gfiber_suspend_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber)
+{
+    #if defined GFIBER_SWITCH_UCONTEXT
+        swapcontext( &(fiber->ctx), &(sched->mainCtx) );
+    #else
+        gfiber_switch_priv( &(fiber->sp), sched->mainSp );
+    #endif
+}
+
+static void gfiber_main_priv()
+{
+    struct GFiberSchedPriv* sched = gfiber_curSched;
+    struct GFiberPriv* fiber = sched->current;
+
+    fiber->proc( fiber->param );
+
+    // The scheduler frees the stack - we're still running on it.
+    fiber->state = GFIBER_STATE_DONE;
+    gfiber_suspend_priv( sched, fiber );
+    abort(); // A finished fiber is never resumed.
+}
+
+//==========================================================//
+// - - - - - - - - - - -  Stacks & timers  - - - - - - - - -//
+
+static long long gfiber_now_priv()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct GFiberPriv* gfiber_allocFiber_priv(struct GFiberSchedPriv* sched)
+{
+    size_t mapSize = sched->pageSize + sched->stackSize;
+    char* base;
+
+    if(sched->freeStackCount > 0)
+        base = sched->freeStacks[ --(sched->freeStackCount) ];
+    else{
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        #if defined MAP_STACK
+            flags |= MAP_STACK;
+        #endif
+        base = mmap( NULL, mapSize, PROT_READ | PROT_WRITE, flags, -1, 0 );
+        if(base == MAP_FAILED){
+            hlogError("gfiber: ERROR on mmap() of a fiber stack : %s\n", strerror(errno));
+            return NULL;
+        }
+        // Overflowing the stack faults here, instead of corrupting memory below.
+        if( mprotect( base, sched->pageSize, PROT_NONE ) != 0 ){
+            hlogError("gfiber: ERROR on mprotect() of a guard page : %s\n", strerror(errno));
+            munmap( base, mapSize );
+            return NULL;
+        }
+    }
+
+    struct GFiberPriv* fiber = (struct GFiberPriv*)( (uintptr_t)(base + mapSize - sizeof(struct GFiberPriv)) & ~(uintptr_t)63 );
+    memset( fiber, 0, sizeof(struct GFiberPriv) );
+    fiber->mapBase = base;
+    fiber->mapSize = mapSize;
+    fiber->sched = sched;
+    fiber->waitFd = -1;
+    fiber->timerIdx = -1;
+    return fiber;
+}
+
+static void gfiber_freeFiber_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber)
+{
+    if(sched->freeStackCount < GFIBER_STACK_POOL_MAX)
+        sched->freeStacks[ (sched->freeStackCount)++ ] = fiber->mapBase;
+    else
+        munmap( fiber->mapBase, fiber->mapSize );
+}
+
+static void gfiber_pushReady_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber)
+{
+    fiber->state = GFIBER_STATE_READY;
+    fiber->next = NULL;
+    if(sched->readyTail)
+        sched->readyTail->next = fiber;
+    else
+        sched->readyHead = fiber;
+    sched->readyTail = fiber;
+}
+
+// Puts tm at place i of the heap, and tells its fiber where it is.
+static void gfiber_placeTimer_priv(struct GFiberSchedPriv* sched, size_t i, struct GFiberTimer tm)
+{
+    sched->timers[i] = tm;
+    tm.fiber->timerIdx = (long)i;
+}
+
+// Moves tm from place i up or down the heap, to where its deadline belongs.
+static void gfiber_siftTimer_priv(struct GFiberSchedPriv* sched, size_t i, struct GFiberTimer tm)
+{
+    while(i > 0 && sched->timers[ (i - 1) / 2 ].deadline > tm.deadline){
+        gfiber_placeTimer_priv( sched, i, sched->timers[ (i - 1) / 2 ] );
+        i = (i - 1) / 2;
+    }
+    size_t n = sched->timerCount;
+    while(2 * i + 1 < n){
+        size_t c = 2 * i + 1;
+        if(c + 1 < n && sched->timers[c + 1].deadline < sched->timers[c].deadline)
+            c++;
+        if(tm.deadline <= sched->timers[c].deadline)
+            break;
+        gfiber_placeTimer_priv( sched, i, sched->timers[c] );
+        i = c;
+    }
+    gfiber_placeTimer_priv( sched, i, tm );
+}
+
+static char gfiber_addTimer_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber, long millisec)
+{
+    if(sched->timerCount == sched->timerCapacity){
+        size_t cap = (sched->timerCapacity ? sched->timerCapacity * 2 : 64);
+        struct GFiberTimer* arr = realloc( sched->timers, cap * sizeof(struct GFiberTimer) );
+        if(!arr){
+            hlogError("gfiber: ERROR on realloc() of timers.\n");
+            return -1;
+        }
+        sched->timers = arr;
+        sched->timerCapacity = cap;
+    }
+    struct GFiberTimer tm = { gfiber_now_priv() + millisec, fiber };
+    gfiber_siftTimer_priv( sched, (sched->timerCount)++, tm );
+    return 0;
+}
+
+// Drops the fiber's timer, if it has one.
+static void gfiber_removeTimer_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber)
+{
+    if(fiber->timerIdx < 0)
+        return;
+    size_t i = (size_t)fiber->timerIdx;
+    fiber->timerIdx = -1;
+    struct GFiberTimer last = sched->timers[ --(sched->timerCount) ];
+    if(i < sched->timerCount)
+        gfiber_siftTimer_priv( sched, i, last );
+}
+
+// Wakes a waiting fiber, and cancels whatever else could have woken it.
+static void gfiber_wake_priv(struct GFiberSchedPriv* sched, struct GFiberPriv* fiber, char result)
+{
+    if(fiber->waitFd >= 0){
+        sched->fdWaiters--;
+        #if defined GFIBER_HAVE_EPOLL
+            // On timeout, the one-shot registration is still armed.
+            if(result == 1)
+                epoll_ctl( sched->epfd, EPOLL_CTL_DEL, fiber->waitFd, NULL );
+        #endif
+        fiber->waitFd = -1;
+    }
+    gfiber_removeTimer_priv( sched, fiber );
+    fiber->waitResult = result;
+    gfiber_pushReady_priv( sched, fiber );
+}
+
+static void gfiber_fireTimers_priv(struct GFiberSchedPriv* sched)
+{
+    long long now = gfiber_now_priv();
+    // Waking removes the timer.
+    while(sched->timerCount && sched->timers[0].deadline <= now)
+        gfiber_wake_priv( sched, sched->timers[0].fiber, 1 );
+}
+
+// Waits for fd events or the nearest timer, and wakes fibers. timeout < 0 - infinite.
+static void gfiber_poll_priv(struct GFiberSchedPriv* sched, long timeout)
+{
+    #if defined GFIBER_HAVE_EPOLL
+        struct epoll_event events[ GFIBER_EPOLL_BATCH ];
+        int n = epoll_wait( sched->epfd, events, GFIBER_EPOLL_BATCH, (int)timeout );
+        for(int i = 0; i < n; i++){
+            struct GFiberPriv* fiber = (struct GFiberPriv*)events[i].data.ptr;
+            if(fiber->state == GFIBER_STATE_WAITING && fiber->waitFd >= 0)
+                gfiber_wake_priv( sched, fiber, 0 );
+        }
+    #else
+        struct pollfd* pfds = malloc( sched->pollWaiterCount * sizeof(struct pollfd) + 1 );
+        if(!pfds)
+            return;
+        size_t count = sched->pollWaiterCount;
+        for(size_t i = 0; i < count; i++){
+            pfds[i].fd = sched->pollWaiters[i]->waitFd;
+            pfds[i].events = sched->pollWaiters[i]->waitEvents;
+            pfds[i].revents = 0;
+        }
+        if( poll( pfds, count, (int)timeout ) > 0 ){
+            // Compact the waiter list, waking the ready ones.
+            size_t kept = 0;
+            for(size_t i = 0; i < count; i++){
+                struct GFiberPriv* fiber = sched->pollWaiters[i];
+                if(pfds[i].revents && fiber->waitFd >= 0)
+                    gfiber_wake_priv( sched, fiber, 0 );
+                else if(fiber->waitFd >= 0)
+                    sched->pollWaiters[ kept++ ] = fiber;
+            }
+            sched->pollWaiterCount = kept;
+        }
+        free(pfds);
+    #endif
+}
+
+#if !defined GFIBER_HAVE_EPOLL
+// Drops fibers which timed out from the poll list.
+static void gfiber_compactPollWaiters_priv(struct GFiberSchedPriv* sched)
+{
+    size_t kept = 0;
+    for(size_t i = 0; i < sched->pollWaiterCount; i++){
+        if(sched->pollWaiters[i]->waitFd >= 0)
+            sched->pollWaiters[ kept++ ] = sched->pollWaiters[i];
+    }
+    sched->pollWaiterCount = kept;
+}
+#endif
+
+#endif // _GRYLTOOL_POSIX
+
+//==========================================================//
+// - - - - - - - - - - - -  Public API  - - - - - - - - - - //
+
+GrFiberSched gfiber_Sched_create(size_t stackSize)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberSchedPriv* sched = calloc( 1, sizeof(struct GFiberSchedPriv) );
+        if(!sched){
+            hlogError("gfiber: ERROR on calloc() creating a scheduler.\n");
+            return NULL;
+        }
+        sched->pageSize = (size_t)sysconf( _SC_PAGESIZE );
+        if(!stackSize)
+            stackSize = GFIBER_DEFAULT_STACK_SIZE;
+        sched->stackSize = (stackSize + sched->pageSize - 1) & ~(sched->pageSize - 1);
+
+        #if defined GFIBER_HAVE_EPOLL
+            if( (sched->epfd = epoll_create1( EPOLL_CLOEXEC )) < 0 ){
+                hlogError("gfiber: ERROR on epoll_create1() : %s\n", strerror(errno));
+                free(sched);
+                return NULL;
+            }
+        #endif
+        return (GrFiberSched)sched;
+    #else
+        hlogError("gfiber: Fibers are not supported on this platform.\n");
+        return NULL;
+    #endif
+}
+
+// Unfinished fibers are dropped without running to completion.
+void gfiber_Sched_destroy(GrFiberSched* hnd)
+{
+    #if defined _GRYLTOOL_POSIX
+        if(!hnd || !*hnd) return;
+        struct GFiberSchedPriv* sched = (struct GFiberSchedPriv*)(*hnd);
+        if(sched->fiberCount)
+            hlogWarn("gfiber: Destroying a scheduler with %zu unfinished fibers.\n", sched->fiberCount);
+
+        for(size_t i = 0; i < sched->freeStackCount; i++)
+            munmap( sched->freeStacks[i], sched->pageSize + sched->stackSize );
+        #if defined GFIBER_HAVE_EPOLL
+            close( sched->epfd );
+        #else
+            free( sched->pollWaiters );
+        #endif
+        free( sched->timers );
+        free( sched );
+        *hnd = NULL;
+    #endif
+}
+
+size_t gfiber_Sched_getFiberCount(GrFiberSched hnd)
+{
+    #if defined _GRYLTOOL_POSIX
+        return (hnd ? ((struct GFiberSchedPriv*)hnd)->fiberCount : 0);
+    #endif
+    return 0;
+}
+
+char gfiber_Sched_run(GrFiberSched hnd)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberSchedPriv* sched = (struct GFiberSchedPriv*)hnd;
+        if(!sched) return -2;
+        struct GFiberSchedPriv* prevSched = gfiber_curSched;
+        gfiber_curSched = sched;
+        char retval = 0;
+
+        while(sched->fiberCount > 0)
+        {
+            // Run the fibers which are ready now. The ones they wake run after the next poll,
+            // so a busy fiber can't starve the I/O.
+            struct GFiberPriv* batch = sched->readyHead;
+            sched->readyHead = sched->readyTail = NULL;
+            while(batch){
+                struct GFiberPriv* fiber = batch;
+                batch = batch->next;
+                gfiber_resume_priv( sched, fiber );
+                if(fiber->state == GFIBER_STATE_DONE){
+                    sched->fiberCount--;
+                    gfiber_freeFiber_priv( sched, fiber );
+                }
+            }
+            if(!sched->fiberCount)
+                break;
+
+            long timeout = -1;
+            if(sched->readyHead)
+                timeout = 0;
+            else if(sched->timerCount){
+                long long left = sched->timers[0].deadline - gfiber_now_priv();
+                timeout = (left > 0 ? (long)left : 0);
+            }
+            else if(!sched->fdWaiters){
+                hlogError("gfiber: %zu fibers are waiting, but nothing can wake them.\n", sched->fiberCount);
+                retval = 1;
+                break;
+            }
+
+            if(sched->fdWaiters)
+                gfiber_poll_priv( sched, timeout );
+            else if(timeout > 0){
+                struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+                nanosleep( &ts, NULL );
+            }
+            gfiber_fireTimers_priv( sched );
+            #if !defined GFIBER_HAVE_EPOLL
+                gfiber_compactPollWaiters_priv( sched );
+            #endif
+        }
+
+        gfiber_curSched = prevSched;
+        return retval;
+    #endif
+    return -1;
+}
+
+GrFiber gfiber_spawn(GrFiberSched hnd, void (*proc)(void*), void* param)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberSchedPriv* sched = (struct GFiberSchedPriv*)hnd;
+        if(!sched || !proc) return NULL;
+
+        struct GFiberPriv* fiber = gfiber_allocFiber_priv( sched );
+        if(!fiber)
+            return NULL;
+        fiber->proc = proc;
+        fiber->param = param;
+
+        #if defined GFIBER_SWITCH_UCONTEXT
+            getcontext( &(fiber->ctx) );
+            fiber->ctx.uc_stack.ss_sp = fiber->mapBase + sched->pageSize;
+            fiber->ctx.uc_stack.ss_size = (size_t)((char*)fiber - (fiber->mapBase + sched->pageSize));
+            fiber->ctx.uc_link = NULL;
+            makecontext( &(fiber->ctx), gfiber_main_priv, 0 );
+        #else
+            fiber->sp = gfiber_initFrame_priv( fiber, gfiber_main_priv );
+        #endif
+
+        sched->fiberCount++;
+        gfiber_pushReady_priv( sched, fiber );
+        return (GrFiber)fiber;
+    #endif
+    return NULL;
+}
+
+GrFiber gfiber_current()
+{
+    #if defined _GRYLTOOL_POSIX
+        return (gfiber_curSched ? (GrFiber)gfiber_curSched->current : NULL);
+    #endif
+    return NULL;
+}
+
+void gfiber_yield()
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberPriv* fiber = (struct GFiberPriv*)gfiber_current();
+        if(!fiber) return;
+        gfiber_pushReady_priv( fiber->sched, fiber );
+        gfiber_suspend_priv( fiber->sched, fiber );
+    #endif
+}
+
+void gfiber_sleep(long millisec)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberPriv* fiber = (struct GFiberPriv*)gfiber_current();
+        if(!fiber){
+            struct timespec ts = { millisec / 1000, (millisec % 1000) * 1000000L };
+            nanosleep( &ts, NULL );
+            return;
+        }
+        if( gfiber_addTimer_priv( fiber->sched, fiber, (millisec > 0 ? millisec : 0) ) != 0 )
+            return;
+        fiber->state = GFIBER_STATE_WAITING;
+        gfiber_suspend_priv( fiber->sched, fiber );
+    #endif
+}
+
+/* Parks the current fiber until fd is ready for the events (GFIBER_READ/WRITE).
+ * Only one fiber may wait on an fd at a time.
+ */
+char gfiber_waitFD(int fd, int events, long millisec)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct GFiberPriv* fiber = (struct GFiberPriv*)gfiber_current();
+        if(!fiber || fd < 0) return -2;
+        struct GFiberSchedPriv* sched = fiber->sched;
+
+        #if defined GFIBER_HAVE_EPOLL
+            // One-shot, so the registration stays disarmed after the wakeup, and the next
+            // wait on this fd is a single MOD.
+            struct epoll_event ev;
+            ev.events = EPOLLONESHOT | ((events & GFIBER_READ) ? EPOLLIN | EPOLLRDHUP : 0) |
+                                       ((events & GFIBER_WRITE) ? EPOLLOUT : 0);
+            ev.data.ptr = fiber;
+            if( epoll_ctl( sched->epfd, EPOLL_CTL_MOD, fd, &ev ) != 0 ){
+                if( errno != ENOENT || epoll_ctl( sched->epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 ){
+                    hlogError("gfiber: ERROR on epoll_ctl(%d) : %s\n", fd, strerror(errno));
+                    return -1;
+                }
+            }
+        #else
+            if(sched->pollWaiterCount == sched->pollWaiterCapacity){
+                size_t cap = (sched->pollWaiterCapacity ? sched->pollWaiterCapacity * 2 : 64);
+                struct GFiberPriv** arr = realloc( sched->pollWaiters, cap * sizeof(struct GFiberPriv*) );
+                if(!arr){
+                    hlogError("gfiber: ERROR on realloc() of poll waiters.\n");
+                    return -1;
+                }
+                sched->pollWaiters = arr;
+                sched->pollWaiterCapacity = cap;
+            }
+            sched->pollWaiters[ (sched->pollWaiterCount)++ ] = fiber;
+            fiber->waitEvents = ((events & GFIBER_READ) ? POLLIN : 0) | ((events & GFIBER_WRITE) ? POLLOUT : 0);
+        #endif
+
+        fiber->waitFd = fd;
+        sched->fdWaiters++;
+        if(millisec >= 0)
+            gfiber_addTimer_priv( sched, fiber, millisec );
+
+        fiber->state = GFIBER_STATE_WAITING;
+        gfiber_suspend_priv( sched, fiber );
+        return fiber->waitResult;
+    #endif
+    return -1;
+}
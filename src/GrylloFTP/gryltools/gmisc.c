@@ -1,3 +1,5 @@
+#define HLOG_MODULE HLOG_MOD_MISC
+
 #include "gmisc.h"
 #include "hlog.h"
 #include <string.h>
@@ -89,7 +91,7 @@ void gmisc_PrintTimeByFormat(FILE* file, const char* fmt)
     timeinfo = localtime (&rawtime);
 
     if(!strftime(buffer, 80, (fmt ? fmt : "%Y-%m-%d %H:%M:%S"), timeinfo))
-        hlogf("gmisc_PrintTimeByFormat(): format is invalid, or buffer size (%d) exceeded.\n", sizeof(buffer));
+        hlogError("gmisc_PrintTimeByFormat(): format is invalid, or buffer size (%d) exceeded.\n", sizeof(buffer));
 
     fputs(buffer, file);
 }
@@ -1,7 +1,46 @@
+#define HLOG_MODULE HLOG_MOD_SOCKS
+
 #include "grylsocks.h"
 #include "hlog.h"
+#include "gfiber.h"
+#include "grylthread.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined _GRYLTOOL_POSIX
+    #include <netinet/tcp.h>
+    #include <sys/uio.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <time.h>
+    #include <limits.h>
+    #include <stddef.h>
+    #include <sys/un.h>
+
+    #if !defined IOV_MAX
+        #define IOV_MAX 1024
+    #endif
+
+    // GSockBuf arrays are passed to sendmsg()/recvmsg() as they are.
+    typedef char gsockBufLayoutCheck_priv[ (sizeof(GSockBuf) == sizeof(struct iovec) &&
+        offsetof(GSockBuf, base) == offsetof(struct iovec, iov_base) &&
+        offsetof(GSockBuf, len) == offsetof(struct iovec, iov_len)) ? 1 : -1 ];
+    #define gsockPoll_priv  poll
+
+    #if defined __linux__
+        #include <linux/errqueue.h>
+    #endif
+    #if defined SO_ZEROCOPY && defined MSG_ZEROCOPY && defined SO_EE_ORIGIN_ZEROCOPY
+        #define GSOCK_ZEROCOPY_PRIV  1
+    #endif
+#elif defined _GRYLTOOL_WIN32
+    #define gsockPoll_priv  WSAPoll
+#endif
+
+// Most addresses raced in one connect.
+#define GSOCK_CONNECT_MAX_ATTEMPTS  16
 
 int gsockGetLastError()
 {
@@ -13,6 +52,451 @@ int gsockGetLastError()
     return 0;
 }
 
+//==========================================================//
+// - - - - - - - - - - -  Socket options  - - - - - - - - - //
+
+// Maps a GSOCK_OPT_* to setsockopt() level and name. Returns 1 if unsupported here.
+static char gsockOptionLookup_priv(int option, int* level, int* name)
+{
+    switch(option)
+    {
+    case GSOCK_OPT_NODELAY:   *level = IPPROTO_TCP;  *name = TCP_NODELAY;  return 0;
+    case GSOCK_OPT_KEEPALIVE: *level = SOL_SOCKET;   *name = SO_KEEPALIVE; return 0;
+    case GSOCK_OPT_REUSEADDR: *level = SOL_SOCKET;   *name = SO_REUSEADDR; return 0;
+    case GSOCK_OPT_V6ONLY:    *level = IPPROTO_IPV6; *name = IPV6_V6ONLY;  return 0;
+    case GSOCK_OPT_SNDBUF:    *level = SOL_SOCKET;   *name = SO_SNDBUF;    return 0;
+    case GSOCK_OPT_RCVBUF:    *level = SOL_SOCKET;   *name = SO_RCVBUF;    return 0;
+    #if defined TCP_CORK
+        case GSOCK_OPT_CORK:  *level = IPPROTO_TCP;  *name = TCP_CORK;     return 0;
+    #elif defined TCP_NOPUSH
+        case GSOCK_OPT_CORK:  *level = IPPROTO_TCP;  *name = TCP_NOPUSH;   return 0;
+    #endif
+    #if defined SO_REUSEPORT
+        case GSOCK_OPT_REUSEPORT: *level = SOL_SOCKET; *name = SO_REUSEPORT; return 0;
+    #endif
+    #if defined TCP_KEEPIDLE
+        case GSOCK_OPT_KEEPIDLE:  *level = IPPROTO_TCP; *name = TCP_KEEPIDLE;  return 0;
+    #elif defined TCP_KEEPALIVE // macOS
+        case GSOCK_OPT_KEEPIDLE:  *level = IPPROTO_TCP; *name = TCP_KEEPALIVE; return 0;
+    #endif
+    #if defined TCP_KEEPINTVL
+        case GSOCK_OPT_KEEPINTVL: *level = IPPROTO_TCP; *name = TCP_KEEPINTVL; return 0;
+    #endif
+    #if defined TCP_KEEPCNT
+        case GSOCK_OPT_KEEPCNT:   *level = IPPROTO_TCP; *name = TCP_KEEPCNT;   return 0;
+    #endif
+    #if defined TCP_USER_TIMEOUT
+        case GSOCK_OPT_USER_TIMEOUT: *level = IPPROTO_TCP; *name = TCP_USER_TIMEOUT; return 0;
+    #endif
+    #if defined TCP_FASTOPEN
+        case GSOCK_OPT_FASTOPEN:  *level = IPPROTO_TCP; *name = TCP_FASTOPEN;  return 0;
+    #endif
+    #if defined TCP_FASTOPEN_CONNECT
+        case GSOCK_OPT_FASTOPEN_CONNECT: *level = IPPROTO_TCP; *name = TCP_FASTOPEN_CONNECT; return 0;
+    #endif
+    }
+    return 1;
+}
+
+int gsockSetOption(SOCKET sock, int option, int value)
+{
+    if(option == GSOCK_OPT_NONBLOCK)
+    {
+        #if defined _GRYLTOOL_WIN32
+            u_long nonBlocking = (value ? 1 : 0);
+            if( ioctlsocket( sock, FIONBIO, &nonBlocking ) != 0 ){
+        #elif defined _GRYLTOOL_POSIX
+            int fl = fcntl( sock, F_GETFL, 0 );
+            if( fl < 0 || fcntl( sock, F_SETFL, (value ? fl | O_NONBLOCK : fl & ~O_NONBLOCK) ) < 0 ){
+        #endif
+                hlogError("gsockSetOption(): ERROR setting non-blocking mode : %d\n", gsockGetLastError());
+                return -1;
+            }
+        return 0;
+    }
+
+    int level, name;
+    if( gsockOptionLookup_priv( option, &level, &name ) != 0 ){
+        hlogDebug("gsockSetOption(): option %d is not supported on this platform.\n", option);
+        return 1;
+    }
+    if( setsockopt( sock, level, name, (const char*)&value, sizeof(value) ) != 0 ){
+        hlogError("gsockSetOption(): ERROR on setsockopt(%d, %d) : %d\n", option, value, gsockGetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+int gsockGetOption(SOCKET sock, int option, int* value)
+{
+    if(!value) return -1;
+    if(option == GSOCK_OPT_NONBLOCK)
+    {
+        #if defined _GRYLTOOL_POSIX
+            int fl = fcntl( sock, F_GETFL, 0 );
+            if(fl < 0){
+                hlogError("gsockGetOption(): ERROR on fcntl() : %d\n", gsockGetLastError());
+                return -1;
+            }
+            *value = ((fl & O_NONBLOCK) ? 1 : 0);
+            return 0;
+        #endif
+        return 1; // Winsock can't query FIONBIO.
+    }
+
+    int level, name;
+    if( gsockOptionLookup_priv( option, &level, &name ) != 0 )
+        return 1;
+
+    *value = 0;
+    socklen_t len = sizeof(*value);
+    if( getsockopt( sock, level, name, (char*)value, &len ) != 0 ){
+        hlogError("gsockGetOption(): ERROR on getsockopt(%d) : %d\n", option, gsockGetLastError());
+        return -1;
+    }
+    // Some booleans come back as a nonzero bit value.
+    if(len < sizeof(*value))
+        *value = (*value ? 1 : 0);
+    return 0;
+}
+
+// Fast Open is set before listen()/connect(), and differs for the two ends.
+static void gsockApplyFastOpen_priv(SOCKET sock, const GSockOptions* opts, char listener)
+{
+    if(!opts || !(opts->flags & GSOCK_FLAG_FASTOPEN))
+        return;
+    if(listener)
+        gsockSetOption( sock, GSOCK_OPT_FASTOPEN,
+                        (opts->fastOpenQueue > 0 ? opts->fastOpenQueue : GSOCK_FASTOPEN_DEFAULT_QUEUE) );
+    else
+        gsockSetOption( sock, GSOCK_OPT_FASTOPEN_CONNECT, 1 );
+}
+
+/* Stage 0 - options for a fresh socket, before bind()/connect(). Stage 1 - the rest.
+ * Unsupported options are skipped, errors are logged and counted.
+ */
+static int gsockApplyOptions_priv(SOCKET sock, const GSockOptions* opts, char stage)
+{
+    if(!opts) return 0;
+    int errors = 0;
+    int fl = opts->flags;
+    char keepAlive = ( (fl & GSOCK_FLAG_KEEPALIVE) || opts->keepIdle || opts->keepInterval || opts->keepCount );
+
+    #define GSOCK_APPLY_PRIV( cond, opt, val )  \
+        if( (cond) && gsockSetOption( sock, (opt), (val) ) < 0 ) errors++;
+
+    if(stage == 0){
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_REUSEADDR, GSOCK_OPT_REUSEADDR, 1 );
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_REUSEPORT, GSOCK_OPT_REUSEPORT, 1 );
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_V6ONLY,    GSOCK_OPT_V6ONLY, 1 );
+        // Buffer sizes must be known before the handshake, which picks the window scale.
+        GSOCK_APPLY_PRIV( opts->sendBufSize > 0, GSOCK_OPT_SNDBUF, opts->sendBufSize );
+        GSOCK_APPLY_PRIV( opts->recvBufSize > 0, GSOCK_OPT_RCVBUF, opts->recvBufSize );
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_NODELAY, GSOCK_OPT_NODELAY, 1 );
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_CORK,    GSOCK_OPT_CORK, 1 );
+        GSOCK_APPLY_PRIV( keepAlive,           GSOCK_OPT_KEEPALIVE, 1 );
+        GSOCK_APPLY_PRIV( opts->keepIdle > 0,     GSOCK_OPT_KEEPIDLE, opts->keepIdle );
+        GSOCK_APPLY_PRIV( opts->keepInterval > 0, GSOCK_OPT_KEEPINTVL, opts->keepInterval );
+        GSOCK_APPLY_PRIV( opts->keepCount > 0,    GSOCK_OPT_KEEPCNT, opts->keepCount );
+        GSOCK_APPLY_PRIV( opts->userTimeout > 0,  GSOCK_OPT_USER_TIMEOUT, opts->userTimeout );
+    }
+    else{
+        GSOCK_APPLY_PRIV( fl & GSOCK_FLAG_NONBLOCK, GSOCK_OPT_NONBLOCK, 1 );
+    }
+
+    #undef GSOCK_APPLY_PRIV
+    return errors;
+}
+
+int gsockApplyOptions(SOCKET sock, const GSockOptions* opts)
+{
+    return gsockApplyOptions_priv( sock, opts, 0 ) + gsockApplyOptions_priv( sock, opts, 1 );
+}
+
+//==========================================================//
+
+//==========================================================//
+// - - - - - - - - - - - - -  Resolver  - - - - - - - - - - //
+
+static long long gsockNowMs_priv()
+{
+    #if defined _GRYLTOOL_WIN32
+        return (long long)GetTickCount64();
+    #else
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    #endif
+}
+
+// Lists we hand out are a single block of these, so gsockFreeAddrInfo() is one free().
+struct GSockAddrNode_priv
+{
+    struct addrinfo ai;
+    struct sockaddr_storage addr;
+};
+
+static struct addrinfo* gsockCopyAddrInfo_priv(const struct addrinfo* src)
+{
+    size_t count = 0;
+    for(const struct addrinfo* p = src; p; p = p->ai_next)
+        count++;
+    if(!count) return NULL;
+
+    struct GSockAddrNode_priv* nodes = calloc( count, sizeof(struct GSockAddrNode_priv) );
+    if(!nodes){
+        hlogError("gsockResolve(): ERROR on calloc().\n");
+        return NULL;
+    }
+    size_t i = 0;
+    for(const struct addrinfo* p = src; p; p = p->ai_next, i++){
+        nodes[i].ai = *p;
+        nodes[i].ai.ai_canonname = NULL;
+        nodes[i].ai.ai_addrlen = (p->ai_addrlen <= sizeof(struct sockaddr_storage) ? p->ai_addrlen : sizeof(struct sockaddr_storage));
+        memcpy( &(nodes[i].addr), p->ai_addr, nodes[i].ai.ai_addrlen );
+        nodes[i].ai.ai_addr = (struct sockaddr*)&(nodes[i].addr);
+        nodes[i].ai.ai_next = (i + 1 < count ? &(nodes[i + 1].ai) : NULL);
+    }
+    return &(nodes[0].ai);
+}
+
+void gsockFreeAddrInfo(struct addrinfo* ai)
+{
+    free( ai ); // The first node is the start of the block.
+}
+
+/* Literal addresses with numeric ports are built here, without a resolver call.
+ * Returns 0 if handled, 1 if the host or port isn't numeric.
+ */
+static char gsockResolveNumeric_priv(const char* host, const char* port, int family, int socktype,
+                                     int protocol, struct addrinfo** result)
+{
+    if(!host || !port || !*port)
+        return 1;
+    char* end;
+    long portNum = strtol( port, &end, 10 );
+    if(*end || portNum < 0 || portNum > 65535)
+        return 1;
+
+    struct GSockAddrNode_priv node;
+    memset( &node, 0, sizeof(node) );
+    if( (family == AF_UNSPEC || family == AF_INET) &&
+        inet_pton( AF_INET, host, &(((struct sockaddr_in*)&node.addr)->sin_addr) ) == 1 ){
+        struct sockaddr_in* sin = (struct sockaddr_in*)&node.addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons( (unsigned short)portNum );
+        node.ai.ai_family = AF_INET;
+        node.ai.ai_addrlen = sizeof(struct sockaddr_in);
+    }
+    else if( (family == AF_UNSPEC || family == AF_INET6) &&
+             inet_pton( AF_INET6, host, &(((struct sockaddr_in6*)&node.addr)->sin6_addr) ) == 1 ){
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&node.addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons( (unsigned short)portNum );
+        node.ai.ai_family = AF_INET6;
+        node.ai.ai_addrlen = sizeof(struct sockaddr_in6);
+    }
+    else
+        return 1;
+
+    node.ai.ai_socktype = (socktype ? socktype : SOCK_STREAM);
+    node.ai.ai_protocol = protocol;
+    node.ai.ai_addr = (struct sockaddr*)&node.addr;
+    *result = gsockCopyAddrInfo_priv( &node.ai );
+    return 0;
+}
+
+// The cache. Small, so lookups are a linear scan, and the least recently used entry is replaced.
+struct GSockResolveEntry_priv
+{
+    char host[ GSOCK_RESOLVE_MAX_HOST ];
+    char port[ 32 ];
+    int family, socktype, protocol;
+    int error;              // 0 - positive entry, EAI_* - negative entry.
+    struct addrinfo* addrs; // Owned.
+    long long expires;      // 0 - empty slot.
+    long long lastUsed;
+};
+
+static struct GSockResolveEntry_priv gsockResolveCache_priv[ GSOCK_RESOLVE_CACHE_SIZE ];
+static GrFastMutex gsockResolveLock_priv = GTHREAD_FASTMUTEX_INIT;
+static long gsockResolveTTL_priv = GSOCK_RESOLVE_DEFAULT_TTL;
+static long gsockResolveNegativeTTL_priv = GSOCK_RESOLVE_NEGATIVE_TTL;
+
+static char gsockResolveKeyMatch_priv(const struct GSockResolveEntry_priv* e, const char* host, const char* port,
+                                      int family, int socktype, int protocol)
+{
+    return ( e->expires && e->family == family && e->socktype == socktype && e->protocol == protocol &&
+             strcmp( e->host, host ) == 0 && strcmp( e->port, (port ? port : "") ) == 0 );
+}
+
+void gsockResolveCache_setTTL(long ttlMillis, long negativeTtlMillis)
+{
+    gthread_FastMutex_lock( &gsockResolveLock_priv );
+    gsockResolveTTL_priv = ttlMillis;
+    gsockResolveNegativeTTL_priv = negativeTtlMillis;
+    gthread_FastMutex_unlock( &gsockResolveLock_priv );
+}
+
+void gsockResolveCache_clear()
+{
+    gthread_FastMutex_lock( &gsockResolveLock_priv );
+    for(int i = 0; i < GSOCK_RESOLVE_CACHE_SIZE; i++){
+        gsockFreeAddrInfo( gsockResolveCache_priv[i].addrs );
+        memset( gsockResolveCache_priv + i, 0, sizeof(struct GSockResolveEntry_priv) );
+    }
+    gthread_FastMutex_unlock( &gsockResolveLock_priv );
+}
+
+int gsockResolve(const char* host, const char* port, int family, int socktype, int protocol, struct addrinfo** result)
+{
+    if(!result) return EAI_FAIL;
+    *result = NULL;
+
+    if( gsockResolveNumeric_priv( host, port, family, socktype, protocol, result ) == 0 )
+        return (*result ? 0 : EAI_MEMORY);
+
+    char cacheable = ( host && strlen(host) < GSOCK_RESOLVE_MAX_HOST && (!port || strlen(port) < 32) );
+    long long now = gsockNowMs_priv();
+
+    if(cacheable){
+        int err = -1;
+        gthread_FastMutex_lock( &gsockResolveLock_priv );
+        for(int i = 0; i < GSOCK_RESOLVE_CACHE_SIZE; i++){
+            struct GSockResolveEntry_priv* e = gsockResolveCache_priv + i;
+            if( gsockResolveKeyMatch_priv( e, host, port, family, socktype, protocol ) && e->expires > now ){
+                e->lastUsed = now;
+                err = e->error;
+                if(!err && !(*result = gsockCopyAddrInfo_priv( e->addrs )))
+                    err = EAI_MEMORY;
+                break;
+            }
+        }
+        gthread_FastMutex_unlock( &gsockResolveLock_priv );
+        if(err >= 0){
+            hlogDebug("gsockResolve(): cache hit for %s:%s\n", host, (port ? port : ""));
+            return err;
+        }
+    }
+
+    // Resolve outside the lock, so a slow lookup doesn't hold up the others.
+    struct addrinfo hints = { 0 }, *res = NULL;
+    hints.ai_family = family;
+    hints.ai_socktype = socktype;
+    hints.ai_protocol = protocol;
+    int err = getaddrinfo( host, port, &hints, &res );
+    if(!err){
+        *result = gsockCopyAddrInfo_priv( res );
+        freeaddrinfo( res );
+        if(!*result)
+            return EAI_MEMORY;
+    }
+
+    // Only answers are cached - a failed lookup (EAI_AGAIN etc.) is retried next time.
+    char negative = (err == EAI_NONAME);
+    #if defined EAI_NODATA && EAI_NODATA != EAI_NONAME
+        negative = (negative || err == EAI_NODATA);
+    #endif
+
+    if( cacheable && (!err || negative) ){
+        gthread_FastMutex_lock( &gsockResolveLock_priv );
+        long ttl = (err ? gsockResolveNegativeTTL_priv : gsockResolveTTL_priv);
+        struct addrinfo* copy = (err || ttl <= 0 ? NULL : gsockCopyAddrInfo_priv( *result ));
+        if( ttl > 0 && (err || copy) ){
+            // Replace the same key, or an empty/expired slot, or the least recently used.
+            struct GSockResolveEntry_priv* slot = NULL;
+            for(int i = 0; i < GSOCK_RESOLVE_CACHE_SIZE; i++){
+                struct GSockResolveEntry_priv* e = gsockResolveCache_priv + i;
+                if( gsockResolveKeyMatch_priv( e, host, port, family, socktype, protocol ) ){
+                    slot = e;
+                    break;
+                }
+                if( !slot || (slot->expires > now && (e->expires <= now || e->lastUsed < slot->lastUsed)) )
+                    slot = e;
+            }
+            gsockFreeAddrInfo( slot->addrs );
+            strcpy( slot->host, host );
+            strcpy( slot->port, (port ? port : "") );
+            slot->family = family;
+            slot->socktype = socktype;
+            slot->protocol = protocol;
+            slot->error = err;
+            slot->addrs = copy;
+            slot->expires = now + ttl;
+            slot->lastUsed = now;
+        }
+        gthread_FastMutex_unlock( &gsockResolveLock_priv );
+    }
+    return err;
+}
+
+// Async resolves run on a small pool, created on first use.
+static GrThreadPool gsockResolvePool_priv = NULL;
+
+struct GSockResolveRequest_priv
+{
+    char* host;
+    char* port;
+    int family, socktype, protocol;
+};
+
+static void* gsockResolveTask_priv(void* param)
+{
+    struct GSockResolveRequest_priv* req = (struct GSockResolveRequest_priv*)param;
+    struct addrinfo* result = NULL;
+    int err = gsockResolve( req->host, req->port, req->family, req->socktype, req->protocol, &result );
+    if(err)
+        hlogDebug("gsockResolveAsync(): %s : %s\n", (req->host ? req->host : ""), gai_strerror(err));
+    free( req->host );
+    free( req->port );
+    free( req );
+    return result;
+}
+
+static void gsockResolvePool_destroy_priv()
+{
+    gthread_FastMutex_lock( &gsockResolveLock_priv );
+    GrThreadPool pool = gsockResolvePool_priv;
+    gsockResolvePool_priv = NULL;
+    gthread_FastMutex_unlock( &gsockResolveLock_priv );
+    if(pool)
+        gthread_Pool_destroy( &pool, 1 );
+}
+
+GrFuture gsockResolveAsync(GrThreadPool pool, const char* host, const char* port, int family, int socktype, int protocol)
+{
+    if(!pool){
+        gthread_FastMutex_lock( &gsockResolveLock_priv );
+        if(!gsockResolvePool_priv)
+            gsockResolvePool_priv = gthread_Pool_create( GSOCK_RESOLVE_ASYNC_WORKERS );
+        pool = gsockResolvePool_priv;
+        gthread_FastMutex_unlock( &gsockResolveLock_priv );
+        if(!pool)
+            return NULL;
+    }
+
+    struct GSockResolveRequest_priv* req = malloc( sizeof(struct GSockResolveRequest_priv) );
+    if(!req){
+        hlogError("gsockResolveAsync(): ERROR on malloc().\n");
+        return NULL;
+    }
+    req->host = (host ? strdup(host) : NULL);
+    req->port = (port ? strdup(port) : NULL);
+    req->family = family;
+    req->socktype = socktype;
+    req->protocol = protocol;
+
+    GrFuture fut = gthread_Pool_submitFuture( pool, gsockResolveTask_priv, req );
+    if(!fut){
+        free( req->host );
+        free( req->port );
+        free( req );
+    }
+    return fut;
+}
+
+//==========================================================//
+
 int gsockInitSocks()
 {
     #ifdef _GRYLTOOL_WIN32
@@ -20,7 +504,7 @@ int gsockInitSocks()
         struct WSAData wsaData;
         int iResult = WSAStartup(MAKEWORD(2,2), &wsaData);
         if (iResult != 0) {
-            hlogf("WSAStartup failed with error: %d\n", iResult);
+            hlogError("WSAStartup failed with error: %d\n", iResult);
             return 1;
         }
     #endif // _GRYLTOOL_WIN32
@@ -30,7 +514,7 @@ int gsockInitSocks()
 int gsockErrorCleanup(SOCKET sock, struct addrinfo* addrin, const char* msg, char cleanupEverything, int retval)
 {
     if(msg)
-        hlogf("%s : %d\n", msg, gsockGetLastError());
+        hlogError("%s : %d\n", msg, gsockGetLastError());
 
     gsockCloseSocket(sock);
 
@@ -45,6 +529,9 @@ int gsockErrorCleanup(SOCKET sock, struct addrinfo* addrin, const char* msg, cha
 
 void gsockSockCleanup()
 {
+    gsockResolveCache_clear();
+    gsockResolvePool_destroy_priv();
+
     #if defined _GRYLTOOL_WIN32
         WSACleanup();
     #endif // _GRYLTOOL_WIN32
@@ -64,7 +551,278 @@ int gsockCloseSocket(SOCKET sock)
 
 // Easy connect
 
+static char gsockConnectPending_priv(int err)
+{
+    #if defined _GRYLTOOL_WIN32
+        return (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS);
+    #else
+        return (err == EINPROGRESS || err == EINTR || err == EAGAIN);
+    #endif
+}
+
+/* Races non-blocking connects to the addresses (RFC 8305 "Happy Eyeballs").
+ * - Families are interleaved, starting with the one getaddrinfo() sorted first.
+ * - A new attempt starts every GSOCK_CONNECT_ATTEMPT_DELAY ms, or at once if all the
+ *   started ones failed. The first connected socket wins, the rest are closed.
+ * - opts->connectTimeout bounds the whole race.
+ * The winner is left in blocking mode.
+ */
+static SOCKET gsockRaceConnect_priv(struct addrinfo* result, const GSockOptions* opts)
+{
+    struct addrinfo* order[ GSOCK_CONNECT_MAX_ATTEMPTS ];
+    size_t count = 0;
+    {
+        struct addrinfo* first[ GSOCK_CONNECT_MAX_ATTEMPTS ];
+        struct addrinfo* other[ GSOCK_CONNECT_MAX_ATTEMPTS ];
+        size_t nFirst = 0, nOther = 0;
+        for(struct addrinfo* ptr = result; ptr != NULL; ptr = ptr->ai_next){
+            if(ptr->ai_family == result->ai_family){
+                if(nFirst < GSOCK_CONNECT_MAX_ATTEMPTS) first[ nFirst++ ] = ptr;
+            }
+            else if(nOther < GSOCK_CONNECT_MAX_ATTEMPTS)
+                other[ nOther++ ] = ptr;
+        }
+        for(size_t i = 0; (i < nFirst || i < nOther) && count < GSOCK_CONNECT_MAX_ATTEMPTS; i++){
+            if(i < nFirst)
+                order[ count++ ] = first[i];
+            if(i < nOther && count < GSOCK_CONNECT_MAX_ATTEMPTS)
+                order[ count++ ] = other[i];
+        }
+    }
+
+    struct pollfd pfds[ GSOCK_CONNECT_MAX_ATTEMPTS ];
+    size_t inFlight = 0, next = 0;
+    SOCKET winner = INVALID_SOCKET;
+    int lastErr = 0;
+
+    long long now = gsockNowMs_priv();
+    long long deadline = ( (opts && opts->connectTimeout > 0) ? now + opts->connectTimeout : -1 );
+    long long nextStart = now;
+
+    while(winner == INVALID_SOCKET)
+    {
+        now = gsockNowMs_priv();
+        if(deadline >= 0 && now >= deadline){
+            hlogError("gsockConnectSocket(): Timed out after %d ms.\n", opts->connectTimeout);
+            break;
+        }
+
+        // Start the next attempt when its turn comes, or right away if nothing is in flight.
+        if(next < count && (now >= nextStart || inFlight == 0))
+        {
+            struct addrinfo* ai = order[ next ];
+            hlogDebug(" Trying to connect to entity #%d\n", (int)next);
+            next++;
+
+            SOCKET sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if(sock == INVALID_SOCKET){
+                lastErr = gsockGetLastError();
+                hlogDebug(" ERROR on socket() : %d\n", lastErr);
+                continue;
+            }
+            gsockApplyOptions_priv(sock, opts, 0);
+            gsockApplyFastOpen_priv(sock, opts, 0);
+            gsockSetOption(sock, GSOCK_OPT_NONBLOCK, 1);
+
+            if( connect(sock, ai->ai_addr, (int)ai->ai_addrlen) == 0 ){
+                winner = sock; // Connected immediately (loopback, unix sockets).
+                break;
+            }
+            int err = gsockGetLastError();
+            if( !gsockConnectPending_priv(err) ){
+                lastErr = err;
+                hlogDebug(" Entity #%d failed at once : %d\n", (int)next - 1, err);
+                gsockCloseSocket(sock);
+                continue;
+            }
+            pfds[ inFlight ].fd = sock;
+            pfds[ inFlight ].events = POLLOUT;
+            pfds[ inFlight ].revents = 0;
+            inFlight++;
+            nextStart = now + GSOCK_CONNECT_ATTEMPT_DELAY;
+            continue;
+        }
+        if(inFlight == 0)
+            break; // Every address failed.
+
+        // Wait until an attempt completes, the next one is due, or the deadline.
+        long long wait = (next < count ? nextStart - now : -1);
+        if(deadline >= 0 && (wait < 0 || deadline - now < wait))
+            wait = deadline - now;
+
+        int res = gsockPoll_priv(pfds, inFlight, (int)wait);
+        if(res < 0){
+            if(gsockGetLastError() == EINTR)
+                continue;
+            lastErr = gsockGetLastError();
+            hlogError("gsockConnectSocket(): ERROR on poll() : %d\n", lastErr);
+            break;
+        }
+
+        for(size_t i = 0; i < inFlight; ){
+            if(!pfds[i].revents){
+                i++;
+                continue;
+            }
+            int soErr = 0;
+            socklen_t len = sizeof(soErr);
+            if( getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, (char*)&soErr, &len) != 0 )
+                soErr = gsockGetLastError();
+
+            if(soErr == 0 && winner == INVALID_SOCKET)
+                winner = pfds[i].fd;
+            else{
+                lastErr = soErr;
+                gsockCloseSocket(pfds[i].fd);
+            }
+            pfds[i] = pfds[ --inFlight ];
+        }
+    }
+
+    // Close the losers.
+    for(size_t i = 0; i < inFlight; i++)
+        gsockCloseSocket(pfds[i].fd);
+
+    if(winner == INVALID_SOCKET){
+        if(lastErr)
+            hlogError("gsockConnectSocket(): Last connect error : %d\n", lastErr);
+        return INVALID_SOCKET;
+    }
+    gsockSetOption(winner, GSOCK_OPT_NONBLOCK, 0);
+    return winner;
+}
+
+//==========================================================//
+// - - - - - - - - - -  Unix domain sockets - - - - - - - - //
+
+char gsockIsUnixAddress(const char* address)
+{
+    return ( address && strncmp( address, GSOCK_UNIX_PREFIX, sizeof(GSOCK_UNIX_PREFIX) - 1 ) == 0 );
+}
+
+#if defined _GRYLTOOL_POSIX
+
+// Fills sun from "unix:/path" or "unix:@name". Returns -1 if the path doesn't fit.
+static int gsockUnixAddr_priv(const char* address, struct sockaddr_un* sun, socklen_t* len)
+{
+    const char* path = address + sizeof(GSOCK_UNIX_PREFIX) - 1;
+    size_t pathLen = strlen( path );
+    if(!pathLen || pathLen >= sizeof(sun->sun_path)){
+        hlogError("gsockUnixAddr(): Bad unix socket path: \"%s\"\n", path);
+        return -1;
+    }
+    memset( sun, 0, sizeof(*sun) );
+    sun->sun_family = AF_UNIX;
+    memcpy( sun->sun_path, path, pathLen );
+
+    #if defined __linux__
+        if(path[0] == '@') // Abstract namespace - no file, the name isn't null-terminated.
+            sun->sun_path[0] = 0;
+    #endif
+    *len = (socklen_t)( offsetof(struct sockaddr_un, sun_path) + pathLen + (sun->sun_path[0] ? 1 : 0) );
+    return 0;
+}
+
+// Only the buffer sizes and NONBLOCK apply to unix sockets.
+static void gsockUnixOptions_priv(const GSockOptions* opts, GSockOptions* unixOpts)
+{
+    memset( unixOpts, 0, sizeof(*unixOpts) );
+    if(!opts) return;
+    unixOpts->flags = opts->flags & GSOCK_FLAG_NONBLOCK;
+    unixOpts->sendBufSize = opts->sendBufSize;
+    unixOpts->recvBufSize = opts->recvBufSize;
+}
+
+static SOCKET gsockConnectUnix_priv(const char* address, int socktype, const GSockOptions* opts)
+{
+    struct sockaddr_un sun;
+    socklen_t sunLen;
+    GSockOptions unixOpts;
+    if( gsockUnixAddr_priv( address, &sun, &sunLen ) != 0 )
+        return INVALID_SOCKET;
+    gsockUnixOptions_priv( opts, &unixOpts );
+
+    SOCKET sock = socket( AF_UNIX, socktype, 0 );
+    if(sock == INVALID_SOCKET){
+        hlogError("gsockConnectSocket(): ERROR on socket() : %d\n", gsockGetLastError());
+        return INVALID_SOCKET;
+    }
+    gsockApplyOptions_priv( sock, &unixOpts, 0 );
+
+    if( connect( sock, (struct sockaddr*)&sun, sunLen ) != 0 ){
+        hlogError("gsockConnectSocket(): Can't connect to %s : %d\n", address, gsockGetLastError());
+        gsockCloseSocket( sock );
+        return INVALID_SOCKET;
+    }
+    gsockApplyOptions_priv( sock, &unixOpts, 1 );
+    return sock;
+}
+
+// Binds sun, replacing a socket file left behind by a dead server.
+static int gsockBindUnix_priv(SOCKET sock, struct sockaddr_un* sun, socklen_t sunLen)
+{
+    if( bind( sock, (struct sockaddr*)sun, sunLen ) == 0 )
+        return 0;
+    if(errno != EADDRINUSE || !sun->sun_path[0])
+        return -1;
+
+    // Someone still accepting on it keeps it.
+    SOCKET probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+    int stale = ( probe != INVALID_SOCKET && connect( probe, (struct sockaddr*)sun, sunLen ) != 0 &&
+                  errno == ECONNREFUSED );
+    if(probe != INVALID_SOCKET)
+        gsockCloseSocket( probe );
+    if(!stale){
+        errno = EADDRINUSE;
+        return -1;
+    }
+    hlogDebug("gsockListenSocket(): Removing a stale socket file: %s\n", sun->sun_path);
+    unlink( sun->sun_path );
+    return bind( sock, (struct sockaddr*)sun, sunLen );
+}
+
+static SOCKET gsockListenUnix_priv(const char* address, int socktype, const GSockOptions* opts)
+{
+    struct sockaddr_un sun;
+    socklen_t sunLen;
+    GSockOptions unixOpts;
+    if( gsockUnixAddr_priv( address, &sun, &sunLen ) != 0 )
+        return INVALID_SOCKET;
+    gsockUnixOptions_priv( opts, &unixOpts );
+
+    SOCKET sock = socket( AF_UNIX, socktype, 0 );
+    if(sock == INVALID_SOCKET){
+        hlogError("gsockListenSocket(): ERROR on socket() : %d\n", gsockGetLastError());
+        return INVALID_SOCKET;
+    }
+    gsockApplyOptions_priv( sock, &unixOpts, 0 );
+
+    if( gsockBindUnix_priv( sock, &sun, sunLen ) != 0 ){
+        hlogError("gsockListenSocket(): Can't bind %s : %d\n", address, gsockGetLastError());
+        gsockCloseSocket( sock );
+        return INVALID_SOCKET;
+    }
+    if( (socktype == SOCK_STREAM || socktype == SOCK_SEQPACKET) && listen( sock, SOMAXCONN ) != 0 ){
+        hlogError("gsockListenSocket(): ERROR on listen() : %d\n", gsockGetLastError());
+        gsockCloseSocket( sock );
+        return INVALID_SOCKET;
+    }
+    gsockApplyOptions_priv( sock, &unixOpts, 1 );
+    return sock;
+}
+
+#endif // _GRYLTOOL_POSIX
+
+//==========================================================//
+
 SOCKET gsockConnectSocket(const char* address, const char* port, int family, int socktype, int protocol, int flags)
+{
+    GSockOptions opts = { 0 };
+    opts.flags = flags;
+    return gsockConnectSocketEx(address, port, family, socktype, protocol, &opts);
+}
+
+SOCKET gsockConnectSocketEx(const char* address, const char* port, int family, int socktype, int protocol, const GSockOptions* opts)
 {
     // Set the DEFAULT values if ZERO.
     if(!family)
@@ -73,75 +831,63 @@ SOCKET gsockConnectSocket(const char* address, const char* port, int family, int
         socktype = SOCK_STREAM; // TCP Stream mode
     // Protocol is 0 anyways (unless explicitly specified by user).
 
-    hlogf("\ngsockConnectSocket(): Trying to connect to: %s, on port: %s.\n", address, port);
-    hlogf("Set AddrInfo hints: ai_family=AF_UNSPEC, ai_socktype=%d, ai_protocol=%d\n", socktype, protocol);
+    if( gsockIsUnixAddress(address) ){
+        #if defined _GRYLTOOL_POSIX
+            return gsockConnectUnix_priv(address, socktype, opts);
+        #else
+            hlogError("gsockConnectSocket(): Unix sockets are not supported on this platform.\n");
+            return INVALID_SOCKET;
+        #endif
+    }
+
+    hlogDebug("\ngsockConnectSocket(): Trying to connect to: %s, on port: %s.\n", address, port);
+    hlogDebug("Set AddrInfo hints: ai_family=AF_UNSPEC, ai_socktype=%d, ai_protocol=%d\n", socktype, protocol);
     
     SOCKET ConnectSocket = INVALID_SOCKET;
-    struct addrinfo hints = { 0 },
-                    *result;
+    struct addrinfo* result;
 
-    // Set the Socket Option hints.  // For Defaults:
-    hints.ai_family   = family;      // AF_UNSPEC - Use IPv4 or IPv6, respectively.
-    hints.ai_socktype = socktype;    // SOCK_STREAM - TCP Stream mode (Connection-oriented)
-    hints.ai_protocol = protocol;    // 0 - Use default protocol for the given SockType.
-    
-    hlogf("Resolve server address & port (GetAddrInfo)... ");
+    hlogDebug("Resolve server address & port (GetAddrInfo)... ");
 
-    // Resolve the server address, port, and Socket Options (Preferred in Hints)
+    // Resolve the server address, port, and Socket Options (Used as Hints)
     // 1: Server address (ipv4, ipv6, or DNS)
     // 2: Service ID, or Port Number of the server.
-    // 3: hints (above)
-    // 4: Result addrinfo struct. The server address might return more than one
+    // 3-5: family - AF_UNSPEC - Use IPv4 or IPv6, respectively. socktype - SOCK_STREAM - TCP Stream mode
+    //      (Connection-oriented). protocol - 0 - Use default protocol for the given SockType.
+    // 6: Result addrinfo struct. The server address might return more than one
     //    connectable entities, so ADDRINFO uses a linked list.
-    int iResult = getaddrinfo(address, port, &hints, &result);
+    // Literal addresses skip the resolver, and names are answered from the cache when possible.
+    int iResult = gsockResolve(address, port, family, socktype, protocol, &result);
     if ( iResult != 0 ) {
-        hlogf("ERROR on getaddrinfo() : %d\n", gsockGetLastError() );
+        hlogError("ERROR on getaddrinfo() : %s\n", gai_strerror(iResult) );
         return INVALID_SOCKET;
     }
 
-    hlogf("Done.\nTry to connect to the first connectable entity of the server...\n");
-    // Attempt to connect to an address until one succeeds
-    int cnt=0;
-    for(struct addrinfo* ptr=result; ptr != NULL; ptr=ptr->ai_next) {
-        hlogf(" Trying to connect to entity #%d\n", cnt);
-        cnt++;
-
-        // Create a SOCKET for connecting to server
-        ConnectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (ConnectSocket == INVALID_SOCKET) {
-            hlogf("ERROR on socket() : %d\n", gsockGetLastError() );
-            return ConnectSocket;
-        }
-
-        // Connect to server.
-        // 1: the socket handle for maintaining a connection
-        // 2: server address (IPv4, IPv6, or other (if using UNIX sockets))
-        // 3: address lenght in bytes.
-        // This makes the TCP/UDP SYN handshake.
-        iResult = connect( ConnectSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
-        if (iResult == SOCKET_ERROR) {
-            gsockCloseSocket(ConnectSocket);
-            ConnectSocket = INVALID_SOCKET;
-            continue; // If can't connect, close sock, and Resume to the next entity.
-        }
-        // We found a connectable address entity, so we can quit now.
-        break;
-    }
+    hlogDebug("Done.\nRacing connects to the entities of the server...\n");
+    ConnectSocket = gsockRaceConnect_priv(result, opts);
+
     // Free the result ADDRINFO* structure, we no longer need it.
-    freeaddrinfo(result);
+    gsockFreeAddrInfo(result);
     
     // The server might refuse a connection, so we must check if ConnectSocket is INVALID.
     if (ConnectSocket == INVALID_SOCKET) {
-        hlogf("ERROR: Can't connect to this server!\n");
+        hlogError("ERROR: Can't connect to this server!\n");
+        return INVALID_SOCKET;
     }
-    hlogf("Success!\n");
 
-    // Set the Socket IOCTL or SockOpt flags. - Currently None Supported.
+    // The options which would have changed how connect() works.
+    gsockApplyOptions_priv(ConnectSocket, opts, 1);
     
     return ConnectSocket;
 }
 
 SOCKET gsockListenSocket(int port, const char* localBindAddr, int family, int socktype, int protocol, int flags)
+{
+    GSockOptions opts = { 0 };
+    opts.flags = flags;
+    return gsockListenSocketEx(port, localBindAddr, family, socktype, protocol, &opts);
+}
+
+SOCKET gsockListenSocketEx(int port, const char* localBindAddr, int family, int socktype, int protocol, const GSockOptions* opts)
 {
     // Set the DEFAULT values if ZERO.
     if(!family)
@@ -154,13 +900,24 @@ SOCKET gsockListenSocket(int port, const char* localBindAddr, int family, int so
     struct sockaddr_in localAddr = { 0 }; // Local Address in Connection Tuple.
     int iRes = 0;
 
-    hlogf("\ngsockListenSocket(): Port: %d, family: %d\nCreating Socket:");
+    if( gsockIsUnixAddress(localBindAddr) ){
+        #if defined _GRYLTOOL_POSIX
+            return gsockListenUnix_priv(localBindAddr, socktype, opts);
+        #else
+            hlogError("gsockListenSocket(): Unix sockets are not supported on this platform.\n");
+            return INVALID_SOCKET;
+        #endif
+    }
+
+    hlogDebug("\ngsockListenSocket(): Port: %d, family: %d\nCreating Socket:", port, family);
 
     sockFd = socket(family, socktype, protocol);
     if(sockFd == INVALID_SOCKET){
-        hlogf("ERROR on socket(): %d\n", gsockGetLastError());
+        hlogError("ERROR on socket(): %d\n", gsockGetLastError());
         return INVALID_SOCKET;
     }
+    gsockApplyOptions_priv(sockFd, opts, 0);
+    gsockApplyFastOpen_priv(sockFd, opts, 1);
     
     // Setup the Bind Structure
     localAddr.sin_family = family;
@@ -171,7 +928,7 @@ SOCKET gsockListenSocket(int port, const char* localBindAddr, int family, int so
     // (Connection Tuple: LocalAddr-LocalPort-RemoteAddr-RemotePort)
     iRes = bind(sockFd, (struct sockaddr*)&localAddr, sizeof(localAddr));
     if(iRes == SOCKET_ERROR){
-        hlogf("ERROR on Bind() : %d\n", gsockGetLastError());
+        hlogError("ERROR on Bind() : %d\n", gsockGetLastError());
         gsockCloseSocket(sockFd);
         return INVALID_SOCKET;
     }
@@ -181,26 +938,880 @@ SOCKET gsockListenSocket(int port, const char* localBindAddr, int family, int so
     { 
         iRes = listen(sockFd, SOMAXCONN);
         if(iRes == SOCKET_ERROR){
-            hlogf("ERROR on listen() : %d\n", gsockGetLastError());
+            hlogError("ERROR on listen() : %d\n", gsockGetLastError());
             gsockCloseSocket(sockFd);
             return INVALID_SOCKET;
         }
     }
 
-    // Setup the needed flags (NonBlock, etc.) - Currently not supported.
+    gsockApplyOptions_priv(sockFd, opts, 1);
 
     return sockFd;
 }
 
 // Functions for sending and receiving multipacket buffers.
+// Inside a fiber, a call which would block parks the fiber in the scheduler instead,
+// unless the caller asked for MSG_DONTWAIT itself.
+
+#if defined _GRYLTOOL_POSIX && defined MSG_DONTWAIT
+    #define GSOCK_FIBER_AWARE_PRIV  1
+
+// After a failed call in a fiber: 1 - waited until the socket is ready, retry. 0 - a real error.
+static char gsockFiberRetry_priv(SOCKET sock, int events)
+{
+    if(errno == EINTR)
+        return 1;
+    return ( (errno == EAGAIN || errno == EWOULDBLOCK) && gfiber_waitFD( sock, events, -1 ) >= 0 );
+}
+#endif
+
 int gsockReceive(SOCKET sock, char* buff, size_t bufsize, int flags)
 {
+    #if defined GSOCK_FIBER_AWARE_PRIV
+        if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+            int res;
+            while( (res = recv(sock, buff, bufsize, flags | MSG_DONTWAIT)) < 0 &&
+                   gsockFiberRetry_priv( sock, GFIBER_READ ) )
+                ;
+            return res;
+        }
+    #endif
     return recv(sock, buff, bufsize, flags);
 }
 
 int gsockSend(SOCKET sock, const char* buff, size_t bufsize, int flags)
 {
+    #if defined GSOCK_FIBER_AWARE_PRIV
+        if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+            int res;
+            while( (res = send(sock, buff, bufsize, flags | MSG_DONTWAIT)) < 0 &&
+                   gsockFiberRetry_priv( sock, GFIBER_WRITE ) )
+                ;
+            return res;
+        }
+    #endif
     return send(sock, buff, bufsize, flags);
 }
 
+#if defined _GRYLTOOL_WIN32
+// WSABUF has its fields the other way around, so the buffers are converted in batches of this.
+#define GSOCK_WSABUF_BATCH  64
+
+static int gsockConvertBufs_priv(WSABUF* wb, const GSockBuf* bufs, int count)
+{
+    int n = (count < GSOCK_WSABUF_BATCH ? count : GSOCK_WSABUF_BATCH);
+    for(int i = 0; i < n; i++){
+        wb[i].buf = (char*)bufs[i].base;
+        wb[i].len = (ULONG)bufs[i].len;
+    }
+    return n;
+}
+#endif
+
+int gsockSendv(SOCKET sock, const GSockBuf* bufs, int count, int flags)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct msghdr msg = { 0 };
+        msg.msg_iov = (struct iovec*)bufs;
+        msg.msg_iovlen = (count < IOV_MAX ? count : IOV_MAX);
+        int res;
+        #if defined GSOCK_FIBER_AWARE_PRIV
+            if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+                while( (res = sendmsg(sock, &msg, flags | MSG_DONTWAIT)) < 0 &&
+                       gsockFiberRetry_priv( sock, GFIBER_WRITE ) )
+                    ;
+                return res;
+            }
+        #endif
+        return sendmsg(sock, &msg, flags);
+
+    #elif defined _GRYLTOOL_WIN32
+        WSABUF wb[ GSOCK_WSABUF_BATCH ];
+        DWORD sent = 0;
+        if( WSASend( sock, wb, gsockConvertBufs_priv( wb, bufs, count ), &sent, flags, NULL, NULL ) != 0 )
+            return SOCKET_ERROR;
+        return (int)sent;
+    #endif
+}
+
+int gsockRecvv(SOCKET sock, const GSockBuf* bufs, int count, int flags)
+{
+    #if defined _GRYLTOOL_POSIX
+        struct msghdr msg = { 0 };
+        msg.msg_iov = (struct iovec*)bufs;
+        msg.msg_iovlen = (count < IOV_MAX ? count : IOV_MAX);
+        int res;
+        #if defined GSOCK_FIBER_AWARE_PRIV
+            if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+                while( (res = recvmsg(sock, &msg, flags | MSG_DONTWAIT)) < 0 &&
+                       gsockFiberRetry_priv( sock, GFIBER_READ ) )
+                    ;
+                return res;
+            }
+        #endif
+        return recvmsg(sock, &msg, flags);
+
+    #elif defined _GRYLTOOL_WIN32
+        WSABUF wb[ GSOCK_WSABUF_BATCH ];
+        DWORD got = 0, wsaFlags = (DWORD)flags;
+        if( WSARecv( sock, wb, gsockConvertBufs_priv( wb, bufs, count ), &got, &wsaFlags, NULL, NULL ) != 0 )
+            return SOCKET_ERROR;
+        return (int)got;
+    #endif
+}
+
+// Descriptor passing over unix sockets.
+
+int gsockSendFd(SOCKET sock, int fd, const char* data, size_t len, int flags)
+{
+    #if defined _GRYLTOOL_POSIX
+        if(!data || !len){
+            hlogError("gsockSendFd(): At least 1 byte of data must go with the descriptor.\n");
+            return -1;
+        }
+        union {
+            struct cmsghdr hdr;
+            char buf[ CMSG_SPACE(sizeof(int)) ];
+        } ctrl;
+        memset( &ctrl, 0, sizeof(ctrl) );
+
+        struct iovec iov = { (void*)data, len };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy( CMSG_DATA(cmsg), &fd, sizeof(int) );
+
+        #if defined GSOCK_FIBER_AWARE_PRIV
+            if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+                int res;
+                while( (res = sendmsg(sock, &msg, flags | MSG_DONTWAIT)) < 0 &&
+                       gsockFiberRetry_priv( sock, GFIBER_WRITE ) )
+                    ;
+                return res;
+            }
+        #endif
+        return sendmsg(sock, &msg, flags);
+    #else
+        hlogError("gsockSendFd(): Descriptor passing is not supported on this platform.\n");
+        return -1;
+    #endif
+}
+
+int gsockReceiveFd(SOCKET sock, int* fd, char* buff, size_t bufsize, int flags)
+{
+    if(fd) *fd = -1;
+    #if defined _GRYLTOOL_POSIX
+        if(!fd || !buff || !bufsize)
+            return -1;
+        union {
+            struct cmsghdr hdr;
+            char buf[ CMSG_SPACE(sizeof(int)) ];
+        } ctrl;
+
+        struct iovec iov = { buff, bufsize };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+
+        #if defined MSG_CMSG_CLOEXEC
+            flags |= MSG_CMSG_CLOEXEC;
+        #endif
+
+        int res;
+        #if defined GSOCK_FIBER_AWARE_PRIV
+            if( !(flags & MSG_DONTWAIT) && gfiber_current() ){
+                while( (res = recvmsg(sock, &msg, flags | MSG_DONTWAIT)) < 0 &&
+                       gsockFiberRetry_priv( sock, GFIBER_READ ) )
+                    ;
+            }
+            else
+        #endif
+            res = recvmsg(sock, &msg, flags);
+        if(res < 0)
+            return res;
+
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg )){
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+               cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+                memcpy( fd, CMSG_DATA(cmsg), sizeof(int) );
+        }
+        // The sender passed more descriptors than fit. The kernel has closed the rest.
+        if(msg.msg_flags & MSG_CTRUNC)
+            hlogError("gsockReceiveFd(): Control data truncated - descriptors lost.\n");
+        return res;
+    #else
+        hlogError("gsockReceiveFd(): Descriptor passing is not supported on this platform.\n");
+        return -1;
+    #endif
+}
+
+// Waits until sock is readable/writable. 0 - ready, 1 - timeout, -1 - error.
+static int gsockWaitReady_priv(SOCKET sock, char writing, long millisec)
+{
+    #if defined _GRYLTOOL_POSIX
+        if( gfiber_current() ){
+            char res = gfiber_waitFD( sock, (writing ? GFIBER_WRITE : GFIBER_READ), millisec );
+            return (res < 0 ? -1 : res);
+        }
+        struct pollfd pfd = { sock, (short)(writing ? POLLOUT : POLLIN), 0 };
+        int res = poll( &pfd, 1, (int)millisec );
+        if(res < 0)
+            return (errno == EINTR ? 0 : -1); // The caller retries and waits again.
+        return (res > 0 ? 0 : 1);
+
+    #elif defined _GRYLTOOL_WIN32
+        fd_set set;
+        struct timeval tm = { millisec / 1000, (millisec % 1000) * 1000 };
+        FD_ZERO( &set );
+        FD_SET( sock, &set );
+        int res = select( 0, (writing ? NULL : &set), (writing ? &set : NULL), NULL, (millisec < 0 ? NULL : &tm) );
+        if(res < 0)
+            return -1;
+        return (res > 0 ? 0 : 1);
+    #endif
+}
+
+// Drops n transferred bytes from the front of the buffer list.
+static void gsockAdvanceBufs_priv(GSockBuf** bufs, int* count, size_t n)
+{
+    while(*count > 0 && n >= (*bufs)->len){
+        n -= (*bufs)->len;
+        (*bufs)++;
+        (*count)--;
+    }
+    if(*count > 0 && n){
+        (*bufs)->base = (char*)((*bufs)->base) + n;
+        (*bufs)->len -= n;
+    }
+}
+
+/* Moves all of bufs. millisec < 0 - no deadline.
+ * Returns 0 - done, 1 - timeout, 2 - the peer closed (receiving), -1 - error.
+ */
+static int gsockTransferAll_priv(SOCKET sock, GSockBuf* bufs, int count, int flags, char sending,
+                                 long millisec, size_t* done)
+{
+    long long deadline = (millisec >= 0 ? gsockNowMs_priv() + millisec : -1);
+    size_t total = 0;
+    int retval = 0;
+
+    // With a deadline, we wait ourselves, and only do non-blocking calls.
+    #if defined MSG_DONTWAIT
+        if(deadline >= 0)
+            flags |= MSG_DONTWAIT;
+    #endif
+
+    while(1)
+    {
+        gsockAdvanceBufs_priv( &bufs, &count, 0 ); // Skip the empty ones.
+        if(count <= 0)
+            break;
+
+        if(deadline >= 0){
+            long long left = deadline - gsockNowMs_priv();
+            int ready = gsockWaitReady_priv( sock, sending, (left > 0 ? (long)left : 0) );
+            if(ready != 0){
+                retval = ready;
+                break;
+            }
+        }
+
+        int n;
+        if(count == 1)
+            n = (sending ? gsockSend( sock, (const char*)bufs->base, bufs->len, flags )
+                         : gsockReceive( sock, (char*)bufs->base, bufs->len, flags ));
+        else
+            n = (sending ? gsockSendv( sock, bufs, count, flags ) : gsockRecvv( sock, bufs, count, flags ));
+
+        if(n < 0){
+            int err = gsockGetLastError();
+            #if defined _GRYLTOOL_WIN32
+                if(deadline >= 0 && err == WSAEWOULDBLOCK)
+                    continue;
+            #else
+                if(err == EINTR || (deadline >= 0 && (err == EAGAIN || err == EWOULDBLOCK)))
+                    continue;
+            #endif
+            hlogDebug("gsockTransferAll(): ERROR on %s : %d\n", (sending ? "send" : "recv"), err);
+            retval = -1;
+            break;
+        }
+        if(n == 0 && !sending){
+            retval = 2;
+            break;
+        }
+        total += (size_t)n;
+        gsockAdvanceBufs_priv( &bufs, &count, (size_t)n );
+    }
+
+    if(done)
+        *done = total;
+    return retval;
+}
+
+int gsockSendAll(SOCKET sock, const char* buff, size_t len, int flags)
+{
+    return gsockSendAll_time( sock, buff, len, flags, -1, NULL );
+}
+
+int gsockReceiveAll(SOCKET sock, char* buff, size_t len, int flags)
+{
+    return gsockReceiveAll_time( sock, buff, len, flags, -1, NULL );
+}
+
+int gsockSendvAll(SOCKET sock, GSockBuf* bufs, int count, int flags)
+{
+    return gsockTransferAll_priv( sock, bufs, count, flags, 1, -1, NULL );
+}
+
+int gsockSendAll_time(SOCKET sock, const char* buff, size_t len, int flags, long millisec, size_t* done)
+{
+    GSockBuf buf = { (void*)buff, len };
+    return gsockTransferAll_priv( sock, &buf, 1, flags, 1, millisec, done );
+}
+
+int gsockReceiveAll_time(SOCKET sock, char* buff, size_t len, int flags, long millisec, size_t* done)
+{
+    GSockBuf buf = { buff, len };
+    return gsockTransferAll_priv( sock, &buf, 1, flags, 0, millisec, done );
+}
+
+int gsockSendvAll_time(SOCKET sock, GSockBuf* bufs, int count, int flags, long millisec, size_t* done)
+{
+    return gsockTransferAll_priv( sock, bufs, count, flags, 1, millisec, done );
+}
+
+
+//--------------- Zero-copy sends ---------------//
+
+struct GSockZeroCopyRecord_priv
+{
+    const void* buff;
+    void (*onDone)(const void*, void*);
+    void* userData;
+    unsigned int firstSeq;  // Notification ids of the first and the last sendmsg() of the buffer.
+    unsigned int lastSeq;
+    unsigned int remaining; // sendmsg() calls not completed yet.
+};
+
+struct GSockZeroCopy_d
+{
+    SOCKET sock;
+    char enabled;
+    size_t threshold;
+    unsigned int nextSeq;   // The kernel numbers the MSG_ZEROCOPY sendmsg() calls from 0.
+    struct GSockZeroCopyRecord_priv* recs;
+    size_t recCount;
+    size_t recCapacity;
+    struct GSockZeroCopyRecord_priv current; // The buffer being sent, while sending is set.
+    char sending;
+    GSockZeroCopyStats stats;
+};
+
+GSockZeroCopy gsockZeroCopy_create(SOCKET sock)
+{
+    struct GSockZeroCopy_d* zc = calloc( 1, sizeof(struct GSockZeroCopy_d) );
+    if(!zc){
+        hlogError("gsockZeroCopy_create(): ERROR on calloc().\n");
+        return NULL;
+    }
+    zc->sock = sock;
+    zc->threshold = GSOCK_ZEROCOPY_THRESHOLD;
+
+    #if defined GSOCK_ZEROCOPY_PRIV
+        int one = 1;
+        zc->enabled = ( setsockopt( sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one) ) == 0 );
+        if(!zc->enabled)
+            hlogDebug("gsockZeroCopy_create(): zerocopy unavailable on sock %d : %s\n", (int)sock, strerror(errno));
+    #endif
+    zc->stats.enabled = zc->enabled;
+    return zc;
+}
+
+void gsockZeroCopy_setThreshold(GSockZeroCopy zc, size_t minSize)
+{
+    if(zc)
+        zc->threshold = minSize;
+}
+
+void gsockZeroCopy_getStats(GSockZeroCopy zc, GSockZeroCopyStats* stats)
+{
+    if(!zc || !stats) return;
+    *stats = zc->stats;
+    stats->enabled = zc->enabled;
+    stats->pending = zc->recCount;
+}
+
+#if defined GSOCK_ZEROCOPY_PRIV
+
+// Takes the completed range [lo, hi] off the records, and releases the finished buffers.
+static void gsockZeroCopyCount_priv(struct GSockZeroCopyRecord_priv* rec, unsigned int lo, unsigned int hi)
+{
+    for(unsigned int seq = rec->firstSeq; rec->remaining && seq != rec->lastSeq + 1; seq++){
+        if(seq - lo <= hi - lo)
+            rec->remaining--;
+    }
+}
+
+static void gsockZeroCopyComplete_priv(struct GSockZeroCopy_d* zc, unsigned int lo, unsigned int hi)
+{
+    // The buffer being sent is released by the sender, when it's done.
+    if(zc->sending)
+        gsockZeroCopyCount_priv( &(zc->current), lo, hi );
+
+    size_t kept = 0;
+    for(size_t i = 0; i < zc->recCount; i++){
+        struct GSockZeroCopyRecord_priv* rec = zc->recs + i;
+        gsockZeroCopyCount_priv( rec, lo, hi );
+        if(rec->remaining == 0){
+            if(rec->onDone)
+                rec->onDone( rec->buff, rec->userData );
+        }
+        else
+            zc->recs[ kept++ ] = *rec;
+    }
+    zc->recCount = kept;
+}
+
+// Reads all the notifications queued on the error queue, without waiting. Returns -1 on error.
+static int gsockZeroCopyReap_priv(struct GSockZeroCopy_d* zc)
+{
+    char control[ 128 ];
+    while(1)
+    {
+        struct msghdr msg = { 0 };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if( recvmsg( zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 ){
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == EINTR)
+                continue;
+            hlogError("gsockZeroCopy: ERROR on recvmsg(MSG_ERRQUEUE) : %s\n", strerror(errno));
+            return -1;
+        }
+
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if( !(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR) )
+                continue;
+
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0){
+                hlogDebug("gsockZeroCopy: error queue message, origin %d, errno %d\n",
+                          (int)serr->ee_origin, (int)serr->ee_errno);
+                continue;
+            }
+
+            // The kernel had to copy after all (loopback, or a device without scatter-gather).
+            // Then zerocopy only adds the notification overhead, so the rest goes the plain way.
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                zc->stats.copiedCompletions += serr->ee_data - serr->ee_info + 1;
+                if(zc->enabled)
+                    hlogDebug("gsockZeroCopy: sock %d data was copied, zerocopy turned off.\n", (int)zc->sock);
+                zc->enabled = 0;
+            }
+            gsockZeroCopyComplete_priv( zc, serr->ee_info, serr->ee_data );
+        }
+    }
+}
+
+// Waits for notifications to arrive. 0 - something arrived, 1 - timeout, -1 - error.
+static int gsockZeroCopyWait_priv(struct GSockZeroCopy_d* zc, long millisec)
+{
+    // No events: the error queue wakes poll() up with POLLERR by itself.
+    if( gfiber_current() ){
+        char res = gfiber_waitFD( zc->sock, 0, millisec );
+        return (res < 0 ? -1 : res);
+    }
+    struct pollfd pfd = { zc->sock, 0, 0 };
+    int res = poll( &pfd, 1, (int)millisec );
+    if(res < 0)
+        return (errno == EINTR ? 0 : -1);
+    return (res > 0 ? 0 : 1);
+}
+
+static char gsockZeroCopyReserve_priv(struct GSockZeroCopy_d* zc)
+{
+    if(zc->recCount == zc->recCapacity){
+        size_t cap = (zc->recCapacity ? zc->recCapacity * 2 : 16);
+        struct GSockZeroCopyRecord_priv* arr = realloc( zc->recs, cap * sizeof(struct GSockZeroCopyRecord_priv) );
+        if(!arr){
+            hlogError("gsockZeroCopy: ERROR on realloc() of records.\n");
+            return -1;
+        }
+        zc->recs = arr;
+        zc->recCapacity = cap;
+    }
+    return 0;
+}
+
+// Sends with MSG_ZEROCOPY. Returns 0 - sent, 1 - nothing was sent zero-copy (send the plain way), -1 - error.
+static int gsockZeroCopySend_priv(struct GSockZeroCopy_d* zc, const char* buff, size_t len, int flags,
+                                  void (*onDone)(const void*, void*), void* userData)
+{
+    if( gsockZeroCopyReap_priv( zc ) != 0 )
+        return -1;
+    // The record slot is taken beforehand, so a sent buffer can always be tracked.
+    if( !zc->enabled || gsockZeroCopyReserve_priv( zc ) != 0 )
+        return 1;
+
+    struct GSockZeroCopyRecord_priv* cur = &(zc->current);
+    cur->buff = buff;
+    cur->onDone = onDone;
+    cur->userData = userData;
+    cur->firstSeq = zc->nextSeq;
+    cur->lastSeq = zc->nextSeq - 1;
+    cur->remaining = 0;
+    zc->sending = 1;
+
+    char inFiber = ( !(flags & MSG_DONTWAIT) && gfiber_current() );
+    size_t off = 0;
+    int retval = 0;
+
+    while(off < len)
+    {
+        ssize_t n = send( zc->sock, buff + off, len - off, flags | MSG_ZEROCOPY | (inFiber ? MSG_DONTWAIT : 0) );
+        if(n >= 0){
+            off += (size_t)n;
+            cur->lastSeq = (zc->nextSeq)++;
+            cur->remaining++;
+            continue;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            if( gsockWaitReady_priv( zc->sock, 1, -1 ) < 0 ){
+                retval = -1;
+                break;
+            }
+            continue;
+        }
+        if(errno == ENOBUFS){
+            // Out of option memory for the notifications. Wait for some, unless none can come.
+            if(zc->recCount == 0 && cur->lastSeq + 1 == cur->firstSeq){
+                retval = 1;
+                break;
+            }
+            if( gsockZeroCopyWait_priv( zc, GSOCK_ZEROCOPY_NOBUFS_WAIT ) < 0 ||
+                gsockZeroCopyReap_priv( zc ) != 0 ){
+                retval = -1;
+                break;
+            }
+            continue;
+        }
+        hlogError("gsockZeroCopy: ERROR on send(MSG_ZEROCOPY) : %s\n", strerror(errno));
+        retval = -1;
+        break;
+    }
+    zc->sending = 0;
+
+    // Nothing sent - nothing to track.
+    if(cur->lastSeq + 1 == cur->firstSeq)
+        return retval;
+
+    // The kernel holds on to the pages of everything sent - even when failing midway.
+    zc->stats.zeroCopySends++;
+    if(cur->remaining)
+        zc->recs[ (zc->recCount)++ ] = *cur;
+    else if(onDone)
+        onDone( buff, userData );
+
+    return (retval > 0 ? 0 : retval);
+}
+
+#endif // GSOCK_ZEROCOPY_PRIV
+
+int gsockZeroCopy_send(GSockZeroCopy zc, const void* buff, size_t len, int flags,
+                       void (*onDone)(const void* buff, void* userData), void* userData)
+{
+    if(!zc || (!buff && len))
+        return -1;
+
+    #if defined GSOCK_ZEROCOPY_PRIV
+        if(len >= zc->threshold){
+            int res = gsockZeroCopySend_priv( zc, (const char*)buff, len, flags, onDone, userData );
+            if(res <= 0)
+                return res;
+        }
+    #endif
+
+    zc->stats.plainSends++;
+    int res = gsockSendAll( zc->sock, (const char*)buff, len, flags );
+    if(onDone)
+        onDone( buff, userData );
+    return res;
+}
+
+int gsockZeroCopy_poll(GSockZeroCopy zc, long millisec)
+{
+    if(!zc)
+        return -1;
+    #if defined GSOCK_ZEROCOPY_PRIV
+        if( gsockZeroCopyReap_priv( zc ) != 0 )
+            return -1;
+        if(zc->recCount && millisec != 0){
+            if( gsockZeroCopyWait_priv( zc, millisec ) < 0 || gsockZeroCopyReap_priv( zc ) != 0 )
+                return -1;
+        }
+    #endif
+    return (int)zc->recCount;
+}
+
+int gsockZeroCopy_flush(GSockZeroCopy zc, long millisec)
+{
+    if(!zc)
+        return -1;
+    #if defined GSOCK_ZEROCOPY_PRIV
+        long long deadline = (millisec >= 0 ? gsockNowMs_priv() + millisec : -1);
+        while(1){
+            if( gsockZeroCopyReap_priv( zc ) != 0 )
+                return -1;
+            if(!zc->recCount)
+                break;
+
+            long long left = (deadline >= 0 ? deadline - gsockNowMs_priv() : -1);
+            if(deadline >= 0 && left <= 0)
+                return 1;
+            if( gsockZeroCopyWait_priv( zc, (long)left ) < 0 )
+                return -1;
+        }
+    #endif
+    return 0;
+}
+
+void gsockZeroCopy_destroy(GSockZeroCopy* zc)
+{
+    if(!zc || !*zc) return;
+
+    if( gsockZeroCopy_flush( *zc, GSOCK_ZEROCOPY_DESTROY_WAIT ) != 0 ){
+        // The kernel may still read these, so their owners are never told they're free.
+        hlogWarn("gsockZeroCopy_destroy(): %d buffers on sock %d never completed, leaking them.\n",
+                 (int)((*zc)->recCount), (int)((*zc)->sock));
+    }
+    free( (*zc)->recs );
+    free( *zc );
+    *zc = NULL;
+}
+
+
+//--------------- Line-framed reader ---------------//
+
+struct GSockLineReader_d
+{
+    SOCKET sock;
+    char* buf;
+    size_t start;   // Unread data is buf[start, end).
+    size_t end;
+    size_t cap;     // One byte is always kept free, for the terminating null.
+    size_t maxCap;
+    char heldByte;  // The byte the last reply's null went over, put back on the next call.
+    char holding;
+};
+
+static void gsockLineReaderRestore_priv(struct GSockLineReader_d* rd)
+{
+    if(rd->holding){
+        rd->buf[ rd->start ] = rd->heldByte;
+        rd->holding = 0;
+    }
+}
+
+GSockLineReader gsockLineReader_create(SOCKET sock, size_t maxSize)
+{
+    struct GSockLineReader_d* rd = calloc( 1, sizeof(struct GSockLineReader_d) );
+    if(!maxSize)
+        maxSize = GSOCK_LINEREADER_MAX_SIZE;
+    size_t cap = (maxSize < GSOCK_LINEREADER_INITIAL_SIZE ? maxSize : GSOCK_LINEREADER_INITIAL_SIZE);
+    if(!rd || cap < 2 || !(rd->buf = malloc( cap ))){
+        hlogError("gsockLineReader_create(): ERROR on allocation.\n");
+        free( rd );
+        return NULL;
+    }
+    rd->sock = sock;
+    rd->cap = cap;
+    rd->maxCap = maxSize;
+    return rd;
+}
+
+void gsockLineReader_destroy(GSockLineReader* rd)
+{
+    if(!rd || !*rd) return;
+    free( (*rd)->buf );
+    free( *rd );
+    *rd = NULL;
+}
+
+SOCKET gsockLineReader_getSocket(GSockLineReader rd)
+{
+    return (rd ? rd->sock : INVALID_SOCKET);
+}
+
+char gsockLineReader_hasLine(GSockLineReader rd)
+{
+    if(!rd) return 0;
+    gsockLineReaderRestore_priv( rd );
+    return (memchr( rd->buf + rd->start, '\n', rd->end - rd->start ) != NULL);
+}
+
+/* Receives more data into the buffer, waiting until the deadline (< 0 - none).
+ * Returns 0 - try parsing again, 1 - timeout, 2 - peer closed, 3 - buffer full, -1 - error.
+ */
+static int gsockLineReaderFill_priv(struct GSockLineReader_d* rd, long long deadline)
+{
+    if(rd->end + 1 >= rd->cap){
+        if(rd->start){
+            memmove( rd->buf, rd->buf + rd->start, rd->end - rd->start );
+            rd->end -= rd->start;
+            rd->start = 0;
+        }
+        else if(rd->cap < rd->maxCap){
+            size_t cap = (rd->cap * 2 < rd->maxCap ? rd->cap * 2 : rd->maxCap);
+            char* buf = realloc( rd->buf, cap );
+            if(!buf){
+                hlogError("gsockLineReader: ERROR on realloc().\n");
+                return -1;
+            }
+            rd->buf = buf;
+            rd->cap = cap;
+        }
+        else
+            return 3;
+    }
+
+    long long left = (deadline >= 0 ? deadline - gsockNowMs_priv() : -1);
+    int ready = gsockWaitReady_priv( rd->sock, 0, (deadline >= 0 ? (left > 0 ? (long)left : 0) : -1) );
+    if(ready != 0)
+        return ready;
+
+    #if defined MSG_DONTWAIT
+        int n = gsockReceive( rd->sock, rd->buf + rd->end, rd->cap - 1 - rd->end, MSG_DONTWAIT );
+    #else
+        int n = gsockReceive( rd->sock, rd->buf + rd->end, rd->cap - 1 - rd->end, 0 );
+    #endif
+    if(n < 0){
+        int err = gsockGetLastError();
+        #if defined _GRYLTOOL_WIN32
+            if(err == WSAEWOULDBLOCK)
+                return 0;
+        #else
+            if(err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+                return 0;
+        #endif
+        hlogDebug("gsockLineReader: ERROR on recv : %d\n", err);
+        return -1;
+    }
+    if(n == 0)
+        return 2;
+    rd->end += (size_t)n;
+    return 0;
+}
+
+int gsockLineReader_readLine(GSockLineReader rd, char** line, size_t* len, long millisec)
+{
+    if(!rd || !line) return -1;
+    gsockLineReaderRestore_priv( rd );
+    long long deadline = (millisec >= 0 ? gsockNowMs_priv() + millisec : -1);
+
+    while(1)
+    {
+        char* data = rd->buf + rd->start;
+        char* nl = memchr( data, '\n', rd->end - rd->start );
+        int res = (nl ? 0 : gsockLineReaderFill_priv( rd, deadline ));
+
+        if(nl || res == 3){
+            // A line longer than the buffer is returned in pieces.
+            size_t lineLen = (nl ? (size_t)(nl - data) : rd->end - rd->start);
+            rd->start += lineLen + (nl ? 1 : 0);
+            if(nl && lineLen && data[ lineLen - 1 ] == '\r')
+                lineLen--;
+            data[ lineLen ] = 0;
+
+            *line = data;
+            if(len)
+                *len = lineLen;
+            return 0;
+        }
+        if(res != 0)
+            return res;
+    }
+}
+
+/* Finds the end of the FTP reply at the start of data.
+ * Returns 1 and sets code & replyLen if the whole reply is there, 0 if not.
+ */
+static char gsockReplyEnd_priv(const char* data, size_t len, int* code, size_t* replyLen)
+{
+    const char* nl = memchr( data, '\n', len );
+    if(!nl) return 0;
+
+    // Not a "NNN" reply line - it's a reply of its own, with code 0.
+    int c = 0;
+    if(nl - data >= 3 && isdigit((unsigned char)data[0]) && isdigit((unsigned char)data[1]) &&
+       isdigit((unsigned char)data[2]))
+        c = (data[0] - '0') * 100 + (data[1] - '0') * 10 + (data[2] - '0');
+
+    // Multi-line: "NNN-" ... until a line starting with the same "NNN ".
+    if(c && nl - data > 3 && data[3] == '-'){
+        const char* p = nl + 1;
+        while( (nl = memchr( p, '\n', (size_t)(data + len - p) )) != NULL ){
+            if(nl - p >= 3 && memcmp( p, data, 3 ) == 0 && (p[3] == ' ' || p[3] == '\r' || p[3] == '\n'))
+                break;
+            p = nl + 1;
+        }
+        if(!nl) return 0;
+    }
+
+    *code = c;
+    *replyLen = (size_t)(nl - data) + 1;
+    return 1;
+}
+
+int gsockLineReader_readReply(GSockLineReader rd, char** reply, size_t* len, int* code, long millisec)
+{
+    if(!rd || !reply) return -1;
+    gsockLineReaderRestore_priv( rd );
+    long long deadline = (millisec >= 0 ? gsockNowMs_priv() + millisec : -1);
+
+    while(1)
+    {
+        int replyCode;
+        size_t replyLen;
+        char* data = rd->buf + rd->start;
+
+        // The reply stays in the buffer until it's complete, so a timeout loses nothing.
+        if( gsockReplyEnd_priv( data, rd->end - rd->start, &replyCode, &replyLen ) ){
+            rd->start += replyLen;
+            rd->heldByte = data[ replyLen ];
+            rd->holding = 1;
+            data[ replyLen ] = 0;
+            *reply = data;
+            if(len)
+                *len = replyLen;
+            if(code)
+                *code = replyCode;
+            return 0;
+        }
+
+        int res = gsockLineReaderFill_priv( rd, deadline );
+        if(res == 3){
+            hlogError("gsockLineReader_readReply(): reply on sock %d is longer than %d bytes.\n",
+                      (int)rd->sock, (int)rd->maxCap);
+            return -1;
+        }
+        if(res != 0)
+            return res;
+    }
+}
 
@@ -29,6 +29,8 @@
 
 #endif // __linux__ || __WIN32
 
+#include "grylthread.h"
+
 #define GSOCK_DEFAULT_BUFLEN 1500
 
 /*! The socket data structure
@@ -43,6 +45,90 @@ typedef struct
     short checksum;
 } GSOCKSocketStruct;
 
+/*! Socket options
+ *  - Flags are the on/off options to set when a socket is created (the flags argument of
+ *    gsockConnectSocket()/gsockListenSocket()). GSockOptions adds the sized ones.
+ *    Options which must be set before bind()/connect() (REUSEADDR, REUSEPORT, V6ONLY, buffer
+ *    sizes) are set right after socket(). NONBLOCK is set after connect() completes.
+ *  - gsockSetOption()/gsockGetOption() work on any socket, at any time.
+ *    Return 0 on success, 1 if the option isn't supported on this platform, -1 on error.
+ *  - Values: booleans are 0/1, buffer sizes in bytes, keepalive times in seconds,
+ *    USER_TIMEOUT in milliseconds. Linux reports buffer sizes doubled (with its bookkeeping).
+ *  - FASTOPEN (TCP Fast Open) means different things on the two ends. A listener takes data in
+ *    the SYN (FASTOPEN is its queue length for those). A connecting socket gets FASTOPEN_CONNECT:
+ *    connect() returns at once, and the SYN goes out with the first send(), carrying its data
+ *    once the server's cookie is cached. Connect errors show up on that send().
+ *    Use it only where the client speaks first - the handshake waits for the send().
+ *    Needs kernel support (Linux net.ipv4.tcp_fastopen: 1 - client, 2 - server).
+ */
+#define GSOCK_FLAG_NONBLOCK    1
+#define GSOCK_FLAG_NODELAY     2
+#define GSOCK_FLAG_CORK        4
+#define GSOCK_FLAG_KEEPALIVE   8
+#define GSOCK_FLAG_REUSEADDR   16
+#define GSOCK_FLAG_REUSEPORT   32
+#define GSOCK_FLAG_V6ONLY      64
+#define GSOCK_FLAG_FASTOPEN    128
+
+#define GSOCK_OPT_NONBLOCK      1
+#define GSOCK_OPT_NODELAY       2
+#define GSOCK_OPT_CORK          3  // Linux TCP_CORK, TCP_NOPUSH on BSDs.
+#define GSOCK_OPT_KEEPALIVE     4
+#define GSOCK_OPT_REUSEADDR     5
+#define GSOCK_OPT_REUSEPORT     6
+#define GSOCK_OPT_V6ONLY        7
+#define GSOCK_OPT_SNDBUF        8
+#define GSOCK_OPT_RCVBUF        9
+#define GSOCK_OPT_KEEPIDLE      10
+#define GSOCK_OPT_KEEPINTVL     11
+#define GSOCK_OPT_KEEPCNT       12
+#define GSOCK_OPT_USER_TIMEOUT  13
+#define GSOCK_OPT_FASTOPEN      14 // Listeners. Queue length, 0 - off.
+#define GSOCK_OPT_FASTOPEN_CONNECT  15
+
+#define GSOCK_FASTOPEN_DEFAULT_QUEUE  16
+
+// Zero fields keep the system defaults. Keepalive fields imply GSOCK_FLAG_KEEPALIVE.
+// connectTimeout (ms) bounds the whole gsockConnectSocketEx() call, all addresses included.
+typedef struct
+{
+    int flags;        // GSOCK_FLAG_*
+    int connectTimeout;
+    int sendBufSize;
+    int recvBufSize;
+    int keepIdle;
+    int keepInterval;
+    int keepCount;
+    int userTimeout;
+    int fastOpenQueue; // Listeners with GSOCK_FLAG_FASTOPEN. 0 - GSOCK_FASTOPEN_DEFAULT_QUEUE.
+} GSockOptions;
+
+int gsockSetOption(SOCKET sock, int option, int value);
+int gsockGetOption(SOCKET sock, int option, int* value);
+int gsockApplyOptions(SOCKET sock, const GSockOptions* opts);
+
+/*! Resolver
+ *  - gsockResolve() is getaddrinfo() with a cache. Returns 0 or an EAI_* code (see gai_strerror()).
+ *    Free the list with gsockFreeAddrInfo(), not freeaddrinfo().
+ *  - Literal IPv4/IPv6 addresses with numeric ports are converted without a resolver call.
+ *  - Answers are cached for the TTL, "no such name" answers for the negative TTL.
+ *    Temporary failures aren't cached. TTL 0 disables that kind of caching.
+ *  - gsockResolveAsync() resolves on pool (NULL - an internal pool, created on first use).
+ *    The future's result is the struct addrinfo* list, or NULL on failure.
+ */
+#define GSOCK_RESOLVE_CACHE_SIZE     64
+#define GSOCK_RESOLVE_MAX_HOST       256
+#define GSOCK_RESOLVE_DEFAULT_TTL    60000 // ms
+#define GSOCK_RESOLVE_NEGATIVE_TTL   5000  // ms
+#define GSOCK_RESOLVE_ASYNC_WORKERS  2
+
+int gsockResolve(const char* host, const char* port, int family, int socktype, int protocol, struct addrinfo** result);
+void gsockFreeAddrInfo(struct addrinfo* ai);
+GrFuture gsockResolveAsync(GrThreadPool pool, const char* host, const char* port, int family, int socktype, int protocol);
+
+void gsockResolveCache_setTTL(long ttlMillis, long negativeTtlMillis);
+void gsockResolveCache_clear();
+
 int gsockGetLastError();
 int gsockInitSocks();
 int gsockErrorCleanup(SOCKET sock, struct addrinfo* addrin, const char* msg, char cleanupEverything, int retval);
@@ -52,7 +138,125 @@ void gsockSockCleanup();
 SOCKET gsockConnectSocket(const char* address, const char* port, int family, int socktype, int protocol, int flags);
 SOCKET gsockListenSocket(int port, const char* localBindAddr, int family, int socktype, int protocol, int flags);
 
+/*! Connects to the first address of the host which answers.
+ *  Addresses are raced RFC 8305 style: non-blocking connects, started GSOCK_CONNECT_ATTEMPT_DELAY ms
+ *  apart and alternating IPv6/IPv4, so a dead address doesn't stall the connect for a full TCP timeout.
+ */
+#define GSOCK_CONNECT_ATTEMPT_DELAY  250
+
+// The same, with full options. opts may be NULL.
+SOCKET gsockConnectSocketEx(const char* address, const char* port, int family, int socktype, int protocol, const GSockOptions* opts);
+SOCKET gsockListenSocketEx(int port, const char* localBindAddr, int family, int socktype, int protocol, const GSockOptions* opts);
+
+/*! Unix domain sockets (POSIX)
+ *  - Addresses "unix:/path" (or "unix:@name", Linux' abstract namespace) make
+ *    gsockConnectSocket() (address) and gsockListenSocket() (localBindAddr) use AF_UNIX.
+ *    The port and family are ignored, and so are the TCP-only options.
+ *  - A listener replaces a socket file left behind by a dead server, but not one which
+ *    someone still accepts on. The file isn't removed when the socket is closed.
+ *  - gsockSendFd()/gsockReceiveFd() pass an open descriptor with SCM_RIGHTS, so a local peer
+ *    can read a file itself instead of getting its bytes copied through the socket.
+ *    At least 1 byte of data must go with it. Both return bytes moved, like send()/recv().
+ *    *fd is -1 if no descriptor came. The received descriptor is the caller's to close.
+ */
+#define GSOCK_UNIX_PREFIX  "unix:"
+
+char gsockIsUnixAddress(const char* address);
+int gsockSendFd(SOCKET sock, int fd, const char* data, size_t len, int flags);
+int gsockReceiveFd(SOCKET sock, int* fd, char* buff, size_t bufsize, int flags);
+
 int gsockReceive(SOCKET sock, char* buff, size_t bufsize, int flags);
 int gsockSend(SOCKET sock, const char* buff, size_t bufsize, int flags); 
 
+/*! Scatter-gather and full-length I/O
+ *  - Sendv/Recvv do a single sendmsg()/recvmsg() (WSASend()/WSARecv()) over all the buffers, so a
+ *    header and its payload go out in one syscall. They return the bytes moved, or < 0, like send()/recv().
+ *  - The *All functions loop until everything is moved. They return 0 on success, 1 on timeout,
+ *    2 if the peer closed the connection first (receiving), -1 on error.
+ *  - The _time versions bound the whole call by millisec (< 0 - no limit), and store the bytes moved
+ *    to done (may be NULL). The vector versions advance bufs as they go.
+ *  - Inside a fiber, all waits park the fiber.
+ */
+typedef struct
+{
+    void* base;
+    size_t len;
+} GSockBuf; // The same layout as struct iovec on POSIX.
+
+int gsockSendv(SOCKET sock, const GSockBuf* bufs, int count, int flags);
+int gsockRecvv(SOCKET sock, const GSockBuf* bufs, int count, int flags);
+
+int gsockSendAll(SOCKET sock, const char* buff, size_t len, int flags);
+int gsockReceiveAll(SOCKET sock, char* buff, size_t len, int flags);
+int gsockSendvAll(SOCKET sock, GSockBuf* bufs, int count, int flags);
+
+int gsockSendAll_time(SOCKET sock, const char* buff, size_t len, int flags, long millisec, size_t* done);
+int gsockReceiveAll_time(SOCKET sock, char* buff, size_t len, int flags, long millisec, size_t* done);
+int gsockSendvAll_time(SOCKET sock, GSockBuf* bufs, int count, int flags, long millisec, size_t* done);
+
+/*! Zero-copy sends (Linux MSG_ZEROCOPY), for big payloads already in memory.
+ *  - The kernel sends straight from the caller's pages, so the buffer must stay untouched until
+ *    onDone(buff, userData) is called. It's called from _send(), _poll(), _flush() or _destroy(),
+ *    on the caller's thread.
+ *  - Buffers under the threshold, and all of them where zerocopy isn't supported, are sent the
+ *    plain way, and released right away. When the kernel reports it had to copy anyway (e.g.
+ *    loopback), zerocopy is turned off for the socket.
+ *  - One tracker per socket, created before any zero-copy send, and used by one thread.
+ *    _send() returns 0 or -1. _poll() releases the completed buffers, waiting up to millisec
+ *    for some if any are pending, and returns how many are still pending, or -1.
+ *    _flush() waits for all of them: 0 - done, 1 - timeout, -1 - error.
+ *  - _destroy() flushes for up to GSOCK_ZEROCOPY_DESTROY_WAIT ms. It doesn't close the socket.
+ */
+#define GSOCK_ZEROCOPY_THRESHOLD     (16 * 1024)  // Under ~10 KB the page pinning costs more than a copy.
+#define GSOCK_ZEROCOPY_NOBUFS_WAIT   10           // ms to wait for completions when out of option memory.
+#define GSOCK_ZEROCOPY_DESTROY_WAIT  5000         // ms
+
+typedef struct GSockZeroCopy_d* GSockZeroCopy;
+
+typedef struct
+{
+    char enabled;
+    unsigned long zeroCopySends;     // Buffers sent with MSG_ZEROCOPY.
+    unsigned long plainSends;        // Buffers sent the plain way.
+    unsigned long copiedCompletions; // MSG_ZEROCOPY sends the kernel copied anyway.
+    size_t pending;                  // Buffers not released yet.
+} GSockZeroCopyStats;
+
+GSockZeroCopy gsockZeroCopy_create(SOCKET sock);
+void gsockZeroCopy_destroy(GSockZeroCopy* zc);
+void gsockZeroCopy_setThreshold(GSockZeroCopy zc, size_t minSize);
+void gsockZeroCopy_getStats(GSockZeroCopy zc, GSockZeroCopyStats* stats);
+
+int gsockZeroCopy_send(GSockZeroCopy zc, const void* buff, size_t len, int flags,
+                       void (*onDone)(const void* buff, void* userData), void* userData);
+int gsockZeroCopy_poll(GSockZeroCopy zc, long millisec);
+int gsockZeroCopy_flush(GSockZeroCopy zc, long millisec);
+
+/*! Line-framed reader, for text protocol control connections.
+ *  - Owns a receive buffer for the socket, and hands out whole lines and whole FTP replies as
+ *    soon as they're in - no waiting for the sender to go quiet. Once a reader is used, all
+ *    reads from the socket must go through it, as it may hold data already received.
+ *  - readLine(): a line without its CRLF (a bare LF ends a line too), null-terminated.
+ *    Lines longer than the buffer are returned in pieces.
+ *  - readReply(): a whole FTP reply with its line ends - one line, or "NNN-" lines up to the
+ *    closing "NNN " one. code gets NNN, or 0 if the reply doesn't start with a code.
+ *  - The returned pointers point into the reader's buffer, valid until its next call.
+ *  - millisec bounds the whole call (< 0 - no limit, 0 - only what can be read now).
+ *    Returns 0 on success, 1 on timeout, 2 if the peer closed the connection, -1 on error.
+ *    On timeout no data is lost: a partial line or reply stays buffered for the next call.
+ *  - The buffer grows up to maxSize (0 - GSOCK_LINEREADER_MAX_SIZE), which is also the longest reply.
+ */
+#define GSOCK_LINEREADER_INITIAL_SIZE  4096
+#define GSOCK_LINEREADER_MAX_SIZE      (256 * 1024)
+
+typedef struct GSockLineReader_d* GSockLineReader;
+
+GSockLineReader gsockLineReader_create(SOCKET sock, size_t maxSize);
+void gsockLineReader_destroy(GSockLineReader* rd); // Doesn't close the socket.
+SOCKET gsockLineReader_getSocket(GSockLineReader rd);
+char gsockLineReader_hasLine(GSockLineReader rd);
+
+int gsockLineReader_readLine(GSockLineReader rd, char** line, size_t* len, long millisec);
+int gsockLineReader_readReply(GSockLineReader rd, char** reply, size_t* len, int* code, long millisec);
+
 #endif
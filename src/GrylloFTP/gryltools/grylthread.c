@@ -1,4 +1,12 @@
+#define HLOG_MODULE HLOG_MOD_THREAD
+
+// For the pthread affinity and naming extensions, and sched_getcpu().
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
 #include "grylthread.h"
+#include "gatomic.h"
 #include "systemcheck.h"
 
 // Include OS-specific needed headers
@@ -7,6 +15,8 @@
     // Windows Vista (0x0600) - required for full functionality.
     #define _WIN32_WINNT 0x0600 
 
+    // Winsock before windows.h - GrEvent uses a socket, to be selectable.
+    #include <winsock2.h>
     #include <windows.h>
     #include <WinBase.h>
 
@@ -18,19 +28,26 @@
     #include <errno.h>
     #include <signal.h>
     #include <pthread.h>
+    #include <sched.h>
+    #include <time.h>
+    #include <limits.h>
+    #include <fcntl.h>
+    #include <poll.h>
+
+    #if defined __linux__
+        #include <sys/eventfd.h>
+        #define GTHREAD_HAVE_EVENTFD  1
+        #include <linux/futex.h>
+        #define GTHREAD_HAVE_FUTEX  1
+        #define GTHREAD_HAVE_AFFINITY  1
+    #endif
 
-    // TODO: Set the Error if some headers are unavailable
-    // NOt really working.
-	#ifdef SYS_gettid
-		//pid_t tid = syscall(SYS_gettid);
-	#else
-		//#error "SYS_gettid unavailable on this system"
-	#endif 
 
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include "hlog.h"
 
@@ -82,16 +99,20 @@ struct ThreadHandlePriv
         pthread_t tid;
         pthread_attr_t attribs;
     #endif
-    volatile char flags;
-    volatile long threadID;
+    char flags;     // Written under flagtex, read with gatomic.
+    long threadID;
     GrMutex flagtex; // Thread-Safety guarantee'd.
 };
 
+#define GTHREAD_NAME_LEN  16
+
 struct ThreadFuncAttribs
 {
 	void (*proc)(void*);
 	void* param;
     struct ThreadHandlePriv* threadInfo;
+    char name[ GTHREAD_NAME_LEN ]; // Set by the new thread itself.
+    int lateSchedPolicy; // Policies pthread attribs can't set - the thread sets them. -1 if none.
 };
 
 
@@ -122,7 +143,7 @@ void pEndFlagSetProc( void* param )
     // Set the flag to InActive, protected by Mutex.
     gthread_Mutex_lock( attrs->threadInfo->flagtex );
 
-    (attrs->threadInfo->flags) &= ~GRYLTHREAD_FLAG_ACTIVE;
+    gatomic_fetchAnd( &(attrs->threadInfo->flags), ~GRYLTHREAD_FLAG_ACTIVE, GATOMIC_RELEASE );
 
     gthread_Mutex_unlock( attrs->threadInfo->flagtex );
 
@@ -140,11 +161,19 @@ void* pThreadProc( void* param )
 
     // Set the thread-specific variables, with thread-safety.
     gthread_Mutex_lock( attrs->threadInfo->flagtex );
-    // TODO: Now substiture GetTid() wiith GetPid, because the gettid() is not available in most systems.
-    attrs->threadInfo->threadID = (long)/*gettid()*/ getpid();
+    gatomic_store( &(attrs->threadInfo->threadID), gthread_Thread_getID( NULL ), GATOMIC_RELEASE );
 
     gthread_Mutex_unlock( attrs->threadInfo->flagtex );
 
+    if(attrs->name[0])
+        gthread_Thread_setName( NULL, attrs->name );
+    if(attrs->lateSchedPolicy >= 0){
+        struct sched_param sp = { 0 };
+        int res = pthread_setschedparam( pthread_self(), attrs->lateSchedPolicy, &sp );
+        if(res != 0)
+            hlogError("gthread: ERROR on pthread_setschedparam(%d) : %s\n", attrs->lateSchedPolicy, strerror(res));
+    }
+
     // Actually invoke the procedure.
     attrs->proc( attrs->param );
 
@@ -162,17 +191,57 @@ static void gthread_Thread_terminate_priv( struct ThreadHandlePriv* pv );
 // API Public funcs
 
 GrThread gthread_Thread_create(void (*proc)(void*), void* param)
+{
+    return gthread_Thread_createEx( proc, param, NULL );
+}
+
+// Win32 priorities closest to the scheduling policies.
+#if defined _GRYLTOOL_WIN32
+static int gthread_Thread_win32Priority_priv(int policy)
+{
+    switch(policy){
+        case GTHREAD_SCHED_BATCH: return THREAD_PRIORITY_BELOW_NORMAL;
+        case GTHREAD_SCHED_IDLE:  return THREAD_PRIORITY_IDLE;
+        case GTHREAD_SCHED_FIFO:
+        case GTHREAD_SCHED_RR:    return THREAD_PRIORITY_TIME_CRITICAL;
+    }
+    return THREAD_PRIORITY_NORMAL;
+}
+#elif defined _GRYLTOOL_POSIX
+static int gthread_Thread_posixPolicy_priv(int policy)
+{
+    switch(policy){
+        #if defined SCHED_BATCH
+        case GTHREAD_SCHED_BATCH: return SCHED_BATCH;
+        #endif
+        #if defined SCHED_IDLE
+        case GTHREAD_SCHED_IDLE:  return SCHED_IDLE;
+        #endif
+        case GTHREAD_SCHED_FIFO:  return SCHED_FIFO;
+        case GTHREAD_SCHED_RR:    return SCHED_RR;
+    }
+    return SCHED_OTHER;
+}
+#endif
+
+GrThread gthread_Thread_createEx(void (*proc)(void*), void* param, const GrThreadAttribs* tattr)
 {
     struct ThreadHandlePriv* thread_id = calloc( 1, sizeof(struct ThreadHandlePriv) );
     struct ThreadFuncAttribs* attr = malloc( sizeof(struct ThreadFuncAttribs) );
     if(!thread_id || !attr){
-        hlogf("gthread: ERROR on malloc()...\n");
+        hlogError("gthread: ERROR on malloc()...\n");
         return NULL;
     }
 
 	attr->proc = proc;
     attr->param = param;
     attr->threadInfo = thread_id;
+    attr->name[0] = 0;
+    attr->lateSchedPolicy = -1;
+    if(tattr && tattr->name){
+        strncpy( attr->name, tattr->name, GTHREAD_NAME_LEN - 1 );
+        attr->name[ GTHREAD_NAME_LEN - 1 ] = 0;
+    }
 
     // Set the "active" flag on thread.	If error occurs on creation, this memory will just be "free'd"
     thread_id->flags |= GRYLTHREAD_FLAG_ACTIVE;	
@@ -182,26 +251,70 @@ GrThread gthread_Thread_create(void (*proc)(void*), void* param)
     int errr = 0;
     // OS-specific code
     #if defined _GRYLTOOL_WIN32
-        HANDLE h = CreateThread(NULL, 0, ThreadProc, (void*)attr, 0, NULL);
-        if(h)
+        // Start suspended, so attributes apply before the proc runs.
+        HANDLE h = CreateThread(NULL, (tattr ? tattr->stackSize : 0), ThreadProc, (void*)attr, 
+                                (tattr ? CREATE_SUSPENDED : 0), NULL);
+        if(h){
             thread_id->hThread = h;
+            if(tattr){
+                if(tattr->schedPolicy != GTHREAD_SCHED_DEFAULT)
+                    SetThreadPriority( h, gthread_Thread_win32Priority_priv( tattr->schedPolicy ) );
+                if(gthread_CPUSet_count( &(tattr->cpus) ) > 0)
+                    gthread_Thread_setAffinity( (GrThread)thread_id, &(tattr->cpus) );
+                ResumeThread( h );
+            }
+        }
         else{ // h == NULL, error occured.
-            hlogf("gthread: ERROR when creating Win32 thread: 0x%0x\n", GetLastError());
+            hlogError("gthread: ERROR when creating Win32 thread: 0x%0x\n", GetLastError());
             errr = 1;
         }
 
     #elif defined _GRYLTOOL_POSIX
-        // Create with the DeFaUlt attribs
         pthread_attr_init( &(thread_id->attribs) );
-        int res = pthread_create( &(thread_id->tid), &(thread_id->attribs), pThreadProc, (void*)attr );
+        int res = 0;
+        if(tattr){
+            if(tattr->stackSize && (res = pthread_attr_setstacksize( &(thread_id->attribs), tattr->stackSize )) != 0)
+                hlogError("gthread: ERROR on pthread_attr_setstacksize(%zu) : %s\n", tattr->stackSize, strerror(res));
+
+            if(!res && tattr->schedPolicy != GTHREAD_SCHED_DEFAULT){
+                struct sched_param sp = { 0 };
+                int policy = gthread_Thread_posixPolicy_priv( tattr->schedPolicy );
+                if(policy == SCHED_FIFO || policy == SCHED_RR)
+                    sp.sched_priority = tattr->schedPriority;
+                else if(policy != SCHED_OTHER){
+                    // BATCH and IDLE are rejected by pthread_attr_setschedpolicy().
+                    attr->lateSchedPolicy = policy;
+                    policy = SCHED_OTHER;
+                }
+                if( (res = pthread_attr_setinheritsched( &(thread_id->attribs), PTHREAD_EXPLICIT_SCHED )) != 0 ||
+                    (res = pthread_attr_setschedpolicy( &(thread_id->attribs), policy )) != 0 ||
+                    (res = pthread_attr_setschedparam( &(thread_id->attribs), &sp )) != 0 )
+                    hlogError("gthread: ERROR setting the scheduling policy %d : %s\n", tattr->schedPolicy, strerror(res));
+            }
+
+            #if defined GTHREAD_HAVE_AFFINITY
+            if(!res && gthread_CPUSet_count( &(tattr->cpus) ) > 0){
+                cpu_set_t cs;
+                CPU_ZERO( &cs );
+                for(int i = 0; i < GTHREAD_MAX_CPUS && i < CPU_SETSIZE; i++)
+                    if(gthread_CPUSet_has( &(tattr->cpus), i ))
+                        CPU_SET( i, &cs );
+                if( (res = pthread_attr_setaffinity_np( &(thread_id->attribs), sizeof(cs), &cs )) != 0 )
+                    hlogError("gthread: ERROR on pthread_attr_setaffinity_np() : %s\n", strerror(res));
+            }
+            #endif
+        }
+
+        if( res == 0 && (res = pthread_create( &(thread_id->tid), &(thread_id->attribs), pThreadProc, (void*)attr )) != 0 )
+            hlogError("gthread: ERROR on pthread_create() : %s\n", strerror(res));
         if( res != 0 ){ // Error OccurEd.
-            hlogf("gthread: ERROR on pthread_create() : %d\n", res);
             errr = 1;
             pthread_attr_destroy( &(thread_id->attribs) );
         }
     #endif
 
     if( errr ){ // Error occured
+        gthread_Mutex_destroy( &(thread_id->flagtex) );
         free( thread_id );
         free( attr );
         return NULL;
@@ -213,7 +326,7 @@ GrThread gthread_Thread_create(void (*proc)(void*), void* param)
 void gthread_Thread_destroy(GrThread hnd)
 {
     struct ThreadHandlePriv* pv = (struct ThreadHandlePriv*)hnd;
-    hlogf("gthread Thread_destroy: thread addr: %p.\nLock mutex...", pv);
+    hlogDebug("gthread Thread_destroy: thread addr: %p.\nLock mutex...", pv);
     gthread_Mutex_lock( pv->flagtex );
 
     // If thread hasn't been joined (is still active) and hasn't been detached, terminate.
@@ -228,7 +341,7 @@ void gthread_Thread_destroy(GrThread hnd)
     #endif
 
     // Unlock and Destroy that mutex.
-    hlogf("gthread Thread_destroy: Success. Unlocking and destroying mutex...\n");
+    hlogDebug("gthread Thread_destroy: Success. Unlocking and destroying mutex...\n");
     gthread_Mutex_unlock( pv->flagtex );
     gthread_Mutex_destroy( &(pv->flagtex) );
 
@@ -239,7 +352,7 @@ void gthread_Thread_destroy(GrThread hnd)
 void gthread_Thread_join(GrThread hnd, char destroy)
 {
     struct ThreadHandlePriv* pv = (struct ThreadHandlePriv*)hnd;
-    hlogf("gthread Thread_join: Joining thread %p.\nLock mutex...\n", pv);
+    hlogDebug("gthread Thread_join: Joining thread %p.\nLock mutex...\n", pv);
     
     // Here we assume that thread is joinable and don't check.
     // It's programmer's responsibility to keep track of which threads are joinable, after all.
@@ -247,7 +360,7 @@ void gthread_Thread_join(GrThread hnd, char destroy)
         WaitForSingleObject( pv->hThread, INFINITE );
 
     #elif defined _GRYLTOOL_POSIX
-        hlogf("gthread Thread_join: calling pthread_join.\n");
+        hlogDebug("gthread Thread_join: calling pthread_join.\n");
         // We must unlock the mutex here because if we own the lock, and
         // target thread is still running, then deadlock would occur 
         // when the target executes a cleanup handler on termination, 
@@ -255,10 +368,10 @@ void gthread_Thread_join(GrThread hnd, char destroy)
         // UPDATE: But we don't even need locking on this function because we don't modify any flags.
         int res = pthread_join( pv->tid , NULL );
         if( res != 0 )
-            hlogf("gthread Thread_join: ERROR on pthread_join() : %s\n", strerror(res));
+            hlogError("gthread Thread_join: ERROR on pthread_join() : %s\n", strerror(res));
     #endif
 
-    hlogf("gthread Thread_join: Returning.\n\n");
+    hlogDebug("gthread Thread_join: Returning.\n\n");
     if(destroy)
         gthread_Thread_destroy( hnd );
 }
@@ -282,10 +395,10 @@ char gthread_Thread_isRunning(GrThread hnd)
                 if(status == STILL_ACTIVE)
                     retval = 1; // Still running!
                 else // Not running
-                    phnd->flags &= ~GRYLTHREAD_FLAG_ACTIVE; // Clear the active flag.
+                    gatomic_fetchAnd( &(phnd->flags), ~GRYLTHREAD_FLAG_ACTIVE, GATOMIC_RELEASE ); // Clear the active flag.
             }
             else // Error occured
-                hlogf("gthread: ERROR: GetExitCodeThread() failed: 0x%0x\n", GetLastError());
+                hlogError("gthread: ERROR: GetExitCodeThread() failed: 0x%0x\n", GetLastError());
 
         #elif defined _GRYLTOOL_POSIX
             // On POSIX, the GRYLTHREAD_FLAG_ACTIVE is automatically cleared by the
@@ -328,7 +441,7 @@ char gthread_Thread_isJoinable(GrThread hnd)
     gthread_Mutex_unlock( ((struct ThreadHandlePriv*)hnd)->flagtex );*/
     
     //TODO: Now we just use the flag. (If not detached --> joinable)
-    return !( (((struct ThreadHandlePriv*)hnd)->flags) & GRYLTHREAD_FLAG_DETACHED );
+    return !( gatomic_load( &(((struct ThreadHandlePriv*)hnd)->flags), GATOMIC_ACQUIRE ) & GRYLTHREAD_FLAG_DETACHED );
 }
 
 void gthread_Thread_detach(GrThread hnd)
@@ -341,9 +454,9 @@ void gthread_Thread_detach(GrThread hnd)
         #elif defined _GRYLTOOL_POSIX
             int res = pthread_detach( ((struct ThreadHandlePriv*)hnd)->tid ); 
             if( res != 0 )
-                hlogf("gthread: ERROR on pthread_detach() : %s\n", strerror(res));
+                hlogError("gthread: ERROR on pthread_detach() : %s\n", strerror(res));
         #endif
-        ((struct ThreadHandlePriv*)hnd)->flags |= GRYLTHREAD_FLAG_DETACHED; 
+        gatomic_fetchOr( &(((struct ThreadHandlePriv*)hnd)->flags), GRYLTHREAD_FLAG_DETACHED, GATOMIC_RELEASE );
     }
     gthread_Mutex_unlock( ((struct ThreadHandlePriv*)hnd)->flagtex );
 }
@@ -357,6 +470,10 @@ static void gthread_Thread_terminate_priv( struct ThreadHandlePriv* pv )
         // TODO: We should probably use pthread_kill(), after installing signal handler on the specified thread.
         // It is known that pthread_cancel() terminates thread only after thread calls a SysCall which is a
         // Cancellation Point. This should not work immediatly.
+        // If thread has already exited (and maybe been joined), tid is no longer valid.
+        if( !((pv->flags) & GRYLTHREAD_FLAG_ACTIVE) )
+            return;
+
         // Lock is acquired. So we must unlock to prevent deadlock in Cleanup Handlor
         gthread_Mutex_unlock( pv->flagtex );
         pthread_cancel( pv->tid );
@@ -365,7 +482,7 @@ static void gthread_Thread_terminate_priv( struct ThreadHandlePriv* pv )
         // After Cancellation we could join. Wait until the thread closes itself (it's optional).
     #endif
     // Set the activity flag to false.
-    (pv->flags) &= ~GRYLTHREAD_FLAG_ACTIVE;
+    gatomic_fetchAnd( &(pv->flags), ~GRYLTHREAD_FLAG_ACTIVE, GATOMIC_RELEASE );
 }
 
 void gthread_Thread_terminate(GrThread hnd)
@@ -392,10 +509,46 @@ void gthread_Thread_sleep(unsigned int millisecs)
     #if defined _GRYLTOOL_WIN32
         Sleep(millisecs);
     #elif defined _GRYLTOOL_POSIX
-        sleep(millisecs);
+        struct timespec tims;
+        tims.tv_sec = millisecs / 1000;
+        tims.tv_nsec = (millisecs % 1000) * 1000000L;
+        // Resume sleeping if interrupted by a signal.
+        while( nanosleep( &tims, &tims ) != 0 && errno == EINTR )
+            ;
     #endif
 }
 
+#if defined _GRYLTOOL_POSIX
+/* The kernel thread ID, cached per thread - it's a syscall.
+ * A forked child's only thread gets a new ID, so the cache is reset there.
+ */
+static __thread long gthread_cachedTid = 0;
+static pthread_once_t gthread_tidForkOnce = PTHREAD_ONCE_INIT;
+
+static void gthread_Thread_tidAtFork_priv()
+{
+    gthread_cachedTid = 0;
+}
+
+static void gthread_Thread_tidForkInit_priv()
+{
+    pthread_atfork( NULL, NULL, gthread_Thread_tidAtFork_priv );
+}
+
+static long gthread_Thread_currentTid_priv()
+{
+    if(!gthread_cachedTid){
+        pthread_once( &gthread_tidForkOnce, gthread_Thread_tidForkInit_priv );
+        #if defined SYS_gettid
+            gthread_cachedTid = (long)syscall( SYS_gettid );
+        #else
+            gthread_cachedTid = (long)getpid(); // No portable thread ID.
+        #endif
+    }
+    return gthread_cachedTid;
+}
+#endif
+
 long gthread_Thread_getID(GrThread hnd)
 {
     #if defined _GRYLTOOL_WIN32
@@ -405,9 +558,8 @@ long gthread_Thread_getID(GrThread hnd)
 
     #elif defined _GRYLTOOL_POSIX
         if(hnd) 
-            return (long)( ((struct ThreadHandlePriv*)hnd)->threadID );
-        // TODO: getTid() -- not really available in some systems.
-        return (long) /*gettid()*/ getpid(); // This actually returns a TID.
+            return gatomic_load( &(((struct ThreadHandlePriv*)hnd)->threadID), GATOMIC_ACQUIRE );
+        return gthread_Thread_currentTid_priv();
     #endif
     return 0;
 }
@@ -423,6 +575,338 @@ char gthread_Thread_equal(GrThread t1, GrThread t2)
     #endif
 }
 
+// Thread attributes, affinity and naming.
+
+void gthread_ThreadAttribs_init(GrThreadAttribs* attr)
+{
+    memset( attr, 0, sizeof(GrThreadAttribs) );
+}
+
+void gthread_CPUSet_clear(GrCPUSet* set)
+{
+    memset( set, 0, sizeof(GrCPUSet) );
+}
+
+#define GTHREAD_CPUSET_WORDBITS  (8 * sizeof(unsigned long))
+
+void gthread_CPUSet_add(GrCPUSet* set, int cpu)
+{
+    if(cpu >= 0 && cpu < GTHREAD_MAX_CPUS)
+        set->bits[ cpu / GTHREAD_CPUSET_WORDBITS ] |= 1UL << (cpu % GTHREAD_CPUSET_WORDBITS);
+}
+
+char gthread_CPUSet_has(const GrCPUSet* set, int cpu)
+{
+    if(cpu < 0 || cpu >= GTHREAD_MAX_CPUS)
+        return 0;
+    return (set->bits[ cpu / GTHREAD_CPUSET_WORDBITS ] >> (cpu % GTHREAD_CPUSET_WORDBITS)) & 1;
+}
+
+int gthread_CPUSet_count(const GrCPUSet* set)
+{
+    int count = 0;
+    for(size_t i = 0; i < sizeof(set->bits) / sizeof(set->bits[0]); i++)
+        count += __builtin_popcountl( set->bits[i] );
+    return count;
+}
+
+char gthread_Thread_setAffinity(GrThread hnd, const GrCPUSet* cpus)
+{
+    #if defined _GRYLTOOL_WIN32
+        // Only the first processor group is supported.
+        DWORD_PTR mask = (DWORD_PTR)cpus->bits[0];
+        HANDLE h = (hnd ? ((struct ThreadHandlePriv*)hnd)->hThread : GetCurrentThread());
+        if( !SetThreadAffinityMask( h, mask ) ){
+            hlogError("gthread: ERROR on SetThreadAffinityMask(): 0x%0x\n", GetLastError());
+            return -1;
+        }
+        return 0;
+
+    #elif defined GTHREAD_HAVE_AFFINITY
+        cpu_set_t cs;
+        CPU_ZERO( &cs );
+        for(int i = 0; i < GTHREAD_MAX_CPUS && i < CPU_SETSIZE; i++)
+            if(gthread_CPUSet_has( cpus, i ))
+                CPU_SET( i, &cs );
+        int res = pthread_setaffinity_np( (hnd ? ((struct ThreadHandlePriv*)hnd)->tid : pthread_self()), sizeof(cs), &cs );
+        if(res != 0){
+            hlogError("gthread: ERROR on pthread_setaffinity_np() : %s\n", strerror(res));
+            return -1;
+        }
+        return 0;
+    #endif
+    return -1; // Not supported.
+}
+
+char gthread_Thread_getAffinity(GrThread hnd, GrCPUSet* cpus)
+{
+    gthread_CPUSet_clear( cpus );
+    #if defined _GRYLTOOL_WIN32
+        // There's no GetThreadAffinityMask - set the process mask and read back the old one.
+        DWORD_PTR procMask, sysMask;
+        if( !GetProcessAffinityMask( GetCurrentProcess(), &procMask, &sysMask ) )
+            return -1;
+        HANDLE h = (hnd ? ((struct ThreadHandlePriv*)hnd)->hThread : GetCurrentThread());
+        DWORD_PTR old = SetThreadAffinityMask( h, procMask );
+        if(!old)
+            return -1;
+        SetThreadAffinityMask( h, old );
+        cpus->bits[0] = (unsigned long)old;
+        return 0;
+
+    #elif defined GTHREAD_HAVE_AFFINITY
+        cpu_set_t cs;
+        int res = pthread_getaffinity_np( (hnd ? ((struct ThreadHandlePriv*)hnd)->tid : pthread_self()), sizeof(cs), &cs );
+        if(res != 0){
+            hlogError("gthread: ERROR on pthread_getaffinity_np() : %s\n", strerror(res));
+            return -1;
+        }
+        for(int i = 0; i < GTHREAD_MAX_CPUS && i < CPU_SETSIZE; i++)
+            if(CPU_ISSET( i, &cs ))
+                gthread_CPUSet_add( cpus, i );
+        return 0;
+    #endif
+    return -1;
+}
+
+char gthread_Thread_setName(GrThread hnd, const char* name)
+{
+    #if defined _GRYLTOOL_POSIX && defined __linux__
+        // The kernel keeps 15 chars and a terminator, longer names are an error.
+        char buf[ GTHREAD_NAME_LEN ];
+        strncpy( buf, name, GTHREAD_NAME_LEN - 1 );
+        buf[ GTHREAD_NAME_LEN - 1 ] = 0;
+        int res = pthread_setname_np( (hnd ? ((struct ThreadHandlePriv*)hnd)->tid : pthread_self()), buf );
+        if(res != 0){
+            hlogError("gthread: ERROR on pthread_setname_np() : %s\n", strerror(res));
+            return -1;
+        }
+        return 0;
+    #endif
+    // Win32 (SetThreadDescription) needs Windows 10, newer than the version we target.
+    return -1;
+}
+
+int gthread_getCPUCount()
+{
+    static int count = 0;
+    if(!count){
+        #if defined _GRYLTOOL_WIN32
+            SYSTEM_INFO sysInfo;
+            GetSystemInfo( &sysInfo );
+            int n = (int)sysInfo.dwNumberOfProcessors;
+        #elif defined _GRYLTOOL_POSIX
+            int n = (int)sysconf( _SC_NPROCESSORS_ONLN );
+        #endif
+        gatomic_store( &count, (n > 0 ? n : 1), GATOMIC_RELAXED );
+    }
+    return gatomic_load( &count, GATOMIC_RELAXED );
+}
+
+int gthread_getCurrentCPU()
+{
+    #if defined _GRYLTOOL_WIN32
+        return (int)GetCurrentProcessorNumber();
+    #elif defined __linux__
+        return sched_getcpu(); // vDSO on most archs - no syscall.
+    #endif
+    return -1;
+}
+
+//==========================================================//
+// - - - - - - - - - - -  TLS section  - - - - - - - - - - -//
+
+/*! Thread-local storage.
+ *  - Every thread has an array of slots, indexed by key. get() is a bounds check
+ *    and a load, with no library calls.
+ *  - A slot is valid only if its sequence matches the key's, so values left by
+ *    threads in a destroyed key are never seen by a new key in the same slot.
+ *  - One OS key (pthread key, or FLS index on Win32) exists only to run the
+ *    destructors when a thread exits.
+ */
+
+#define GTHREAD_TLS_DESTRUCTOR_ROUNDS  4
+
+struct GThread_TLSKeyInfo
+{
+    unsigned int seq; // Odd if the key is in use.
+    void (*destructor)(void*);
+};
+
+struct GThread_TLSSlot
+{
+    unsigned int seq;
+    void* value;
+};
+
+static struct GThread_TLSKeyInfo gthread_tlsKeys[ GTHREAD_TLS_MAX_KEYS ];
+static GrFastMutex gthread_tlsKeyLock = GTHREAD_FASTMUTEX_INIT;
+
+static __thread struct GThread_TLSSlot* gthread_tlsSlots = NULL;
+static __thread size_t gthread_tlsSlotCount = 0;
+__thread void* gthread_tlsContext_priv = NULL;
+static __thread void (*gthread_tlsContextDtor)(void*) = NULL;
+static __thread char gthread_tlsRegistered = 0;
+
+static void gthread_TLS_threadExit_priv(void* unused);
+
+#if defined _GRYLTOOL_WIN32
+    static DWORD gthread_tlsExitKey = FLS_OUT_OF_INDEXES;
+    static INIT_ONCE gthread_tlsExitOnce = INIT_ONCE_STATIC_INIT;
+
+    static BOOL CALLBACK gthread_TLS_initOnce_priv(PINIT_ONCE once, PVOID param, PVOID* ctx)
+    {
+        gthread_tlsExitKey = FlsAlloc( gthread_TLS_threadExit_priv );
+        return TRUE;
+    }
+#elif defined _GRYLTOOL_POSIX
+    static pthread_key_t gthread_tlsExitKey;
+    static pthread_once_t gthread_tlsExitOnce = PTHREAD_ONCE_INIT;
+
+    static void gthread_TLS_initOnce_priv()
+    {
+        pthread_key_create( &gthread_tlsExitKey, gthread_TLS_threadExit_priv );
+    }
+#endif
+
+// Makes the OS call our exit hook for this thread.
+static void gthread_TLS_register_priv()
+{
+    if(gthread_tlsRegistered)
+        return;
+    #if defined _GRYLTOOL_WIN32
+        InitOnceExecuteOnce( &gthread_tlsExitOnce, gthread_TLS_initOnce_priv, NULL, NULL );
+        if(gthread_tlsExitKey != FLS_OUT_OF_INDEXES)
+            FlsSetValue( gthread_tlsExitKey, (void*)1 );
+    #elif defined _GRYLTOOL_POSIX
+        pthread_once( &gthread_tlsExitOnce, gthread_TLS_initOnce_priv );
+        pthread_setspecific( gthread_tlsExitKey, (void*)1 );
+    #endif
+    gthread_tlsRegistered = 1;
+}
+
+static void gthread_TLS_threadExit_priv(void* unused)
+{
+    // Destructors may set values again, so repeat a few times, like POSIX does.
+    for(int round = 0; round < GTHREAD_TLS_DESTRUCTOR_ROUNDS; round++)
+    {
+        char called = 0;
+        for(size_t i = 0; i < gthread_tlsSlotCount; i++){
+            struct GThread_TLSSlot* slot = gthread_tlsSlots + i;
+            if(!slot->value)
+                continue;
+            gthread_FastMutex_lock( &gthread_tlsKeyLock );
+            void (*dtor)(void*) = ( slot->seq == gthread_tlsKeys[i].seq ? gthread_tlsKeys[i].destructor : NULL );
+            gthread_FastMutex_unlock( &gthread_tlsKeyLock );
+
+            void* value = slot->value;
+            slot->value = NULL;
+            if(dtor){
+                dtor( value );
+                called = 1;
+            }
+        }
+        if(gthread_tlsContext_priv && gthread_tlsContextDtor){
+            void* ctx = gthread_tlsContext_priv;
+            gthread_tlsContext_priv = NULL;
+            gthread_tlsContextDtor( ctx );
+            called = 1;
+        }
+        if(!called)
+            break;
+    }
+
+    free( gthread_tlsSlots );
+    gthread_tlsSlots = NULL;
+    gthread_tlsSlotCount = 0;
+    gthread_tlsContext_priv = NULL;
+    gthread_tlsContextDtor = NULL;
+    gthread_tlsRegistered = 0;
+}
+
+GrTLSKey gthread_TLS_create(void (*destructor)(void*))
+{
+    gthread_FastMutex_lock( &gthread_tlsKeyLock );
+    size_t i;
+    for(i = 0; i < GTHREAD_TLS_MAX_KEYS; i++){
+        if( !(gthread_tlsKeys[i].seq & 1) ){
+            gthread_tlsKeys[i].destructor = destructor;
+            gatomic_store( &(gthread_tlsKeys[i].seq), gthread_tlsKeys[i].seq + 1, GATOMIC_RELEASE );
+            break;
+        }
+    }
+    gthread_FastMutex_unlock( &gthread_tlsKeyLock );
+
+    if(i == GTHREAD_TLS_MAX_KEYS){
+        hlogError("gthread: ERROR: all %d TLS keys are in use.\n", GTHREAD_TLS_MAX_KEYS);
+        return NULL;
+    }
+    return (GrTLSKey)(i + 1); // Keys are never NULL.
+}
+
+void gthread_TLS_destroy(GrTLSKey* key)
+{
+    if(!key || !*key) return;
+    size_t i = (size_t)*key - 1;
+    if(i < GTHREAD_TLS_MAX_KEYS){
+        gthread_FastMutex_lock( &gthread_tlsKeyLock );
+        if(gthread_tlsKeys[i].seq & 1){
+            gthread_tlsKeys[i].destructor = NULL;
+            gatomic_store( &(gthread_tlsKeys[i].seq), gthread_tlsKeys[i].seq + 1, GATOMIC_RELEASE );
+        }
+        gthread_FastMutex_unlock( &gthread_tlsKeyLock );
+    }
+    *key = NULL;
+}
+
+void* gthread_TLS_get(GrTLSKey key)
+{
+    size_t i = (size_t)key - 1;
+    if(i >= gthread_tlsSlotCount || !gthread_tlsSlots[i].value)
+        return NULL;
+    // The key may have been destroyed and created again since the value was set.
+    if(gthread_tlsSlots[i].seq != gatomic_load( &(gthread_tlsKeys[i].seq), GATOMIC_RELAXED ))
+        return NULL;
+    return gthread_tlsSlots[i].value;
+}
+
+char gthread_TLS_set(GrTLSKey key, void* value)
+{
+    size_t i = (size_t)key - 1;
+    if(i >= GTHREAD_TLS_MAX_KEYS)
+        return -2;
+    unsigned int seq = gatomic_load( &(gthread_tlsKeys[i].seq), GATOMIC_ACQUIRE );
+    if( !(seq & 1) )
+        return -2; // Not created.
+
+    if(i >= gthread_tlsSlotCount){
+        // Grow to the highest key in use now, so the array rarely grows again.
+        size_t count = 8;
+        while(count <= i) count *= 2;
+        if(count > GTHREAD_TLS_MAX_KEYS) count = GTHREAD_TLS_MAX_KEYS;
+
+        struct GThread_TLSSlot* slots = realloc( gthread_tlsSlots, count * sizeof(struct GThread_TLSSlot) );
+        if(!slots)
+            return -1;
+        memset( slots + gthread_tlsSlotCount, 0, (count - gthread_tlsSlotCount) * sizeof(struct GThread_TLSSlot) );
+        gthread_tlsSlots = slots;
+        gthread_tlsSlotCount = count;
+    }
+    if(value)
+        gthread_TLS_register_priv();
+
+    gthread_tlsSlots[i].seq = seq;
+    gthread_tlsSlots[i].value = value;
+    return 0;
+}
+
+void gthread_TLS_setContext(void* context, void (*destructor)(void*))
+{
+    gthread_tlsContext_priv = context;
+    gthread_tlsContextDtor = destructor;
+    if(context && destructor)
+        gthread_TLS_register_priv();
+}
 
 //==========================================================//
 // - - - - - - - - -   Process section   - - - - - - - - - -//
@@ -435,8 +919,8 @@ struct GThread_ProcessHandlePriv
     #elif defined _GRYLTOOL_POSIX
         pid_t pid;
     #endif
-    volatile char flags;
-    GrMutex flagtex; 
+    char flags;
+    int exitStatus; // Valid when ACTIVE flag is cleared. See gthread_Process_getExitStatus().
 };
 
 /* Process Functions.
@@ -444,7 +928,8 @@ struct GThread_ProcessHandlePriv
  */ 
 GrProcess gthread_Process_create(const char* pathToFile, const char* commandLine)
 {
-     ;
+    hlogError("gthread: ERROR: gthread_Process_create() is Not (yet) Supported!\n");
+    return NULL;
 }
 
 GrProcess gthread_Process_fork(void (*proc)(void*), void* param)
@@ -453,22 +938,42 @@ GrProcess gthread_Process_fork(void (*proc)(void*), void* param)
 
     #if defined _GRYLTOOL_WIN32
         // TODO:
-        hlogf("gthread: ERROR: Fork()'ing on Windows is Not (yet) Supported!\n");
+        hlogError("gthread: ERROR: Fork()'ing on Windows is Not (yet) Supported!\n");
         return NULL;
         
     #elif defined _GRYLTOOL_POSIX
+        if(!proc) return NULL;
+        if( !(procHand = malloc(sizeof(struct GThread_ProcessHandlePriv))) ){
+            hlogError("gthread: ERROR on malloc() of a process handle.\n");
+            return NULL;
+        }
+
+        // Unflushed stdio buffers would be written by both processes.
+        fflush(NULL);
+
         // Call fork - spawn process.
         // On a child process execution resumes after FORK,
-        // For a child fork() returns 0, and for the original, returns 0 on good, < 0 on error.
+        // For a child fork() returns 0, and for the original, returns child's pid on good, < 0 on error.
         pid_t pid = fork();
 
         if(pid == 0){ // Child process
+            free(procHand);
             proc(param); // Call the client servicer function
+
+            // The child must never return into the caller's code - it would run the parent's logic.
+            // _exit() skips the atexit handlers which belong to the parent.
+            fflush(NULL);
+            _exit(0);
         }
         else if(pid > 0){ // Parent and no error
-            procHand = malloc(sizeof(struct GThread_ProcessHandlePriv));
             procHand->pid = pid;
-            // Maybe initialize the mutex (if we'll ever use it).
+            procHand->flags = GRYLTHREAD_FLAG_ACTIVE;
+            procHand->exitStatus = -1;
+        }
+        else{
+            hlogError("gthread: ERROR on fork(): %s\n", strerror(errno));
+            free(procHand);
+            procHand = NULL;
         }
     #endif
 
@@ -478,20 +983,26 @@ GrProcess gthread_Process_fork(void (*proc)(void*), void* param)
 void gthread_Process_join(GrProcess hnd)
 {
     if(!hnd) return;
+    struct GThread_ProcessHandlePriv* phnd = (struct GThread_ProcessHandlePriv*)hnd;
     if( gthread_Process_isRunning(hnd) )
     {
         #if defined _GRYLTOOL_WIN32
-            WaitForSingleObject( ((struct GThread_ProcessHandlePriv*)hnd)->hProcess, INFINITE );
-            CloseHandle( ((struct GThread_ProcessHandlePriv*)hnd)->hProcess ); // Close native handle (OS recomendation)
+            WaitForSingleObject( phnd->hProcess, INFINITE );
      
         #elif defined _GRYLTOOL_POSIX
             // Just wait for termination of the PID.
-            int res = waitpid( ((struct GThread_ProcessHandlePriv*)hnd)->pid, NULL, 0 );
+            int status;
+            pid_t res;
+            while( (res = waitpid( phnd->pid, &status, 0 )) < 0 && errno == EINTR )
+                ;
             if( res < 0 ) // Error
-                hlogf("gthread: ERROR on waitpid(): %s\n", strerror(res));
+                hlogError("gthread: ERROR on waitpid(): %s\n", strerror(errno));
         #endif
     }
-    free( (struct GThread_ProcessHandlePriv*)hnd );
+    #if defined _GRYLTOOL_WIN32
+        CloseHandle( phnd->hProcess ); // Close native handle (OS recomendation)
+    #endif
+    free( phnd );
 }
 
 char gthread_Process_isRunning(GrProcess hnd)
@@ -507,16 +1018,28 @@ char gthread_Process_isRunning(GrProcess hnd)
             if(status == STILL_ACTIVE)
                 return 1; // Still running!
             // Not running
+            phnd->exitStatus = (int)status;
 	        phnd->flags &= ~GRYLTHREAD_FLAG_ACTIVE; // Clear the active flag.
         }
         else // Error occured
-            hlogf("gthread: ERROR: GetExitCodeProcess() failed: 0x%0x\n", GetLastError());
+            hlogError("gthread: ERROR: GetExitCodeProcess() failed: 0x%0x\n", GetLastError());
 
     #elif defined _GRYLTOOL_POSIX
-        // Here we use kill (send signal to process), with signal as 0 - don't send, just check process state.
-        // If error occured, now check if process doesn't exist.
-        if( kill( phnd->pid, 0 ) < 0 ){ 
-            if(errno == ESRCH){ // Process doesn't exist.
+        // Reap our own child if it has exited - kill(pid, 0) would still see it as a zombie.
+        int status;
+        pid_t res = waitpid( phnd->pid, &status, WNOHANG );
+        if( res == phnd->pid ){
+            if( WIFEXITED(status) )
+                phnd->exitStatus = WEXITSTATUS(status);
+            else if( WIFSIGNALED(status) )
+                phnd->exitStatus = GTHREAD_PROCESS_SIGNALED + WTERMSIG(status);
+            phnd->flags &= ~GRYLTHREAD_FLAG_ACTIVE; // Clear the active flag.
+            return 0;
+        }
+        if( res < 0 && errno == ECHILD ){
+            // Not our child (or already reaped) - use kill (send signal to process), with signal
+            // as 0 - don't send, just check process state.
+            if( kill( phnd->pid, 0 ) < 0 && errno == ESRCH ){ // Process doesn't exist.
 	    	    phnd->flags &= ~GRYLTHREAD_FLAG_ACTIVE; // Clear the active flag.
                 return 0; // Not running.
 	        }
@@ -527,6 +1050,31 @@ char gthread_Process_isRunning(GrProcess hnd)
     return 0;
 }
 
+int gthread_Process_getExitStatus(GrProcess hnd)
+{
+    if(!hnd || gthread_Process_isRunning(hnd)) return -1;
+    return ((struct GThread_ProcessHandlePriv*)hnd)->exitStatus;
+}
+
+char gthread_Process_terminate(GrProcess hnd)
+{
+    if( !gthread_Process_isRunning(hnd) ) return 1;
+    struct GThread_ProcessHandlePriv* phnd = (struct GThread_ProcessHandlePriv*)hnd;
+
+    #if defined _GRYLTOOL_WIN32
+        if( !TerminateProcess( phnd->hProcess, 1 ) ){
+            hlogError("gthread: ERROR: TerminateProcess() failed: 0x%0x\n", GetLastError());
+            return -1;
+        }
+    #elif defined _GRYLTOOL_POSIX
+        if( kill( phnd->pid, SIGTERM ) < 0 ){
+            hlogError("gthread: ERROR on kill(): %s\n", strerror(errno));
+            return -1;
+        }
+    #endif
+    return 0;
+}
+
 long gthread_Process_getID(GrProcess hnd)
 {
     #if defined _GRYLTOOL_WIN32
@@ -565,7 +1113,7 @@ GrMutex gthread_Mutex_init(int flags)
     // Zero-initialize the structure. ZERO because when checking, ZERO means NonExistent.
     struct GThread_MutexPriv* mpv = (struct GThread_MutexPriv*) calloc( sizeof(struct GThread_MutexPriv), 1 );
     if(!mpv){
-        hlogf("Calloc() failz0red!\n");
+        hlogError("Calloc() failz0red!\n");
         return NULL;
     }
     mpv->flags = flags;
@@ -582,7 +1130,7 @@ GrMutex gthread_Mutex_init(int flags)
             
             mpv->hMutex = CreateMutex( &attrs, FALSE, NULL );
             if( !mpv->hMutex ){
-                hlogf("gthread: CreateMutex() failz0red to initialize Win32 Mutex. ErrCode: 0x%0x\n", GetLastError());
+                hlogError("gthread: CreateMutex() failz0red to initialize Win32 Mutex. ErrCode: 0x%0x\n", GetLastError());
                 free(mpv);
                 return NULL;
             }
@@ -595,7 +1143,7 @@ GrMutex gthread_Mutex_init(int flags)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_mutex_init( &(mpv->mtx), NULL );
         if( res != 0 ){ // Error occur'd when initializing.
-            hlogf("gthread: Error initializing Mutex (%d) !\n", res);
+            hlogError("gthread: Error initializing Mutex (%d) !\n", res);
             free(mpv);
             return NULL;
         }
@@ -615,7 +1163,7 @@ void gthread_Mutex_destroy(GrMutex* mtx)
         // Free all resources of the structure.
         if( mpv->hMutex ){
             if( !CloseHandle( mpv->hMutex ) ) // If error, retval is NonZero
-                hlogf("gthread: failed to CloseHandle() on mutex.\n");
+                hlogError("gthread: failed to CloseHandle() on mutex.\n");
         }
         else{ // If not hMutex, it's non-shared, use CRITICAL_SECTION. 
             DeleteCriticalSection( &(mpv->critSect) ); 
@@ -623,7 +1171,7 @@ void gthread_Mutex_destroy(GrMutex* mtx)
 
     #elif defined _GRYLTOOL_POSIX
         if( pthread_mutex_destroy( &(mpv->mtx) ) != 0 )
-            hlogf("gthread: pthread_mutex_destroy() failed to destroy a mutex.\n");
+            hlogError("gthread: pthread_mutex_destroy() failed to destroy a mutex.\n");
     #endif
     // At the end, free the dynamically allocated private structure.
     free( (struct GThread_MutexPriv*)(*mtx) );
@@ -640,7 +1188,7 @@ char gthread_Mutex_lock(GrMutex mtx)
             // If called on a Mutex, after waiting also takes Ownership of this mutex (Ackquires a lock).
             DWORD waitRes = WaitForSingleObject( ((struct GThread_MutexPriv*)mtx)->hMutex , INFINITE );
             if(waitRes == WAIT_FAILED){
-                hlogf("gthread: Error on WaitForSingleObject() : 0x%p\n", GetLastError());
+                hlogError("gthread: Error on WaitForSingleObject() : 0x%p\n", GetLastError());
                 return -1;
             }
         }
@@ -651,7 +1199,7 @@ char gthread_Mutex_lock(GrMutex mtx)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_mutex_lock( &( ((struct GThread_MutexPriv*)mtx)->mtx ) );
         if(res != 0){
-            hlogf("gthread: Error locking mutex (%d)\n", res);
+            hlogError("gthread: Error locking mutex (%d)\n", res);
             return -1;
         }
     #endif
@@ -668,13 +1216,13 @@ char gthread_Mutex_tryLock(GrMutex mtx)
     if(!mtx) return -3;
     #if defined _GRYLTOOL_WIN32
         if( (((struct GThread_MutexPriv*)mtx)->flags) & GTHREAD_MUTEX_SHARED ){
-            hlogf("gthread: TryLock can't be called on a Shared Win32 mutex. \n");
+            hlogError("gthread: TryLock can't be called on a Shared Win32 mutex. \n");
             return -2;
         }
         else{ // Lock CRITICAL_SECTION
             // If another thread already owns a mutex, returns ZERO.
             if(TryEnterCriticalSection( &( ((struct GThread_MutexPriv*)mtx)->critSect ) ) == 0 ){
-                //hlogf("gthread: TryLock: mutex already locked.\n");
+                //hlogDebug("gthread: TryLock: mutex already locked.\n");
                 return 1;
             }
         }
@@ -682,11 +1230,11 @@ char gthread_Mutex_tryLock(GrMutex mtx)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_mutex_trylock( &( ((struct GThread_MutexPriv*)mtx)->mtx ) );
         if(res != 0 && res != EBUSY){
-            hlogf("gthread: Error locking mutex (%d)\n", res);
+            hlogError("gthread: Error locking mutex (%d)\n", res);
             return -1; // Error
         }
         else if(res == EBUSY){
-            //hlogf("gthread: TryLock: mutex already locked.\n");
+            //hlogDebug("gthread: TryLock: mutex already locked.\n");
             return 1; // Already locked
         }
 
@@ -705,7 +1253,7 @@ char gthread_Mutex_unlock(GrMutex mtx)
         if( (((struct GThread_MutexPriv*)mtx)->flags) & GTHREAD_MUTEX_SHARED ){ // UnLock hMUTEX
             // If the function fails, the return value is ZERO.
             if( ReleaseMutex( ((struct GThread_MutexPriv*)mtx)->hMutex ) == 0 ){
-                hlogf("gthread: Error on ReleaseMutex() : 0x%p\n", GetLastError());
+                hlogError("gthread: Error on ReleaseMutex() : 0x%p\n", GetLastError());
                 return -1;
             }
         }
@@ -716,7 +1264,7 @@ char gthread_Mutex_unlock(GrMutex mtx)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_mutex_unlock( &( ((struct GThread_MutexPriv*)mtx)->mtx ) );
         if(res != 0){
-            hlogf("gthread: Error pthread_unlocking mutex (%d)\n", res);
+            hlogError("gthread: Error pthread_unlocking mutex (%d)\n", res);
             return -1;
         }
     #endif
@@ -744,7 +1292,7 @@ GrCondVar gthread_CondVar_init()
     // Zero-initialize the structure. ZERO because when checking, ZERO means NonExistent.
     struct GThread_CondVarPriv* mpv = (struct GThread_CondVarPriv*) calloc( sizeof(struct GThread_CondVarPriv), 1 );
     if(!mpv){
-        hlogf("Calloc() failz0red!\n");
+        hlogError("Calloc() failz0red!\n");
         return NULL;
     }
 
@@ -756,7 +1304,7 @@ GrCondVar gthread_CondVar_init()
         // Init with default attributes.
         int res = pthread_cond_init( &(mpv->cond), NULL );
         if( res != 0 ){ // Error occur'd when initializing.
-            hlogf("gthread: Error initializing pthread_CondVar (%d) !\n", res);
+            hlogError("gthread: Error initializing pthread_CondVar (%d) !\n", res);
             free(mpv);
             return NULL;
         }
@@ -777,7 +1325,7 @@ void gthread_CondVar_destroy(GrCondVar* cond)
         // Init with default attributes.
         int res = pthread_cond_destroy( &(mpv->cond) );
         if( res != 0 ){ // Error occur'd when initializing.
-            hlogf("gthread: Error destroying pthread_CondVar (%s) !\n", strerror(res));
+            hlogError("gthread: Error destroying pthread_CondVar (%s) !\n", strerror(res));
         }
     #endif
     free( mpv );
@@ -790,7 +1338,7 @@ char gthread_CondVar_wait_time(GrCondVar cond, GrMutex mutex, long millisec)
     struct GThread_MutexPriv* mtp = (struct GThread_MutexPriv*)mutex;
     #if defined _GRYLTOOL_WIN32
         if( (mtp->flags) & GTHREAD_MUTEX_SHARED ){ // Only unshared mutex can be used to wait 
-            hlogf("gthread: ERROR: CondVar can only wait on a non-shared Windows mutex (CRITICAL_SECTION)\n");
+            hlogError("gthread: ERROR: CondVar can only wait on a non-shared Windows mutex (CRITICAL_SECTION)\n");
             return -3;
         }
             
@@ -798,22 +1346,28 @@ char gthread_CondVar_wait_time(GrCondVar cond, GrMutex mutex, long millisec)
         {
             DWORD error = GetLastError();
             if(error != ERROR_TIMEOUT){ // Actual error happened.
-                hlogf("gthread: SleepConditionVariableCS() returned Error: 0x%0x\n", error);
+                hlogError("gthread: SleepConditionVariableCS() returned Error: 0x%0x\n", error);
                 return -1; // Error occur'd
             }
             return 1; // Timeout
         }
 
     #elif defined _GRYLTOOL_POSIX
+        // pthread_cond_timedwait() takes an Absolute deadline, not a relative timeout.
         struct timespec tims;
-        tims.tv_sec = millisec / 1000; // Seconds
-        tims.tv_nsec = (millisec % 1000) * 1000; // Nanoseconds
+        clock_gettime( CLOCK_REALTIME, &tims );
+        tims.tv_sec += millisec / 1000; // Seconds
+        tims.tv_nsec += (millisec % 1000) * 1000000L; // Nanoseconds
+        if( tims.tv_nsec >= 1000000000L ){
+            tims.tv_sec++;
+            tims.tv_nsec -= 1000000000L;
+        }
 
         int res = pthread_cond_timedwait( &(cvp->cond), &(mtp->mtx), &tims );
         if( res != 0 ){
             if( res == ETIMEDOUT ) // Timeout occured.
                 return 1; // Timeout
-            hlogf("gthread: ERROR when trying to pthread_cond_timedwait() : %d\n", res);
+            hlogError("gthread: ERROR when trying to pthread_cond_timedwait() : %d\n", res);
             return -1;
         }
     #endif
@@ -830,7 +1384,7 @@ char gthread_CondVar_wait(GrCondVar cond, GrMutex mtp)
         int res = pthread_cond_wait( &(((struct GThread_CondVarPriv*)cond)->cond),
 			             &(((struct GThread_MutexPriv*)mtp)->mtx) );
         if( res != 0 ){
-            hlogf("gthread: ERROR when trying to pthread_cond_wait() : %d\n", res);
+            hlogError("gthread: ERROR when trying to pthread_cond_wait() : %d\n", res);
             return -1; // Only error can occur, no timeout.
         }
     #endif
@@ -846,7 +1400,7 @@ void gthread_CondVar_notify(GrCondVar cond)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_cond_signal( &( ((struct GThread_CondVarPriv*)cond)->cond ) );
         if( res != 0 ){
-            hlogf("gthread: ERROR when trying to pthread_cond_signal() : %d\n", res);
+            hlogError("gthread: ERROR when trying to pthread_cond_signal() : %d\n", res);
         }
     #endif
 }
@@ -860,8 +1414,1451 @@ void gthread_CondVar_notifyAll(GrCondVar cond)
     #elif defined _GRYLTOOL_POSIX
         int res = pthread_cond_broadcast( &( ((struct GThread_CondVarPriv*)cond)->cond ) );
         if( res != 0 ){
-            hlogf("gthread: ERROR when trying to pthread_cond_signal() : %d\n", res);
+            hlogError("gthread: ERROR when trying to pthread_cond_signal() : %d\n", res);
+        }
+    #endif
+}
+
+//==========================================================//
+// - - - - - - - - -  Fast primitives section  - - - - - - -//
+
+/*! Lightweight Mutex, CondVar and Event.
+ *  - Plain ints, which can be embedded and statically initialized. Nothing to destroy.
+ *  - Uncontended lock/unlock is a single atomic op each.
+ *  - Contended threads spin for a while (adapted to how long the lock is usually held),
+ *    and then park on a futex. Where there are no futexes, parking is a yield loop.
+ */
+
+#define GTHREAD_FAST_SPIN_MAX  100
+
+// Mutex states.
+#define GTHREAD_FAST_UNLOCKED  0
+#define GTHREAD_FAST_LOCKED    1
+#define GTHREAD_FAST_CONTENDED 2 // Locked, and someone may be parked.
+
+static inline void gthread_Fast_pause_priv()
+{
+    #if defined __x86_64__ || defined __i386__
+        __builtin_ia32_pause();
+    #elif defined __aarch64__
+        __asm__ __volatile__("yield");
+    #endif
+}
+
+/* Parks the thread while *addr == val, at most millisec (< 0 - infinitely).
+ * May return spuriously. Returns 1 on timeout, 0 otherwise.
+ */
+static char gthread_Fast_park_priv(int* addr, int val, long millisec)
+{
+    #if defined GTHREAD_HAVE_FUTEX
+        struct timespec tims;
+        if(millisec >= 0){
+            tims.tv_sec = millisec / 1000;
+            tims.tv_nsec = (millisec % 1000) * 1000000L;
+        }
+        if( syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, (millisec >= 0 ? &tims : NULL), NULL, 0 ) != 0 )
+            return (errno == ETIMEDOUT);
+        return 0;
+
+    #else
+        // No way to sleep on an address - just give up the CPU, the caller re-checks.
+        if( gatomic_load( addr, GATOMIC_ACQUIRE ) == val ){
+            #if defined _GRYLTOOL_WIN32
+                Sleep(millisec == 0 ? 0 : 1);
+            #else
+                sched_yield();
+            #endif
+        }
+        return 0;
+    #endif
+}
+
+static void gthread_Fast_unpark_priv(int* addr, int count)
+{
+    #if defined GTHREAD_HAVE_FUTEX
+        syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+    #endif
+}
+
+// Milliseconds left until deadline (CLOCK_MONOTONIC), 0 if passed.
+static long gthread_Fast_remaining_priv(const struct timespec* deadline)
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+    return (ms > 0 ? ms : 0);
+}
+
+static void gthread_Fast_deadline_priv(struct timespec* deadline, long millisec)
+{
+    clock_gettime( CLOCK_MONOTONIC, deadline );
+    deadline->tv_sec += millisec / 1000;
+    deadline->tv_nsec += (millisec % 1000) * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L){
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// FastMutex
+
+void gthread_FastMutex_init(GrFastMutex* mtx)
+{
+    mtx->state = GTHREAD_FAST_UNLOCKED;
+    mtx->spins = 0;
+}
+
+// Returns 0 if lock acquired, 1 if already locked.
+char gthread_FastMutex_tryLock(GrFastMutex* mtx)
+{
+    int c = GTHREAD_FAST_UNLOCKED;
+    return !gatomic_cas( &(mtx->state), &c, GTHREAD_FAST_LOCKED,
+                                         GATOMIC_ACQUIRE, GATOMIC_RELAXED );
+}
+
+// Takes the lock as CONTENDED - used once we may have parked waiters behind us.
+static void gthread_FastMutex_lockContended_priv(GrFastMutex* mtx)
+{
+    while( gatomic_exchange( &(mtx->state), GTHREAD_FAST_CONTENDED, GATOMIC_ACQUIRE ) != GTHREAD_FAST_UNLOCKED )
+        gthread_Fast_park_priv( &(mtx->state), GTHREAD_FAST_CONTENDED, -1 );
+}
+
+void gthread_FastMutex_lock(GrFastMutex* mtx)
+{
+    if( gthread_FastMutex_tryLock( mtx ) == 0 )
+        return;
+
+    /* Spin up to twice the recent average. Spinning only pays off if the owner is running.
+     * The average is only a hint - concurrent lockers may overwrite each other's updates. */
+    int spins = gatomic_load( &(mtx->spins), GATOMIC_RELAXED );
+    int maxSpins = spins * 2 + 10;
+    if(maxSpins > GTHREAD_FAST_SPIN_MAX)
+        maxSpins = GTHREAD_FAST_SPIN_MAX;
+
+    for(int i = 0; i < maxSpins; i++){
+        gthread_Fast_pause_priv();
+        if( gatomic_load( &(mtx->state), GATOMIC_RELAXED ) == GTHREAD_FAST_UNLOCKED &&
+            gthread_FastMutex_tryLock( mtx ) == 0 )
+        {
+            gatomic_store( &(mtx->spins), spins + (i - spins) / 8, GATOMIC_RELAXED );
+            return;
         }
+    }
+    gatomic_store( &(mtx->spins), spins + (maxSpins - spins) / 8, GATOMIC_RELAXED );
+
+    gthread_FastMutex_lockContended_priv( mtx );
+}
+
+void gthread_FastMutex_unlock(GrFastMutex* mtx)
+{
+    if( gatomic_exchange( &(mtx->state), GTHREAD_FAST_UNLOCKED, GATOMIC_RELEASE ) == GTHREAD_FAST_CONTENDED )
+        gthread_Fast_unpark_priv( &(mtx->state), 1 );
+}
+
+// FastCondVar
+
+void gthread_FastCondVar_init(GrFastCondVar* cond)
+{
+    cond->seq = 0;
+    cond->mutex = NULL;
+}
+
+/* Mutex must be locked, and is locked again on return.
+ * Returns 0 if woken (maybe spuriously), 1 on timeout (millisec < 0 - wait infinitely).
+ */
+char gthread_FastCondVar_wait_time(GrFastCondVar* cond, GrFastMutex* mtx, long millisec)
+{
+    gatomic_store( &(cond->mutex), mtx, GATOMIC_RELAXED );
+    int seq = gatomic_load( &(cond->seq), GATOMIC_RELAXED );
+
+    gthread_FastMutex_unlock( mtx );
+    char res = gthread_Fast_park_priv( &(cond->seq), seq, millisec );
+
+    // notifyAll may have moved us to the mutex's wait queue, so others may be parked on it.
+    gthread_FastMutex_lockContended_priv( mtx );
+    return res;
+}
+
+char gthread_FastCondVar_wait(GrFastCondVar* cond, GrFastMutex* mtx)
+{
+    return gthread_FastCondVar_wait_time( cond, mtx, -1 );
+}
+
+void gthread_FastCondVar_notify(GrFastCondVar* cond)
+{
+    gatomic_addFetch( &(cond->seq), 1, GATOMIC_RELEASE );
+    gthread_Fast_unpark_priv( &(cond->seq), 1 );
+}
+
+void gthread_FastCondVar_notifyAll(GrFastCondVar* cond)
+{
+    GrFastMutex* mtx = gatomic_load( &(cond->mutex), GATOMIC_RELAXED );
+    gatomic_addFetch( &(cond->seq), 1, GATOMIC_RELEASE );
+    if(!mtx)
+        return; // Nobody has ever waited.
+
+    #if defined GTHREAD_HAVE_FUTEX
+        // Wake one, and move the rest straight to the mutex, instead of having
+        // all of them wake up just to fight for it.
+        syscall( SYS_futex, &(cond->seq), FUTEX_REQUEUE_PRIVATE, 1, (void*)(long)INT_MAX, &(mtx->state), 0 );
+
+        // The moved waiters are only woken by an unlock of a CONTENDED mutex.
+        while(1){
+            int c = gatomic_load( &(mtx->state), GATOMIC_RELAXED );
+            if(c == GTHREAD_FAST_CONTENDED)
+                break;
+            if(c == GTHREAD_FAST_UNLOCKED){
+                gthread_Fast_unpark_priv( &(mtx->state), 1 );
+                break;
+            }
+            if( gatomic_cas( &(mtx->state), &c, GTHREAD_FAST_CONTENDED, GATOMIC_RELAXED, GATOMIC_RELAXED ) )
+                break;
+        }
+    #endif
+}
+
+// FastEvent
+
+// Event states.
+#define GTHREAD_FAST_EVENT_UNSET    0
+#define GTHREAD_FAST_EVENT_SET      1
+#define GTHREAD_FAST_EVENT_WAITING  2 // Unset, and someone may be parked.
+
+void gthread_FastEvent_init(GrFastEvent* evt, char set)
+{
+    evt->state = (set ? GTHREAD_FAST_EVENT_SET : GTHREAD_FAST_EVENT_UNSET);
+}
+
+// Sets the event, and wakes all the waiters. Stays set until reset.
+void gthread_FastEvent_set(GrFastEvent* evt)
+{
+    if( gatomic_exchange( &(evt->state), GTHREAD_FAST_EVENT_SET, GATOMIC_RELEASE ) == GTHREAD_FAST_EVENT_WAITING )
+        gthread_Fast_unpark_priv( &(evt->state), INT_MAX );
+}
+
+void gthread_FastEvent_reset(GrFastEvent* evt)
+{
+    int c = GTHREAD_FAST_EVENT_SET;
+    gatomic_cas( &(evt->state), &c, GTHREAD_FAST_EVENT_UNSET, GATOMIC_RELAXED, GATOMIC_RELAXED );
+}
+
+char gthread_FastEvent_isSet(GrFastEvent* evt)
+{
+    return ( gatomic_load( &(evt->state), GATOMIC_ACQUIRE ) == GTHREAD_FAST_EVENT_SET );
+}
+
+// Returns 0 if the event is set, 1 on timeout (millisec < 0 - wait infinitely).
+char gthread_FastEvent_wait_time(GrFastEvent* evt, long millisec)
+{
+    struct timespec deadline;
+    if(millisec > 0)
+        gthread_Fast_deadline_priv( &deadline, millisec );
+
+    while(1)
+    {
+        int c = gatomic_load( &(evt->state), GATOMIC_ACQUIRE );
+        if(c == GTHREAD_FAST_EVENT_SET)
+            return 0;
+        if(millisec == 0)
+            return 1;
+        if(c == GTHREAD_FAST_EVENT_UNSET &&
+           !gatomic_cas( &(evt->state), &c, GTHREAD_FAST_EVENT_WAITING,
+                                         GATOMIC_ACQUIRE, GATOMIC_RELAXED ))
+            continue;
+
+        long left = -1;
+        if(millisec > 0 && (left = gthread_Fast_remaining_priv( &deadline )) == 0)
+            return 1;
+        gthread_Fast_park_priv( &(evt->state), GTHREAD_FAST_EVENT_WAITING, left );
+    }
+}
+
+char gthread_FastEvent_wait(GrFastEvent* evt)
+{
+    return gthread_FastEvent_wait_time( evt, -1 );
+}
+
+//==========================================================//
+// - - - - - - - - -  SharedMutex section  - - - - - - - - -//
+
+/*! Reader-writer lock.
+ *  - Readers count themselves in one of several reader slots, each on its own cache line,
+ *    so readers on different threads don't bounce a single counter.
+ *  - A writer raises the writer flag, then waits for all slots to drain.
+ *    Readers back off while the flag is raised, so writers are preferred.
+ *  - Writers are serialized by a FastMutex. Waiting is done on futexes.
+ */
+
+#define GTHREAD_RWLOCK_SLOTS  16 // Power of 2.
+#define GTHREAD_RWLOCK_SPINS  100
+
+struct GThread_RWSlot
+{
+    int count;
+    char pad[ 64 - sizeof(int) ];
+};
+
+struct GThread_SharedMutexPriv
+{
+    struct GThread_RWSlot slots[ GTHREAD_RWLOCK_SLOTS ];
+    int writer;       // Nonzero while a writer holds or waits for the lock, 2 if readers are parked.
+    int drainSeq;     // Writer parks on this, readers bump it when their slot drains.
+    int drainWaiting; // Writer is parked on drainSeq.
+    GrFastMutex writerLock;
+    void* block;   // Allocated block, for freeing.
+};
+
+static int gthread_rwNextSlot = 0;
+static __thread int gthread_rwSlot = -1;
+
+static struct GThread_RWSlot* gthread_SharedMutex_slot_priv(struct GThread_SharedMutexPriv* rw)
+{
+    if(gthread_rwSlot < 0)
+        gthread_rwSlot = gatomic_fetchAdd( &gthread_rwNextSlot, 1, GATOMIC_RELAXED ) & (GTHREAD_RWLOCK_SLOTS - 1);
+    return rw->slots + gthread_rwSlot;
+}
+
+GrSharedMutex gthread_SharedMutex_init()
+{
+    // Slots must start on a cache line boundary.
+    void* block = calloc( 1, sizeof(struct GThread_SharedMutexPriv) + 64 );
+    if(!block){
+        hlogError("gthread: ERROR on calloc() creating a SharedMutex.\n");
+        return NULL;
+    }
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)( ((uintptr_t)block + 63) & ~(uintptr_t)63 );
+    rw->block = block;
+    gthread_FastMutex_init( &(rw->writerLock) );
+    return (GrSharedMutex)rw;
+}
+
+// Must be unlocked.
+void gthread_SharedMutex_destroy(GrSharedMutex* mtx)
+{
+    if(!mtx || !*mtx) return;
+    free( ((struct GThread_SharedMutexPriv*)(*mtx))->block );
+    *mtx = NULL;
+}
+
+static void gthread_SharedMutex_readerLeave_priv(struct GThread_SharedMutexPriv* rw, struct GThread_RWSlot* slot)
+{
+    // If a writer is waiting for the slots to drain, and ours just did - tell it.
+    if( gatomic_subFetch( &(slot->count), 1, GATOMIC_SEQ_CST ) == 0 &&
+        gatomic_load( &(rw->writer), GATOMIC_SEQ_CST ) &&
+        gatomic_load( &(rw->drainWaiting), GATOMIC_SEQ_CST ) )
+    {
+        gatomic_addFetch( &(rw->drainSeq), 1, GATOMIC_SEQ_CST );
+        gthread_Fast_unpark_priv( &(rw->drainSeq), 1 );
+    }
+}
+
+// Returns 0 if lock acquired, 1 if a writer holds or waits for it.
+char gthread_SharedMutex_tryLockShared(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+    struct GThread_RWSlot* slot = gthread_SharedMutex_slot_priv( rw );
+
+    gatomic_addFetch( &(slot->count), 1, GATOMIC_SEQ_CST );
+    if( !gatomic_load( &(rw->writer), GATOMIC_SEQ_CST ) )
+        return 0;
+    gthread_SharedMutex_readerLeave_priv( rw, slot );
+    return 1;
+}
+
+char gthread_SharedMutex_lockShared(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+
+    while( gthread_SharedMutex_tryLockShared( mtx ) != 0 ){
+        // Wait until the writer's gone.
+        for(int i = 0; i < GTHREAD_RWLOCK_SPINS && gatomic_load( &(rw->writer), GATOMIC_ACQUIRE ); i++)
+            gthread_Fast_pause_priv();
+        int w;
+        while( (w = gatomic_load( &(rw->writer), GATOMIC_ACQUIRE )) != 0 ){
+            // Mark that readers are parked, so the writer's unlock wakes us.
+            if( w == 1 && !gatomic_cas( &(rw->writer), &w, 2, GATOMIC_ACQ_REL, GATOMIC_ACQUIRE ) )
+                continue;
+            gthread_Fast_park_priv( &(rw->writer), 2, -1 );
+        }
+    }
+    return 0;
+}
+
+char gthread_SharedMutex_unlockShared(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+    gthread_SharedMutex_readerLeave_priv( rw, gthread_SharedMutex_slot_priv( rw ) );
+    return 0;
+}
+
+static void gthread_SharedMutex_waitDrain_priv(struct GThread_SharedMutexPriv* rw)
+{
+    for(int i = 0; i < GTHREAD_RWLOCK_SLOTS; i++)
+    {
+        int* count = &(rw->slots[i].count);
+        if( !gatomic_load( count, GATOMIC_SEQ_CST ) )
+            continue;
+        for(int s = 0; s < GTHREAD_RWLOCK_SPINS && gatomic_load( count, GATOMIC_ACQUIRE ); s++)
+            gthread_Fast_pause_priv();
+
+        while(1){
+            // Read the sequence first, so a drain between the check and the park isn't missed.
+            gatomic_store( &(rw->drainWaiting), 1, GATOMIC_SEQ_CST );
+            int seq = gatomic_load( &(rw->drainSeq), GATOMIC_SEQ_CST );
+            if( !gatomic_load( count, GATOMIC_SEQ_CST ) )
+                break;
+            gthread_Fast_park_priv( &(rw->drainSeq), seq, -1 );
+        }
+        gatomic_store( &(rw->drainWaiting), 0, GATOMIC_RELAXED );
+    }
+}
+
+char gthread_SharedMutex_lock(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+
+    gthread_FastMutex_lock( &(rw->writerLock) );
+    gatomic_store( &(rw->writer), 1, GATOMIC_SEQ_CST );
+    gthread_SharedMutex_waitDrain_priv( rw );
+    return 0;
+}
+
+// Returns 0 if lock acquired, 1 if it's held by anyone.
+char gthread_SharedMutex_tryLock(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+    if( gthread_FastMutex_tryLock( &(rw->writerLock) ) != 0 )
+        return 1;
+
+    gatomic_store( &(rw->writer), 1, GATOMIC_SEQ_CST );
+    for(int i = 0; i < GTHREAD_RWLOCK_SLOTS; i++){
+        if( gatomic_load( &(rw->slots[i].count), GATOMIC_SEQ_CST ) ){
+            gthread_SharedMutex_unlock( mtx ); // Readers inside - back off.
+            return 1;
+        }
+    }
+    return 0;
+}
+
+char gthread_SharedMutex_unlock(GrSharedMutex mtx)
+{
+    struct GThread_SharedMutexPriv* rw = (struct GThread_SharedMutexPriv*)mtx;
+    if(!rw) return -2;
+
+    if( gatomic_exchange( &(rw->writer), 0, GATOMIC_SEQ_CST ) == 2 )
+        gthread_Fast_unpark_priv( &(rw->writer), INT_MAX );
+    gthread_FastMutex_unlock( &(rw->writerLock) );
+    return 0;
+}
+
+//==========================================================//
+// - - - - - - - - - -  Queue section  - - - - - - - - - - -//
+
+/*! Bounded MPMC queue (D. Vyukov's algorithm).
+ *  - Every cell has a sequence number, telling whether it's ready to be written or read
+ *    on the current lap. Producers and consumers claim positions with a CAS, so they only
+ *    contend among themselves, each side on its own cache line.
+ *  - Blocking calls spin a bit, then sleep on a CondVar. The mutex is only taken
+ *    by the other side if someone is actually waiting.
+ */
+
+#define GTHREAD_QUEUE_SPINS  64
+
+// Spinning can't help when the other side has no CPU to run on.
+static int gthread_Queue_spinCount_priv()
+{
+    return (gthread_getCPUCount() > 1 ? GTHREAD_QUEUE_SPINS : 0);
+}
+
+struct GThread_QueueCell
+{
+    size_t seq;
+    void* data;
+};
+
+struct GThread_QueuePriv
+{
+    size_t enqPos;
+    char pad1[ 64 - sizeof(size_t) ];
+    size_t deqPos;
+    char pad2[ 64 - sizeof(size_t) ];
+
+    size_t mask;
+    struct GThread_QueueCell* cells;
+
+    GrMutex mtx;
+    GrCondVar notEmpty;
+    GrCondVar notFull;
+    int popWaiters;
+    int pushWaiters;
+    char popWakePending;
+    char pushWakePending;
+};
+
+GrQueue gthread_Queue_create(size_t capacity)
+{
+    size_t size = 2;
+    while(size < capacity)
+        size <<= 1;
+
+    struct GThread_QueuePriv* q = calloc( 1, sizeof(struct GThread_QueuePriv) );
+    if(q)
+        q->cells = malloc( size * sizeof(struct GThread_QueueCell) );
+    if(!q || !q->cells){
+        hlogError("gthread: ERROR on malloc() creating a queue.\n");
+        free(q);
+        return NULL;
+    }
+    q->mask = size - 1;
+    for(size_t i = 0; i < size; i++)
+        q->cells[i].seq = i;
+
+    q->mtx = gthread_Mutex_init(0);
+    q->notEmpty = gthread_CondVar_init();
+    q->notFull = gthread_CondVar_init();
+    if(!q->mtx || !q->notEmpty || !q->notFull){
+        GrQueue hnd = (GrQueue)q;
+        gthread_Queue_destroy( &hnd );
+        return NULL;
+    }
+    return (GrQueue)q;
+}
+
+// Queue must not be used by other threads anymore. Items left in it are not freed.
+void gthread_Queue_destroy(GrQueue* hnd)
+{
+    if(!hnd || !*hnd) return;
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)(*hnd);
+    gthread_Mutex_destroy( &(q->mtx) );
+    gthread_CondVar_destroy( &(q->notEmpty) );
+    gthread_CondVar_destroy( &(q->notFull) );
+    free( q->cells );
+    free( q );
+    *hnd = NULL;
+}
+
+/* Wakes a waiter, if there is one.
+ * Only one wake is in flight per side - until the woken thread runs, it still counts as a
+ * waiter, and every push/pop would take the mutex otherwise. A woken thread which succeeds
+ * passes the wake on to the next waiter.
+ */
+static void gthread_Queue_wake_priv(struct GThread_QueuePriv* q, int* waiters, char* wakePending, GrCondVar cond)
+{
+    gatomic_fence( GATOMIC_SEQ_CST );
+    if( gatomic_load( waiters, GATOMIC_RELAXED ) &&
+        !gatomic_exchange( wakePending, 1, GATOMIC_ACQ_REL ) )
+    {
+        gthread_Mutex_lock( q->mtx );
+        gthread_CondVar_notify( cond );
+        gthread_Mutex_unlock( q->mtx );
+    }
+}
+
+static char gthread_Queue_tryPush_priv(struct GThread_QueuePriv* q, void* item)
+{
+    size_t pos = gatomic_load( &(q->enqPos), GATOMIC_RELAXED );
+    while(1)
+    {
+        struct GThread_QueueCell* cell = q->cells + (pos & q->mask);
+        size_t seq = gatomic_load( &(cell->seq), GATOMIC_ACQUIRE );
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if(dif == 0){ // Free on this lap - try to claim it.
+            if( gatomic_casWeak( &(q->enqPos), &pos, pos + 1, GATOMIC_RELAXED, GATOMIC_RELAXED ) ){
+                cell->data = item;
+                gatomic_store( &(cell->seq), pos + 1, GATOMIC_RELEASE );
+                return 0;
+            }
+        }
+        else if(dif < 0) // Not yet consumed from the previous lap - full.
+            return 1;
+        else
+            pos = gatomic_load( &(q->enqPos), GATOMIC_RELAXED );
+    }
+}
+
+static char gthread_Queue_tryPop_priv(struct GThread_QueuePriv* q, void** item)
+{
+    size_t pos = gatomic_load( &(q->deqPos), GATOMIC_RELAXED );
+    while(1)
+    {
+        struct GThread_QueueCell* cell = q->cells + (pos & q->mask);
+        size_t seq = gatomic_load( &(cell->seq), GATOMIC_ACQUIRE );
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(dif == 0){ // Written on this lap - try to claim it.
+            if( gatomic_casWeak( &(q->deqPos), &pos, pos + 1, GATOMIC_RELAXED, GATOMIC_RELAXED ) ){
+                *item = cell->data;
+                // Free the cell for the next lap.
+                gatomic_store( &(cell->seq), pos + q->mask + 1, GATOMIC_RELEASE );
+                return 0;
+            }
+        }
+        else if(dif < 0) // Empty.
+            return 1;
+        else
+            pos = gatomic_load( &(q->deqPos), GATOMIC_RELAXED );
+    }
+}
+
+/* Non-blocking operations.
+ * Return 0 on success, 1 if the queue is full (push) or empty (pop), < 0 on error.
+ */
+char gthread_Queue_tryPush(GrQueue hnd, void* item)
+{
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)hnd;
+    if(!q) return -2;
+    if( gthread_Queue_tryPush_priv( q, item ) != 0 )
+        return 1;
+    gthread_Queue_wake_priv( q, &(q->popWaiters), &(q->popWakePending), q->notEmpty );
+    return 0;
+}
+
+char gthread_Queue_tryPop(GrQueue hnd, void** item)
+{
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)hnd;
+    if(!q || !item) return -2;
+    if( gthread_Queue_tryPop_priv( q, item ) != 0 )
+        return 1;
+    gthread_Queue_wake_priv( q, &(q->pushWaiters), &(q->pushWakePending), q->notFull );
+    return 0;
+}
+
+/* Blocking operations. Wait at most millisec (< 0 - infinitely), however many times they
+ * lose the race for a freed slot or a pushed item.
+ * Return 0 on success, 1 on timeout, < 0 on error.
+ */
+char gthread_Queue_push(GrQueue hnd, void* item, long millisec)
+{
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)hnd;
+    if(!q) return -2;
+
+    for(int i = 0, spins = gthread_Queue_spinCount_priv(); i <= spins; i++){
+        if( gthread_Queue_tryPush_priv( q, item ) == 0 ){
+            gthread_Queue_wake_priv( q, &(q->popWaiters), &(q->popWakePending), q->notEmpty );
+            return 0;
+        }
+    }
+
+    char ret = 0;
+    struct timespec deadline;
+    if(millisec > 0)
+        gthread_Fast_deadline_priv( &deadline, millisec );
+
+    gthread_Mutex_lock( q->mtx );
+    gatomic_addFetch( &(q->pushWaiters), 1, GATOMIC_SEQ_CST );
+    while( gthread_Queue_tryPush_priv( q, item ) != 0 ){
+        char res = ( millisec < 0 ? gthread_CondVar_wait( q->notFull, q->mtx )
+                                  : gthread_CondVar_wait_time( q->notFull, q->mtx,
+                                        (millisec > 0 ? gthread_Fast_remaining_priv( &deadline ) : 0) ) );
+        gatomic_store( &(q->pushWakePending), 0, GATOMIC_RELEASE );
+        if(res != 0){
+            // One last try - the item may have been freed just as we timed out.
+            ret = ( gthread_Queue_tryPush_priv( q, item ) == 0 ? 0 : res );
+            break;
+        }
+    }
+    gatomic_subFetch( &(q->pushWaiters), 1, GATOMIC_SEQ_CST );
+    gatomic_store( &(q->pushWakePending), 0, GATOMIC_RELEASE );
+    gthread_Mutex_unlock( q->mtx );
+
+    if(ret == 0){
+        gthread_Queue_wake_priv( q, &(q->popWaiters), &(q->popWakePending), q->notEmpty );
+        gthread_Queue_wake_priv( q, &(q->pushWaiters), &(q->pushWakePending), q->notFull );
+    }
+    return ret;
+}
+
+char gthread_Queue_pop(GrQueue hnd, void** item, long millisec)
+{
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)hnd;
+    if(!q || !item) return -2;
+
+    for(int i = 0, spins = gthread_Queue_spinCount_priv(); i <= spins; i++){
+        if( gthread_Queue_tryPop_priv( q, item ) == 0 ){
+            gthread_Queue_wake_priv( q, &(q->pushWaiters), &(q->pushWakePending), q->notFull );
+            return 0;
+        }
+    }
+
+    char ret = 0;
+    struct timespec deadline;
+    if(millisec > 0)
+        gthread_Fast_deadline_priv( &deadline, millisec );
+
+    gthread_Mutex_lock( q->mtx );
+    gatomic_addFetch( &(q->popWaiters), 1, GATOMIC_SEQ_CST );
+    while( gthread_Queue_tryPop_priv( q, item ) != 0 ){
+        char res = ( millisec < 0 ? gthread_CondVar_wait( q->notEmpty, q->mtx )
+                                  : gthread_CondVar_wait_time( q->notEmpty, q->mtx,
+                                        (millisec > 0 ? gthread_Fast_remaining_priv( &deadline ) : 0) ) );
+        gatomic_store( &(q->popWakePending), 0, GATOMIC_RELEASE );
+        if(res != 0){
+            ret = ( gthread_Queue_tryPop_priv( q, item ) == 0 ? 0 : res );
+            break;
+        }
+    }
+    gatomic_subFetch( &(q->popWaiters), 1, GATOMIC_SEQ_CST );
+    gatomic_store( &(q->popWakePending), 0, GATOMIC_RELEASE );
+    gthread_Mutex_unlock( q->mtx );
+
+    if(ret == 0){
+        gthread_Queue_wake_priv( q, &(q->pushWaiters), &(q->pushWakePending), q->notFull );
+        gthread_Queue_wake_priv( q, &(q->popWaiters), &(q->popWakePending), q->notEmpty );
+    }
+    return ret;
+}
+
+// Approximate - may be stale as soon as it returns.
+size_t gthread_Queue_getSize(GrQueue hnd)
+{
+    struct GThread_QueuePriv* q = (struct GThread_QueuePriv*)hnd;
+    if(!q) return 0;
+    size_t deq = gatomic_load( &(q->deqPos), GATOMIC_ACQUIRE );
+    size_t enq = gatomic_load( &(q->enqPos), GATOMIC_ACQUIRE );
+    return (enq > deq ? enq - deq : 0);
+}
+
+size_t gthread_Queue_getCapacity(GrQueue hnd)
+{
+    return (hnd ? ((struct GThread_QueuePriv*)hnd)->mask + 1 : 0);
+}
+
+//==========================================================//
+// - - - - - - - - -  Thread Pool section  - - - - - - - - -//
+
+/*! Pool structure.
+ *  - Every worker owns a Chase-Lev deque. It pushes and pops tasks at the bottom,
+ *    while idle workers steal from the top.
+ *  - Tasks submitted from outside the pool go to a mutex-protected injection list.
+ *  - Idle workers sleep on a CondVar. Submitters only take the mutex if someone sleeps.
+ */
+
+#define GTHREAD_POOL_DEQUE_INITIAL  256 // Must be a power of 2.
+
+#define GTHREAD_FUTURE_DONE      1
+#define GTHREAD_FUTURE_CANCELED  2
+
+struct GThread_FuturePriv
+{
+    GrMutex mtx;
+    GrCondVar cond;
+    char flags;
+    void* result;
+    int refs; // Pool and the submitter both hold a reference.
+};
+
+struct GThread_PoolTask
+{
+    void (*proc)(void*);
+    void* (*futureProc)(void*);
+    void* param;
+    struct GThread_FuturePriv* future;
+    struct GThread_PoolTask* next; // Injection list link.
+};
+
+// Deque buffers are never freed while the pool runs - a thief may still be reading an old one.
+struct GThread_DequeArray
+{
+    long size;
+    struct GThread_DequeArray* retired;
+    struct GThread_PoolTask* buf[];
+};
+
+struct GThread_Deque
+{
+    long top;
+    char pad1[ 64 - sizeof(long) ];
+    long bottom;
+    char pad2[ 64 - sizeof(long) ];
+    struct GThread_DequeArray* array;
+};
+
+struct GThread_PoolPriv;
+
+struct GThread_PoolWorker
+{
+    struct GThread_Deque deque;
+    struct GThread_PoolPriv* pool;
+    GrThread thread;
+    unsigned int seed; // For picking a steal victim.
+};
+
+struct GThread_PoolPriv
+{
+    struct GThread_PoolWorker* workers;
+    int workerCount;
+
+    GrMutex mtx; // Protects the injection list and sleeping.
+    GrCondVar cond;
+    struct GThread_PoolTask* injectHead;
+    struct GThread_PoolTask* injectTail;
+    long injectCount;
+    int sleeping;
+
+    long pending;      // Submitted, but not yet finished.
+    char stopping;     // Destroy was called - exit once there's no work.
+    char discarding;   // Destroy was called without finishing tasks.
+};
+
+// The worker the current thread is, if it belongs to a pool.
+static __thread struct GThread_PoolWorker* gthread_currentWorker = NULL;
+
+static struct GThread_DequeArray* gthread_Deque_newArray_priv(long size)
+{
+    struct GThread_DequeArray* arr = malloc( sizeof(struct GThread_DequeArray) + size * sizeof(struct GThread_PoolTask*) );
+    if(arr){
+        arr->size = size;
+        arr->retired = NULL;
+    }
+    return arr;
+}
+
+// Owner only. Returns 0 on success.
+static char gthread_Deque_push_priv(struct GThread_Deque* dq, struct GThread_PoolTask* task)
+{
+    long b = gatomic_load( &(dq->bottom), GATOMIC_RELAXED );
+    long t = gatomic_load( &(dq->top), GATOMIC_ACQUIRE );
+    struct GThread_DequeArray* arr = gatomic_load( &(dq->array), GATOMIC_RELAXED );
+
+    if( b - t > arr->size - 1 ){ // Full - grow.
+        struct GThread_DequeArray* bigger = gthread_Deque_newArray_priv( arr->size * 2 );
+        if(!bigger)
+            return 1;
+        for(long i = t; i < b; i++)
+            bigger->buf[ i & (bigger->size - 1) ] = arr->buf[ i & (arr->size - 1) ];
+        bigger->retired = arr;
+        gatomic_store( &(dq->array), bigger, GATOMIC_RELEASE );
+        arr = bigger;
+    }
+    gatomic_store( &(arr->buf[ b & (arr->size - 1) ]), task, GATOMIC_RELAXED );
+    gatomic_fence( GATOMIC_RELEASE );
+    gatomic_store( &(dq->bottom), b + 1, GATOMIC_RELAXED );
+    return 0;
+}
+
+// Owner only. LIFO end.
+static struct GThread_PoolTask* gthread_Deque_take_priv(struct GThread_Deque* dq)
+{
+    long b = gatomic_load( &(dq->bottom), GATOMIC_RELAXED ) - 1;
+    struct GThread_DequeArray* arr = gatomic_load( &(dq->array), GATOMIC_RELAXED );
+    gatomic_store( &(dq->bottom), b, GATOMIC_RELAXED );
+    gatomic_fence( GATOMIC_SEQ_CST );
+    long t = gatomic_load( &(dq->top), GATOMIC_RELAXED );
+
+    struct GThread_PoolTask* task = NULL;
+    if( t <= b ){
+        task = gatomic_load( &(arr->buf[ b & (arr->size - 1) ]), GATOMIC_RELAXED );
+        if( t == b ){ // Last one - race against thieves.
+            if( !gatomic_cas( &(dq->top), &t, t + 1, GATOMIC_SEQ_CST, GATOMIC_RELAXED ) )
+                task = NULL;
+            gatomic_store( &(dq->bottom), b + 1, GATOMIC_RELAXED );
+        }
+    }
+    else // Empty.
+        gatomic_store( &(dq->bottom), b + 1, GATOMIC_RELAXED );
+    return task;
+}
+
+// Any thread. FIFO end. Returns NULL if empty or lost a race.
+static struct GThread_PoolTask* gthread_Deque_steal_priv(struct GThread_Deque* dq)
+{
+    long t = gatomic_load( &(dq->top), GATOMIC_ACQUIRE );
+    gatomic_fence( GATOMIC_SEQ_CST );
+    long b = gatomic_load( &(dq->bottom), GATOMIC_ACQUIRE );
+
+    if( t < b ){
+        struct GThread_DequeArray* arr = gatomic_load( &(dq->array), GATOMIC_ACQUIRE );
+        struct GThread_PoolTask* task = gatomic_load( &(arr->buf[ t & (arr->size - 1) ]), GATOMIC_RELAXED );
+        if( gatomic_cas( &(dq->top), &t, t + 1, GATOMIC_SEQ_CST, GATOMIC_RELAXED ) )
+            return task;
+    }
+    return NULL;
+}
+
+static char gthread_Deque_isEmpty_priv(struct GThread_Deque* dq)
+{
+    return gatomic_load( &(dq->top), GATOMIC_ACQUIRE ) >= gatomic_load( &(dq->bottom), GATOMIC_ACQUIRE );
+}
+
+static void gthread_Future_release_priv(struct GThread_FuturePriv* fut)
+{
+    if( gatomic_subFetch( &(fut->refs), 1, GATOMIC_ACQ_REL ) == 0 ){
+        gthread_Mutex_destroy( &(fut->mtx) );
+        gthread_CondVar_destroy( &(fut->cond) );
+        free(fut);
+    }
+}
+
+static void gthread_Future_complete_priv(struct GThread_FuturePriv* fut, void* result, char flags)
+{
+    gthread_Mutex_lock( fut->mtx );
+    fut->result = result;
+    // isDone() reads the flags without the lock.
+    gatomic_fetchOr( &(fut->flags), flags, GATOMIC_RELEASE );
+    gthread_CondVar_notifyAll( fut->cond );
+    gthread_Mutex_unlock( fut->mtx );
+    gthread_Future_release_priv( fut );
+}
+
+static void gthread_Pool_runTask_priv(struct GThread_PoolPriv* pool, struct GThread_PoolTask* task)
+{
+    if( gatomic_load( &(pool->discarding), GATOMIC_ACQUIRE ) ){
+        if(task->future)
+            gthread_Future_complete_priv( task->future, NULL, GTHREAD_FUTURE_DONE | GTHREAD_FUTURE_CANCELED );
+    }
+    else if(task->futureProc){
+        void* res = task->futureProc( task->param );
+        gthread_Future_complete_priv( task->future, res, GTHREAD_FUTURE_DONE );
+    }
+    else
+        task->proc( task->param );
+
+    free(task);
+    if( gatomic_subFetch( &(pool->pending), 1, GATOMIC_ACQ_REL ) == 0 &&
+        gatomic_load( &(pool->stopping), GATOMIC_ACQUIRE ) )
+    {
+        // Last task of a stopping pool - wake the sleepers so they can exit.
+        gthread_Mutex_lock( pool->mtx );
+        gthread_CondVar_notifyAll( pool->cond );
+        gthread_Mutex_unlock( pool->mtx );
+    }
+}
+
+static struct GThread_PoolTask* gthread_Pool_takeInjected_priv(struct GThread_PoolPriv* pool)
+{
+    struct GThread_PoolTask* task = NULL;
+    if( gatomic_load( &(pool->injectCount), GATOMIC_ACQUIRE ) == 0 )
+        return NULL;
+
+    gthread_Mutex_lock( pool->mtx );
+    if( (task = pool->injectHead) != NULL ){
+        if( !(pool->injectHead = task->next) )
+            pool->injectTail = NULL;
+        gatomic_subFetch( &(pool->injectCount), 1, GATOMIC_RELEASE );
+    }
+    gthread_Mutex_unlock( pool->mtx );
+    return task;
+}
+
+static struct GThread_PoolTask* gthread_Pool_findTask_priv(struct GThread_PoolWorker* self)
+{
+    struct GThread_PoolPriv* pool = self->pool;
+    struct GThread_PoolTask* task;
+
+    if( (task = gthread_Deque_take_priv( &(self->deque) )) != NULL )
+        return task;
+    if( (task = gthread_Pool_takeInjected_priv( pool )) != NULL )
+        return task;
+
+    // Steal, starting from a random victim.
+    self->seed = self->seed * 1103515245u + 12345u;
+    int start = (int)((self->seed >> 16) % pool->workerCount);
+    for(int i = 0; i < pool->workerCount; i++){
+        struct GThread_PoolWorker* victim = pool->workers + ((start + i) % pool->workerCount);
+        if( victim != self && (task = gthread_Deque_steal_priv( &(victim->deque) )) != NULL )
+            return task;
+    }
+    return NULL;
+}
+
+static char gthread_Pool_hasWork_priv(struct GThread_PoolPriv* pool)
+{
+    gatomic_fence( GATOMIC_SEQ_CST ); // Pairs with the fence in enqueue.
+    if( gatomic_load( &(pool->injectCount), GATOMIC_SEQ_CST ) )
+        return 1;
+    for(int i = 0; i < pool->workerCount; i++){
+        if( !gthread_Deque_isEmpty_priv( &(pool->workers[i].deque) ) )
+            return 1;
+    }
+    return 0;
+}
+
+static void gthread_Pool_workerProc_priv(void* param)
+{
+    struct GThread_PoolWorker* self = (struct GThread_PoolWorker*)param;
+    struct GThread_PoolPriv* pool = self->pool;
+    gthread_currentWorker = self;
+
+    while(1)
+    {
+        struct GThread_PoolTask* task = gthread_Pool_findTask_priv( self );
+        if(task){
+            gthread_Pool_runTask_priv( pool, task );
+            continue;
+        }
+
+        // Nothing found. Announce sleeping, then re-check, so a concurrent submit can't be missed.
+        gthread_Mutex_lock( pool->mtx );
+        gatomic_addFetch( &(pool->sleeping), 1, GATOMIC_SEQ_CST );
+        while( !gthread_Pool_hasWork_priv( pool ) ){
+            if( pool->stopping && gatomic_load( &(pool->pending), GATOMIC_ACQUIRE ) == 0 ){
+                gatomic_subFetch( &(pool->sleeping), 1, GATOMIC_SEQ_CST );
+                gthread_CondVar_notifyAll( pool->cond ); // Let the others exit too.
+                gthread_Mutex_unlock( pool->mtx );
+                gthread_currentWorker = NULL;
+                return;
+            }
+            gthread_CondVar_wait( pool->cond, pool->mtx );
+        }
+        gatomic_subFetch( &(pool->sleeping), 1, GATOMIC_SEQ_CST );
+        gthread_Mutex_unlock( pool->mtx );
+    }
+}
+
+static char gthread_Pool_enqueue_priv(struct GThread_PoolPriv* pool, struct GThread_PoolTask* task)
+{
+    gatomic_addFetch( &(pool->pending), 1, GATOMIC_ACQ_REL );
+
+    struct GThread_PoolWorker* self = gthread_currentWorker;
+    if( self && self->pool == pool && gthread_Deque_push_priv( &(self->deque), task ) == 0 ){
+        // Pushed to own deque. Wake a sleeper to steal it, if any.
+        gatomic_fence( GATOMIC_SEQ_CST );
+        if( gatomic_load( &(pool->sleeping), GATOMIC_SEQ_CST ) ){
+            gthread_Mutex_lock( pool->mtx );
+            gthread_CondVar_notify( pool->cond );
+            gthread_Mutex_unlock( pool->mtx );
+        }
+        return 0;
+    }
+
+    gthread_Mutex_lock( pool->mtx );
+    task->next = NULL;
+    if(pool->injectTail)
+        pool->injectTail->next = task;
+    else
+        pool->injectHead = task;
+    pool->injectTail = task;
+    gatomic_addFetch( &(pool->injectCount), 1, GATOMIC_SEQ_CST );
+
+    if(pool->sleeping)
+        gthread_CondVar_notify( pool->cond );
+    gthread_Mutex_unlock( pool->mtx );
+    return 0;
+}
+
+// Public Pool API
+
+GrThreadPool gthread_Pool_create(int workerCount)
+{
+    if(workerCount <= 0)
+        workerCount = gthread_getCPUCount();
+
+    struct GThread_PoolPriv* pool = calloc( 1, sizeof(struct GThread_PoolPriv) );
+    if(!pool || !(pool->workers = calloc( workerCount, sizeof(struct GThread_PoolWorker) ))){
+        hlogError("gthread: ERROR on calloc() creating a pool.\n");
+        free(pool);
+        return NULL;
+    }
+    pool->workerCount = workerCount;
+    pool->mtx = gthread_Mutex_init(0);
+    pool->cond = gthread_CondVar_init();
+
+    for(int i = 0; i < workerCount; i++){
+        struct GThread_PoolWorker* wk = pool->workers + i;
+        wk->pool = pool;
+        wk->seed = (unsigned int)i * 2654435761u + 1;
+        if( !(wk->deque.array = gthread_Deque_newArray_priv( GTHREAD_POOL_DEQUE_INITIAL )) ){
+            hlogError("gthread: ERROR on malloc() creating a pool deque.\n");
+            workerCount = i;
+            break;
+        }
+    }
+
+    // Deques must all exist before any worker starts stealing.
+    int started = 0;
+    if(pool->mtx && pool->cond && workerCount == pool->workerCount){
+        GrThreadAttribs attr;
+        char name[ GTHREAD_NAME_LEN ];
+        gthread_ThreadAttribs_init( &attr );
+        attr.name = name;
+        for(; started < workerCount; started++){
+            // Fits the name limit (6 + 5 + 1 chars) with any worker count.
+            snprintf( name, sizeof(name), "gpool-%u", (unsigned)started % 100000 );
+            if( !(pool->workers[ started ].thread = gthread_Thread_createEx( gthread_Pool_workerProc_priv, pool->workers + started, &attr )) )
+                break;
+        }
+    }
+    if(started < pool->workerCount){
+        hlogError("gthread: ERROR: Failed to start pool workers.\n");
+        pool->workerCount = started; // Destroy only joins the started ones.
+        GrThreadPool hnd = (GrThreadPool)pool;
+        for(int i = started; i < workerCount; i++)
+            free( pool->workers[i].deque.array );
+        gthread_Pool_destroy( &hnd, 0 );
+        return NULL;
+    }
+
+    hlogDebug("gthread: Created a pool with %d workers.\n", workerCount);
+    return (GrThreadPool)pool;
+}
+
+/* Stops the pool, joins all workers and frees it.
+ * If finishTasks is set, all submitted tasks run first. Otherwise pending tasks
+ * are dropped, and their futures are completed as canceled.
+ * Must not be called from a pool task.
+ */
+void gthread_Pool_destroy(GrThreadPool* hnd, char finishTasks)
+{
+    if(!hnd || !*hnd) return;
+    struct GThread_PoolPriv* pool = (struct GThread_PoolPriv*)(*hnd);
+
+    gthread_Mutex_lock( pool->mtx );
+    if(!finishTasks)
+        gatomic_store( &(pool->discarding), 1, GATOMIC_RELEASE );
+    gatomic_store( &(pool->stopping), 1, GATOMIC_SEQ_CST );
+    gthread_CondVar_notifyAll( pool->cond );
+    gthread_Mutex_unlock( pool->mtx );
+
+    for(int i = 0; i < pool->workerCount; i++)
+        gthread_Thread_join( pool->workers[i].thread, 1 );
+
+    // All workers are gone. Free deque buffers with all their predecessors.
+    for(int i = 0; i < pool->workerCount; i++){
+        struct GThread_DequeArray* arr = pool->workers[i].deque.array;
+        while(arr){
+            struct GThread_DequeArray* prev = arr->retired;
+            free(arr);
+            arr = prev;
+        }
+    }
+    // If no workers were ever started, the injection list may still hold tasks.
+    while(pool->injectHead){
+        struct GThread_PoolTask* task = pool->injectHead;
+        pool->injectHead = task->next;
+        if(task->future)
+            gthread_Future_complete_priv( task->future, NULL, GTHREAD_FUTURE_DONE | GTHREAD_FUTURE_CANCELED );
+        free(task);
+    }
+
+    gthread_Mutex_destroy( &(pool->mtx) );
+    gthread_CondVar_destroy( &(pool->cond) );
+    free( pool->workers );
+    free( pool );
+    *hnd = NULL;
+}
+
+// Returns 1 if current thread is a worker of this pool.
+char gthread_Pool_isWorker(GrThreadPool hnd)
+{
+    return ( hnd && gthread_currentWorker && gthread_currentWorker->pool == (struct GThread_PoolPriv*)hnd );
+}
+
+// Returns 0 if task was queued, NonZero on error.
+char gthread_Pool_submit(GrThreadPool hnd, void (*proc)(void*), void* param)
+{
+    struct GThread_PoolPriv* pool = (struct GThread_PoolPriv*)hnd;
+    // While stopping, only the pool's own tasks may add more work.
+    if(!pool || !proc || (pool->stopping && !gthread_Pool_isWorker(hnd))) return -2;
+
+    struct GThread_PoolTask* task = calloc( 1, sizeof(struct GThread_PoolTask) );
+    if(!task){
+        hlogError("gthread: ERROR on calloc() submitting a task.\n");
+        return -1;
+    }
+    task->proc = proc;
+    task->param = param;
+    return gthread_Pool_enqueue_priv( pool, task );
+}
+
+// Returns a future which must be destroyed by the caller, or NULL on error.
+GrFuture gthread_Pool_submitFuture(GrThreadPool hnd, void* (*proc)(void*), void* param)
+{
+    struct GThread_PoolPriv* pool = (struct GThread_PoolPriv*)hnd;
+    if(!pool || !proc || (pool->stopping && !gthread_Pool_isWorker(hnd))) return NULL;
+
+    struct GThread_PoolTask* task = calloc( 1, sizeof(struct GThread_PoolTask) );
+    struct GThread_FuturePriv* fut = calloc( 1, sizeof(struct GThread_FuturePriv) );
+    if(task && fut){
+        fut->mtx = gthread_Mutex_init(0);
+        fut->cond = gthread_CondVar_init();
+    }
+    if(!task || !fut || !fut->mtx || !fut->cond){
+        hlogError("gthread: ERROR creating a future.\n");
+        if(fut){
+            gthread_Mutex_destroy( &(fut->mtx) );
+            gthread_CondVar_destroy( &(fut->cond) );
+        }
+        free(fut);
+        free(task);
+        return NULL;
+    }
+    fut->refs = 2;
+    task->futureProc = proc;
+    task->param = param;
+    task->future = fut;
+
+    gthread_Pool_enqueue_priv( pool, task );
+    return (GrFuture)fut;
+}
+
+int gthread_Pool_getWorkerCount(GrThreadPool hnd)
+{
+    return (hnd ? ((struct GThread_PoolPriv*)hnd)->workerCount : 0);
+}
+
+// Future API
+
+/* Waits for the task to finish, at most millisec (< 0 - infinitely).
+ * Returns 0 if done, 1 on timeout, 2 if the task was canceled, < 0 on error.
+ */
+char gthread_Future_wait_time(GrFuture hnd, long millisec)
+{
+    struct GThread_FuturePriv* fut = (struct GThread_FuturePriv*)hnd;
+    if(!fut) return -2;
+    char ret = 0;
+    struct timespec deadline;
+    if(millisec > 0)
+        gthread_Fast_deadline_priv( &deadline, millisec );
+
+    gthread_Mutex_lock( fut->mtx );
+    while( !(fut->flags & GTHREAD_FUTURE_DONE) ){
+        char res = ( millisec < 0 ? gthread_CondVar_wait( fut->cond, fut->mtx )
+                                  : gthread_CondVar_wait_time( fut->cond, fut->mtx,
+                                        (millisec > 0 ? gthread_Fast_remaining_priv( &deadline ) : 0) ) );
+        if(res != 0){
+            ret = res;
+            break;
+        }
+    }
+    if( fut->flags & GTHREAD_FUTURE_CANCELED )
+        ret = 2;
+    gthread_Mutex_unlock( fut->mtx );
+    return ret;
+}
+
+// Waits for the task and returns its result (NULL if canceled).
+void* gthread_Future_get(GrFuture hnd)
+{
+    if( gthread_Future_wait_time( hnd, -1 ) != 0 )
+        return NULL;
+    return ((struct GThread_FuturePriv*)hnd)->result;
+}
+
+char gthread_Future_isDone(GrFuture hnd)
+{
+    if(!hnd) return 0;
+    return ( gatomic_load( &(((struct GThread_FuturePriv*)hnd)->flags), GATOMIC_ACQUIRE ) & GTHREAD_FUTURE_DONE ) ? 1 : 0;
+}
+
+// Releases the caller's reference. The task may still be running.
+void gthread_Future_destroy(GrFuture* hnd)
+{
+    if(!hnd || !*hnd) return;
+    gthread_Future_release_priv( (struct GThread_FuturePriv*)(*hnd) );
+    *hnd = NULL;
+}
+
+//==========================================================//
+// - - - - - - - - - - -  Event section  - - - - - - - - - -//
+
+/*! Selectable event.
+ *  - Backed by an eventfd (a pipe on other POSIX, a self-connected UDP socket on Win32),
+ *    which is readable while there are undrained signals.
+ *  - Signals are counted in memory. Only the first signal after a drain writes the fd,
+ *    so a burst of signals costs one syscall and one wakeup.
+ *  - Drain clears the fd before taking the count. A signal racing with it is then either
+ *    counted, or makes the fd readable again - it's never lost.
+ */
+
+struct GThread_EventPriv
+{
+    unsigned long pending; // Signals since the last drain.
+    #if defined _GRYLTOOL_WIN32
+        SOCKET sock;
+    #elif defined _GRYLTOOL_POSIX
+        int fd;      // The readable end.
+        int writeFd; // Same as fd for eventfd.
+    #endif
+};
+
+GrEvent gthread_Event_create()
+{
+    struct GThread_EventPriv* ev = calloc( 1, sizeof(struct GThread_EventPriv) );
+    if(!ev){
+        hlogError("gthread: ERROR on calloc() creating an event.\n");
+        return NULL;
+    }
+
+    #if defined _GRYLTOOL_WIN32
+        struct sockaddr_in addr = { 0 };
+        int addrLen = sizeof(addr);
+        u_long nonBlocking = 1;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+        ev->sock = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+        if( ev->sock == INVALID_SOCKET ||
+            bind( ev->sock, (struct sockaddr*)&addr, sizeof(addr) ) != 0 ||
+            getsockname( ev->sock, (struct sockaddr*)&addr, &addrLen ) != 0 ||
+            connect( ev->sock, (struct sockaddr*)&addr, addrLen ) != 0 ||
+            ioctlsocket( ev->sock, FIONBIO, &nonBlocking ) != 0 )
+        {
+            hlogError("gthread: ERROR creating an event socket: %d\n", WSAGetLastError());
+            if(ev->sock != INVALID_SOCKET)
+                closesocket( ev->sock );
+            free(ev);
+            return NULL;
+        }
+
+    #elif defined GTHREAD_HAVE_EVENTFD
+        if( (ev->fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) < 0 ){
+            hlogError("gthread: ERROR on eventfd() : %s\n", strerror(errno));
+            free(ev);
+            return NULL;
+        }
+        ev->writeFd = ev->fd;
+
+    #elif defined _GRYLTOOL_POSIX
+        int fds[2];
+        if( pipe( fds ) != 0 ){
+            hlogError("gthread: ERROR on pipe() : %s\n", strerror(errno));
+            free(ev);
+            return NULL;
+        }
+        for(int i = 0; i < 2; i++){
+            fcntl( fds[i], F_SETFL, fcntl( fds[i], F_GETFL ) | O_NONBLOCK );
+            fcntl( fds[i], F_SETFD, FD_CLOEXEC );
+        }
+        ev->fd = fds[0];
+        ev->writeFd = fds[1];
+    #endif
+
+    return (GrEvent)ev;
+}
+
+void gthread_Event_destroy(GrEvent* hnd)
+{
+    if(!hnd || !*hnd) return;
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)(*hnd);
+
+    #if defined _GRYLTOOL_WIN32
+        closesocket( ev->sock );
+    #elif defined _GRYLTOOL_POSIX
+        if(ev->writeFd != ev->fd)
+            close( ev->writeFd );
+        close( ev->fd );
+    #endif
+    free(ev);
+    *hnd = NULL;
+}
+
+// Safe to call from signal handlers on POSIX.
+char gthread_Event_signal(GrEvent hnd)
+{
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)hnd;
+    if(!ev) return -2;
+
+    // The fd is already readable, or the one who made the count nonzero is writing it.
+    if( gatomic_fetchAdd( &(ev->pending), 1, GATOMIC_ACQ_REL ) != 0 )
+        return 0;
+
+    #if defined _GRYLTOOL_WIN32
+        char byte = 1;
+        if( send( ev->sock, &byte, 1, 0 ) < 0 && WSAGetLastError() != WSAEWOULDBLOCK )
+            return -1;
+    #elif defined _GRYLTOOL_POSIX
+        #if defined GTHREAD_HAVE_EVENTFD
+            uint64_t one = 1;
+            ssize_t res = write( ev->writeFd, &one, sizeof(one) );
+        #else
+            char one = 1;
+            ssize_t res = write( ev->writeFd, &one, 1 );
+        #endif
+        // EAGAIN means it's readable anyway.
+        if(res < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    #endif
+    return 0;
+}
+
+/* Resets the event, and returns the number of signals since the last drain (0 if none).
+ * Call when the fd becomes readable. Never blocks.
+ */
+unsigned long gthread_Event_drain(GrEvent hnd)
+{
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)hnd;
+    if(!ev) return 0;
+
+    #if defined _GRYLTOOL_WIN32
+        char buf[ 64 ];
+        while( recv( ev->sock, buf, sizeof(buf), 0 ) > 0 )
+            ;
+    #elif defined GTHREAD_HAVE_EVENTFD
+        uint64_t count;
+        if( read( ev->fd, &count, sizeof(count) ) < 0 && errno != EAGAIN )
+            hlogWarn("gthread: Event drain read() : %s\n", strerror(errno));
+    #elif defined _GRYLTOOL_POSIX
+        char buf[ 64 ];
+        while( read( ev->fd, buf, sizeof(buf) ) > 0 )
+            ;
+    #endif
+
+    return gatomic_exchange( &(ev->pending), 0, GATOMIC_ACQ_REL );
+}
+
+char gthread_Event_isSet(GrEvent hnd)
+{
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)hnd;
+    return (ev && gatomic_load( &(ev->pending), GATOMIC_ACQUIRE ) != 0);
+}
+
+/* Waits until the event is signaled, without draining it.
+ * Returns 0 if signaled, 1 on timeout, < 0 on error.
+ */
+char gthread_Event_wait_time(GrEvent hnd, long millisec)
+{
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)hnd;
+    if(!ev) return -2;
+    if( gthread_Event_isSet( hnd ) )
+        return 0;
+
+    #if defined _GRYLTOOL_WIN32
+        fd_set rfds;
+        struct timeval tm = { millisec / 1000, (millisec % 1000) * 1000 };
+        FD_ZERO( &rfds );
+        FD_SET( ev->sock, &rfds );
+        int res = select( 0, &rfds, NULL, NULL, (millisec < 0 ? NULL : &tm) );
+        if(res < 0)
+            return -1;
+        return (res > 0 ? 0 : 1);
+
+    #elif defined _GRYLTOOL_POSIX
+        struct pollfd pfd = { ev->fd, POLLIN, 0 };
+        struct timespec deadline;
+        if(millisec > 0)
+            gthread_Fast_deadline_priv( &deadline, millisec );
+        while(1){
+            int res = poll( &pfd, 1, (millisec > 0 ? (int)gthread_Fast_remaining_priv( &deadline ) : (int)millisec) );
+            if(res > 0)
+                return 0;
+            if(res == 0)
+                return 1;
+            if(errno != EINTR)
+                return -1;
+        }
+    #endif
+    return -1;
+}
+
+char gthread_Event_wait(GrEvent hnd)
+{
+    return gthread_Event_wait_time( hnd, -1 );
+}
+
+int gthread_Event_getFD(GrEvent hnd)
+{
+    struct GThread_EventPriv* ev = (struct GThread_EventPriv*)hnd;
+    if(!ev) return -1;
+    #if defined _GRYLTOOL_WIN32
+        return (int)ev->sock;
+    #elif defined _GRYLTOOL_POSIX
+        return ev->fd;
     #endif
 }
 
@@ -1,59 +1,818 @@
-#include "hlog.h"
-#include <stdarg.h>
-
-#define HLOG_DEFAULT_LOGFILE stdout
-
-static FILE* curFile = NULL;
-static char active = 1;
-
-FILE* hlogSetFile(const char* fname, char mode)
-{
-    hlogCloseFile();
-    const char* oformat = ( (mode & HLOG_MODE_APPEND) ? "aw" : "w" ); // Set format according to mode flags
-    if( (curFile = fopen(fname, oformat)) && (mode & HLOG_MODE_UNBUFFERED) ) // check for UNBUFFERED bit
-        setbuf(curFile, NULL); // Disable buffering.
-    return curFile;
-}
-
-void hlogSetFileFromFile(FILE* file, char mode)
-{
-    hlogCloseFile();
-    curFile = file;
-    if(mode & HLOG_MODE_UNBUFFERED)
-        setbuf(curFile, NULL); // Disable buffering.
-}
-
-void hlogCloseFile()
-{
-    if(curFile && curFile!=stdout && curFile!=stderr)
-        fclose(curFile);
-}
-
-FILE* hlogGetFile()
-{
-    return curFile;
-}
-
-void hlogf(const char* fmt, ...)
-{
-    if(!active)
-        return;
-    if(!curFile)
-        curFile = HLOG_DEFAULT_LOGFILE;
-
-    va_list vl;
-    va_start(vl, fmt);
-
-    vfprintf( curFile, fmt, vl ); // Call vith Variadic Arguments.
-
-    va_end(vl);
-}
-
-char hlogIsActive(){
-    return active;
-}
-
-void hlogSetActive(char val){
-    active = val;
-}
-
+#include "hlog.h"
+#include "hlogbin.h"
+#include "gatomic.h"
+#include "grylthread.h"
+#include "systemcheck.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined _GRYLTOOL_POSIX
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <time.h>
+    #include <sched.h>
+#endif
+
+#define HLOG_DEFAULT_LOGFILE stdout
+
+static FILE* curFile = NULL;
+static char active = 1;
+
+//==========================================================//
+// - - - - - - - - - - -  Level gate - - - - - - - - - - - -//
+
+static int curLevel = HLOG_LEVEL_TRACE;
+static unsigned int curModuleMask = HLOG_MODMASK_ALL;
+
+unsigned int hlogLevelGate[ HLOG_LEVEL_NONE ] = {
+    HLOG_MODMASK_ALL, HLOG_MODMASK_ALL, HLOG_MODMASK_ALL, HLOG_MODMASK_ALL, HLOG_MODMASK_ALL
+};
+
+// Recompute the gate from active flag, threshold and module mask.
+static void hlogUpdateGate_priv()
+{
+    for(int i = 0; i < HLOG_LEVEL_NONE; i++)
+        hlogLevelGate[i] = ( (active && i >= curLevel) ? curModuleMask : 0 );
+}
+
+//==========================================================//
+// - - - - - - - - - -  Async section  - - - - - - - - - - -//
+
+#define HLOG_CACHELINE_SIZE  64
+
+/*! Per-thread Single-Producer Single-Consumer byte ring.
+ *  - head is advanced only by the owner thread, tail only by the drainer.
+ *  - Indexes grow forever, position in buffer is (index & (HLOG_ASYNC_RING_SIZE-1)).
+ *  - Rings are never freed. When owner thread exits, ring is marked unowned,
+ *    and can be picked up by a new thread.
+ */
+struct HLogRing
+{
+    size_t head;
+    char padHead[ HLOG_CACHELINE_SIZE - sizeof(size_t) ];
+    size_t tail;
+    char padTail[ HLOG_CACHELINE_SIZE - sizeof(size_t) ];
+
+    char owned;
+    struct HLogRing* next;
+    char buff[ HLOG_ASYNC_RING_SIZE ];
+};
+
+static struct HLogRing* ringList = NULL; // Protected by ringMutex. Rings are only prepended.
+static size_t ringCount = 0;
+static GrMutex ringMutex = NULL;
+static GrMutex drainMutex = NULL;        // Serializes the ring consumers, and their file writes.
+static GrCondVar drainCond = NULL;
+static GrThread drainThread = NULL;
+
+static char asyncRunning = 0;
+static char asyncPolicy = HLOG_ASYNC_POLICY_DROP;
+static unsigned long droppedCount = 0;
+
+static __thread struct HLogRing* threadRing = NULL;
+
+// The key is used only for it's destructor, which releases the ring when thread exits.
+static GrTLSKey ringKey = NULL;
+
+static void hlogRingRelease_priv(void* ring)
+{
+    gatomic_store( &(((struct HLogRing*)ring)->owned), 0, GATOMIC_RELEASE );
+}
+
+static struct HLogRing* hlogAcquireRing_priv()
+{
+    struct HLogRing* ring;
+    gthread_Mutex_lock( ringMutex );
+
+    // Reuse a ring abandoned by an exited thread, if any.
+    for(ring = ringList; ring != NULL; ring = ring->next){
+        if( !gatomic_load( &(ring->owned), GATOMIC_ACQUIRE ) )
+            break;
+    }
+    if(!ring){
+        if( (ring = malloc(sizeof(struct HLogRing))) != NULL ){
+            ring->head = ring->tail = 0;
+            ring->next = ringList;
+            ringList = ring;
+            ringCount++;
+        }
+    }
+    if(ring)
+        ring->owned = 1;
+
+    gthread_Mutex_unlock( ringMutex );
+
+    if(ring)
+        gthread_TLS_set( ringKey, ring );
+
+    threadRing = ring;
+    return ring;
+}
+
+/*! Writes all pending ring data to curFile. drainMutex must be held.
+ *  ringMutex is held only to take the list head - the file is written without it, so threads
+ *  getting their rings don't wait for the disk. A ring's next never changes once it's in the
+ *  list, and its space isn't given back to the owner until the data is written.
+ */
+static size_t hlogDrainRings_priv()
+{
+    size_t total = 0;
+    gthread_Mutex_lock( ringMutex );
+    struct HLogRing* first = ringList;
+    gthread_Mutex_unlock( ringMutex );
+
+    for(struct HLogRing* ring = first; ring != NULL; ring = ring->next)
+    {
+        size_t tail = ring->tail;
+        size_t head = gatomic_load( &(ring->head), GATOMIC_ACQUIRE );
+        if(head == tail)
+            continue;
+
+        size_t len = head - tail;
+        size_t pos = tail & (HLOG_ASYNC_RING_SIZE - 1);
+        size_t first = (len < HLOG_ASYNC_RING_SIZE - pos ? len : HLOG_ASYNC_RING_SIZE - pos);
+
+        fwrite( ring->buff + pos, 1, first, curFile );
+        if(len > first) // Wrapped around.
+            fwrite( ring->buff, 1, len - first, curFile );
+
+        gatomic_store( &(ring->tail), head, GATOMIC_RELEASE );
+        total += len;
+    }
+    if(total)
+        fflush( curFile );
+    return total;
+}
+
+static void hlogDrainProc_priv(void* param)
+{
+    // Own a ring before taking the locks, so our own log calls won't deadlock on ringMutex.
+    hlogAcquireRing_priv();
+
+    gthread_Mutex_lock( drainMutex );
+    while( gatomic_load( &asyncRunning, GATOMIC_ACQUIRE ) )
+    {
+        hlogDrainRings_priv();
+        gthread_CondVar_wait_time( drainCond, drainMutex, HLOG_ASYNC_DRAIN_INTERVAL );
+    }
+    hlogDrainRings_priv(); // Final pass, after logging has been stopped.
+    gthread_Mutex_unlock( drainMutex );
+}
+
+static char hlogStartAsync_priv()
+{
+    if(!curFile)
+        return 1;
+    if(!ringMutex){
+        ringMutex = gthread_Mutex_init(0);
+        drainMutex = gthread_Mutex_init(0);
+        drainCond = gthread_CondVar_init();
+        ringKey = gthread_TLS_create( hlogRingRelease_priv );
+    }
+    // The drainer flushes after every batch, so full buffering is what we want.
+    setvbuf( curFile, NULL, _IOFBF, BUFSIZ );
+
+    gatomic_store( &asyncRunning, 1, GATOMIC_RELEASE );
+    if( !(drainThread = gthread_Thread_create( hlogDrainProc_priv, NULL )) ){
+        gatomic_store( &asyncRunning, 0, GATOMIC_RELEASE );
+        return 1;
+    }
+    return 0;
+}
+
+static void hlogAsyncWrite_priv(const char* fmt, va_list vl)
+{
+    struct HLogRing* ring = (threadRing ? threadRing : hlogAcquireRing_priv());
+    if(!ring){
+        gatomic_addFetch( &droppedCount, 1, GATOMIC_RELAXED );
+        return;
+    }
+
+    char msg[ HLOG_ASYNC_MAX_MSG ];
+    int len = vsnprintf( msg, sizeof(msg), fmt, vl );
+    if(len <= 0)
+        return;
+    if(len >= (int)sizeof(msg)) // Truncated.
+        len = sizeof(msg) - 1;
+
+    size_t head = ring->head; // Only this thread modifies head.
+    size_t tail = gatomic_load( &(ring->tail), GATOMIC_ACQUIRE );
+
+    while( HLOG_ASYNC_RING_SIZE - (head - tail) < (size_t)len )
+    {
+        if( asyncPolicy == HLOG_ASYNC_POLICY_DROP || !gatomic_load( &asyncRunning, GATOMIC_ACQUIRE ) ){
+            gatomic_addFetch( &droppedCount, 1, GATOMIC_RELAXED );
+            return;
+        }
+        // Block policy - kick the drainer and wait for space.
+        gthread_CondVar_notify( drainCond );
+        gthread_Thread_sleep( 1 );
+        tail = gatomic_load( &(ring->tail), GATOMIC_ACQUIRE );
+    }
+
+    size_t pos = head & (HLOG_ASYNC_RING_SIZE - 1);
+    size_t first = ((size_t)len < HLOG_ASYNC_RING_SIZE - pos ? (size_t)len : HLOG_ASYNC_RING_SIZE - pos);
+    memcpy( ring->buff + pos, msg, first );
+    if((size_t)len > first)
+        memcpy( ring->buff, msg + first, len - first );
+
+    gatomic_store( &(ring->head), head + len, GATOMIC_RELEASE );
+
+    // Wake the drainer early if the ring is getting full.
+    if( head + len - tail > HLOG_ASYNC_RING_SIZE / 2 )
+        gthread_CondVar_notify( drainCond );
+}
+
+//==========================================================//
+// - - - - - - - - - -  Binary section  - - - - - - - - - - //
+
+#define HLOG_BIN_MAX_RECORD  ( sizeof(HLogBinRecordHeader) + \
+                               HLOG_FORMAT_MAX_ARGS * (sizeof(uint16_t) + HLOG_BIN_MAX_STRING) + \
+                               HLOG_ASYNC_MAX_MSG + HLOG_BIN_ALIGN )
+
+/* Internal arg type codes - tell how to fetch the arg from va_list.
+ * Mapped to wire types (HLOG_BIN_ARG_*) when stored.
+ */
+#define HLOG_ARG_INT       'i'
+#define HLOG_ARG_LONG      'l'
+#define HLOG_ARG_LONGLONG  'q'
+#define HLOG_ARG_SIZE      'z'
+#define HLOG_ARG_INTMAX    'j'
+#define HLOG_ARG_PTRDIFF   't'
+#define HLOG_ARG_DOUBLE    'd'
+#define HLOG_ARG_LDOUBLE   'D'
+#define HLOG_ARG_STRING    's'
+#define HLOG_ARG_POINTER   'p'
+
+static char hlogWireArgType_priv(char type)
+{
+    switch(type){
+        case HLOG_ARG_INT:     return HLOG_BIN_ARG_I32;
+        case HLOG_ARG_DOUBLE:
+        case HLOG_ARG_LDOUBLE: return HLOG_BIN_ARG_DBL;
+        case HLOG_ARG_STRING:  return HLOG_BIN_ARG_STR;
+        case HLOG_ARG_POINTER: return HLOG_BIN_ARG_PTR;
+    }
+    return HLOG_BIN_ARG_I64;
+}
+
+// Derive the arg signature of a printf format. Args past HLOG_FORMAT_MAX_ARGS are not stored.
+static void hlogParseArgTypes_priv(HLogFormat* hf)
+{
+    int argc = 0;
+    for(const char* c = hf->fmt; *c && argc < HLOG_FORMAT_MAX_ARGS; c++)
+    {
+        if(*c != '%')
+            continue;
+        if(*(++c) == '%')
+            continue;
+
+        // Flags, width, precision. A '*' takes an int arg.
+        for(; *c && strchr("-+ #0123456789.*'", *c); c++){
+            if(*c == '*' && argc < HLOG_FORMAT_MAX_ARGS)
+                hf->argTypes[ argc++ ] = HLOG_ARG_INT;
+        }
+        // Length modifiers.
+        char type = HLOG_ARG_INT, longDbl = 0;
+        for(; *c && strchr("hlLqjzt", *c); c++){
+            if(*c == 'l')
+                type = (type == HLOG_ARG_LONG ? HLOG_ARG_LONGLONG : HLOG_ARG_LONG);
+            else if(*c == 'L')
+                longDbl = 1;
+            else if(*c != 'h')
+                type = *c;
+        }
+        if(!*c)
+            break;
+
+        switch(*c){
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                type = (longDbl ? HLOG_ARG_LDOUBLE : HLOG_ARG_DOUBLE);
+                break;
+            case 's':
+                type = HLOG_ARG_STRING;
+                break;
+            case 'p':
+                type = HLOG_ARG_POINTER;
+                break;
+            default: // %n and unknown conversions - nothing to store.
+                continue;
+        }
+        if(argc < HLOG_FORMAT_MAX_ARGS)
+            hf->argTypes[ argc++ ] = type;
+    }
+    hf->argc = argc;
+}
+
+#if defined _GRYLTOOL_POSIX
+
+/*! A mmap'd segment file.
+ *  - Writers reserve space with a fetch-add on offset, so it can run past the segment size.
+ *  - inflight counts writers holding a reservation. A full segment is retired, and unmapped
+ *    only when no writers are left.
+ *  - binEntering counts writers between loading binSegment and announcing themselves on it.
+ *    A retired structure is freed only when neither count is set, so nobody can touch it later.
+ */
+struct HLogSegment
+{
+    char* base;
+    int fd;
+    size_t offset;
+    int inflight;
+    struct HLogSegment* next;
+};
+
+static char binaryRunning = 0;
+static struct HLogSegment* binSegment = NULL;
+static struct HLogSegment* binRetired = NULL;
+static int binEntering = 0;
+static int binSegmentIndex = 0;
+static char binBaseName[ 256 ];
+static FILE* binFmtFile = NULL;
+static GrMutex binMutex = NULL; // Protects format registration and segment rotation.
+
+// Registered formats. Ids are process-wide, so every new dictionary starts with all of them.
+static HLogFormat** binFormats = NULL;
+static size_t binFormatCount = 0;
+static size_t binFormatCapacity = 0;
+
+static struct HLogSegment* hlogBinOpenSegment_priv()
+{
+    char path[ sizeof(binBaseName) + 32 ];
+    snprintf( path, sizeof(path), "%s.%d" HLOG_BIN_SEGMENT_EXT, binBaseName, binSegmentIndex );
+
+    struct HLogSegment* seg = calloc( 1, sizeof(struct HLogSegment) );
+    if(!seg)
+        return NULL;
+
+    if( (seg->fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 )) < 0 ){
+        free(seg);
+        return NULL;
+    }
+    if( ftruncate( seg->fd, HLOG_BIN_SEGMENT_SIZE ) != 0 ||
+        (seg->base = mmap( NULL, HLOG_BIN_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0 )) == MAP_FAILED )
+    {
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    binSegmentIndex++;
+    return seg;
+}
+
+// Unmaps the segment and trims the file to the used size.
+static void hlogBinUnmapSegment_priv(struct HLogSegment* seg)
+{
+    size_t used = (seg->offset < HLOG_BIN_SEGMENT_SIZE ? seg->offset : HLOG_BIN_SEGMENT_SIZE);
+    munmap( seg->base, HLOG_BIN_SEGMENT_SIZE );
+    if( ftruncate( seg->fd, used ) != 0 ){
+        // Not fatal - the tail is zero-filled, and the decoder stops there anyway.
+    }
+    close( seg->fd );
+    seg->base = NULL;
+}
+
+// Switch to a new segment, if "full" is still the current one.
+static void hlogBinRotate_priv(struct HLogSegment* full)
+{
+    gthread_Mutex_lock( binMutex );
+    if( binSegment == full ){
+        full->next = binRetired;
+        binRetired = full;
+        // If opening fails, all further events are dropped.
+        gatomic_store( &binSegment, hlogBinOpenSegment_priv(), GATOMIC_SEQ_CST );
+    }
+    // Check binEntering first - a writer which passed it has its inflight count visible.
+    char noneEntering = ( gatomic_load( &binEntering, GATOMIC_SEQ_CST ) == 0 );
+    struct HLogSegment** link = &binRetired;
+    while(*link){
+        struct HLogSegment* seg = *link;
+        if( gatomic_load( &(seg->inflight), GATOMIC_SEQ_CST ) == 0 ){
+            if(seg->base)
+                hlogBinUnmapSegment_priv( seg );
+            if(noneEntering){
+                *link = seg->next;
+                free( seg );
+                continue;
+            }
+        }
+        link = &(seg->next);
+    }
+    gthread_Mutex_unlock( binMutex );
+}
+
+static void hlogBinWriteFormat_priv(HLogFormat* hf, unsigned short id)
+{
+    fprintf( binFmtFile, "%u %u %u ", id, hf->level, hf->module );
+    for(int i = 0; i < hf->argc; i++)
+        fputc( hlogWireArgType_priv( hf->argTypes[i] ), binFmtFile );
+    fputs( (hf->argc ? " " : "- "), binFmtFile );
+
+    // Escape the format, so it fits on one line.
+    for(const char* c = hf->fmt; *c; c++){
+        switch(*c){
+            case '\n': fputs( "\\n", binFmtFile );  break;
+            case '\r': fputs( "\\r", binFmtFile );  break;
+            case '\t': fputs( "\\t", binFmtFile );  break;
+            case '\\': fputs( "\\\\", binFmtFile ); break;
+            default:   fputc( *c, binFmtFile );
+        }
+    }
+    fputc( '\n', binFmtFile );
+}
+
+// Returns format id, or HLOG_BIN_TEXT_ID if format can't be registered.
+static unsigned short hlogBinRegister_priv(HLogFormat* hf)
+{
+    unsigned short id = gatomic_load( &(hf->id), GATOMIC_ACQUIRE );
+    if(id)
+        return id;
+
+    gthread_Mutex_lock( binMutex );
+    if( !(id = gatomic_load( &(hf->id), GATOMIC_RELAXED )) && binFormatCount < 0xFFFF )
+    {
+        if(binFormatCount == binFormatCapacity){
+            size_t newCap = (binFormatCapacity ? binFormatCapacity * 2 : 64);
+            HLogFormat** arr = realloc( binFormats, newCap * sizeof(HLogFormat*) );
+            if(!arr){
+                gthread_Mutex_unlock( binMutex );
+                return HLOG_BIN_TEXT_ID;
+            }
+            binFormats = arr;
+            binFormatCapacity = newCap;
+        }
+        binFormats[ binFormatCount++ ] = hf;
+
+        hlogParseArgTypes_priv( hf );
+        id = (unsigned short)binFormatCount; // Ids start from 1, 0 is for text records.
+        if(binFmtFile){
+            hlogBinWriteFormat_priv( hf, id );
+            fflush( binFmtFile );
+        }
+        gatomic_store( &(hf->id), id, GATOMIC_RELEASE );
+    }
+    gthread_Mutex_unlock( binMutex );
+    return id;
+}
+
+// Copies a finished record into the current segment. Header size is stored last.
+static void hlogBinCommit_priv(char* rec, size_t size)
+{
+    size = (size + HLOG_BIN_ALIGN - 1) & ~(size_t)(HLOG_BIN_ALIGN - 1);
+    HLogBinRecordHeader* hdr = (HLogBinRecordHeader*)rec;
+
+    struct timespec tims;
+    clock_gettime( CLOCK_REALTIME, &tims );
+    hdr->timestamp = (uint64_t)tims.tv_sec * 1000000000ULL + tims.tv_nsec;
+    hdr->tid = (uint32_t)gthread_Thread_getID( NULL ); // Cached, no syscall.
+
+    while(1)
+    {
+        gatomic_addFetch( &binEntering, 1, GATOMIC_SEQ_CST );
+        struct HLogSegment* seg = gatomic_load( &binSegment, GATOMIC_SEQ_CST );
+        if(!seg){
+            gatomic_subFetch( &binEntering, 1, GATOMIC_SEQ_CST );
+            gatomic_addFetch( &droppedCount, 1, GATOMIC_RELAXED );
+            return;
+        }
+        // Announce ourselves before checking that the segment is still current,
+        // so a rotating thread won't unmap it under us.
+        gatomic_addFetch( &(seg->inflight), 1, GATOMIC_SEQ_CST );
+        gatomic_subFetch( &binEntering, 1, GATOMIC_SEQ_CST );
+        if( gatomic_load( &binSegment, GATOMIC_SEQ_CST ) != seg ){
+            gatomic_subFetch( &(seg->inflight), 1, GATOMIC_SEQ_CST );
+            continue;
+        }
+
+        size_t pos = gatomic_fetchAdd( &(seg->offset), size, GATOMIC_RELAXED );
+        if( pos + size <= HLOG_BIN_SEGMENT_SIZE ){
+            memcpy( seg->base + pos + sizeof(hdr->size), rec + sizeof(hdr->size), size - sizeof(hdr->size) );
+            gatomic_store( (uint16_t*)(seg->base + pos), (uint16_t)size, GATOMIC_RELEASE );
+            gatomic_subFetch( &(seg->inflight), 1, GATOMIC_SEQ_CST );
+            return;
+        }
+        gatomic_subFetch( &(seg->inflight), 1, GATOMIC_SEQ_CST );
+        hlogBinRotate_priv( seg );
+    }
+}
+
+static char* hlogBinPutString_priv(char* pos, const char* str, size_t maxLen)
+{
+    if(!str)
+        str = "(null)";
+    size_t len = strnlen( str, maxLen );
+    uint16_t len16 = (uint16_t)len;
+    memcpy( pos, &len16, sizeof(len16) );
+    memcpy( pos + sizeof(len16), str, len );
+    return pos + sizeof(len16) + len;
+}
+
+static void hlogBinText_priv(const char* fmt, va_list vl)
+{
+    char rec[ HLOG_BIN_MAX_RECORD ];
+    char msg[ HLOG_ASYNC_MAX_MSG ];
+    if( vsnprintf( msg, sizeof(msg), fmt, vl ) < 0 )
+        return;
+
+    ((HLogBinRecordHeader*)rec)->fmtId = HLOG_BIN_TEXT_ID;
+    char* end = hlogBinPutString_priv( rec + sizeof(HLogBinRecordHeader), msg, sizeof(msg) );
+    memset( end, 0, HLOG_BIN_ALIGN );
+    hlogBinCommit_priv( rec, end - rec );
+}
+
+static void hlogBinEvent_priv(HLogFormat* hf, va_list vl)
+{
+    unsigned short id = hlogBinRegister_priv( hf );
+    if(id == HLOG_BIN_TEXT_ID){
+        hlogBinText_priv( hf->fmt, vl );
+        return;
+    }
+
+    char rec[ HLOG_BIN_MAX_RECORD ];
+    ((HLogBinRecordHeader*)rec)->fmtId = id;
+    char* pos = rec + sizeof(HLogBinRecordHeader);
+
+    for(int i = 0; i < hf->argc; i++)
+    {
+        int32_t i32;
+        int64_t i64;
+        double dbl;
+        void* ptr;
+        switch( hf->argTypes[i] ){
+            case HLOG_ARG_INT:
+                i32 = va_arg( vl, int );
+                memcpy( pos, &i32, sizeof(i32) );
+                pos += sizeof(i32);
+                continue;
+            case HLOG_ARG_DOUBLE:
+            case HLOG_ARG_LDOUBLE:
+                dbl = (hf->argTypes[i] == HLOG_ARG_DOUBLE ? va_arg( vl, double ) : (double)va_arg( vl, long double ));
+                memcpy( pos, &dbl, sizeof(dbl) );
+                pos += sizeof(dbl);
+                continue;
+            case HLOG_ARG_STRING:
+                pos = hlogBinPutString_priv( pos, va_arg( vl, const char* ), HLOG_BIN_MAX_STRING );
+                continue;
+            case HLOG_ARG_POINTER:
+                ptr = va_arg( vl, void* );
+                i64 = (int64_t)(uintptr_t)ptr;
+                break;
+            case HLOG_ARG_LONG:     i64 = va_arg( vl, long );      break;
+            case HLOG_ARG_LONGLONG: i64 = va_arg( vl, long long ); break;
+            case HLOG_ARG_SIZE:     i64 = va_arg( vl, size_t );    break;
+            case HLOG_ARG_INTMAX:   i64 = va_arg( vl, intmax_t );  break;
+            default:                i64 = va_arg( vl, ptrdiff_t ); break;
+        }
+        memcpy( pos, &i64, sizeof(i64) );
+        pos += sizeof(i64);
+    }
+    memset( pos, 0, HLOG_BIN_ALIGN );
+    hlogBinCommit_priv( rec, pos - rec );
+}
+
+static char hlogStartBinary_priv(const char* fname)
+{
+    char path[ sizeof(binBaseName) + 32 ];
+    if( strlen(fname) >= sizeof(binBaseName) )
+        return 1;
+    strcpy( binBaseName, fname );
+    snprintf( path, sizeof(path), "%s" HLOG_BIN_FMT_EXT, binBaseName );
+
+    if(!binMutex)
+        binMutex = gthread_Mutex_init(0);
+
+    gthread_Mutex_lock( binMutex );
+    if( !(binFmtFile = fopen( path, "w" )) ){
+        gthread_Mutex_unlock( binMutex );
+        return 1;
+    }
+    fprintf( binFmtFile, "# hlog binary format dictionary v%d\n", HLOG_BIN_VERSION );
+    for(size_t i = 0; i < binFormatCount; i++)
+        hlogBinWriteFormat_priv( binFormats[i], (unsigned short)(i + 1) );
+    fflush( binFmtFile );
+
+    // Segments of an older log by this name don't match the new dictionary. The decoder reads
+    // on until a segment is missing, so they all go.
+    for(int i = 0; ; i++){
+        snprintf( path, sizeof(path), "%s.%d" HLOG_BIN_SEGMENT_EXT, binBaseName, i );
+        if( unlink( path ) != 0 )
+            break;
+    }
+
+    binSegmentIndex = 0;
+    binSegment = hlogBinOpenSegment_priv();
+    gthread_Mutex_unlock( binMutex );
+
+    if(!binSegment){
+        fclose( binFmtFile );
+        binFmtFile = NULL;
+        return 1;
+    }
+    gatomic_store( &binaryRunning, 1, GATOMIC_RELEASE );
+    return 0;
+}
+
+static void hlogStopBinary_priv()
+{
+    gatomic_store( &binaryRunning, 0, GATOMIC_RELEASE );
+
+    gthread_Mutex_lock( binMutex );
+    struct HLogSegment* seg = binSegment;
+    gatomic_store( &binSegment, NULL, GATOMIC_SEQ_CST );
+    if(seg){
+        seg->next = binRetired;
+        binRetired = seg;
+    }
+    // No new reservations can start now, wait for the ones in flight.
+    while( gatomic_load( &binEntering, GATOMIC_SEQ_CST ) != 0 )
+        sched_yield();
+    while(binRetired){
+        seg = binRetired;
+        while( gatomic_load( &(seg->inflight), GATOMIC_SEQ_CST ) != 0 )
+            sched_yield();
+        if(seg->base)
+            hlogBinUnmapSegment_priv( seg );
+        binRetired = seg->next;
+        free( seg );
+    }
+    fclose( binFmtFile );
+    binFmtFile = NULL;
+    gthread_Mutex_unlock( binMutex );
+}
+
+#endif // _GRYLTOOL_POSIX
+
+//==========================================================//
+// - - - - - - - - - - -  Public API - - - - - - - - - - - -//
+
+FILE* hlogSetFile(const char* fname, char mode)
+{
+    hlogCloseFile();
+    const char* oformat = ( (mode & HLOG_MODE_APPEND) ? "aw" : "w" ); // Set format according to mode flags
+    if( !(curFile = fopen(fname, oformat)) )
+        return NULL;
+
+    if(mode & HLOG_MODE_BINARY){
+        #if defined _GRYLTOOL_POSIX
+            if( hlogStartBinary_priv(fname) == 0 )
+                return curFile;
+        #endif
+        // Fall back to text logging.
+        fprintf( curFile, "hlog: ERROR: can't start binary logging to %s\n", fname );
+    }
+
+    if(mode & HLOG_MODE_ASYNC)
+        hlogStartAsync_priv();
+    else if(mode & HLOG_MODE_UNBUFFERED) // check for UNBUFFERED bit
+        setbuf(curFile, NULL); // Disable buffering.
+    return curFile;
+}
+
+void hlogSetFileFromFile(FILE* file, char mode)
+{
+    hlogCloseFile();
+    curFile = file;
+    if(mode & HLOG_MODE_ASYNC)
+        hlogStartAsync_priv();
+    else if(mode & HLOG_MODE_UNBUFFERED)
+        setbuf(curFile, NULL); // Disable buffering.
+}
+
+/* In async mode, stops the drainer after a final pass.
+ * In binary mode, unmaps and trims the segments.
+ * Messages from threads still logging while closing may be lost.
+ */
+void hlogCloseFile()
+{
+    #if defined _GRYLTOOL_POSIX
+        if(binaryRunning)
+            hlogStopBinary_priv();
+    #endif
+    if(drainThread){
+        gatomic_store( &asyncRunning, 0, GATOMIC_RELEASE );
+        gthread_CondVar_notify( drainCond );
+        gthread_Thread_join( drainThread, 1 );
+        drainThread = NULL;
+    }
+    if(curFile && curFile!=stdout && curFile!=stderr)
+        fclose(curFile);
+    curFile = NULL;
+}
+
+FILE* hlogGetFile()
+{
+    return curFile;
+}
+
+void hlogSetAsyncPolicy(char policy)
+{
+    asyncPolicy = policy;
+}
+
+unsigned long hlogGetDroppedCount()
+{
+    return gatomic_load( &droppedCount, GATOMIC_RELAXED );
+}
+size_t hlogGetAsyncRingCount()
+{
+    if(!ringMutex)
+        return 0;
+    gthread_Mutex_lock( ringMutex );
+    size_t count = ringCount;
+    gthread_Mutex_unlock( ringMutex );
+    return count;
+}
+
+// Writes all pending async data to file from the calling thread.
+void hlogFlush()
+{
+    if( gatomic_load( &asyncRunning, GATOMIC_ACQUIRE ) ){
+        gthread_Mutex_lock( drainMutex );
+        hlogDrainRings_priv();
+        gthread_Mutex_unlock( drainMutex );
+    }
+    else if(curFile)
+        fflush(curFile);
+}
+
+// Text output - to the async rings, or straight to file.
+static void hlogVWrite_priv(const char* fmt, va_list vl)
+{
+    if(!curFile)
+        curFile = HLOG_DEFAULT_LOGFILE;
+
+    if( gatomic_load( &asyncRunning, GATOMIC_ACQUIRE ) )
+        hlogAsyncWrite_priv( fmt, vl );
+    else
+        vfprintf( curFile, fmt, vl ); // Call vith Variadic Arguments.
+}
+
+void hlogf(const char* fmt, ...)
+{
+    if(!active)
+        return;
+
+    va_list vl;
+    va_start(vl, fmt);
+
+    #if defined _GRYLTOOL_POSIX
+    if( gatomic_load( &binaryRunning, GATOMIC_ACQUIRE ) )
+        hlogBinText_priv( fmt, vl ); // No static format - store the formatted text.
+    else
+    #endif
+        hlogVWrite_priv( fmt, vl );
+
+    va_end(vl);
+}
+
+void hlogEvent(HLogFormat* format, ...)
+{
+    if(!active)
+        return;
+
+    va_list vl;
+    va_start(vl, format);
+
+    #if defined _GRYLTOOL_POSIX
+    if( gatomic_load( &binaryRunning, GATOMIC_ACQUIRE ) )
+        hlogBinEvent_priv( format, vl );
+    else
+    #endif
+        hlogVWrite_priv( format->fmt, vl );
+
+    va_end(vl);
+}
+
+char hlogIsActive(){
+    return active;
+}
+
+void hlogSetActive(char val){
+    active = val;
+    hlogUpdateGate_priv();
+}
+
+void hlogSetLevel(int level){
+    curLevel = level;
+    hlogUpdateGate_priv();
+}
+
+int hlogGetLevel(){
+    return curLevel;
+}
+
+void hlogSetModuleMask(unsigned int mask){
+    curModuleMask = mask;
+    hlogUpdateGate_priv();
+}
+
+unsigned int hlogGetModuleMask(){
+    return curModuleMask;
+}
+
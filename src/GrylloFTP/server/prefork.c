@@ -0,0 +1,231 @@
+#include "prefork.h"
+#include <grylthread.h>
+#include <gatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#if defined _GRYLTOOL_POSIX
+
+#include <sys/mman.h>
+
+// Master state.
+static GrEvent masterEvent = NULL;
+static int shutdownRequested = 0;
+
+typedef struct
+{
+    int index;
+    GrProcess proc;
+    long restartAt;   // ms, when proc is NULL.
+    long restartDelay;
+    long startedAt;   // ms
+} GsrvWorkerSlot;
+
+typedef struct
+{
+    SOCKET listenSock;
+    GsrvWorkerStats* stats;
+    int (*workerLoop)(SOCKET, GsrvWorkerStats*);
+} GsrvWorkerParams;
+
+static long nowMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void onMasterShutdownSignal(int sig)
+{
+    gatomic_store(&shutdownRequested, 1, GATOMIC_RELAXED);
+    gthread_Event_signal(masterEvent);
+}
+
+static void onMasterChildSignal(int sig)
+{
+    gthread_Event_signal(masterEvent);
+}
+
+// Runs in the forked child.
+static void workerProc(void* param)
+{
+    GsrvWorkerParams* wp = (GsrvWorkerParams*)param;
+
+    // The master's handlers and Event belong to the master.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    gthread_Event_destroy(&masterEvent);
+
+    int ret = wp->workerLoop(wp->listenSock, wp->stats);
+
+    fflush(NULL);
+    _exit(ret);
+}
+
+static char startWorker(GsrvWorkerSlot* slot, GsrvWorkerParams* params)
+{
+    gatomic_store(&(params->stats->connectionsActive), 0, GATOMIC_RELAXED);
+    gatomic_store(&(params->stats->startTime), (long)time(NULL), GATOMIC_RELAXED);
+
+    if( !(slot->proc = gthread_Process_fork(workerProc, params)) ){
+        printf("[master] Failed to fork worker %d.\n", slot->index);
+        return -1;
+    }
+    slot->startedAt = nowMillis();
+    gatomic_store(&(params->stats->pid), gthread_Process_getID(slot->proc), GATOMIC_RELAXED);
+    printf("[master] Worker %d started, pid %ld.\n", slot->index, gthread_Process_getID(slot->proc));
+    return 0;
+}
+
+static void printStats(GsrvWorkerStats* stats, int workerCount)
+{
+    long accepted = 0, active = 0, rejected = 0, restarts = 0;
+    for(int i = 0; i < workerCount; i++){
+        accepted += gatomic_load(&(stats[i].connectionsAccepted), GATOMIC_RELAXED);
+        active   += gatomic_load(&(stats[i].connectionsActive), GATOMIC_RELAXED);
+        rejected += gatomic_load(&(stats[i].connectionsRejected), GATOMIC_RELAXED);
+        restarts += gatomic_load(&(stats[i].restarts), GATOMIC_RELAXED);
+    }
+    printf("[master] %d workers: %ld connections accepted, %ld active, %ld rejected, %ld restarts.\n",
+           workerCount, accepted, active, rejected, restarts);
+}
+
+#endif // _GRYLTOOL_POSIX
+
+int gsrvRunPreforkMaster(SOCKET listenSock, int workerCount, int (*workerLoop)(SOCKET, GsrvWorkerStats*))
+{
+#if defined _GRYLTOOL_POSIX
+    if(workerCount < 1 || workerCount > GSRV_PREFORK_MAX_WORKERS || !workerLoop){
+        printf("[master] Invalid worker count: %d\n", workerCount);
+        return -1;
+    }
+
+    // Workers share the listener. Only one of them wins each connection, so the rest must not block.
+    gsockSetOption(listenSock, GSOCK_OPT_NONBLOCK, 1);
+
+    GsrvWorkerStats* stats = mmap(NULL, sizeof(GsrvWorkerStats) * workerCount, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stats == MAP_FAILED){
+        printf("[master] Failed to map the shared stats: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(stats, 0, sizeof(GsrvWorkerStats) * workerCount);
+
+    if( !(masterEvent = gthread_Event_create()) ){
+        munmap(stats, sizeof(GsrvWorkerStats) * workerCount);
+        return -1;
+    }
+    gatomic_store(&shutdownRequested, 0, GATOMIC_RELAXED);
+    signal(SIGINT, onMasterShutdownSignal);
+    signal(SIGTERM, onMasterShutdownSignal);
+    signal(SIGCHLD, onMasterChildSignal);
+
+    GsrvWorkerSlot slots[GSRV_PREFORK_MAX_WORKERS];
+    GsrvWorkerParams params[GSRV_PREFORK_MAX_WORKERS];
+    int started = 0;
+
+    for(int i = 0; i < workerCount; i++){
+        memset(slots + i, 0, sizeof(GsrvWorkerSlot));
+        slots[i].index = i;
+        params[i].listenSock = listenSock;
+        params[i].stats = stats + i;
+        params[i].workerLoop = workerLoop;
+        if(startWorker(slots + i, params + i) == 0)
+            started++;
+    }
+
+    int retval = (started ? 0 : -1);
+    long nextStats = nowMillis() + GSRV_PREFORK_STATS_INTERVAL;
+
+    while(started && !gatomic_load(&shutdownRequested, GATOMIC_RELAXED))
+    {
+        long now = nowMillis();
+        long timeout = nextStats - now;
+        for(int i = 0; i < workerCount; i++){
+            if(!slots[i].proc && slots[i].restartAt - now < timeout)
+                timeout = slots[i].restartAt - now;
+        }
+        gthread_Event_wait_time(masterEvent, (timeout > 0 ? timeout : 0));
+        gthread_Event_drain(masterEvent);
+
+        if(gatomic_load(&shutdownRequested, GATOMIC_RELAXED))
+            break;
+
+        // Reap exited workers.
+        now = nowMillis();
+        for(int i = 0; i < workerCount; i++)
+        {
+            if(!slots[i].proc || gthread_Process_isRunning(slots[i].proc))
+                continue;
+
+            int status = gthread_Process_getExitStatus(slots[i].proc);
+            gthread_Process_join(slots[i].proc);
+            slots[i].proc = NULL;
+
+            if(status == GSRV_WORKER_EXIT_SHUTDOWN){
+                printf("[master] Worker %d requested server shutdown.\n", i);
+                gatomic_store(&shutdownRequested, 1, GATOMIC_RELAXED);
+                break;
+            }
+            if(status >= GTHREAD_PROCESS_SIGNALED)
+                printf("[master] Worker %d was killed by signal %d.\n", i, status - GTHREAD_PROCESS_SIGNALED);
+            else
+                printf("[master] Worker %d exited with status %d.\n", i, status);
+
+            // Quick crashes back off, a worker which ran for a while is restarted right away.
+            if(now - slots[i].startedAt < 1000)
+                slots[i].restartDelay = (slots[i].restartDelay ? slots[i].restartDelay * 2 : 250);
+            else
+                slots[i].restartDelay = 0;
+            if(slots[i].restartDelay > GSRV_PREFORK_MAX_RESTART_DELAY)
+                slots[i].restartDelay = GSRV_PREFORK_MAX_RESTART_DELAY;
+            slots[i].restartAt = now + slots[i].restartDelay;
+        }
+
+        if(gatomic_load(&shutdownRequested, GATOMIC_RELAXED))
+            break;
+
+        // Restart the ones which are due.
+        for(int i = 0; i < workerCount; i++){
+            if(!slots[i].proc && slots[i].restartAt <= now){
+                gatomic_fetchAdd(&(stats[i].restarts), 1, GATOMIC_RELAXED);
+                if(startWorker(slots + i, params + i) != 0)
+                    slots[i].restartAt = now + GSRV_PREFORK_MAX_RESTART_DELAY;
+            }
+        }
+
+        if(now >= nextStats){
+            printStats(stats, workerCount);
+            nextStats = now + GSRV_PREFORK_STATS_INTERVAL;
+        }
+    }
+
+    printf("[master] Shutting down the workers...\n");
+    for(int i = 0; i < workerCount; i++){
+        if(slots[i].proc)
+            gthread_Process_terminate(slots[i].proc);
+    }
+    for(int i = 0; i < workerCount; i++){
+        if(slots[i].proc){
+            gthread_Process_join(slots[i].proc);
+            slots[i].proc = NULL;
+        }
+    }
+    printStats(stats, workerCount);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    gthread_Event_destroy(&masterEvent);
+    munmap(stats, sizeof(GsrvWorkerStats) * workerCount);
+
+    return retval;
+#else
+    printf("Pre-fork mode is not supported on this platform.\n");
+    return -1;
+#endif // _GRYLTOOL_POSIX
+}
@@ -0,0 +1,39 @@
+#ifndef PREFORK_H_INCLUDED
+#define PREFORK_H_INCLUDED
+
+#include <grylsocks.h>
+
+/*  Pre-forked server mode.
+    - The master binds the listener, and forks workers which all accept on it, each running
+      its own select() loop. A crashing session handler takes down only its worker.
+    - Crashed workers are restarted. Workers crashing right after start get restarted with
+      a growing delay, so a broken build doesn't turn into a fork loop.
+    - Each worker has a stats slot in shared memory. The master prints the totals.
+    POSIX only. */
+
+#define GSRV_PREFORK_MAX_WORKERS       64
+#define GSRV_PREFORK_STATS_INTERVAL    10000  // ms between stats prints.
+#define GSRV_PREFORK_MAX_RESTART_DELAY 8000   // ms
+
+// Worker loop return values, which are also the worker exit codes.
+#define GSRV_WORKER_EXIT_STOPPED   0  // Stopped by a signal.
+#define GSRV_WORKER_EXIT_ERROR     1
+#define GSRV_WORKER_EXIT_SHUTDOWN  2  // A client requested server shutdown.
+
+// Per-worker stats, shared between the master and the worker. Access with gatomic_*.
+typedef struct
+{
+    long pid;
+    long startTime;
+    long restarts;
+    long connectionsAccepted;
+    long connectionsActive;
+    long connectionsRejected;
+} GsrvWorkerStats;
+
+/*  Runs the master until SIGINT/SIGTERM, or until a worker exits with GSRV_WORKER_EXIT_SHUTDOWN.
+    - workerLoop is run in every worker with the listener (set to non-blocking) and its stats slot.
+    - Returns 0 on clean shutdown, < 0 if the workers couldn't be started. */
+int gsrvRunPreforkMaster(SOCKET listenSock, int workerCount, int (*workerLoop)(SOCKET, GsrvWorkerStats*));
+
+#endif // PREFORK_H_INCLUDED
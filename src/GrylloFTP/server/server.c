@@ -8,8 +8,13 @@
 #include <stdio.h>
 #include <string.h>
 
-#include <gsrvsocks.h>
+#include <signal.h>
+
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <gatomic.h>
 #include "service.h"
+#include "prefork.h"
 
 // Need to link with Ws2_32.lib
 // #pragma comment (lib, "Ws2_32.lib")
@@ -17,40 +22,35 @@
 
 // App Data.
 
-// Arg: Port number on which we'll listen.
-int runServer(const char* port)
+// Signaled on SIGINT/SIGTERM. It's in the select() set, so the loop wakes up and exits cleanly.
+static GrEvent shutdownEvent = NULL;
+
+static void onShutdownSignal(int sig)
 {
-    printf("Init start vars... ");
+    gthread_Event_signal(shutdownEvent);
+}
 
+// Arg: Port number on which we'll listen. Returns INVALID_SOCKET on error.
+SOCKET createListenSocket(const char* port)
+{
     int iResult;
-
     SOCKET ListenSocket = INVALID_SOCKET;
-    GsrvClientSocket ClientSocket[GSRV_MAX_CLIENTS];
-
-    fd_set readfds; // The fd_set of the socket descriptors which we will check with SELECT.
-    SOCKET max_fds; // The highest file desctiptor number, needed for SELECT to check.
 
-    // Optimize the program work by allocating variable memory on the stack at the beginning of the program.
     struct sockaddr_in sin;
     socklen_t sinlen = sizeof(sin);
 
     struct addrinfo *result = NULL;
     struct addrinfo hints;
 
-    int iSendResult;
-
-    //============================================//
-    // Init WinSocks.
-    printf("Done.\nInit WinSock... ");
-    if(gsockInitSocks() != 0)
-        return 1;
-
-    printf("Done.\nInit addrinfo's and SockBuffs ...");
-
-    // Set the variables
-    for(int i=0; i<GSRV_MAX_CLIENTS; i++){
-        gsrvInitClientSocket(ClientSocket+i, INVALID_SOCKET, 0);
+    // Co-located clients can come over a unix socket ("unix:/path" instead of the port).
+    if(gsockIsUnixAddress(port)){
+        printf("Creating a unix socket listener on %s... ", port + strlen(GSOCK_UNIX_PREFIX));
+        ListenSocket = gsockListenSocket(0, port, AF_UNIX, SOCK_STREAM, 0, 0);
+        printf(ListenSocket == INVALID_SOCKET ? "Failed.\n" : "Done.\n");
+        return ListenSocket;
     }
+
+    printf("Init addrinfo's... ");
     memset(&hints, 0, sizeof(hints));
 
     // Set the hints for the preferred sockaddr properties.
@@ -66,22 +66,30 @@ int runServer(const char* port)
 
     if ( iResult != 0 ) {
         printf("getaddrinfo failed with error: %d\n", iResult);
-        gsockSockCleanup();
-        return 1;
+        return INVALID_SOCKET;
     }
 
     // Create a listening SOCKET for connecting to a client.
     printf("Done.\nCreate a ListenSocket (socket())...");
     ListenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
     if (ListenSocket == INVALID_SOCKET) {
-        return gsockErrorCleanup(INVALID_SOCKET, result, "socket failed with error", 1, 1);
+        gsockErrorCleanup(INVALID_SOCKET, result, "socket failed with error", 0, 1);
+        return INVALID_SOCKET;
     }
+    // Restarting the server shouldn't wait for the old connections' TIME_WAIT.
+    gsockSetOption(ListenSocket, GSOCK_OPT_REUSEADDR, 1);
+    // Clients which send first (and have our cookie) get their request in with the SYN.
+    gsockSetOption(ListenSocket, GSOCK_OPT_FASTOPEN, GSOCK_FASTOPEN_DEFAULT_QUEUE);
+    // Accepted sockets inherit it. A client pipelining its commands gets each reply at once,
+    // not the second one held back until the first is ACKed.
+    gsockSetOption(ListenSocket, GSOCK_OPT_NODELAY, 1);
 
     // Setup the TCP listening socket, bind it to a local server address.
     printf("Done.\nBinding ListenSocket... ");
     iResult = bind( ListenSocket, result->ai_addr, (int)(result->ai_addrlen));
     if (iResult == SOCKET_ERROR) {
-        return gsockErrorCleanup(ListenSocket, result, "bind failed with error", 1, 1);
+        gsockErrorCleanup(ListenSocket, result, "bind failed with error", 0, 1);
+        return INVALID_SOCKET;
     }
 
     printf("Done.\nFreeAddrInfo()... ");
@@ -92,7 +100,8 @@ int runServer(const char* port)
     printf("Done.\nlisten(ListenSocket)... ");
     iResult = listen(ListenSocket, SOMAXCONN);
     if (iResult == SOCKET_ERROR) {
-        return gsockErrorCleanup(ListenSocket, NULL, "listen failed with error", 1, 1);
+        gsockErrorCleanup(ListenSocket, NULL, "listen failed with error", 0, 1);
+        return INVALID_SOCKET;
     }
 
     //===================================================//
@@ -103,12 +112,48 @@ int runServer(const char* port)
     else
         printf("\nThe server is listening on port: %d\n", ntohs(sin.sin_port));
 
+    return ListenSocket;
+}
+
+/*  Runs the accept/receive loop on a listening socket. Used both by the single-process server,
+    and by each worker in pre-fork mode, in which case stats is the worker's shared slot.
+    Returns GSRV_WORKER_EXIT_*. */
+int runServerLoop(SOCKET ListenSocket, GsrvWorkerStats* stats)
+{
+    GsrvClientSocket ClientSocket[GSRV_MAX_CLIENTS];
+
+    fd_set readfds; // The fd_set of the socket descriptors which we will check with SELECT.
+    SOCKET max_fds; // The highest file desctiptor number, needed for SELECT to check.
+
+    // Optimize the program work by allocating variable memory on the stack at the beginning of the program.
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+
+    GsrvWorkerStats localStats;
+    if(!stats){
+        memset(&localStats, 0, sizeof(localStats));
+        stats = &localStats;
+    }
+
+    printf("Init the shutdown Event... ");
+    if( !(shutdownEvent = gthread_Event_create()) )
+        return GSRV_WORKER_EXIT_ERROR;
+    int shutdownFd = gthread_Event_getFD(shutdownEvent);
+    signal(SIGINT, onShutdownSignal);
+    signal(SIGTERM, onShutdownSignal);
+
+    // Set the variables
+    for(int i=0; i<GSRV_MAX_CLIENTS; i++){
+        gsrvInitClientSocket(ClientSocket+i, INVALID_SOCKET, 0);
+    }
+
     // Initialize and start accept/receive loop.
     // Some state vars. Timeout to use in SELECT and how many conns were acceptz0red.
     int connectionsAccepted = 0;
     int selectErrCount = 0;
     struct timeval tm;
 
+    int exitCode = GSRV_WORKER_EXIT_STOPPED;
     char exitLoop = 0;
 
     printf("Done.\n\nStarting Loop... \n");
@@ -122,9 +167,10 @@ int runServer(const char* port)
         tm.tv_sec = 0;
         tm.tv_usec = 1;
 
-        // Add ListenSocket to set
+        // Add ListenSocket and the shutdown Event to set
         FD_SET(ListenSocket, &readfds);
-        max_fds = ListenSocket;
+        FD_SET(shutdownFd, &readfds);
+        max_fds = (ListenSocket > shutdownFd ? ListenSocket : shutdownFd);
 
         char haveActiveJobs = 0;
 
@@ -150,49 +196,76 @@ int runServer(const char* port)
         // If not, we wait until one of the sockets get the data ready in the queue.
         // Returns total number of ready sockets in fds, or <0 if error.
 
-        int activity = select(0, &readfds, NULL, NULL, (haveActiveJobs ? &tm : NULL));
+        int activity = select(max_fds + 1, &readfds, NULL, NULL, (haveActiveJobs ? &tm : NULL));
 
         if(activity < 0){ // Error occured
+            if(gsockGetLastError() == EINTR) // A signal - the Event will be readable on the next round.
+                continue;
             printf("Select error occured: %d\n", gsockGetLastError());
-            if(selectErrCount > 10)
+            if(++selectErrCount > 10){
+                exitCode = GSRV_WORKER_EXIT_ERROR;
                 break; // If more than 10 consecutive errors occured, break the loop.
+            }
             continue; // If not, try in the next loop;
         }
         else if(selectErrCount != 0)
             selectErrCount = 0; // If no error occured, clear the consecutive error counter.
 
 
+        // Shutdown requested by a signal.
+        if(FD_ISSET(shutdownFd, &readfds))
+        {
+            printf("Got %lu shutdown signal(s). Closing...\n", gthread_Event_drain(shutdownEvent));
+            break;
+        }
+
         // Check if the master ListenSocket is ready to read (has a pending connection).
         if(FD_ISSET(ListenSocket, &readfds))
         {
             // Extract first request from a connection queue.
             // Blocks the thread until connection is received. However, it's not blocked here because we already know a request is pending.
+            // In pre-fork mode the listener is shared and non-blocking, and another worker may
+            // have taken the connection already.
+            sinlen = sizeof(sin);
             SOCKET newClient = accept(ListenSocket, (struct sockaddr*)&sin, &sinlen);
-            if(newClient == INVALID_SOCKET){
-                printf("accept failed with error: %d\n", gsockGetLastError());
+            int acceptErr = (newClient == INVALID_SOCKET ? gsockGetLastError() : 0);
+            if(acceptErr == EAGAIN || acceptErr == EWOULDBLOCK || acceptErr == ECONNABORTED || acceptErr == EINTR)
+                ; // Nothing to accept this time.
+            else if(newClient == INVALID_SOCKET){
+                printf("accept failed with error: %d\n", acceptErr);
+                exitCode = GSRV_WORKER_EXIT_ERROR;
                 break;
             }
-            printf("New connection: \n SOCKET fd: %d\n ip: %s\n port : %d \n\n" , newClient , inet_ntoa(sin.sin_addr) , ntohs(sin.sin_port));
+            else{
+                if(sin.sin_family == AF_INET)
+                    printf("New connection: \n SOCKET fd: %d\n ip: %s\n port : %d \n\n" , newClient , inet_ntoa(sin.sin_addr) , ntohs(sin.sin_port));
+                else
+                    printf("New local connection: \n SOCKET fd: %d\n\n", newClient);
 
-            // -- Check if IP is banned and stuff.
+                // -- Check if IP is banned and stuff.
 
-            // Now add this client socket to the structure.
-            char added = 0;
-            for(int i=0; i < GSRV_MAX_CLIENTS; i++)
-            {
-                if(gsrvIsClientSocketEmpty(ClientSocket+i)) // Free position, can add!
+                // Now add this client socket to the structure.
+                char added = 0;
+                for(int i=0; i < GSRV_MAX_CLIENTS; i++)
                 {
-                    gsrvSetupNewClientSocket(ClientSocket+i, newClient);
+                    if(gsrvIsClientSocketEmpty(ClientSocket+i)) // Free position, can add!
+                    {
+                        gsrvSetupNewClientSocket(ClientSocket+i, newClient);
 
-                    added = 1;
-                    break;
+                        added = 1;
+                        break;
+                    }
+                }
+                if(added){
+                    connectionsAccepted++;
+                    gatomic_fetchAdd(&(stats->connectionsAccepted), 1, GATOMIC_RELAXED);
+                    gatomic_fetchAdd(&(stats->connectionsActive), 1, GATOMIC_RELAXED);
+                }
+                else{
+                    printf("Client can't be added, maximum number reached.\n");
+                    gatomic_fetchAdd(&(stats->connectionsRejected), 1, GATOMIC_RELAXED);
+                    gsockCloseSocket(newClient);
                 }
-            }
-            if(added)
-                connectionsAccepted++;
-            else{
-                printf("Client can't be added, maximum number reached.\n");
-                gsockCloseSocket(newClient);
             }
 
             // -- Perform new connection start tasks, like application-level handshakes, data receive and stuff.
@@ -203,22 +276,27 @@ int runServer(const char* port)
         // Or if they have other jobs unfinished, do those jobs.
         for(int i=0; i<GSRV_MAX_CLIENTS; i++)
         {
-            if(FD_ISSET( ClientSocket[i].cliSock, &readfds ))
+            if(ClientSocket[i].cliSock != INVALID_SOCKET && FD_ISSET( ClientSocket[i].cliSock, &readfds ))
                ClientSocket[i].status |= GSRV_STATUS_RECEIVE_PENDING;
 
             // === Do the Test Toy Stuff === //
             if(ClientSocket[i].status)
             {
-                int retStat = performToyOperation(ClientSocket+i);
+                int retStat = gsrvPerformToyOperation(ClientSocket+i);
+                if(ClientSocket[i].cliSock == INVALID_SOCKET) // Connection was closed.
+                    gatomic_fetchSub(&(stats->connectionsActive), 1, GATOMIC_RELAXED);
+
                 if(retStat < 0) // <0 - error happened.
                 {
                     printf("Error occured while performing client operation. Closing...");
+                    exitCode = GSRV_WORKER_EXIT_ERROR;
                     exitLoop = 1;
                     break;
                 }
                 else if(retStat == 2) // Server shutdown requested
                 {
                     printf("Server shutdown requested. Closing...\n");
+                    exitCode = GSRV_WORKER_EXIT_SHUTDOWN;
                     exitLoop = 1;
                     break;
                 }
@@ -229,15 +307,52 @@ int runServer(const char* port)
     for(int i=0; i<GSRV_MAX_CLIENTS; i++){
         gsrvClearClientSocket(ClientSocket + i, 1);
     }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    gthread_Event_destroy(&shutdownEvent);
+
+    return exitCode;
+}
+
+/*  Args: Port number on which we'll listen, and the number of worker processes.
+    0 workers - run the loop in this process. */
+int runServer(const char* port, int workers)
+{
+    // Init WinSocks.
+    printf("Init WinSock... ");
+    if(gsockInitSocks() != 0)
+        return 1;
+    printf("Done.\n");
+
+    SOCKET ListenSocket = createListenSocket(port);
+    if(ListenSocket == INVALID_SOCKET){
+        gsockSockCleanup();
+        return 1;
+    }
+
+    int retval;
+    if(workers > 0){
+        printf("Done.\n\nStarting %d worker processes...\n", workers);
+        retval = (gsrvRunPreforkMaster(ListenSocket, workers, runServerLoop) == 0 ? 0 : 1);
+    }
+    else
+        retval = (runServerLoop(ListenSocket, NULL) == GSRV_WORKER_EXIT_ERROR ? 1 : 0);
+
     gsockCloseSocket(ListenSocket);
     gsockSockCleanup();
 
-    return 0;
+    return retval;
 }
 
+// Usage: server [port | unix:/path] [workers | auto]
 int main(int argc, char** argv)
 {
     printf("Nyaaaa >.<\n");
-    return runServer( argc>1 ? (const char*)argv[1] : GSRV_FTP_DEFAULT_PORT );
+    int workers = 0;
+    if(argc > 2)
+        workers = (strcmp(argv[2], "auto") == 0 ? gthread_getCPUCount() : atoi(argv[2]));
+
+    return runServer( argc>1 ? (const char*)argv[1] : GSRV_FTP_DEFAULT_PORT, workers );
 }
 
@@ -1,8 +1,9 @@
 #include "service.h"
+#include <string.h>
 
 // Specific helper funcs. Maybe should be put into another file.
 
-int sendFile(SOCKET sock, const char* fname){
+int gsrvSendFile(SOCKET sock, const char* fname){
     // Try to open file.
     printf("Trying to open file: %s|\n", fname);
 
@@ -14,12 +15,11 @@ int sendFile(SOCKET sock, const char* fname){
         printf("File requested can't be opened. Terminating.\n");
         strcpy(buffer, "File doesn't exist on this machine!");
 
-        int iSendResult = send( sock, buffer, strlen(buffer), 0 );
-        if (iSendResult == SOCKET_ERROR) {
+        if( gsockSendAll( sock, buffer, strlen(buffer), 0 ) != 0 ){
             gsockErrorCleanup(sock, NULL, "send failed with error", 0, 0);
             return 1;
         }
-        printf("Bytes sent: %d\n", iSendResult);
+        printf("Bytes sent: %d\n", (int)strlen(buffer));
     }
     else{ // File exists.
         size_t bytesRead;
@@ -27,12 +27,11 @@ int sendFile(SOCKET sock, const char* fname){
             size_t bytesRead = fread(buffer, 1, bufferLen, inputFile);
 
             if(bytesRead > 0){
-                int iSendResult = send( sock, buffer, bytesRead, 0 );
-                if (iSendResult == SOCKET_ERROR) {
+                if( gsockSendAll( sock, buffer, bytesRead, 0 ) != 0 ){
                     gsockErrorCleanup(sock, NULL, "send failed with error", 0, 0);
                     return 1;
                 }
-                printf("Bytes sent: %d\n", iSendResult);
+                printf("Bytes sent: %d\n", (int)bytesRead);
             }
         } while(!feof(inputFile) && !ferror(inputFile));
 
@@ -51,6 +50,7 @@ void gsrvInitClientSocket(GsrvClientSocket* sd, SOCKET clSock, char createAdditi
     sd->dataSendSock = INVALID_SOCKET;
     sd->status = GSRV_STATUS_INACTIVE;
     sd->sockDataBuffLen = 0;
+    sd->lineReader = NULL;
     if(createAdditionalData)
     {
         sd->otherData = (GsrvAdditionalData*)malloc( sizeof(GsrvAdditionalData) ); // MALLOC sd->otherData
@@ -67,6 +67,7 @@ void gsrvInitClientSocket(GsrvClientSocket* sd, SOCKET clSock, char createAdditi
 void gsrvClearClientSocket(GsrvClientSocket* sd, char closeSockets)
 {
     if(!sd) return;
+    gsockLineReader_destroy(&(sd->lineReader));
     if(closeSockets){
         if(sd->cliSock != INVALID_SOCKET){
             gsockCloseSocket(sd->cliSock);
@@ -100,39 +101,43 @@ void gsrvSetupNewClientSocket(GsrvClientSocket* sd, SOCKET clSock)
     if(!sd) return;
     sd->cliSock = clSock;
     sd->status = GSRV_STATUS_IDLE;
+    sd->lineReader = gsockLineReader_create(clSock, GSRV_FTP_DEFAULT_BUFLEN);
 }
 
 char gsrvHaveActiveJobs(GsrvClientSocket* sd)
 {
     if(!sd) return 0;
-    return (sd->status & GSRV_STATUS_SENDING_FILE);
+    return (sd->status & (GSRV_STATUS_SENDING_FILE | GSRV_STATUS_RECEIVE_PENDING));
 }
 
 //============= FTP Service funcs =============//
 
-int parseFTPData(GsrvClientSocket* sd)
+int gsrvFTP_ParseData(GsrvClientSocket* sd)
 {
-    if(!sd) return;
+    if(!sd) return -1;
     // Todo
-}
-
-int performFTPOperation(GsrvClientSocket* sd)
+    return 0;
+}
+
+int gsrvFTP_PerformSingleOperation(GsrvClientSocket* sd)
 {
-    if(!sd || sd->cliSock == INVALID_SOCKET) return;
+    if(!sd || sd->cliSock == INVALID_SOCKET) return -1;
     // TOdo
-}
+    return 0;
+}
 
-int runClientService(GsrvClientSocket* sd)
+int gsrvFTP_RunClientService(GsrvClientSocket* sd)
 {
-    if(!sd || sd->cliSock == INVALID_SOCKET) return;
+    if(!sd || sd->cliSock == INVALID_SOCKET) return -1;
     // Todo
+    return 0;
 }
 
 //========== Service (current) end. ===========//
 
 // Toy function. For testing.
 
-int performToyOperation(GsrvClientSocket* sd)
+int gsrvPerformToyOperation(GsrvClientSocket* sd)
 {
     if(!sd || sd->cliSock == INVALID_SOCKET) return 1;
     int iResult;
@@ -142,27 +147,37 @@ int performToyOperation(GsrvClientSocket* sd)
     if(sd->status & GSRV_STATUS_SENDING_FILE)
     {
         printf("\nPerformToyOperation: sending data to sock: %d... ", sd->cliSock);
-        iResult = send(sd->cliSock, sd->sockDataBuffer, sd->sockDataBuffLen, 0);
-        if(iResult < 0){
+        if( gsockSendAll(sd->cliSock, sd->sockDataBuffer, sd->sockDataBuffLen, 0) != 0 ){
             gsockErrorCleanup(sd->cliSock, NULL, "send failed with error", 0, 1);
             return -1;
         }
         sd->status &= ~GSRV_STATUS_SENDING_FILE; // Reset the flag.
         printf("Done.\n");
+
+        // More lines may have come in with the last one - select() won't tell about those.
+        if(gsockLineReader_hasLine(sd->lineReader))
+            sd->status |= GSRV_STATUS_RECEIVE_PENDING;
     }
 
     // Receive operation pending
     else if(sd->status & GSRV_STATUS_RECEIVE_PENDING)
     {
         printf("\nPerformToyOperation: receiving data from sock: %d...\n", sd->cliSock);
-        iResult = recv(sd->cliSock, sd->sockDataBuffer, GSRV_FTP_DEFAULT_BUFLEN, 0);
+        char* line;
+        size_t lineLen;
+        iResult = gsockLineReader_readLine(sd->lineReader, &line, &lineLen, 0);
 
-        if(iResult > 0){ // Got bytes. iRes: how many bytes got.
-            sd->sockDataBuffer[(sd->sockDataBuffer[iResult-1]=='\n' ? iResult-1 : iResult)] = 0; // Null-Terminated string.
-            sd->sockDataBuffLen = iResult;
+        if(iResult == 0){ // Got a whole line.
+            if(lineLen > GSRV_FTP_DEFAULT_BUFLEN - 3)
+                lineLen = GSRV_FTP_DEFAULT_BUFLEN - 3;
+            memcpy(sd->sockDataBuffer, line, lineLen);
+            sd->sockDataBuffer[lineLen] = 0; // Null-Terminated string.
 
-            printf("Bytes received: %d\nPacket data:\n%s\n", iResult, sd->sockDataBuffer);
+            printf("Bytes received: %d\nPacket data:\n%s\n", (int)lineLen, sd->sockDataBuffer);
 
+            // Echo it back as a line.
+            memcpy(sd->sockDataBuffer + lineLen, "\r\n", 3);
+            sd->sockDataBuffLen = lineLen + 2;
             sd->status |= GSRV_STATUS_SENDING_FILE; // Now we will echo the data back to the client.
 
             //Check if quit message has been posted.
@@ -171,7 +186,10 @@ int performToyOperation(GsrvClientSocket* sd)
             else if( strncmp(sd->sockDataBuffer, "shutdown", 8) == 0 )
                 closed = 2;  // Shut down the server
         }
-        else if (iResult == 0){ // Client socket shut down'd properly.
+        else if (iResult == 1){ // Only a part of a line so far.
+            ;
+        }
+        else if (iResult == 2){ // Client socket shut down'd properly.
             printf("Close message posted...\n");
             closed = 1;
 
@@ -194,7 +212,8 @@ int performToyOperation(GsrvClientSocket* sd)
     return (closed==2 ? 2 : 0);
 }
 
-int runToyClientService(GsrvClientSocket* sd)
+int gsrvRunToyClientService(GsrvClientSocket* sd)
 {
     if(!sd || sd->cliSock == INVALID_SOCKET) return 2;
+    return 0;
 }
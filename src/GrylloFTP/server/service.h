@@ -1,7 +1,7 @@
 #ifndef SERVICE_H_INCLUDED
 #define SERVICE_H_INCLUDED
 
-#include <gsrvsocks.h>
+#include <grylsocks.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,12 +39,13 @@ typedef struct
 // The socket structure.
 typedef struct
 {
-    volatile SOCKET cliSock;
-    volatile SOCKET dataSendSock;
-    volatile char status;
-    volatile char sockDataBuffer[GSRV_FTP_DEFAULT_BUFLEN];
-    volatile size_t sockDataBuffLen;
-    volatile GsrvAdditionalData* otherData;
+    SOCKET cliSock;
+    SOCKET dataSendSock;
+    char status;
+    char sockDataBuffer[GSRV_FTP_DEFAULT_BUFLEN];
+    size_t sockDataBuffLen;
+    GsrvAdditionalData* otherData;
+    GSockLineReader lineReader; // Frames the command lines coming on cliSock.
 } GsrvClientSocket;
 
 // =========== FTP Service functions =========== //
@@ -0,0 +1,142 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Scatter-gather & full-length I/O test.
+ *
+ *  - SendvAll/ReceiveAll must move a buffer list much bigger than the socket buffers,
+ *    while a reader thread drains the other end.
+ *  - ReceiveAll_time must time out on a silent peer, and report the peer closing early.
+ *  - Header + payload messages are sent with two send()s, and with one gsockSendv().
+ */
+
+#define BIG_SIZE   (8 * 1024 * 1024)
+#define BIG_PIECES 7
+#define HDR_SIZE   8
+#define MSG_SIZE   256
+
+const int Messages = 200000;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct
+{
+    int fd;
+    char* buf;
+    size_t len;
+    int result;
+} ReaderParams;
+
+void readerProc(void* param)
+{
+    ReaderParams* rp = (ReaderParams*)param;
+    rp->result = gsockReceiveAll( rp->fd, rp->buf, rp->len, 0 );
+}
+
+// Receives and drops everything until the peer closes.
+void drainProc(void* param)
+{
+    int fd = *(int*)param;
+    char buf[ 64 * 1024 ];
+    while( gsockReceive( fd, buf, sizeof(buf), 0 ) > 0 )
+        ;
+}
+
+double timeMessages(int fd, char vectored)
+{
+    char hdr[ HDR_SIZE ] = "GFTPHDR", payload[ MSG_SIZE ];
+    memset( payload, 'p', sizeof(payload) );
+
+    double start = timeNow();
+    for(int i = 0; i < Messages; i++){
+        if(vectored){
+            GSockBuf bufs[2] = { { hdr, HDR_SIZE }, { payload, MSG_SIZE } };
+            if( gsockSendvAll( fd, bufs, 2, 0 ) != 0 )
+                return -1;
+        }
+        else if( gsockSendAll( fd, hdr, HDR_SIZE, 0 ) != 0 ||
+                 gsockSendAll( fd, payload, MSG_SIZE, 0 ) != 0 )
+            return -1;
+    }
+    return (timeNow() - start) * 1e9 / Messages;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest10.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+
+    // Big vectored transfer.
+    int pair[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 ){
+        printf("socketpair() failed: %s\n", strerror(errno));
+        return 1;
+    }
+    char* src = malloc( BIG_SIZE );
+    char* dst = malloc( BIG_SIZE );
+    for(size_t i = 0; i < BIG_SIZE; i++)
+        src[i] = (char)(i * 7 + (i >> 12));
+    memset( dst, 0, BIG_SIZE );
+
+    // Uneven pieces, with an empty one in the middle.
+    GSockBuf bufs[ BIG_PIECES ];
+    size_t off = 0;
+    for(int i = 0; i < BIG_PIECES; i++){
+        size_t len = (i == BIG_PIECES - 1 ? BIG_SIZE - off : (i == 3 ? 0 : BIG_SIZE / 11 + i * 4099));
+        bufs[i].base = src + off;
+        bufs[i].len = len;
+        off += len;
+    }
+
+    ReaderParams rp = { pair[1], dst, BIG_SIZE, -1 };
+    GrThread reader = gthread_Thread_create( readerProc, &rp );
+    errors += ( gsockSendvAll( pair[0], bufs, BIG_PIECES, 0 ) != 0 );
+    gthread_Thread_join( reader, 1 );
+    errors += ( rp.result != 0 || memcmp( src, dst, BIG_SIZE ) != 0 );
+    printf("Vectored transfer of %d bytes: %s\n", BIG_SIZE, (errors ? "FAIL" : "OK"));
+
+    // Timeouts and early close.
+    size_t done = 12345;
+    double start = timeNow();
+    int res = gsockReceiveAll_time( pair[1], dst, 16, 0, 50, &done );
+    double waited = timeNow() - start;
+    errors += ( res != 1 || done != 0 || waited < 0.045 || waited > 1.0 );
+
+    gsockSend( pair[0], "partial", 7, 0 );
+    gsockCloseSocket( pair[0] );
+    res = gsockReceiveAll_time( pair[1], dst, 16, 0, 1000, &done );
+    errors += ( res != 2 || done != 7 || memcmp( dst, "partial", 7 ) != 0 );
+    gsockCloseSocket( pair[1] );
+    printf("Timeout & early close: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Header + payload: two sends vs one.
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 )
+        return 1;
+    GrThread drain = gthread_Thread_create( drainProc, pair + 1 );
+    double separate = timeMessages( pair[0], 0 );
+    double vectored = timeMessages( pair[0], 1 );
+    gsockCloseSocket( pair[0] );
+    gthread_Thread_join( drain, 1 );
+    gsockCloseSocket( pair[1] );
+    errors += ( separate < 0 || vectored < 0 );
+
+    printf("\n%-24s %12s\n", "Header + payload", "ns/message");
+    printf("%-24s %12.1f\n", "two sends", separate);
+    printf("%-24s %12.1f\n\n", "one sendv", vectored);
+
+    free( src );
+    free( dst );
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,197 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Zero-copy send test.
+ *
+ *  - Buffers from a small pool are sent over TCP loopback through a zero-copy tracker, and
+ *    reused only after their release callback. The receiver checks every byte, so a buffer
+ *    reused too early shows up as corrupted data.
+ *  - Every buffer must be released exactly once, and small ones right away.
+ *  - Throughput is printed for plain sends and for the tracker. On loopback the kernel
+ *    copies anyway, which turns zerocopy off after the first completions.
+ */
+
+#define POOL_SIZE   8
+#define BUF_SIZE    (256 * 1024)
+#define SMALL_SIZE  512
+
+const int Buffers = 2000;
+
+typedef struct
+{
+    char* data;
+    char inUse;
+    int released;
+} PoolBuf;
+
+PoolBuf pool[ POOL_SIZE ];
+int releaseErrors = 0;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void onReleased(const void* buff, void* userData)
+{
+    PoolBuf* pb = (PoolBuf*)userData;
+    if(pb->data != buff || !pb->inUse)
+        releaseErrors++;
+    pb->inUse = 0;
+    pb->released++;
+}
+
+typedef struct
+{
+    int fd;
+    long long expected;
+    long long received;
+    int corrupted;
+} ReceiverParams;
+
+// Every buffer is filled with its sequence number's low byte, so the stream is checkable.
+void receiverProc(void* param)
+{
+    ReceiverParams* rp = (ReceiverParams*)param;
+    char buf[ 64 * 1024 ];
+    int len;
+    while( rp->received < rp->expected && (len = gsockReceive( rp->fd, buf, sizeof(buf), 0 )) > 0 ){
+        for(int i = 0; i < len; i++){
+            if( buf[i] != (char)((rp->received + i) / BUF_SIZE) )
+                rp->corrupted++;
+        }
+        rp->received += len;
+    }
+}
+
+// Returns MB/s, or < 0 on error.
+double sendBuffers(int fd, GSockZeroCopy zc)
+{
+    double start = timeNow();
+    for(int i = 0; i < Buffers; i++){
+        PoolBuf* pb = pool + (i % POOL_SIZE);
+        while(pb->inUse){
+            if( gsockZeroCopy_poll( zc, 100 ) < 0 )
+                return -1;
+        }
+        pb->inUse = 1;
+        memset( pb->data, (char)i, BUF_SIZE );
+
+        int res = (zc ? gsockZeroCopy_send( zc, pb->data, BUF_SIZE, 0, onReleased, pb )
+                      : gsockSendAll( fd, pb->data, BUF_SIZE, 0 ));
+        if(res != 0)
+            return -1;
+        if(!zc)
+            onReleased( pb->data, pb );
+    }
+    if( zc && gsockZeroCopy_flush( zc, 5000 ) != 0 )
+        return -1;
+    return (double)Buffers * BUF_SIZE / (1024 * 1024) / (timeNow() - start);
+}
+
+// Connects a TCP loopback pair.
+int makeTcpPair(int* sender, int* receiver)
+{
+    SOCKET lfd = gsockListenSocket( 0, "127.0.0.1", AF_INET, SOCK_STREAM, 0, 0 );
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if( lfd == INVALID_SOCKET || getsockname( lfd, (struct sockaddr*)&addr, &addrLen ) != 0 )
+        return -1;
+    char port[ 16 ];
+    snprintf( port, sizeof(port), "%d", ntohs(addr.sin_port) );
+
+    *sender = gsockConnectSocket( "127.0.0.1", port, AF_INET, SOCK_STREAM, 0, 0 );
+    *receiver = accept( lfd, NULL, NULL );
+    gsockCloseSocket( lfd );
+    return (*sender == INVALID_SOCKET || *receiver < 0 ? -1 : 0);
+}
+
+double runTransfer(char zeroCopy, GSockZeroCopyStats* stats)
+{
+    int sender, receiver;
+    if( makeTcpPair( &sender, &receiver ) != 0 ){
+        printf("Failed to connect a loopback pair.\n");
+        return -1;
+    }
+    for(int i = 0; i < POOL_SIZE; i++){
+        pool[i].inUse = 0;
+        pool[i].released = 0;
+    }
+
+    GSockZeroCopy zc = (zeroCopy ? gsockZeroCopy_create( sender ) : NULL);
+    ReceiverParams rp = { receiver, (long long)Buffers * BUF_SIZE, 0, 0 };
+    GrThread thr = gthread_Thread_create( receiverProc, &rp );
+
+    double mbps = sendBuffers( sender, zc );
+    gthread_Thread_join( thr, 1 );
+
+    int released = 0;
+    for(int i = 0; i < POOL_SIZE; i++)
+        released += pool[i].released;
+    if( rp.received != rp.expected || rp.corrupted || released != Buffers ){
+        printf("Transfer broken: %lld/%lld bytes, %d corrupted, %d/%d released.\n",
+               rp.received, rp.expected, rp.corrupted, released, Buffers);
+        mbps = -1;
+    }
+
+    if(zc){
+        gsockZeroCopy_getStats( zc, stats );
+        gsockZeroCopy_destroy( &zc );
+    }
+    gsockCloseSocket( sender );
+    gsockCloseSocket( receiver );
+    return mbps;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest11.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+
+    for(int i = 0; i < POOL_SIZE; i++)
+        pool[i].data = malloc( BUF_SIZE );
+
+    // Small buffers go the plain way, and are released before _send() returns.
+    int sender, receiver;
+    char small[ SMALL_SIZE ] = { 0 };
+    errors += ( makeTcpPair( &sender, &receiver ) != 0 );
+    GSockZeroCopy zc = gsockZeroCopy_create( sender );
+    pool[0].data = small;
+    pool[0].inUse = 1;
+    pool[0].released = 0;
+    errors += ( gsockZeroCopy_send( zc, small, SMALL_SIZE, 0, onReleased, pool ) != 0 );
+    errors += ( pool[0].released != 1 || pool[0].inUse );
+    errors += ( gsockReceiveAll( receiver, small, SMALL_SIZE, 0 ) != 0 );
+    gsockZeroCopy_destroy( &zc );
+    errors += ( zc != NULL );
+    gsockCloseSocket( sender );
+    gsockCloseSocket( receiver );
+    pool[0].data = malloc( BUF_SIZE );
+    printf("Small buffers: %s\n", (errors ? "FAIL" : "OK"));
+
+    GSockZeroCopyStats stats = { 0 };
+    double plain = runTransfer( 0, NULL );
+    double zeroCopy = runTransfer( 1, &stats );
+    errors += ( plain < 0 || zeroCopy < 0 || releaseErrors );
+    printf("Pool reuse & release: %s\n", (errors ? "FAIL" : "OK"));
+
+    printf("\n%-24s %12s\n", "Send path", "MB/s");
+    printf("%-24s %12.1f\n", "plain", plain);
+    printf("%-24s %12.1f\n", "zero-copy tracker", zeroCopy);
+    printf("Tracker: %lu zero-copy, %lu plain, %lu copied by the kernel, zerocopy %s at the end.\n\n",
+           stats.zeroCopySends, stats.plainSends, stats.copiedCompletions, (stats.enabled ? "on" : "off"));
+
+    for(int i = 0; i < POOL_SIZE; i++)
+        free( pool[i].data );
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,124 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Line reader test.
+ *
+ *  - Lines and FTP replies must come out whole, however the bytes were split on the wire,
+ *    and a timeout in the middle of a reply must lose nothing.
+ *  - Multi-line replies end only at the "NNN " line with the same code.
+ *  - Request-reply round trips over loopback are timed, with the reply taken as soon as
+ *    it's complete.
+ */
+
+const int RoundTrips = 20000;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sends str in pieces of the given size.
+void sendSplit(int fd, const char* str, size_t piece)
+{
+    size_t len = strlen( str );
+    for(size_t off = 0; off < len; off += piece)
+        gsockSendAll( fd, str + off, (len - off < piece ? len - off : piece), 0 );
+}
+
+// Answers every line with a two-line reply.
+void serverProc(void* param)
+{
+    GSockLineReader rd = gsockLineReader_create( *(int*)param, 0 );
+    char* line;
+    while( gsockLineReader_readLine( rd, &line, NULL, -1 ) == 0 ){
+        const char* reply = "211-Status\r\n211 End\r\n";
+        if( gsockSendAll( gsockLineReader_getSocket( rd ), reply, strlen(reply), 0 ) != 0 )
+            break;
+    }
+    gsockLineReader_destroy( &rd );
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest12.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+
+    int pair[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 ){
+        printf("socketpair() failed: %s\n", strerror(errno));
+        return 1;
+    }
+    GSockLineReader rd = gsockLineReader_create( pair[1], 0 );
+    char* line;
+    size_t len;
+    int code;
+
+    // Lines, byte by byte, with CRLF and bare LF ends, and an empty line.
+    sendSplit( pair[0], "USER anonymous\r\nPASS x\n\r\nNOOP\r\n", 1 );
+    const char* expect[] = { "USER anonymous", "PASS x", "", "NOOP" };
+    for(int i = 0; i < 4; i++){
+        errors += ( gsockLineReader_readLine( rd, &line, &len, 1000 ) != 0 ||
+                    strcmp( line, expect[i] ) != 0 || len != strlen( expect[i] ) );
+    }
+    errors += ( gsockLineReader_readLine( rd, &line, &len, 20 ) != 1 );
+    printf("Lines: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Replies. Inner lines starting with the code, or another "NNN " code, don't end the reply.
+    const char* multi = "214-Commands:\r\n214-USER PASS\r\n 200 not the end\r\n226 nor this\r\n214 End\r\n";
+    sendSplit( pair[0], multi, 7 );
+    sendSplit( pair[0], "200 OK\r\n", 3 );
+    errors += ( gsockLineReader_readReply( rd, &line, &len, &code, 1000 ) != 0 ||
+                code != 214 || strcmp( line, multi ) != 0 || len != strlen( multi ) );
+    errors += ( gsockLineReader_readReply( rd, &line, &len, &code, 1000 ) != 0 ||
+                code != 200 || strcmp( line, "200 OK\r\n" ) != 0 );
+
+    // A timeout in the middle keeps what's there.
+    gsockSendAll( pair[0], "150-Opening\r\n15", 15, 0 );
+    errors += ( gsockLineReader_readReply( rd, &line, &len, &code, 30 ) != 1 );
+    gsockSendAll( pair[0], "0 Go\r\n", 6, 0 );
+    errors += ( gsockLineReader_readReply( rd, &line, &len, &code, 1000 ) != 0 ||
+                code != 150 || strcmp( line, "150-Opening\r\n150 Go\r\n" ) != 0 );
+
+    // The peer closing, with half a line left.
+    gsockSendAll( pair[0], "421 Bye", 7, 0 );
+    gsockCloseSocket( pair[0] );
+    errors += ( gsockLineReader_readReply( rd, &line, &len, &code, 1000 ) != 2 );
+    gsockLineReader_destroy( &rd );
+    gsockCloseSocket( pair[1] );
+    printf("Replies & timeouts: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Round trips.
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 )
+        return 1;
+    GrThread server = gthread_Thread_create( serverProc, pair + 1 );
+    rd = gsockLineReader_create( pair[0], 0 );
+
+    double start = timeNow();
+    int trips;
+    for(trips = 0; trips < RoundTrips; trips++){
+        if( gsockSendAll( pair[0], "STAT\r\n", 6, 0 ) != 0 ||
+            gsockLineReader_readReply( rd, &line, &len, &code, 1000 ) != 0 || code != 211 )
+            break;
+    }
+    double secs = timeNow() - start;
+    errors += ( trips != RoundTrips );
+
+    gsockCloseSocket( pair[0] );
+    gthread_Thread_join( server, 1 );
+    gsockCloseSocket( pair[1] );
+    gsockLineReader_destroy( &rd );
+
+    printf("\nCommand round trip: %.2f us (%d trips)\n\n", secs * 1e6 / RoundTrips, trips);
+
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
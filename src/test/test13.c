@@ -0,0 +1,136 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+/*  TCP Fast Open test.
+ *
+ *  - A loopback listener answers a one-line request with a small payload, like a RETR of a
+ *    small file on a fresh connection, and closes.
+ *  - Time to first byte (connect() to the first payload byte) is timed with Fast Open off
+ *    and on. With it on, the first connection fetches the server's cookie, and the following
+ *    ones carry the request in the SYN - if the kernel allows it (net.ipv4.tcp_fastopen).
+ *  - Every payload must arrive whole either way.
+ */
+
+#define PAYLOAD_SIZE  1024
+
+const int Connections = 2000;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char payload[ PAYLOAD_SIZE ];
+volatile int serverStop = 0;
+
+void serverProc(void* param)
+{
+    SOCKET lfd = *(SOCKET*)param;
+    char req[ 256 ];
+    while( !serverStop ){
+        SOCKET cfd = accept( lfd, NULL, NULL );
+        if(cfd == INVALID_SOCKET)
+            break;
+        int len = gsockReceive( cfd, req, sizeof(req), 0 );
+        if(len > 0 && strncmp( req, "RETR ", 5 ) == 0)
+            gsockSendAll( cfd, payload, PAYLOAD_SIZE, 0 );
+        gsockCloseSocket( cfd );
+    }
+}
+
+// Returns 1 if the connection's SYN carried data which the server took.
+int sentDataInSyn(SOCKET sock)
+{
+#if defined TCPI_OPT_SYN_DATA
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if( getsockopt( sock, IPPROTO_TCP, TCP_INFO, &ti, &len ) == 0 )
+        return ( (ti.tcpi_options & TCPI_OPT_SYN_DATA) ? 1 : 0 );
+#endif
+    return 0;
+}
+
+// Returns the average time to first byte in microseconds, or < 0 on a broken transfer.
+double timeRetrs(const char* port, char fastOpen, int* synData)
+{
+    GSockOptions opts = { 0 };
+    opts.flags = GSOCK_FLAG_NODELAY | (fastOpen ? GSOCK_FLAG_FASTOPEN : 0);
+    char buf[ PAYLOAD_SIZE ];
+    double total = 0;
+    *synData = 0;
+
+    for(int i = 0; i < Connections; i++){
+        double start = timeNow();
+        SOCKET sock = gsockConnectSocketEx( "127.0.0.1", port, AF_INET, SOCK_STREAM, 0, &opts );
+        if(sock == INVALID_SOCKET)
+            return -1;
+        size_t got = 0;
+        int res = gsockSendAll( sock, "RETR small.txt\r\n", 16, 0 );
+        if(res == 0)
+            res = gsockReceiveAll_time( sock, buf, 1, 0, 5000, &got );
+        total += timeNow() - start;
+
+        if(res == 0)
+            res = gsockReceiveAll_time( sock, buf + 1, PAYLOAD_SIZE - 1, 0, 5000, &got );
+        *synData += sentDataInSyn( sock );
+        gsockCloseSocket( sock );
+        if( res != 0 || memcmp( buf, payload, PAYLOAD_SIZE ) != 0 )
+            return -1;
+    }
+    return total * 1e6 / Connections;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest13.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+
+    for(int i = 0; i < PAYLOAD_SIZE; i++)
+        payload[i] = (char)(i * 13);
+
+    GSockOptions lopts = { 0 };
+    lopts.flags = GSOCK_FLAG_REUSEADDR | GSOCK_FLAG_FASTOPEN;
+    SOCKET lfd = gsockListenSocketEx( 0, "127.0.0.1", AF_INET, SOCK_STREAM, 0, &lopts );
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if( lfd == INVALID_SOCKET || getsockname( lfd, (struct sockaddr*)&addr, &addrLen ) != 0 ){
+        printf("Failed to set up the listener.\n");
+        return 1;
+    }
+    char port[ 16 ];
+    snprintf( port, sizeof(port), "%d", ntohs(addr.sin_port) );
+
+    GrThread server = gthread_Thread_create( serverProc, &lfd );
+
+    int synPlain, synFast;
+    double plain = timeRetrs( port, 0, &synPlain );
+    double fast = timeRetrs( port, 1, &synFast );
+    errors += ( plain < 0 || fast < 0 || synPlain != 0 );
+    printf("Transfers with Fast Open off & on: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Wake the accept() up with a last connection.
+    serverStop = 1;
+    gsockCloseSocket( gsockConnectSocket( "127.0.0.1", port, AF_INET, SOCK_STREAM, 0, 0 ) );
+    gthread_Thread_join( server, 1 );
+    gsockCloseSocket( lfd );
+
+    printf("\n%-24s %12s %14s\n", "Small RETR", "TTFB, us", "data in SYN");
+    printf("%-24s %12.1f %8d/%d\n", "Fast Open off", plain, synPlain, Connections);
+    printf("%-24s %12.1f %8d/%d\n", "Fast Open on", fast, synFast, Connections);
+    if(!synFast)
+        printf("No request went in the SYN - Fast Open is off in this kernel (net.ipv4.tcp_fastopen).\n");
+    printf("\n");
+
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
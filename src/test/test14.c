@@ -0,0 +1,171 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Unix domain socket test.
+ *
+ *  - "unix:" addresses must connect and listen, on a socket file and in the abstract namespace.
+ *    A stale socket file gets replaced, a live one must not be taken over.
+ *  - A file is delivered to a local peer by copying its bytes through the socket, and by
+ *    passing its descriptor with SCM_RIGHTS, after which the peer reads it itself.
+ */
+
+#define FILE_SIZE  (64 * 1024 * 1024)
+#define CHUNK_SIZE (256 * 1024)
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct
+{
+    SOCKET sock;
+    const char* fname;
+    char passFd;
+    int result;
+} SenderParams;
+
+void senderProc(void* param)
+{
+    SenderParams* sp = (SenderParams*)param;
+    FILE* f = fopen( sp->fname, "rb" );
+    sp->result = -1;
+    if(!f) return;
+
+    if(sp->passFd){
+        char size[ 32 ];
+        snprintf( size, sizeof(size), "%d", FILE_SIZE );
+        sp->result = ( gsockSendFd( sp->sock, fileno(f), size, strlen(size), 0 ) > 0 ? 0 : -1 );
+    }
+    else{
+        char* buf = malloc( CHUNK_SIZE );
+        size_t len;
+        sp->result = 0;
+        while( sp->result == 0 && (len = fread( buf, 1, CHUNK_SIZE, f )) > 0 )
+            sp->result = gsockSendAll( sp->sock, buf, len, 0 );
+        free( buf );
+    }
+    fclose( f );
+}
+
+// Connects a pair of sockets through a listener on address.
+int makeUnixPair(const char* address, SOCKET* client, SOCKET* server)
+{
+    SOCKET lfd = gsockListenSocket( 0, address, AF_UNIX, SOCK_STREAM, 0, 0 );
+    if(lfd == INVALID_SOCKET)
+        return -1;
+    *client = gsockConnectSocket( address, NULL, 0, SOCK_STREAM, 0, 0 );
+    *server = (*client == INVALID_SOCKET ? INVALID_SOCKET : accept( lfd, NULL, NULL ));
+    gsockCloseSocket( lfd );
+    return (*client == INVALID_SOCKET || *server == INVALID_SOCKET ? -1 : 0);
+}
+
+// Returns the seconds to get the file into dst on the receiving end, or < 0 on error.
+double deliverFile(const char* fname, char passFd, char* dst, double* handOver)
+{
+    SOCKET client, server;
+    if( makeUnixPair( "unix:gryltest14.sock", &client, &server ) != 0 )
+        return -1;
+    SenderParams sp = { server, fname, passFd, -1 };
+
+    double start = timeNow();
+    GrThread sender = gthread_Thread_create( senderProc, &sp );
+    int res = 0;
+    if(passFd){
+        char size[ 32 ] = { 0 };
+        int fd;
+        res = ( gsockReceiveFd( client, &fd, size, sizeof(size) - 1, 0 ) > 0 && fd >= 0 ? 0 : -1 );
+        *handOver = timeNow() - start;
+        if(res == 0){
+            long total = atol( size );
+            ssize_t got = 0;
+            for(long off = 0; off < total && got >= 0; off += got)
+                got = pread( fd, dst + off, total - off, off );
+            res = (got >= 0 && total == FILE_SIZE ? 0 : -1);
+            close( fd );
+        }
+    }
+    else
+        res = gsockReceiveAll( client, dst, FILE_SIZE, 0 );
+    double secs = timeNow() - start;
+
+    gthread_Thread_join( sender, 1 );
+    gsockCloseSocket( client );
+    gsockCloseSocket( server );
+    return (res != 0 || sp.result != 0 ? -1 : secs);
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest14.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+    SOCKET client, server;
+    char buf[ 16 ];
+
+    // Socket file. The first listener leaves its file behind, the second one must replace it.
+    const char* path = "unix:gryltest14.sock";
+    errors += ( gsockIsUnixAddress( path ) != 1 || gsockIsUnixAddress( "127.0.0.1" ) != 0 );
+    for(int i = 0; i < 2; i++){
+        errors += ( makeUnixPair( path, &client, &server ) != 0 );
+        errors += ( gsockSendAll( client, "PING", 4, 0 ) != 0 ||
+                    gsockReceiveAll( server, buf, 4, 0 ) != 0 || memcmp( buf, "PING", 4 ) != 0 );
+        gsockCloseSocket( client );
+        gsockCloseSocket( server );
+    }
+    // A live listener keeps its file.
+    SOCKET live = gsockListenSocket( 0, path, AF_UNIX, SOCK_STREAM, 0, 0 );
+    errors += ( live == INVALID_SOCKET );
+    errors += ( gsockListenSocket( 0, path, AF_UNIX, SOCK_STREAM, 0, 0 ) != INVALID_SOCKET );
+    gsockCloseSocket( live );
+
+    // Abstract namespace.
+    errors += ( makeUnixPair( "unix:@gryltest14", &client, &server ) != 0 );
+    errors += ( gsockSendAll( server, "PONG", 4, 0 ) != 0 ||
+                gsockReceiveAll( client, buf, 4, 0 ) != 0 || memcmp( buf, "PONG", 4 ) != 0 );
+    gsockCloseSocket( client );
+    gsockCloseSocket( server );
+    printf("Unix addresses: %s\n", (errors ? "FAIL" : "OK"));
+
+    // File delivery.
+    const char* fname = "gryltest14.bin";
+    char* src = malloc( FILE_SIZE );
+    char* dst = malloc( FILE_SIZE );
+    for(size_t i = 0; i < FILE_SIZE; i++)
+        src[i] = (char)(i * 31 + (i >> 16));
+    FILE* f = fopen( fname, "wb" );
+    if( !f || fwrite( src, 1, FILE_SIZE, f ) != FILE_SIZE ){
+        printf("Can't write the test file.\n");
+        return 1;
+    }
+    fclose( f );
+
+    double handOver = 0;
+    memset( dst, 0, FILE_SIZE );
+    double copied = deliverFile( fname, 0, dst, &handOver );
+    errors += ( copied < 0 || memcmp( src, dst, FILE_SIZE ) != 0 );
+    memset( dst, 0, FILE_SIZE );
+    double passed = deliverFile( fname, 1, dst, &handOver );
+    errors += ( passed < 0 || memcmp( src, dst, FILE_SIZE ) != 0 );
+    printf("File delivery: %s\n", (errors ? "FAIL" : "OK"));
+
+    printf("\n%-32s %12s\n", "64 MB file to a local peer", "ms");
+    printf("%-32s %12.2f\n", "bytes through the socket", copied * 1000);
+    printf("%-32s %12.2f\n", "descriptor, then pread()", passed * 1000);
+    printf("%-32s %12.3f\n\n", "descriptor hand-over alone", handOver * 1000);
+
+    remove( fname );
+    remove( path + strlen( GSOCK_UNIX_PREFIX ) );
+    free( src );
+    free( dst );
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,142 @@
+#include <hlog.h>
+#include <grylthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Async log test.
+ *
+ *  - Producer threads log numbered lines through async hlog. With the block policy, every
+ *    line must be in the file after hlogCloseFile(), whole, and in its thread's order.
+ *  - With the drop policy, every line must be either in the file or counted as dropped.
+ *  - Producers come in waves of short-lived threads, which must take over the rings of
+ *    the exited ones instead of making new ones.
+ *  Time per message is printed for async and plain buffered logging.
+ */
+
+#define THREADS  4
+#define WAVES    5
+
+const int Messages = 20000; // Per thread, per wave.
+const char* LogName = "gryltest15.log";
+
+typedef struct
+{
+    int wave;
+    int id;
+} ProducerParams;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void producerProc(void* param)
+{
+    ProducerParams* pp = (ProducerParams*)param;
+    for(int i = 0; i < Messages; i++)
+        hlogf( "%d %d %d\n", pp->wave, pp->id, i );
+}
+
+// Returns nanoseconds per message.
+double runWaves(int waves)
+{
+    ProducerParams params[ THREADS ];
+    GrThread thr[ THREADS ];
+
+    double start = timeNow();
+    for(int w = 0; w < waves; w++){
+        for(int i = 0; i < THREADS; i++){
+            params[i].wave = w;
+            params[i].id = i;
+            thr[i] = gthread_Thread_create( producerProc, params + i );
+        }
+        for(int i = 0; i < THREADS; i++)
+            gthread_Thread_join( thr[i], 1 );
+    }
+    return (timeNow() - start) * 1e9 / ((double)waves * THREADS * Messages);
+}
+
+/* Counts the lines of the log. Returns -1 if a line is broken, or out of its thread's order.
+ * If complete is set, no line may be missing either.
+ */
+long checkLog(char complete)
+{
+    FILE* file = fopen( LogName, "r" );
+    if(!file)
+        return -1;
+
+    int last[ WAVES ][ THREADS ];
+    memset( last, -1, sizeof(last) );
+    char line[ 128 ];
+    long lines = 0;
+    while( fgets( line, sizeof(line), file ) )
+    {
+        int w, t, i;
+        char end;
+        if( sscanf( line, "%d %d %d%c", &w, &t, &i, &end ) != 4 || end != '\n' ||
+            w < 0 || w >= WAVES || t < 0 || t >= THREADS || i <= last[w][t] ||
+            (complete && i != last[w][t] + 1) )
+        {
+            lines = -1;
+            break;
+        }
+        last[w][t] = i;
+        lines++;
+    }
+    fclose( file );
+    return lines;
+}
+
+int main(int argc, char** argv)
+{
+    int errors = 0;
+    const long total = (long)WAVES * THREADS * Messages;
+
+    // Only the producers' lines go to the log - hlogf() isn't leveled.
+    hlogSetLevel( HLOG_LEVEL_NONE );
+
+    // Block policy: nothing may be lost.
+    hlogSetFile( LogName, HLOG_MODE_ASYNC );
+    hlogSetAsyncPolicy( HLOG_ASYNC_POLICY_BLOCK );
+    unsigned long droppedBefore = hlogGetDroppedCount();
+    double asyncNs = runWaves( WAVES );
+    size_t rings = hlogGetAsyncRingCount();
+    hlogCloseFile();
+
+    long lines = checkLog( 1 );
+    errors += ( lines != total || hlogGetDroppedCount() != droppedBefore );
+    printf("Block policy: %ld/%ld lines: %s\n", lines, total, (errors ? "FAIL" : "OK"));
+
+    // Producers and the drainer, whichever wave they're in.
+    errors += ( rings == 0 || rings > THREADS + 1 );
+    printf("Ring reuse: %d rings for %d threads: %s\n", (int)rings, WAVES * THREADS, (errors ? "FAIL" : "OK"));
+
+    // Drop policy: whatever didn't fit must be counted.
+    hlogSetFile( LogName, HLOG_MODE_ASYNC );
+    hlogSetAsyncPolicy( HLOG_ASYNC_POLICY_DROP );
+    droppedBefore = hlogGetDroppedCount();
+    double dropNs = runWaves( WAVES );
+    hlogCloseFile();
+
+    unsigned long dropped = hlogGetDroppedCount() - droppedBefore;
+    lines = checkLog( 0 );
+    errors += ( lines <= 0 || lines + (long)dropped != total );
+    printf("Drop policy: %ld written + %lu dropped of %ld: %s\n", lines, dropped, total, (errors ? "FAIL" : "OK"));
+
+    // Plain buffered logging, for comparison.
+    hlogSetFile( LogName, 0 );
+    double syncNs = runWaves( 1 );
+    hlogCloseFile();
+    errors += ( checkLog( 1 ) != (long)THREADS * Messages );
+
+    printf("\n%-24s %12s\n", "Logging", "ns/message");
+    printf("%-24s %12.1f\n", "async, block", asyncNs);
+    printf("%-24s %12.1f\n", "async, drop", dropNs);
+    printf("%-24s %12.1f\n\n", "plain buffered", syncNs);
+
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,141 @@
+#include <hlog.h>
+#include <hlogbin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <time.h>
+
+/*  Binary log round trip test.
+ *
+ *  - Records are written in binary mode: short and long hlogf() text, up to the async
+ *    message limit, and leveled statements with int, string, double and pointer args.
+ *  - The hlogdecode tool must print every one of them back as it was formatted, with
+ *    string args longer than HLOG_BIN_MAX_STRING cut to that length, and no bad records.
+ *  The decoder is taken from argv[1], or looked up next to the test's bin directory.
+ *  Time per record is printed for text and formatted records.
+ */
+
+const int Records = 200000;
+const char* LogName = "gryltest16.log";
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char* findDecoder(const char* self, char* path, size_t size)
+{
+    char dir[ 1024 ];
+    snprintf( dir, sizeof(dir), "%s", self );
+    const char* builds[] = { "debug", "release" };
+    for(int i = 0; i < 2; i++){
+        snprintf( path, size, "%s/../%s/hlogdecode", dirname( dir ), builds[i] );
+        snprintf( dir, sizeof(dir), "%s", self );
+        if( access( path, X_OK ) == 0 )
+            return path;
+    }
+    return NULL;
+}
+
+// Decodes the log, and looks for every expected message on a line of its own.
+int checkDecoded(const char* decoder, const char** expect, int count)
+{
+    char cmd[ 2048 ];
+    snprintf( cmd, sizeof(cmd), "%s %s 2>&1", decoder, LogName );
+    FILE* out = popen( cmd, "r" );
+    if(!out)
+        return count;
+
+    char* found = calloc( count, 1 );
+    char line[ HLOG_ASYNC_MAX_MSG + 256 ];
+    int errors = 0;
+    while( fgets( line, sizeof(line), out ) )
+    {
+        line[ strcspn( line, "\n" ) ] = 0;
+        if( strstr( line, "bad record" ) || strstr( line, "truncated" ) ){
+            printf("Decoder: %s\n", line);
+            errors++;
+        }
+        // The message ends the line, after the time, thread and level columns.
+        size_t len = strlen( line );
+        for(int i = 0; i < count; i++){
+            size_t el = strlen( expect[i] );
+            if( len >= el && strcmp( line + len - el, expect[i] ) == 0 )
+                found[i] = 1;
+        }
+    }
+    pclose( out );
+
+    for(int i = 0; i < count; i++){
+        if(!found[i]){
+            printf("Not decoded: \"%.60s%s\"\n", expect[i], (strlen(expect[i]) > 60 ? "..." : ""));
+            errors++;
+        }
+    }
+    free( found );
+    return errors;
+}
+
+int main(int argc, char** argv)
+{
+    char decoderPath[ 1024 ];
+    const char* decoder = (argc > 1 ? argv[1] : findDecoder( argv[0], decoderPath, sizeof(decoderPath) ));
+    if(!decoder){
+        printf("hlogdecode not found - pass its path as the first argument.\n");
+        return 1;
+    }
+    int errors = 0;
+
+    char longText[ 301 ], maxText[ HLOG_ASYNC_MAX_MSG ], cutArg[ 160 ];
+    for(int i = 0; i < 300; i++)
+        longText[i] = 'a' + i % 26;
+    longText[300] = 0;
+    memset( maxText, 'm', sizeof(maxText) - 1 );
+    maxText[ sizeof(maxText) - 1 ] = 0;
+    snprintf( cutArg, sizeof(cutArg), "arg %.*s end", HLOG_BIN_MAX_STRING, longText );
+
+    char pointer[ 64 ];
+    snprintf( pointer, sizeof(pointer), "at %p", (void*)main );
+
+    // Only the records below - not the library's own statements.
+    hlogSetLevel( HLOG_LEVEL_WARN );
+    if( !hlogSetFile( LogName, HLOG_MODE_BINARY ) ){
+        printf("Can't open %s\n", LogName);
+        return 1;
+    }
+    hlogf( "short text record" );
+    hlogf( "%s", longText );
+    hlogf( "%s", maxText );
+    hlogWarn( "formatted %d %s %.2f %lld %x", -42, "str", 3.25, 1LL << 40, 0xbeef );
+    hlogWarn( "arg %s end", longText );
+    hlogWarn( "at %p", (void*)main );
+    hlogCloseFile();
+
+    const char* expect[] = { "short text record", longText, maxText,
+                             "formatted -42 str 3.25 1099511627776 beef", cutArg, pointer };
+    errors += checkDecoded( decoder, expect, sizeof(expect) / sizeof(*expect) );
+    printf("Round trip: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Cost per record.
+    hlogSetFile( LogName, HLOG_MODE_BINARY );
+    double start = timeNow();
+    for(int i = 0; i < Records; i++)
+        hlogf( "text record %d of %s\n", i, "the test" );
+    double textNs = (timeNow() - start) * 1e9 / Records;
+
+    start = timeNow();
+    for(int i = 0; i < Records; i++)
+        hlogWarn( "formatted record %d of %s\n", i, "the test" );
+    double fmtNs = (timeNow() - start) * 1e9 / Records;
+    hlogCloseFile();
+
+    printf("\n%-24s %12s\n", "Binary record", "ns/record");
+    printf("%-24s %12.1f\n", "text (hlogf)", textNs);
+    printf("%-24s %12.1f\n\n", "formatted (hlogWarn)", fmtNs);
+
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,233 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*  Fast primitives test.
+ *
+ *  - FastMutex: threads increment a shared counter, none of the increments may be lost.
+ *  - FastCondVar: a bounded buffer with notify() on both sides, every item must arrive.
+ *    Then rounds of notifyAll() on parked waiters, which are requeued onto the mutex:
+ *    every waiter must wake up in every round. Timed waits must time out.
+ *  - FastEvent: set() must wake all the parked waiters, reset() and timed waits must work.
+ *  A waiter which never wakes fails the test instead of hanging it.
+ */
+
+#define THREADS       4
+#define BUFFER_SIZE   16
+#define WAIT_TIMEOUT  50   // Millisecs
+#define WAKE_DEADLINE 2000 // Millisecs
+
+const long LockOps = 500000; // Per thread.
+const long Items = 200000;
+const int Rounds = 300;
+
+struct SharedState
+{
+    GrFastMutex mtx;
+    GrFastCondVar notEmpty;
+    GrFastCondVar notFull;
+    GrFastEvent event;
+    long counter;
+    long buffer[ BUFFER_SIZE ];
+    int count;
+    long sum;
+    int round;
+    int waiting;
+    int woken;
+};
+
+double millisNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void sleepMillis(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep( &ts, NULL );
+}
+
+// Waits until the counter reaches the target, for at most WAKE_DEADLINE. Returns 0 if it did.
+int waitCount(struct SharedState* st, int* counter, int target)
+{
+    double deadline = millisNow() + WAKE_DEADLINE;
+    while(1)
+    {
+        gthread_FastMutex_lock( &(st->mtx) );
+        int value = *counter;
+        gthread_FastMutex_unlock( &(st->mtx) );
+        if(value >= target)
+            return 0;
+        if(millisNow() > deadline)
+            return 1;
+        sleepMillis( 1 );
+    }
+}
+
+void counterProc(void* param)
+{
+    struct SharedState* st = (struct SharedState*)param;
+    for(long i = 0; i < LockOps; i++){
+        gthread_FastMutex_lock( &(st->mtx) );
+        st->counter++;
+        gthread_FastMutex_unlock( &(st->mtx) );
+    }
+}
+
+void producerProc(void* param)
+{
+    struct SharedState* st = (struct SharedState*)param;
+    for(long i = 1; i <= Items; i++){
+        gthread_FastMutex_lock( &(st->mtx) );
+        while(st->count == BUFFER_SIZE)
+            gthread_FastCondVar_wait( &(st->notFull), &(st->mtx) );
+        st->buffer[ st->count++ ] = i;
+        gthread_FastMutex_unlock( &(st->mtx) );
+        gthread_FastCondVar_notify( &(st->notEmpty) );
+    }
+}
+
+void consumerProc(void* param)
+{
+    struct SharedState* st = (struct SharedState*)param;
+    for(long i = 1; i <= Items; i++){
+        gthread_FastMutex_lock( &(st->mtx) );
+        while(st->count == 0)
+            gthread_FastCondVar_wait( &(st->notEmpty), &(st->mtx) );
+        st->sum += st->buffer[ --st->count ];
+        gthread_FastMutex_unlock( &(st->mtx) );
+        gthread_FastCondVar_notify( &(st->notFull) );
+    }
+}
+
+void roundWaiterProc(void* param)
+{
+    struct SharedState* st = (struct SharedState*)param;
+    for(int r = 1; r <= Rounds; r++){
+        gthread_FastMutex_lock( &(st->mtx) );
+        st->waiting++;
+        while(st->round < r)
+            gthread_FastCondVar_wait( &(st->notEmpty), &(st->mtx) );
+        st->woken++;
+        gthread_FastMutex_unlock( &(st->mtx) );
+    }
+}
+
+void eventWaiterProc(void* param)
+{
+    struct SharedState* st = (struct SharedState*)param;
+    gthread_FastMutex_lock( &(st->mtx) );
+    st->waiting++;
+    gthread_FastMutex_unlock( &(st->mtx) );
+
+    gthread_FastEvent_wait( &(st->event) );
+
+    gthread_FastMutex_lock( &(st->mtx) );
+    st->woken++;
+    gthread_FastMutex_unlock( &(st->mtx) );
+}
+
+void resetState(struct SharedState* st)
+{
+    gthread_FastMutex_init( &(st->mtx) );
+    gthread_FastCondVar_init( &(st->notEmpty) );
+    gthread_FastCondVar_init( &(st->notFull) );
+    gthread_FastEvent_init( &(st->event), 0 );
+    st->counter = st->sum = 0;
+    st->count = st->round = st->waiting = st->woken = 0;
+}
+
+void joinAll(GrThread* thr, int count)
+{
+    for(int i = 0; i < count; i++)
+        gthread_Thread_join( thr[i], 1 );
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest17.log", HLOG_MODE_APPEND);
+    static struct SharedState st;
+    GrThread thr[ THREADS ];
+    int errors = 0;
+
+    // FastMutex.
+    resetState( &st );
+    double start = millisNow();
+    for(int i = 0; i < THREADS; i++)
+        thr[i] = gthread_Thread_create( counterProc, &st );
+    joinAll( thr, THREADS );
+    double lockMs = millisNow() - start;
+    errors += ( st.counter != LockOps * THREADS );
+    printf("FastMutex: %ld/%ld increments, %.2f Mops/s: %s\n", st.counter, LockOps * THREADS,
+           LockOps * THREADS / lockMs / 1e3, (errors ? "FAIL" : "OK"));
+
+    // FastCondVar notify.
+    resetState( &st );
+    thr[0] = gthread_Thread_create( producerProc, &st );
+    thr[1] = gthread_Thread_create( consumerProc, &st );
+    joinAll( thr, 2 );
+    errors += ( st.sum != Items * (Items + 1) / 2 || st.count != 0 );
+    printf("FastCondVar notify: sum %ld: %s\n", st.sum, (errors ? "FAIL" : "OK"));
+
+    // FastCondVar notifyAll. The waiters are parked (or about to) once they're counted.
+    resetState( &st );
+    for(int i = 0; i < THREADS; i++)
+        thr[i] = gthread_Thread_create( roundWaiterProc, &st );
+    int round = 1;
+    for(; round <= Rounds; round++){
+        if( waitCount( &st, &(st.waiting), THREADS * round ) != 0 )
+            break;
+        gthread_FastMutex_lock( &(st.mtx) );
+        st.round = round;
+        gthread_FastCondVar_notifyAll( &(st.notEmpty) );
+        gthread_FastMutex_unlock( &(st.mtx) );
+        if( waitCount( &st, &(st.woken), THREADS * round ) != 0 )
+            break;
+    }
+    if(round <= Rounds){
+        printf("FastCondVar notifyAll: %d of %d waiters woken in round %d: FAIL\n", st.woken - THREADS * (round - 1), THREADS, round);
+        return 1;
+    }
+    joinAll( thr, THREADS );
+    printf("FastCondVar notifyAll: %d rounds of %d waiters: %s\n", Rounds, THREADS, (errors ? "FAIL" : "OK"));
+
+    // FastCondVar timeout.
+    gthread_FastMutex_lock( &(st.mtx) );
+    start = millisNow();
+    char res = gthread_FastCondVar_wait_time( &(st.notFull), &(st.mtx), WAIT_TIMEOUT );
+    double waitMs = millisNow() - start;
+    gthread_FastMutex_unlock( &(st.mtx) );
+    errors += ( res != 1 || waitMs < WAIT_TIMEOUT - 1 );
+    printf("FastCondVar timeout: %.1f ms: %s\n", waitMs, (errors ? "FAIL" : "OK"));
+
+    // FastEvent.
+    resetState( &st );
+    errors += ( gthread_FastEvent_isSet( &(st.event) ) != 0 || gthread_FastEvent_wait_time( &(st.event), 0 ) != 1 );
+    start = millisNow();
+    errors += ( gthread_FastEvent_wait_time( &(st.event), WAIT_TIMEOUT ) != 1 );
+    waitMs = millisNow() - start;
+    errors += ( waitMs < WAIT_TIMEOUT - 1 );
+
+    for(int i = 0; i < THREADS; i++)
+        thr[i] = gthread_Thread_create( eventWaiterProc, &st );
+    waitCount( &st, &(st.waiting), THREADS );
+    sleepMillis( WAIT_TIMEOUT ); // Let them park.
+    errors += ( st.woken != 0 );
+    gthread_FastEvent_set( &(st.event) );
+    if( waitCount( &st, &(st.woken), THREADS ) != 0 ){
+        printf("FastEvent: %d of %d waiters woken: FAIL\n", st.woken, THREADS);
+        return 1;
+    }
+    joinAll( thr, THREADS );
+    errors += ( gthread_FastEvent_isSet( &(st.event) ) != 1 || gthread_FastEvent_wait_time( &(st.event), 0 ) != 0 );
+    gthread_FastEvent_reset( &(st.event) );
+    errors += ( gthread_FastEvent_isSet( &(st.event) ) != 0 );
+    printf("FastEvent: timeout %.1f ms, %d waiters woken: %s\n\n", waitMs, THREADS, (errors ? "FAIL" : "OK"));
+
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,104 @@
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*  Process test.
+ *
+ *  Forked children exit with a status, return normally, kill themselves with a signal,
+ *  or wait to be terminated. isRunning() must see each of them finish, and reap it -
+ *  no zombie may be left behind. getExitStatus() must return the exit code, or
+ *  GTHREAD_PROCESS_SIGNALED + signal number, and -1 while the child still runs.
+ */
+
+#define EXIT_CODE     7
+#define WAIT_DEADLINE 5000 // Millisecs
+
+double millisNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void exitProc(void* param)
+{
+    exit( EXIT_CODE );
+}
+
+void returnProc(void* param)
+{
+}
+
+void signalProc(void* param)
+{
+    raise( SIGKILL );
+}
+
+void sleepProc(void* param)
+{
+    while(1)
+        pause();
+}
+
+// Polls the child until it has finished. Returns 0 if it did, and was reaped.
+int waitFinished(GrProcess proc)
+{
+    pid_t pid = (pid_t)gthread_Process_getID( proc );
+    double deadline = millisNow() + WAIT_DEADLINE;
+    while( gthread_Process_isRunning( proc ) ){
+        if(millisNow() > deadline)
+            return 1;
+        usleep( 1000 );
+    }
+    int status;
+    return !( waitpid( pid, &status, WNOHANG ) < 0 && errno == ECHILD );
+}
+
+// Forks a child, waits for it, and checks its exit status. Returns the number of errors.
+int runChild(const char* name, void (*proc)(void*), int expectStatus)
+{
+    GrProcess child = gthread_Process_fork( proc, NULL );
+    if(!child){
+        printf("%s: fork failed: FAIL\n", name);
+        return 1;
+    }
+    int errors = waitFinished( child );
+    int status = gthread_Process_getExitStatus( child );
+    errors += ( status != expectStatus || gthread_Process_isRunning( child ) );
+    printf("%s: status %d (expected %d): %s\n", name, status, expectStatus, (errors ? "FAIL" : "OK"));
+    gthread_Process_join( child );
+    return errors;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest18.log", HLOG_MODE_APPEND);
+    int errors = 0;
+
+    errors += runChild( "Exit code", exitProc, EXIT_CODE );
+    errors += runChild( "Return", returnProc, 0 );
+    errors += runChild( "Killed by signal", signalProc, GTHREAD_PROCESS_SIGNALED + SIGKILL );
+
+    // Still running until terminated.
+    GrProcess child = gthread_Process_fork( sleepProc, NULL );
+    if(!child){
+        printf("Terminate: fork failed: FAIL\n");
+        return 1;
+    }
+    int err = ( gthread_Process_isRunning( child ) != 1 || gthread_Process_getExitStatus( child ) != -1 );
+    err += ( gthread_Process_terminate( child ) != 0 );
+    err += waitFinished( child );
+    int status = gthread_Process_getExitStatus( child );
+    err += ( status != GTHREAD_PROCESS_SIGNALED + SIGTERM || gthread_Process_terminate( child ) != 1 );
+    printf("Terminate: status %d (expected %d): %s\n\n", status, GTHREAD_PROCESS_SIGNALED + SIGTERM, (err ? "FAIL" : "OK"));
+    gthread_Process_join( child );
+    errors += err;
+
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,264 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <poll.h>
+
+/*  Segmented download (pget) test.
+ *
+ *  The client is run against a scripted FTP server on the loopback, which serves a generated
+ *  file of FILE_SIZE bytes. Like a real server, it answers a RETR with 426 if the client closes
+ *  the data connection before the server ends it - expected for the segments pget cuts short,
+ *  but the last segment must be read up to EOF and get its 226.
+ *  - The downloaded file must match, byte by byte.
+ *  - Every segment must have been asked for, and the last segment's data connection may not
+ *    be closed by the client before the server's EOF.
+ *  Then the server takes no sessions beyond the client's main one and pget's first: the streams
+ *  which can't log in are refused, and the first stream must get the whole file by itself.
+ *  The client is taken from argv[1], or looked up next to the test's bin directory.
+ */
+
+#define FILE_SIZE    (20 * 1024 * 1024 + 12345)
+#define CHUNK_SIZE   (64 * 1024)
+#define MAX_SESSIONS 32
+#define EOF_WAIT     200 // Millisecs the server gives the client to close first.
+#define SEGMENT_SIZE (4 * 1024 * 1024) // FTP_PGET_MIN_SEGMENT - the file is too small for more.
+
+const char* RemoteName = "pget.bin";
+const char* LocalName = "gryltest19.bin";
+
+struct ServerState
+{
+    SOCKET listener;
+    GrThread sessions[ MAX_SESSIONS ];
+    int sessionCount;
+    int sessionLimit; // 0 - no limit.
+    int refused;
+    int retrs;        // Atomic.
+    int fullRetrs;    // Atomic. RETRs sent to the end of the file.
+    int closedEarly;  // Atomic. Last segment RETRs the client closed before the server did.
+};
+
+struct SessionParams
+{
+    struct ServerState* server;
+    SOCKET sock;
+};
+
+static struct SessionParams sessionParams[ MAX_SESSIONS ];
+
+char fileByte(long long offset)
+{
+    return (char)(offset % 251);
+}
+
+void reply(SOCKET sock, const char* text)
+{
+    gsockSendAll( sock, text, strlen(text), 0 );
+}
+
+// Sends the file from offset. Returns 226 if the transfer ended well, 426 if not.
+int sendFile(struct ServerState* st, SOCKET data, long long offset)
+{
+    char* buf = malloc( CHUNK_SIZE );
+    long long start = offset;
+    int code = 226;
+    while(offset < FILE_SIZE && code == 226){
+        int len = (FILE_SIZE - offset < CHUNK_SIZE ? (int)(FILE_SIZE - offset) : CHUNK_SIZE);
+        for(int i = 0; i < len; i++)
+            buf[i] = fileByte( offset + i );
+        if( gsockSendAll( data, buf, len, 0 ) != 0 )
+            code = 426;
+        offset += len;
+    }
+    free( buf );
+    if(code != 226)
+        return code;
+
+    // All sent. A client which closes its end without waiting for ours gets a 426.
+    // Only the last segment's client has no reason to.
+    gatomic_fetchAdd( &(st->fullRetrs), 1, GATOMIC_RELAXED );
+    struct pollfd pfd = { data, POLLIN, 0 };
+    char byte;
+    if( poll( &pfd, 1, EOF_WAIT ) > 0 && recv( data, &byte, 1, 0 ) <= 0 ){
+        if(start >= (FILE_SIZE - 1) / SEGMENT_SIZE * SEGMENT_SIZE)
+            gatomic_fetchAdd( &(st->closedEarly), 1, GATOMIC_RELAXED );
+        return 426;
+    }
+    shutdown( data, SHUT_WR );
+    return 226;
+}
+
+void sessionProc(void* param)
+{
+    struct SessionParams* sp = (struct SessionParams*)param;
+    GSockLineReader rd = gsockLineReader_create( sp->sock, 0 );
+    SOCKET pasv = INVALID_SOCKET;
+    long long offset = 0;
+    char* line;
+    size_t len;
+    char text[ 128 ];
+
+    reply( sp->sock, "220 Scripted server.\r\n" );
+    while( rd && gsockLineReader_readLine( rd, &line, &len, 10000 ) == 0 )
+    {
+        if( strncmp( line, "USER", 4 ) == 0 )
+            reply( sp->sock, "331 Password.\r\n" );
+        else if( strncmp( line, "PASS", 4 ) == 0 )
+            reply( sp->sock, "230 Logged in.\r\n" );
+        else if( strncmp( line, "SIZE", 4 ) == 0 ){
+            snprintf( text, sizeof(text), "213 %d\r\n", FILE_SIZE );
+            reply( sp->sock, text );
+        }
+        else if( strncmp( line, "REST", 4 ) == 0 ){
+            offset = atoll( line + 5 );
+            reply( sp->sock, "350 Restarting.\r\n" );
+        }
+        else if( strncmp( line, "PASV", 4 ) == 0 ){
+            struct sockaddr_in addr;
+            socklen_t addrLen = sizeof(addr);
+            gsockCloseSocket( pasv );
+            pasv = gsockListenSocket( 0, "127.0.0.1", AF_INET, SOCK_STREAM, 0, 0 );
+            getsockname( pasv, (struct sockaddr*)&addr, &addrLen );
+            int port = ntohs( addr.sin_port );
+            snprintf( text, sizeof(text), "227 Entering Passive Mode (127,0,0,1,%d,%d).\r\n", port / 256, port % 256 );
+            reply( sp->sock, text );
+        }
+        else if( strncmp( line, "RETR", 4 ) == 0 ){
+            gatomic_fetchAdd( &(sp->server->retrs), 1, GATOMIC_RELAXED );
+            SOCKET data = accept( pasv, NULL, NULL );
+            reply( sp->sock, "150 Sending.\r\n" );
+            int code = ( data == INVALID_SOCKET ? 425 : sendFile( sp->server, data, offset ) );
+            gsockCloseSocket( data );
+            snprintf( text, sizeof(text), "%d %s\r\n", code, (code == 226 ? "Done." : "Transfer aborted.") );
+            reply( sp->sock, text );
+            offset = 0;
+        }
+        else if( strncmp( line, "QUIT", 4 ) == 0 ){
+            reply( sp->sock, "221 Bye.\r\n" );
+            break;
+        }
+        else
+            reply( sp->sock, "200 OK.\r\n" );
+    }
+    gsockCloseSocket( pasv );
+    gsockLineReader_destroy( &rd );
+    gsockCloseSocket( sp->sock );
+}
+
+void acceptorProc(void* param)
+{
+    struct ServerState* st = (struct ServerState*)param;
+    SOCKET sock;
+    while( st->sessionCount < MAX_SESSIONS && (sock = accept( st->listener, NULL, NULL )) != INVALID_SOCKET ){
+        if(st->sessionLimit && st->sessionCount >= st->sessionLimit){
+            reply( sock, "421 Too many connections.\r\n" );
+            gsockCloseSocket( sock );
+            st->refused++;
+            continue;
+        }
+        sessionParams[ st->sessionCount ] = (struct SessionParams){ st, sock };
+        st->sessions[ st->sessionCount ] = gthread_Thread_create( sessionProc, sessionParams + st->sessionCount );
+        st->sessionCount++;
+    }
+}
+
+const char* findClient(const char* self, char* path, size_t size)
+{
+    char dir[ 1024 ];
+    snprintf( dir, sizeof(dir), "%s", self );
+    const char* builds[] = { "debug", "release" };
+    for(int i = 0; i < 2; i++){
+        snprintf( path, size, "%s/../%s/client", dirname( dir ), builds[i] );
+        snprintf( dir, sizeof(dir), "%s", self );
+        if( access( path, X_OK ) == 0 )
+            return path;
+    }
+    return NULL;
+}
+
+// Counts the bytes of the downloaded file which differ from the served one, or returns -1.
+long long checkFile()
+{
+    FILE* file = fopen( LocalName, "rb" );
+    if(!file)
+        return -1;
+    long long offset = 0, bad = 0;
+    int c;
+    while( (c = fgetc( file )) != EOF )
+        bad += ( (char)c != fileByte( offset++ ) );
+    fclose( file );
+    return (offset == FILE_SIZE ? bad : -1);
+}
+
+// Runs the client's pget against the scripted server. Returns the number of errors.
+int runDownload(const char* client, const char* name, int sessionLimit)
+{
+    static struct ServerState st;
+    memset( &st, 0, sizeof(st) );
+    st.sessionLimit = sessionLimit;
+    st.listener = gsockListenSocket( 0, "127.0.0.1", AF_INET, SOCK_STREAM, 0, 0 );
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if( st.listener == INVALID_SOCKET || getsockname( st.listener, (struct sockaddr*)&addr, &addrLen ) != 0 ){
+        printf("%s: Can't start the server: FAIL\n", name);
+        return 1;
+    }
+    GrThread acceptor = gthread_Thread_create( acceptorProc, &st );
+
+    // Log in, download, quit - the client reads its commands from stdin.
+    char cmd[ 2048 ];
+    snprintf( cmd, sizeof(cmd), "%s 127.0.0.1 %d > gryltest19.out 2>&1", client, ntohs( addr.sin_port ) );
+    remove( LocalName );
+    FILE* in = popen( cmd, "w" );
+    if(!in){
+        printf("Can't run %s\n", client);
+        return 1;
+    }
+    fprintf( in, "user\npass\npget %s %s\nquit\n", RemoteName, LocalName );
+    int status = pclose( in );
+
+    shutdown( st.listener, SHUT_RDWR );
+    gthread_Thread_join( acceptor, 1 );
+    for(int i = 0; i < st.sessionCount; i++)
+        gthread_Thread_join( st.sessions[i], 1 );
+    gsockCloseSocket( st.listener );
+
+    int errors = 0;
+    long long bad = checkFile();
+    errors += ( status != 0 || bad != 0 );
+    printf("%s: Download: %s\n", name, (bad < 0 ? "incomplete" : bad ? "corrupt" : "matches"));
+
+    int segments = (FILE_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    errors += ( st.retrs < segments || st.fullRetrs < 1 || st.closedEarly != 0 );
+    errors += ( sessionLimit && st.refused < 1 );
+    printf("%s: %d RETRs for %d segments, %d sent to the end, %d closed before EOF, %d sessions refused: %s\n",
+           name, st.retrs, segments, st.fullRetrs, st.closedEarly, st.refused, (errors ? "FAIL" : "OK"));
+    return errors;
+}
+
+int main(int argc, char** argv)
+{
+    char clientPath[ 1024 ];
+    const char* client = (argc > 1 ? argv[1] : findClient( argv[0], clientPath, sizeof(clientPath) ));
+    if(!client){
+        printf("client not found - pass its path as the first argument.\n");
+        return 1;
+    }
+    hlogSetFile("gryltest19.log", HLOG_MODE_APPEND);
+    signal( SIGPIPE, SIG_IGN );
+    gsockInitSocks();
+
+    int errors = runDownload( client, "Any sessions", 0 );
+    errors += runDownload( client, "Two sessions", 2 ); // The client's own and pget's first.
+    printf("\n");
+
+    gsockSockCleanup();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,132 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*  This test demonstrates the GrylloThread Thread Pool:
+ *  - Futures: the main thread splits an array sum into chunks, and collects the results.
+ *  - Work stealing: a task recursively submits subtasks to its own worker's deque,
+ *    and idle workers steal them.
+ *  - Graceful shutdown: destroying the pool runs all the submitted tasks first.
+ *
+ *  At the end, the cost of a pool task is compared to spawning a thread per job.
+ */
+
+const int ChunkCount = 16;
+const long ChunkSize = 100000;
+const int TreeDepth = 12; // The recursive job spawns 2^TreeDepth - 1 tasks.
+const int SpawnJobs = 2000;
+
+GrThreadPool pool;
+long treeTasksDone = 0;
+long trivialDone = 0;
+
+struct SumChunk
+{
+    const long* data;
+    long count;
+    long sum;
+};
+
+void* sumChunk(void* param)
+{
+    struct SumChunk* chunk = (struct SumChunk*)param;
+    chunk->sum = 0;
+    for(long i = 0; i < chunk->count; i++)
+        chunk->sum += chunk->data[i];
+    return &(chunk->sum);
+}
+
+void treeTask(void* param)
+{
+    long depth = (long)param;
+    if(depth > 1){
+        gthread_Pool_submit( pool, treeTask, (void*)(depth - 1) );
+        gthread_Pool_submit( pool, treeTask, (void*)(depth - 1) );
+    }
+    gatomic_addFetch( &treeTasksDone, 1, GATOMIC_RELAXED );
+}
+
+void trivialTask(void* param)
+{
+    gatomic_addFetch( &trivialDone, 1, GATOMIC_RELAXED );
+}
+
+double elapsedMs(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest3.log", HLOG_MODE_APPEND);
+    int errors = 0;
+
+    pool = gthread_Pool_create(0);
+    if(!pool){
+        printf("Failed to create a pool!\n");
+        return 1;
+    }
+    printf("Pool created with %d workers.\n", gthread_Pool_getWorkerCount(pool));
+
+    // 1. Futures.
+    long* data = malloc( ChunkCount * ChunkSize * sizeof(long) );
+    struct SumChunk chunks[ ChunkCount ];
+    GrFuture futures[ ChunkCount ];
+    long expected = 0;
+
+    for(long i = 0; i < ChunkCount * ChunkSize; i++){
+        data[i] = i % 1000;
+        expected += data[i];
+    }
+    for(int i = 0; i < ChunkCount; i++){
+        chunks[i].data = data + i * ChunkSize;
+        chunks[i].count = ChunkSize;
+        futures[i] = gthread_Pool_submitFuture( pool, sumChunk, chunks + i );
+    }
+
+    long total = 0;
+    for(int i = 0; i < ChunkCount; i++){
+        total += *(long*)gthread_Future_get( futures[i] );
+        gthread_Future_destroy( futures + i );
+    }
+    printf("Futures: sum %ld, expected %ld - %s\n", total, expected, (total == expected ? "OK" : "FAIL"));
+    errors += (total != expected);
+    free(data);
+
+    // 2. Recursive tasks, which must be stolen to run in parallel.
+    gthread_Pool_submit( pool, treeTask, (void*)(long)TreeDepth );
+
+    // 3. Pool task vs Thread per job.
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for(int i = 0; i < SpawnJobs; i++)
+        gthread_Pool_submit( pool, trivialTask, NULL );
+
+    // Graceful shutdown waits for everything submitted, including the subtasks.
+    gthread_Pool_destroy( &pool, 1 );
+    double poolMs = elapsedMs( &start );
+
+    long expectedTree = (1L << TreeDepth) - 1;
+    printf("Work stealing: %ld tasks done, expected %ld - %s\n", treeTasksDone, expectedTree,
+           (treeTasksDone == expectedTree ? "OK" : "FAIL"));
+    errors += (treeTasksDone != expectedTree);
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for(int i = 0; i < SpawnJobs; i++){
+        GrThread thr = gthread_Thread_create( trivialTask, NULL );
+        if(thr)
+            gthread_Thread_join( thr, 1 );
+    }
+    double threadMs = elapsedMs( &start );
+
+    printf("%d jobs: pool %.2f ms (with the recursive tasks), thread per job %.2f ms\n", SpawnJobs, poolMs, threadMs);
+    errors += (trivialDone != 2 * SpawnJobs);
+
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
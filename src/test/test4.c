@@ -0,0 +1,252 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/*  Queue contention benchmark.
+ *
+ *  Producers push ItemCount items in total, and consumers pop them until they get a Stop item.
+ *  The same workload is run through:
+ *  - GrQueue - the lock-free MPMC ring, with blocking push/pop.
+ *  - A classic ring protected by a GrMutex, with "not empty" and "not full" CondVars.
+ *
+ *  Both queues have the same capacity, so the difference is only in synchronization.
+ *  The consumed item sum is checked, so lost or duplicated items fail the test.
+ *
+ *  Timed push/pop must give up after their timeout even if they're woken up and lose the race
+ *  for the slot or item, over and over.
+ */
+
+#define QUEUE_CAPACITY 1024
+#define WAIT_TIMEOUT   100 // Millisecs
+
+const long ItemCount = 400000;
+void* const StopItem = (void*)(intptr_t)-1;
+
+// The mutex + condvar queue.
+struct LockedQueue
+{
+    void* items[ QUEUE_CAPACITY ];
+    size_t head, count;
+    GrMutex mtx;
+    GrCondVar notEmpty;
+    GrCondVar notFull;
+};
+
+void lockedPush(struct LockedQueue* q, void* item)
+{
+    gthread_Mutex_lock( q->mtx );
+    while( q->count == QUEUE_CAPACITY )
+        gthread_CondVar_wait( q->notFull, q->mtx );
+    q->items[ (q->head + q->count) % QUEUE_CAPACITY ] = item;
+    q->count++;
+    gthread_CondVar_notify( q->notEmpty );
+    gthread_Mutex_unlock( q->mtx );
+}
+
+void* lockedPop(struct LockedQueue* q)
+{
+    gthread_Mutex_lock( q->mtx );
+    while( q->count == 0 )
+        gthread_CondVar_wait( q->notEmpty, q->mtx );
+    void* item = q->items[ q->head ];
+    q->head = (q->head + 1) % QUEUE_CAPACITY;
+    q->count--;
+    gthread_CondVar_notify( q->notFull );
+    gthread_Mutex_unlock( q->mtx );
+    return item;
+}
+
+// Benchmark run state.
+struct BenchState
+{
+    char useLocked;
+    GrQueue queue;
+    struct LockedQueue locked;
+    long perProducer;
+    long consumedSum;
+};
+
+void producerProc(void* param)
+{
+    struct BenchState* st = (struct BenchState*)param;
+    for(long i = 1; i <= st->perProducer; i++){
+        if(st->useLocked)
+            lockedPush( &(st->locked), (void*)(intptr_t)i );
+        else
+            gthread_Queue_push( st->queue, (void*)(intptr_t)i, -1 );
+    }
+}
+
+void consumerProc(void* param)
+{
+    struct BenchState* st = (struct BenchState*)param;
+    long sum = 0;
+    while(1){
+        void* item;
+        if(st->useLocked)
+            item = lockedPop( &(st->locked) );
+        else
+            gthread_Queue_pop( st->queue, &item, -1 );
+
+        if(item == StopItem)
+            break;
+        sum += (long)(intptr_t)item;
+    }
+    gatomic_addFetch( &(st->consumedSum), sum, GATOMIC_RELAXED );
+}
+
+// Timed waiters on a full (push) or empty (pop) queue, which is freed or filled by one item
+// at a time. A waiter which gets the item passes the wake on, and the next one loses the race.
+#define WAITERS 8
+
+struct WaiterParams
+{
+    GrQueue queue;
+    char push;
+    double ms;
+};
+
+double millisNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void timedWaiterProc(void* param)
+{
+    struct WaiterParams* wp = (struct WaiterParams*)param;
+    void* item = (void*)(intptr_t)1;
+    double start = millisNow();
+    if(wp->push)
+        gthread_Queue_push( wp->queue, item, WAIT_TIMEOUT );
+    else
+        gthread_Queue_pop( wp->queue, &item, WAIT_TIMEOUT );
+    wp->ms = millisNow() - start;
+}
+
+// Returns the longest wait, in millisecs.
+double runTimedWaiters(char push)
+{
+    GrQueue queue = gthread_Queue_create( 1 );
+    while( push && gthread_Queue_tryPush( queue, (void*)(intptr_t)2 ) == 0 )
+        ;
+    struct WaiterParams params[ WAITERS ];
+    GrThread thr[ WAITERS ];
+    for(int i = 0; i < WAITERS; i++){
+        params[i] = (struct WaiterParams){ queue, push, 0 };
+        thr[i] = gthread_Thread_create( timedWaiterProc, params + i );
+    }
+
+    // Fewer items than waiters, so some of them time out after a few lost races.
+    struct timespec pause = { 0, WAIT_TIMEOUT / 3 * 1000000L };
+    for(int i = 0; i < WAITERS; i++){
+        void* item;
+        nanosleep( &pause, NULL );
+        if(push)
+            gthread_Queue_tryPop( queue, &item );
+        else
+            gthread_Queue_tryPush( queue, (void*)(intptr_t)2 );
+    }
+
+    double longest = 0;
+    for(int i = 0; i < WAITERS; i++){
+        gthread_Thread_join( thr[i], 1 );
+        longest = (params[i].ms > longest ? params[i].ms : longest);
+    }
+    gthread_Queue_destroy( &queue );
+    return longest;
+}
+
+// Returns millions of items per second, or < 0 if items got lost.
+double runBench(char useLocked, int producers, int consumers)
+{
+    struct BenchState st = { 0 };
+    st.useLocked = useLocked;
+    st.perProducer = ItemCount / producers;
+    if(useLocked){
+        st.locked.mtx = gthread_Mutex_init(0);
+        st.locked.notEmpty = gthread_CondVar_init();
+        st.locked.notFull = gthread_CondVar_init();
+    }
+    else
+        st.queue = gthread_Queue_create( QUEUE_CAPACITY );
+
+    GrThread prod[ producers ];
+    GrThread cons[ consumers ];
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for(int i = 0; i < consumers; i++)
+        cons[i] = gthread_Thread_create( consumerProc, &st );
+    for(int i = 0; i < producers; i++)
+        prod[i] = gthread_Thread_create( producerProc, &st );
+
+    for(int i = 0; i < producers; i++)
+        gthread_Thread_join( prod[i], 1 );
+    for(int i = 0; i < consumers; i++){
+        if(useLocked)
+            lockedPush( &(st.locked), StopItem );
+        else
+            gthread_Queue_push( st.queue, StopItem, -1 );
+    }
+    for(int i = 0; i < consumers; i++)
+        gthread_Thread_join( cons[i], 1 );
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    if(useLocked){
+        gthread_Mutex_destroy( &(st.locked.mtx) );
+        gthread_CondVar_destroy( &(st.locked.notEmpty) );
+        gthread_CondVar_destroy( &(st.locked.notFull) );
+    }
+    else
+        gthread_Queue_destroy( &(st.queue) );
+
+    long expected = producers * (st.perProducer * (st.perProducer + 1) / 2);
+    if(st.consumedSum != expected)
+        return -1;
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (producers * st.perProducer) / secs / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest4.log", HLOG_MODE_APPEND);
+    const int configs[][2] = { {1, 1}, {2, 2}, {4, 4}, {1, 4}, {4, 1} };
+    int errors = 0;
+
+    // Quick sanity checks of the non-blocking calls.
+    GrQueue q = gthread_Queue_create( 3 );
+    void* item;
+    errors += ( gthread_Queue_getCapacity(q) != 4 );
+    errors += ( gthread_Queue_tryPop( q, &item ) != 1 );
+    for(intptr_t i = 1; i <= 4; i++)
+        errors += ( gthread_Queue_tryPush( q, (void*)i ) != 0 );
+    errors += ( gthread_Queue_tryPush( q, (void*)5 ) != 1 );
+    errors += ( gthread_Queue_pop( q, &item, 10 ) != 0 || item != (void*)1 );
+    errors += ( gthread_Queue_getSize(q) != 3 );
+    gthread_Queue_destroy( &q );
+    printf("Non-blocking checks: %s\n", (errors ? "FAIL" : "OK"));
+
+    double pushMs = runTimedWaiters( 1 );
+    double popMs = runTimedWaiters( 0 );
+    errors += ( pushMs > WAIT_TIMEOUT * 3 / 2 || popMs > WAIT_TIMEOUT * 3 / 2 );
+    printf("Contended %d ms timeouts: push %.1f ms, pop %.1f ms: %s\n\n", WAIT_TIMEOUT, pushMs, popMs, (errors ? "FAIL" : "OK"));
+
+    printf("%-12s %16s %16s\n", "Prod x Cons", "GrQueue Mops/s", "Mutex Mops/s");
+    for(size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++){
+        double lockFree = runBench( 0, configs[i][0], configs[i][1] );
+        double locked = runBench( 1, configs[i][0], configs[i][1] );
+        printf("%5d x %-4d %16.2f %16.2f\n", configs[i][0], configs[i][1], lockFree, locked);
+        errors += (lockFree < 0 || locked < 0);
+    }
+
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,142 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*  SharedMutex (reader-writer lock) throughput benchmark.
+ *
+ *  Threads look up entries of a small shared table, and with some probability
+ *  update an entry instead. Updates keep a checksum of the table, so readers can
+ *  verify they never see a half-done update.
+ *
+ *  Every read/write ratio is run with a GrSharedMutex, and with a plain GrMutex.
+ */
+
+#define TABLE_SIZE 64
+
+const int ThreadCount = 4;
+const long OpsPerThread = 200000;
+
+struct SharedTable
+{
+    long entries[ TABLE_SIZE ];
+    long checksum;
+};
+
+struct BenchState
+{
+    char useShared;
+    int writePermille; // Writes per 1000 ops.
+    GrSharedMutex rwlock;
+    GrMutex mutex;
+    struct SharedTable table;
+    int inconsistencies;
+};
+
+void benchProc(void* param)
+{
+    struct BenchState* st = (struct BenchState*)param;
+    unsigned int seed = (unsigned int)(size_t)&seed;
+
+    for(long i = 0; i < OpsPerThread; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        int idx = (seed >> 8) % TABLE_SIZE;
+        char write = ((seed >> 16) % 1000) < (unsigned)st->writePermille;
+
+        if(write){
+            if(st->useShared) gthread_SharedMutex_lock( st->rwlock );
+            else              gthread_Mutex_lock( st->mutex );
+
+            st->table.entries[ idx ]++;
+            st->table.checksum++;
+
+            if(st->useShared) gthread_SharedMutex_unlock( st->rwlock );
+            else              gthread_Mutex_unlock( st->mutex );
+        }
+        else{
+            if(st->useShared) gthread_SharedMutex_lockShared( st->rwlock );
+            else              gthread_Mutex_lock( st->mutex );
+
+            // Check the whole table now and then, a single lookup otherwise.
+            if((i & 1023) == 0){
+                long sum = 0;
+                for(int j = 0; j < TABLE_SIZE; j++)
+                    sum += st->table.entries[j];
+                if(sum != st->table.checksum)
+                    gatomic_addFetch( &(st->inconsistencies), 1, GATOMIC_RELAXED );
+            }
+            else if(st->table.entries[ idx ] < 0)
+                gatomic_addFetch( &(st->inconsistencies), 1, GATOMIC_RELAXED );
+
+            if(st->useShared) gthread_SharedMutex_unlockShared( st->rwlock );
+            else              gthread_Mutex_unlock( st->mutex );
+        }
+    }
+}
+
+// Returns millions of ops per second, or < 0 on errors.
+double runBench(char useShared, int writePermille)
+{
+    struct BenchState st = { 0 };
+    st.useShared = useShared;
+    st.writePermille = writePermille;
+    st.rwlock = gthread_SharedMutex_init();
+    st.mutex = gthread_Mutex_init(0);
+
+    GrThread threads[ ThreadCount ];
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for(int i = 0; i < ThreadCount; i++)
+        threads[i] = gthread_Thread_create( benchProc, &st );
+    for(int i = 0; i < ThreadCount; i++)
+        gthread_Thread_join( threads[i], 1 );
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    gthread_SharedMutex_destroy( &(st.rwlock) );
+    gthread_Mutex_destroy( &(st.mutex) );
+
+    long sum = 0;
+    for(int j = 0; j < TABLE_SIZE; j++)
+        sum += st.table.entries[j];
+    if(st.inconsistencies || sum != st.table.checksum)
+        return -1;
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (ThreadCount * OpsPerThread) / secs / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest5.log", HLOG_MODE_APPEND);
+    const int writeRatios[] = { 0, 10, 100, 500 };
+    int errors = 0;
+
+    // Quick checks of the try-lock semantics.
+    GrSharedMutex rw = gthread_SharedMutex_init();
+    errors += ( gthread_SharedMutex_lockShared( rw ) != 0 );
+    errors += ( gthread_SharedMutex_tryLockShared( rw ) != 0 );
+    errors += ( gthread_SharedMutex_tryLock( rw ) != 1 );
+    gthread_SharedMutex_unlockShared( rw );
+    gthread_SharedMutex_unlockShared( rw );
+    errors += ( gthread_SharedMutex_tryLock( rw ) != 0 );
+    errors += ( gthread_SharedMutex_tryLockShared( rw ) != 1 );
+    gthread_SharedMutex_unlock( rw );
+    gthread_SharedMutex_destroy( &rw );
+    printf("Try-lock checks: %s\n\n", (errors ? "FAIL" : "OK"));
+
+    printf("%d threads, %ld ops each\n", ThreadCount, OpsPerThread);
+    printf("%-10s %18s %14s\n", "Writes", "SharedMutex Mops/s", "Mutex Mops/s");
+    for(size_t i = 0; i < sizeof(writeRatios) / sizeof(writeRatios[0]); i++){
+        double shared = runBench( 1, writeRatios[i] );
+        double plain = runBench( 0, writeRatios[i] );
+        printf("%8.1f%% %18.2f %14.2f\n", writeRatios[i] / 10.0, shared, plain);
+        errors += (shared < 0 || plain < 0);
+    }
+
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
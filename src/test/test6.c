@@ -0,0 +1,181 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Thread attributes and TLS test.
+ *
+ *  A worker is created pinned to one CPU, with a name and a custom stack size.
+ *  It checks it runs on that CPU and sees its own affinity and name.
+ *  Then a pinned and an unpinned thread count how often they get migrated
+ *  between CPUs while doing the same busy work.
+ *
+ *  TLS: workers set per-thread values, which must be seen only by their own thread
+ *  and destroyed when it exits. The cost of a get is compared with pthread_getspecific().
+ */
+
+const long Samples = 2000000;
+
+struct PinCheck
+{
+    int cpu;
+    int errors;
+    long migrations;
+};
+
+static void readOwnName(char* buf, size_t size)
+{
+    buf[0] = 0;
+    FILE* file = fopen( "/proc/thread-self/comm", "r" );
+    if(file){
+        if( fgets( buf, (int)size, file ) )
+            buf[ strcspn( buf, "\n" ) ] = 0;
+        fclose(file);
+    }
+}
+
+void pinnedProc(void* param)
+{
+    struct PinCheck* chk = (struct PinCheck*)param;
+    GrCPUSet set;
+    char name[ 32 ];
+
+    if( gthread_getCurrentCPU() != chk->cpu )
+        chk->errors++;
+    if( gthread_Thread_getAffinity( NULL, &set ) != 0 || gthread_CPUSet_count( &set ) != 1 ||
+        !gthread_CPUSet_has( &set, chk->cpu ) )
+        chk->errors++;
+
+    readOwnName( name, sizeof(name) );
+    printf("Pinned thread: CPU %d, name \"%s\"\n", gthread_getCurrentCPU(), name);
+    if( name[0] && strcmp( name, "gtest-pinned" ) != 0 )
+        chk->errors++;
+}
+
+void migrationProc(void* param)
+{
+    struct PinCheck* chk = (struct PinCheck*)param;
+    int last = gthread_getCurrentCPU();
+    for(long i = 0; i < Samples; i++){
+        int cpu = gthread_getCurrentCPU();
+        if(cpu != last){
+            chk->migrations++;
+            last = cpu;
+        }
+    }
+}
+
+// TLS.
+const int TLSThreads = 4;
+const long TLSGets = 20000000;
+
+GrTLSKey tlsKey;
+int destroyedValues = 0;
+int tlsErrors = 0;
+pthread_key_t pthreadKey;
+long tlsSink = 0; // Keeps the gets from being optimized out.
+
+void tlsDestructor(void* value)
+{
+    gatomic_addFetch( &destroyedValues, 1, GATOMIC_RELAXED );
+    free(value);
+}
+
+void tlsProc(void* param)
+{
+    long* mine = malloc( sizeof(long) );
+    *mine = (long)param;
+    if( gthread_TLS_get( tlsKey ) != NULL )
+        gatomic_addFetch( &tlsErrors, 1, GATOMIC_RELAXED );
+    gthread_TLS_set( tlsKey, mine );
+    gthread_TLS_setContext( mine, NULL );
+
+    gthread_Thread_sleep( 20 ); // Let the others set theirs.
+    if( gthread_TLS_get( tlsKey ) != mine || *(long*)gthread_TLS_getContext() != (long)param )
+        gatomic_addFetch( &tlsErrors, 1, GATOMIC_RELAXED );
+    if( gthread_Thread_getID( NULL ) == (long)getpid() )
+        gatomic_addFetch( &tlsErrors, 1, GATOMIC_RELAXED ); // Not a real thread ID.
+}
+
+double nsPerGet(int mode)
+{
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for(long i = 0; i < TLSGets; i++){
+        void* v = ( mode == 0 ? gthread_TLS_get( tlsKey ) :
+                    mode == 1 ? gthread_TLS_getContext() : pthread_getspecific( pthreadKey ) );
+        tlsSink += (long)v & 1;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / TLSGets;
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest6.log", HLOG_MODE_APPEND);
+    int errors = 0;
+    int cpus = gthread_getCPUCount();
+    int target = cpus - 1; // Keep off CPU 0, which usually gets the interrupts.
+    printf("%d CPUs, main thread on CPU %d\n", cpus, gthread_getCurrentCPU());
+
+    GrThreadAttribs attr;
+    gthread_ThreadAttribs_init( &attr );
+    gthread_CPUSet_add( &(attr.cpus), target );
+    attr.stackSize = 256 * 1024;
+    attr.name = "gtest-pinned";
+
+    struct PinCheck chk = { target, 0, 0 };
+    GrThread thr = gthread_Thread_createEx( pinnedProc, &chk, &attr );
+    if(!thr){
+        printf("Failed to create a pinned thread!\n");
+        return 1;
+    }
+    gthread_Thread_join( thr, 1 );
+    printf("Pinned thread checks: %s\n", (chk.errors ? "FAIL" : "OK"));
+    errors += chk.errors;
+
+    // Migrations, with and without pinning.
+    struct PinCheck pinned = { target, 0, 0 };
+    struct PinCheck free = { target, 0, 0 };
+    attr.name = "gtest-migr";
+    GrThread t1 = gthread_Thread_createEx( migrationProc, &pinned, &attr );
+    GrThread t2 = gthread_Thread_create( migrationProc, &free );
+    if(t1) gthread_Thread_join( t1, 1 );
+    if(t2) gthread_Thread_join( t2, 1 );
+    printf("CPU migrations in %ld samples: pinned %ld, unpinned %ld\n", Samples, pinned.migrations, free.migrations);
+    errors += (pinned.migrations != 0);
+
+    // TLS.
+    tlsKey = gthread_TLS_create( tlsDestructor );
+    GrThread tlsThreads[ TLSThreads ];
+    for(int i = 0; i < TLSThreads; i++)
+        tlsThreads[i] = gthread_Thread_create( tlsProc, (void*)(long)(i + 1) );
+    for(int i = 0; i < TLSThreads; i++)
+        gthread_Thread_join( tlsThreads[i], 1 );
+    printf("TLS: %d values destroyed of %d - %s\n", destroyedValues, TLSThreads,
+           (!tlsErrors && destroyedValues == TLSThreads ? "OK" : "FAIL"));
+    errors += tlsErrors + (destroyedValues != TLSThreads);
+
+    // A destroyed and re-created key must not show the old value.
+    long value = 42;
+    gthread_TLS_set( tlsKey, &value );
+    gthread_TLS_destroy( &tlsKey );
+    tlsKey = gthread_TLS_create( NULL );
+    errors += ( gthread_TLS_get( tlsKey ) != NULL );
+
+    gthread_TLS_set( tlsKey, &value );
+    gthread_TLS_setContext( &value, NULL );
+    pthread_key_create( &pthreadKey, NULL );
+    pthread_setspecific( pthreadKey, &value );
+    printf("ns per get: gthread_TLS_get %.2f, getContext %.2f, pthread_getspecific %.2f\n",
+           nsPerGet(0), nsPerGet(1), nsPerGet(2));
+    gthread_TLS_destroy( &tlsKey );
+
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
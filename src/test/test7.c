@@ -0,0 +1,85 @@
+#include <grylthread.h>
+#include <gatomic.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+
+/*  Selectable Event test.
+ *
+ *  Producer threads signal the event many times, while the consumer waits on its fd
+ *  with poll(), like an event loop would, and drains it on every wakeup.
+ *  - Every signal must be counted exactly once by the drains.
+ *  - Signals coalesce, so the consumer should wake up far fewer times than it's signaled.
+ *
+ *  At the end the wait_time() timeout and the non-drained state are checked.
+ */
+
+const int Producers = 4;
+const long SignalsPerProducer = 200000;
+
+GrEvent event;
+int producersDone = 0;
+
+void producerProc(void* param)
+{
+    for(long i = 0; i < SignalsPerProducer; i++)
+        gthread_Event_signal( event );
+    gatomic_addFetch( &producersDone, 1, GATOMIC_RELEASE );
+    gthread_Event_signal( event ); // Make sure the consumer sees we're done.
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest7.log", HLOG_MODE_APPEND);
+    int errors = 0;
+
+    if( !(event = gthread_Event_create()) ){
+        printf("Failed to create an event!\n");
+        return 1;
+    }
+
+    GrThread threads[ Producers ];
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for(int i = 0; i < Producers; i++)
+        threads[i] = gthread_Thread_create( producerProc, NULL );
+
+    // The event loop.
+    struct pollfd pfd = { gthread_Event_getFD( event ), POLLIN, 0 };
+    unsigned long received = 0;
+    long wakeups = 0;
+    while( gatomic_load( &producersDone, GATOMIC_ACQUIRE ) < Producers ){
+        if( poll( &pfd, 1, 1000 ) > 0 ){
+            wakeups++;
+            received += gthread_Event_drain( event );
+        }
+    }
+    for(int i = 0; i < Producers; i++)
+        gthread_Thread_join( threads[i], 1 );
+    // The last signals came after the "done" counter.
+    received += gthread_Event_drain( event );
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    unsigned long expected = Producers * (SignalsPerProducer + 1);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Signals: %lu received, %lu expected - %s\n", received, expected, (received == expected ? "OK" : "FAIL"));
+    printf("Wakeups: %ld (%.1f signals per wakeup), %.2f ms\n", wakeups, (wakeups ? (double)received / wakeups : 0.0), ms);
+    errors += (received != expected);
+
+    // Timeouts, and a signal staying until drained.
+    errors += ( gthread_Event_wait_time( event, 20 ) != 1 );
+    errors += ( gthread_Event_isSet( event ) != 0 );
+    gthread_Event_signal( event );
+    gthread_Event_signal( event );
+    errors += ( gthread_Event_wait_time( event, 0 ) != 0 );
+    errors += ( gthread_Event_wait( event ) != 0 );
+    errors += ( gthread_Event_drain( event ) != 2 );
+    errors += ( poll( &pfd, 1, 0 ) != 0 ); // Not readable after the drain.
+    printf("Wait/drain checks: %s\n", (errors ? "FAIL" : "OK"));
+
+    gthread_Event_destroy( &event );
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
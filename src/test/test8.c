@@ -0,0 +1,256 @@
+#include <gfiber.h>
+#include <grylsocks.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+/*  Fiber runtime test.
+ *
+ *  - Sleeping fibers must wake up in deadline order, and waitFD() must time out.
+ *  - A timed waitFD() woken by the fd must leave no timer behind: a fiber which gets the
+ *    finished fiber's stack must wait out its own timeout.
+ *  - Context switch cost is measured with two fibers yielding to each other.
+ *  - Echo: an acceptor fiber, one echo fiber per connection, and one client fiber per
+ *    session all run on the main thread. Session code is plain blocking-style
+ *    gsockSend()/gsockReceive(), which park the fiber while the socket isn't ready.
+ */
+
+const int EchoRounds = 4;
+const long YieldCount = 1000000;
+
+#define MSG_SIZE 64
+
+int sessionCount = 2000;
+int listenPort = 0;
+int acceptedCount = 0;
+int sessionsOK = 0;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+//--------------- Ordering & timeouts ---------------//
+
+int wakeOrder[3];
+int wakeCount = 0;
+
+void sleeperProc(void* param)
+{
+    gfiber_sleep( (long)(size_t)param );
+    wakeOrder[ wakeCount++ ] = (int)(size_t)param;
+}
+
+int timeoutResult = -1;
+
+void timeoutProc(void* param)
+{
+    int* pair = (int*)param;
+    timeoutResult = gfiber_waitFD( pair[0], GFIBER_READ, 20 );
+}
+
+#define REUSE_FIRST_WAIT  50  // Millisecs
+#define REUSE_SECOND_WAIT 200 // Millisecs
+
+int reusePairs[2][2];
+int reuseResult = -1;
+double reuseWaited = 0;
+GrFiberSched reuseSched = NULL;
+
+// Woken by its fd at once, long before its timeout.
+void readyWaiterProc(void* param)
+{
+    gfiber_waitFD( reusePairs[0][0], GFIBER_READ, REUSE_FIRST_WAIT );
+}
+
+void silentWaiterProc(void* param)
+{
+    double start = timeNow();
+    reuseResult = gfiber_waitFD( reusePairs[1][0], GFIBER_READ, REUSE_SECOND_WAIT );
+    reuseWaited = (timeNow() - start) * 1e3;
+}
+
+// Spawns the second waiter once the first one is done, so it gets the first one's stack.
+void reuseSpawnerProc(void* param)
+{
+    gfiber_sleep( 10 );
+    gfiber_spawn( reuseSched, silentWaiterProc, NULL );
+}
+
+//--------------- Switch benchmark ---------------//
+
+void yieldProc(void* param)
+{
+    for(long i = 0; i < YieldCount; i++)
+        gfiber_yield();
+}
+
+//--------------- Echo ---------------//
+
+void echoProc(void* param)
+{
+    int fd = (int)(size_t)param;
+    char buf[ 256 ];
+    int len;
+    while( (len = gsockReceive( fd, buf, sizeof(buf), 0 )) > 0 ){
+        if( gsockSend( fd, buf, len, 0 ) != len )
+            break;
+    }
+    gsockCloseSocket( fd );
+}
+
+GrFiberSched echoSched;
+
+void acceptorProc(void* param)
+{
+    int lfd = (int)(size_t)param;
+    while(acceptedCount < sessionCount){
+        int fd = accept( lfd, NULL, NULL );
+        if(fd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                gfiber_waitFD( lfd, GFIBER_READ, -1 );
+                continue;
+            }
+            printf("accept() failed: %s\n", strerror(errno));
+            break;
+        }
+        acceptedCount++;
+        if( !gfiber_spawn( echoSched, echoProc, (void*)(size_t)fd ) )
+            gsockCloseSocket( fd );
+    }
+}
+
+void clientProc(void* param)
+{
+    int id = (int)(size_t)param;
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if(fd < 0) return;
+    gsockSetOption( fd, GSOCK_OPT_NONBLOCK, 1 );
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( listenPort );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    if( connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 ){
+        int err = 0;
+        socklen_t errLen = sizeof(err);
+        if( errno != EINPROGRESS || gfiber_waitFD( fd, GFIBER_WRITE, 5000 ) != 0 ||
+            getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &errLen ) != 0 || err != 0 ){
+            gsockCloseSocket( fd );
+            return;
+        }
+    }
+
+    char msg[ MSG_SIZE ], reply[ MSG_SIZE ];
+    int round;
+    for(round = 0; round < EchoRounds; round++){
+        snprintf( msg, sizeof(msg), "session %d round %d", id, round );
+        if( gsockSend( fd, msg, MSG_SIZE, 0 ) != MSG_SIZE )
+            break;
+        int got = 0, len = 0;
+        while( got < MSG_SIZE && (len = gsockReceive( fd, reply + got, MSG_SIZE - got, 0 )) > 0 )
+            got += len;
+        if( got != MSG_SIZE || memcmp( msg, reply, MSG_SIZE ) != 0 )
+            break;
+    }
+    if(round == EchoRounds)
+        sessionsOK++;
+    gsockCloseSocket( fd );
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest8.log", HLOG_MODE_APPEND);
+    int errors = 0;
+
+    if(argc > 1)
+        sessionCount = atoi( argv[1] );
+    // Two fds per session.
+    struct rlimit lim;
+    if( getrlimit( RLIMIT_NOFILE, &lim ) == 0 && lim.rlim_cur != RLIM_INFINITY &&
+        (rlim_t)sessionCount * 2 + 32 > lim.rlim_cur ){
+        sessionCount = (int)((lim.rlim_cur - 32) / 2);
+    }
+
+    // Ordering & timeouts.
+    GrFiberSched sched = gfiber_Sched_create( 0 );
+    if(!sched){
+        printf("Failed to create a scheduler!\n");
+        return 1;
+    }
+    int pair[2];
+    socketpair( AF_UNIX, SOCK_STREAM, 0, pair );
+    gfiber_spawn( sched, sleeperProc, (void*)30 );
+    gfiber_spawn( sched, sleeperProc, (void*)10 );
+    gfiber_spawn( sched, sleeperProc, (void*)20 );
+    gfiber_spawn( sched, timeoutProc, pair );
+    errors += ( gfiber_Sched_run( sched ) != 0 );
+    errors += ( wakeCount != 3 || wakeOrder[0] != 10 || wakeOrder[1] != 20 || wakeOrder[2] != 30 );
+    errors += ( timeoutResult != 1 );
+    close( pair[0] );
+    close( pair[1] );
+    printf("Sleep order & timeout: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Stack reuse after an fd wakeup.
+    reuseSched = sched;
+    socketpair( AF_UNIX, SOCK_STREAM, 0, reusePairs[0] );
+    socketpair( AF_UNIX, SOCK_STREAM, 0, reusePairs[1] );
+    send( reusePairs[0][1], "x", 1, 0 );
+    gfiber_spawn( sched, readyWaiterProc, NULL );
+    gfiber_spawn( sched, reuseSpawnerProc, NULL );
+    errors += ( gfiber_Sched_run( sched ) != 0 );
+    errors += ( reuseResult != 1 || reuseWaited < REUSE_SECOND_WAIT - 1 );
+    for(int i = 0; i < 4; i++)
+        close( reusePairs[i / 2][i % 2] );
+    printf("Timed wait on a reused stack: %.1f of %d ms: %s\n", reuseWaited, REUSE_SECOND_WAIT, (errors ? "FAIL" : "OK"));
+
+    // Switch cost.
+    gfiber_spawn( sched, yieldProc, NULL );
+    gfiber_spawn( sched, yieldProc, NULL );
+    double start = timeNow();
+    errors += ( gfiber_Sched_run( sched ) != 0 );
+    double secs = timeNow() - start;
+    printf("Yield: %.1f ns per switch\n", secs * 1e9 / (2.0 * YieldCount));
+    gfiber_Sched_destroy( &sched );
+
+    // Echo sessions.
+    int lfd = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in addr = { 0 };
+    socklen_t addrLen = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( lfd < 0 || bind( lfd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 ||
+        listen( lfd, 4096 ) != 0 || getsockname( lfd, (struct sockaddr*)&addr, &addrLen ) != 0 ){
+        printf("Failed to set up the listening socket: %s\n", strerror(errno));
+        return 1;
+    }
+    listenPort = ntohs( addr.sin_port );
+    gsockSetOption( lfd, GSOCK_OPT_NONBLOCK, 1 );
+
+    echoSched = gfiber_Sched_create( 16 * 1024 );
+    gfiber_spawn( echoSched, acceptorProc, (void*)(size_t)lfd );
+    for(int i = 0; i < sessionCount; i++)
+        gfiber_spawn( echoSched, clientProc, (void*)(size_t)i );
+
+    start = timeNow();
+    errors += ( gfiber_Sched_run( echoSched ) != 0 );
+    secs = timeNow() - start;
+    errors += ( sessionsOK != sessionCount );
+
+    printf("Echo: %d/%d sessions OK (%d fibers on one thread), %d round trips each, %.3f s\n",
+           sessionsOK, sessionCount, sessionCount * 2 + 1, EchoRounds, secs);
+
+    gfiber_Sched_destroy( &echoSched );
+    gsockCloseSocket( lfd );
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
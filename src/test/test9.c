@@ -0,0 +1,125 @@
+#include <grylsocks.h>
+#include <grylthread.h>
+#include <hlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Resolver cache test.
+ *
+ *  - Literal addresses must be converted without the resolver, for both families.
+ *  - Names must be answered from the cache after the first lookup, and unknown names
+ *    from the negative cache, until the TTL runs out.
+ *  - Async resolves must produce the same answer.
+ *  Times per lookup are printed for the uncached, cached and literal paths.
+ */
+
+const int Lookups = 20000;
+
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns microseconds per lookup, or < 0 if a lookup returned something else than expectErr.
+double timeLookups(const char* host, const char* port, int count, int expectErr)
+{
+    double start = timeNow();
+    for(int i = 0; i < count; i++){
+        struct addrinfo* res = NULL;
+        int err = gsockResolve( host, port, AF_UNSPEC, SOCK_STREAM, 0, &res );
+        gsockFreeAddrInfo( res );
+        if(err != expectErr)
+            return -1;
+    }
+    return (timeNow() - start) * 1e6 / count;
+}
+
+int checkAddress(struct addrinfo* ai, int family, const char* text, int port)
+{
+    char buf[ INET6_ADDRSTRLEN ];
+    if(!ai || ai->ai_family != family || ai->ai_socktype != SOCK_STREAM)
+        return 1;
+    if(family == AF_INET){
+        struct sockaddr_in* sin = (struct sockaddr_in*)ai->ai_addr;
+        inet_ntop( AF_INET, &(sin->sin_addr), buf, sizeof(buf) );
+        return ( strcmp( buf, text ) != 0 || ntohs(sin->sin_port) != port );
+    }
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ai->ai_addr;
+    inet_ntop( AF_INET6, &(sin6->sin6_addr), buf, sizeof(buf) );
+    return ( strcmp( buf, text ) != 0 || ntohs(sin6->sin6_port) != port );
+}
+
+int main(int argc, char** argv)
+{
+    hlogSetFile("gryltest9.log", HLOG_MODE_APPEND);
+    gsockInitSocks();
+    int errors = 0;
+
+    // Literals.
+    struct addrinfo* res = NULL;
+    errors += ( gsockResolve( "192.168.1.20", "2121", AF_UNSPEC, SOCK_STREAM, 0, &res ) != 0 );
+    errors += checkAddress( res, AF_INET, "192.168.1.20", 2121 );
+    gsockFreeAddrInfo( res );
+    errors += ( gsockResolve( "fe80::1", "21", AF_UNSPEC, SOCK_STREAM, 0, &res ) != 0 );
+    errors += checkAddress( res, AF_INET6, "fe80::1", 21 );
+    gsockFreeAddrInfo( res );
+    printf("Literal addresses: %s\n", (errors ? "FAIL" : "OK"));
+
+    // Positive and negative caching. Without caching every lookup goes to the resolver.
+    // Unknown names are cached only if the resolver answers "no such name" - without DNS it
+    // reports a temporary failure, which isn't cached.
+    gsockResolveCache_setTTL( 0, 0 );
+    const char* badName = "no-such-host.invalid";
+    int badErr = gsockResolve( badName, "21", AF_UNSPEC, SOCK_STREAM, 0, &res );
+    double uncached = timeLookups( "localhost", "21", Lookups / 20, 0 );
+    double uncachedBad = (badErr == EAI_NONAME ? timeLookups( badName, "21", 20, EAI_NONAME ) : 0);
+
+    gsockResolveCache_setTTL( GSOCK_RESOLVE_DEFAULT_TTL, GSOCK_RESOLVE_NEGATIVE_TTL );
+    double cached = timeLookups( "localhost", "21", Lookups, 0 );
+    double cachedBad = (badErr == EAI_NONAME ? timeLookups( badName, "21", Lookups, EAI_NONAME ) : 0);
+    double literal = timeLookups( "127.0.0.1", "21", Lookups, 0 );
+
+    errors += ( uncached < 0 || cached < 0 || literal < 0 || uncachedBad < 0 || cachedBad < 0 );
+
+    printf("\n%-24s %12s\n", "Lookup", "us/lookup");
+    printf("%-24s %12.3f\n", "name, no cache", uncached);
+    printf("%-24s %12.3f\n", "name, cached", cached);
+    if(badErr == EAI_NONAME){
+        printf("%-24s %12.3f\n", "bad name, no cache", uncachedBad);
+        printf("%-24s %12.3f\n", "bad name, cached", cachedBad);
+    }
+    else
+        printf("%-24s %12s   (%s)\n", "bad name", "n/a", gai_strerror(badErr));
+    printf("%-24s %12.3f\n\n", "literal", literal);
+
+    // Expiry: the entry must be looked up again after its TTL.
+    gsockResolveCache_clear();
+    gsockResolveCache_setTTL( 50, 50 );
+    errors += ( timeLookups( "localhost", "21", 1, 0 ) < 0 );
+    struct timespec pause = { 0, 80 * 1000000L };
+    nanosleep( &pause, NULL );
+    errors += ( timeLookups( "localhost", "21", 1, 0 ) < 0 );
+    gsockResolveCache_setTTL( GSOCK_RESOLVE_DEFAULT_TTL, GSOCK_RESOLVE_NEGATIVE_TTL );
+
+    // Async.
+    GrFuture fut = gsockResolveAsync( NULL, "127.0.0.1", "8080", AF_UNSPEC, SOCK_STREAM, 0 );
+    res = (fut ? (struct addrinfo*)gthread_Future_get( fut ) : NULL);
+    errors += checkAddress( res, AF_INET, "127.0.0.1", 8080 );
+    gsockFreeAddrInfo( res );
+    gthread_Future_destroy( &fut );
+
+    fut = gsockResolveAsync( NULL, "localhost", "21", AF_UNSPEC, SOCK_STREAM, 0 );
+    res = (fut ? (struct addrinfo*)gthread_Future_get( fut ) : NULL);
+    errors += ( res == NULL );
+    gsockFreeAddrInfo( res );
+    gthread_Future_destroy( &fut );
+    printf("Expiry & async: %s\n", (errors ? "FAIL" : "OK"));
+
+    gsockSockCleanup();
+    hlogCloseFile();
+    return (errors ? 1 : 0);
+}
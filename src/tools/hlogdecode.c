@@ -0,0 +1,355 @@
+#include <hlog.h>
+#include <hlogbin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  HLog binary log decoder.
+ *
+ *  Usage: hlogdecode [--json] <log base name>
+ *
+ *  Reads the format dictionary "<base>.fmt" and segments "<base>.0.hlb", "<base>.1.hlb", ...
+ *  and prints every record as a text line, or as a JSON object per line with --json.
+ *  Records are printed in segment order, which is the order writers reserved space in.
+ */
+
+#define MAX_LINE    4096
+#define MAX_MESSAGE 4096
+
+typedef struct
+{
+    char* fmt;
+    int level;
+    int module;
+    int argc;
+    char argTypes[ 16 ];
+} DecFormat;
+
+static DecFormat* formats = NULL;
+static size_t formatCount = 0;
+
+static const char* levelNames[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+static const char* moduleNames[] = { "general", "thread", "socks", "misc", "client", "server", "ftp" };
+
+static const char* levelName(int level){
+    return (level >= 0 && level < (int)(sizeof(levelNames)/sizeof(*levelNames)) ? levelNames[level] : "?");
+}
+
+static const char* moduleName(int module){
+    return (module >= 0 && module < (int)(sizeof(moduleNames)/sizeof(*moduleNames)) ? moduleNames[module] : "?");
+}
+
+static void unescape(char* str)
+{
+    char* out = str;
+    for(char* c = str; *c; c++){
+        if(*c == '\\' && c[1]){
+            c++;
+            *out++ = (*c == 'n' ? '\n' : *c == 'r' ? '\r' : *c == 't' ? '\t' : *c);
+        }
+        else
+            *out++ = *c;
+    }
+    *out = 0;
+}
+
+static int loadFormats(const char* base)
+{
+    char path[ MAX_LINE ];
+    snprintf( path, sizeof(path), "%s" HLOG_BIN_FMT_EXT, base );
+    FILE* file = fopen( path, "r" );
+    if(!file){
+        fprintf( stderr, "Can't open format dictionary %s\n", path );
+        return -1;
+    }
+
+    char line[ MAX_LINE ];
+    while( fgets( line, sizeof(line), file ) )
+    {
+        if(line[0] == '#')
+            continue;
+        line[ strcspn( line, "\r\n" ) ] = 0;
+
+        unsigned int id;
+        int level, module, fmtStart = 0;
+        char types[ 32 ];
+        if( sscanf( line, "%u %d %d %31s %n", &id, &level, &module, types, &fmtStart ) < 4 || !fmtStart || !id )
+            continue;
+        size_t typeCount = strlen( types );
+        if(typeCount >= sizeof(formats->argTypes))
+            continue; // More arguments than a record holds - a cut list would misread them.
+
+        if(id > formatCount){
+            DecFormat* arr = realloc( formats, id * sizeof(DecFormat) );
+            if(!arr)
+                break;
+            memset( arr + formatCount, 0, (id - formatCount) * sizeof(DecFormat) );
+            formats = arr;
+            formatCount = id;
+        }
+        DecFormat* df = formats + (id - 1);
+        free( df->fmt );
+        df->fmt = strdup( line + fmtStart );
+        unescape( df->fmt );
+        df->level = level;
+        df->module = module;
+        df->argc = 0;
+        if( strcmp( types, "-" ) != 0 ){
+            memcpy( df->argTypes, types, typeCount + 1 );
+            df->argc = (int)typeCount;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+typedef struct
+{
+    char type;
+    long long i;
+    double d;
+    char s[ HLOG_BIN_MAX_STRING + 1 ];
+} DecArg;
+
+// Reads the args of a record. Returns -1 if the record is malformed.
+static int readArgs(const DecFormat* df, const char* pos, const char* end, DecArg* args)
+{
+    for(int i = 0; i < df->argc; i++)
+    {
+        int32_t i32;
+        uint16_t len;
+        args[i].type = df->argTypes[i];
+        switch( args[i].type ){
+            case HLOG_BIN_ARG_I32:
+                if(pos + sizeof(i32) > end) return -1;
+                memcpy( &i32, pos, sizeof(i32) );
+                args[i].i = i32;
+                pos += sizeof(i32);
+                break;
+            case HLOG_BIN_ARG_DBL:
+                if(pos + sizeof(double) > end) return -1;
+                memcpy( &(args[i].d), pos, sizeof(double) );
+                pos += sizeof(double);
+                break;
+            case HLOG_BIN_ARG_STR:
+                if(pos + sizeof(len) > end) return -1;
+                memcpy( &len, pos, sizeof(len) );
+                pos += sizeof(len);
+                if(len > HLOG_BIN_MAX_STRING || pos + len > end) return -1;
+                memcpy( args[i].s, pos, len );
+                args[i].s[ len ] = 0;
+                pos += len;
+                break;
+            default: // I64, PTR
+                if(pos + sizeof(int64_t) > end) return -1;
+                memcpy( &(args[i].i), pos, sizeof(int64_t) );
+                pos += sizeof(int64_t);
+        }
+    }
+    return 0;
+}
+
+// Reads a text record - one string, as long as hlogf() formats, which may be longer than a string arg.
+static int readText(const char* pos, const char* end, char* out, size_t outSize)
+{
+    uint16_t len;
+    if(pos + sizeof(len) > end) return -1;
+    memcpy( &len, pos, sizeof(len) );
+    pos += sizeof(len);
+    if(len >= outSize || pos + len > end) return -1;
+    memcpy( out, pos, len );
+    out[ len ] = 0;
+    return 0;
+}
+
+// Formats the message like printf would, using stored arg types for the conversions.
+static void render(const DecFormat* df, const DecArg* args, char* out, size_t outSize)
+{
+    size_t len = 0;
+    int argi = 0;
+    for(const char* c = df->fmt; *c && len + 1 < outSize; )
+    {
+        if(*c != '%'){
+            out[ len++ ] = *c++;
+            continue;
+        }
+        if(c[1] == '%'){
+            out[ len++ ] = '%';
+            c += 2;
+            continue;
+        }
+
+        // Collect the spec without length modifiers. Stars are replaced by their stored values.
+        char spec[ 64 ];
+        size_t sl = 0;
+        spec[ sl++ ] = *c++;
+        for(; *c && strchr("-+ #0123456789.*'", *c) && sl < 32; c++){
+            if(*c == '*')
+                sl += snprintf( spec + sl, sizeof(spec) - sl, "%d", (argi < df->argc ? (int)args[ argi++ ].i : 0) );
+            else
+                spec[ sl++ ] = *c;
+        }
+        while(*c && strchr("hlLqjzt", *c))
+            c++;
+        if(!*c)
+            break;
+        char conv = *c++;
+
+        size_t room = outSize - len;
+        int wr = 0;
+        if( !strchr("diuxXocfFeEgGaAsp", conv) || argi >= df->argc ){
+            wr = snprintf( out + len, room, "%%%c", conv );
+        }
+        else{
+            const DecArg* arg = args + argi++;
+            if(arg->type == HLOG_BIN_ARG_STR){
+                spec[ sl++ ] = 's'; spec[ sl ] = 0;
+                wr = snprintf( out + len, room, spec, arg->s );
+            }
+            else if(arg->type == HLOG_BIN_ARG_DBL){
+                spec[ sl++ ] = conv; spec[ sl ] = 0;
+                wr = snprintf( out + len, room, spec, arg->d );
+            }
+            else if(arg->type == HLOG_BIN_ARG_PTR){
+                spec[ sl++ ] = 'p'; spec[ sl ] = 0;
+                wr = snprintf( out + len, room, spec, (void*)(uintptr_t)arg->i );
+            }
+            else if(conv == 'c'){
+                spec[ sl++ ] = 'c'; spec[ sl ] = 0;
+                wr = snprintf( out + len, room, spec, (int)arg->i );
+            }
+            else{
+                spec[ sl++ ] = 'l'; spec[ sl++ ] = 'l'; spec[ sl++ ] = conv; spec[ sl ] = 0;
+                // 32-bit unsigned conversions must not show sign extension.
+                long long val = arg->i;
+                if(arg->type == HLOG_BIN_ARG_I32 && strchr("uxXo", conv))
+                    val = (unsigned int)val;
+                wr = snprintf( out + len, room, spec, val );
+            }
+        }
+        if(wr < 0)
+            break;
+        len += ((size_t)wr < room ? (size_t)wr : room - 1);
+    }
+    out[ len ] = 0;
+}
+
+static void printJsonString(const char* str)
+{
+    putchar('"');
+    for(const unsigned char* c = (const unsigned char*)str; *c; c++){
+        switch(*c){
+            case '"':  fputs( "\\\"", stdout ); break;
+            case '\\': fputs( "\\\\", stdout ); break;
+            case '\n': fputs( "\\n", stdout );  break;
+            case '\r': fputs( "\\r", stdout );  break;
+            case '\t': fputs( "\\t", stdout );  break;
+            default:
+                if(*c < 0x20)
+                    printf( "\\u%04x", *c );
+                else
+                    putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+static void printRecord(const HLogBinRecordHeader* hdr, const DecFormat* df, const char* msg, char json)
+{
+    if(json){
+        printf( "{\"ts\":%llu,\"tid\":%u,\"id\":%u", (unsigned long long)hdr->timestamp, hdr->tid, hdr->fmtId );
+        if(df)
+            printf( ",\"level\":\"%s\",\"module\":\"%s\"", levelName(df->level), moduleName(df->module) );
+        fputs( ",\"msg\":", stdout );
+        printJsonString( msg );
+        puts( "}" );
+        return;
+    }
+
+    time_t secs = (time_t)(hdr->timestamp / 1000000000ULL);
+    struct tm tmv;
+    char tstr[ 32 ];
+    localtime_r( &secs, &tmv );
+    strftime( tstr, sizeof(tstr), "%Y-%m-%d %H:%M:%S", &tmv );
+
+    printf( "%s.%06u [%u] ", tstr, (unsigned)((hdr->timestamp % 1000000000ULL) / 1000), hdr->tid );
+    if(df)
+        printf( "%-5s %-7s ", levelName(df->level), moduleName(df->module) );
+    fputs( msg, stdout );
+    // Messages usually carry their own newlines.
+    size_t len = strlen(msg);
+    if(!len || msg[ len-1 ] != '\n')
+        putchar('\n');
+}
+
+static int decodeSegment(const char* path, char json)
+{
+    FILE* file = fopen( path, "rb" );
+    if(!file)
+        return -1;
+
+    char rec[ 1 << 16 ];
+    char msg[ MAX_MESSAGE ];
+    char text[ HLOG_ASYNC_MAX_MSG + 1 ];
+    DecArg args[ 16 ];
+    HLogBinRecordHeader hdr;
+
+    while( fread( &hdr, sizeof(hdr), 1, file ) == 1 && hdr.size != 0 )
+    {
+        size_t bodyLen = hdr.size - sizeof(hdr);
+        if(hdr.size < sizeof(hdr) || fread( rec, 1, bodyLen, file ) != bodyLen){
+            fprintf( stderr, "%s: truncated record\n", path );
+            break;
+        }
+        const char* end = rec + bodyLen;
+
+        if(hdr.fmtId == HLOG_BIN_TEXT_ID){
+            if( readText( rec, end, text, sizeof(text) ) == 0 ){
+                printRecord( &hdr, NULL, text, json );
+                continue;
+            }
+        }
+        else if(hdr.fmtId <= formatCount && formats[ hdr.fmtId - 1 ].fmt){
+            const DecFormat* df = formats + (hdr.fmtId - 1);
+            if( readArgs( df, rec, end, args ) == 0 ){
+                render( df, args, msg, sizeof(msg) );
+                printRecord( &hdr, df, msg, json );
+                continue;
+            }
+        }
+        fprintf( stderr, "%s: bad record (format id %u)\n", path, hdr.fmtId );
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char json = 0;
+    const char* base = NULL;
+    for(int i = 1; i < argc; i++){
+        if( strcmp( argv[i], "--json" ) == 0 )
+            json = 1;
+        else
+            base = argv[i];
+    }
+    if(!base){
+        fprintf( stderr, "Usage: %s [--json] <log base name>\n", argv[0] );
+        return 1;
+    }
+
+    if( loadFormats( base ) != 0 )
+        return 1;
+
+    char path[ MAX_LINE ];
+    for(int seg = 0; ; seg++){
+        snprintf( path, sizeof(path), "%s.%d" HLOG_BIN_SEGMENT_EXT, base, seg );
+        if( decodeSegment( path, json ) != 0 ){
+            if(seg == 0)
+                fprintf( stderr, "No segments found for %s\n", base );
+            break;
+        }
+    }
+    return 0;
+}